@@ -23,16 +23,40 @@ namespace sdstorage {
   class Index {
 
     public:
+      /*
+       * SORTED indexes rewrite the whole index file on every change.
+       * LOG_STRUCTURED indexes append changes to a small delta log instead,
+       * which is folded into the index by idxCompact(...), or automatically
+       * once the delta log reaches compactThreshold bytes (0 = never).
+       * A SORTED index's changes in an explicit txn are held in an overlay,
+       * folded in at the same size (or DEFAULT_COMPACT_THRESHOLD if 0).
+       * BTREE indexes are a B+tree of 512 byte pages, so lookups and updates
+       * only touch a few pages. idxCompact(...) rebuilds the tree packed, or
+       * converts a SORTED index to a B+tree.
+       *
+       * The mode isn't stored with the index, so an index must always be
+       * opened with the same mode. Reads and writes fail if they find another
+       * mode's files: a B+tree header for SORTED and LOG_STRUCTURED, or
+       * records in a delta log for SORTED and BTREE. A LOG_STRUCTURED index
+       * with an empty delta log (just compacted) can be opened as SORTED.
+       */
+      enum Mode : uint8_t { SORTED, LOG_STRUCTURED, BTREE };
+      static const uint16_t DEFAULT_COMPACT_THRESHOLD = 1024;
+
       const char* name;
       const bool isPmem;
-
-      explicit Index(const char* n, bool isPmem = false): 
-          name(n), isPmem(isPmem) {};
-      explicit Index(const __FlashStringHelper* n):
-          name(reinterpret_cast<const char*>(n)), isPmem(true) {};
-
-      static Index fromProgmem(const char* n) {
-          return Index(n, true);
+      const Mode mode;
+      const uint16_t compactThreshold;
+
+      explicit Index(const char* n, bool isPmem = false, Mode mode = SORTED,
+            uint16_t compactThreshold = DEFAULT_COMPACT_THRESHOLD): 
+          name(n), isPmem(isPmem), mode(mode), compactThreshold(compactThreshold) {};
+      explicit Index(const __FlashStringHelper* n, Mode mode = SORTED,
+            uint16_t compactThreshold = DEFAULT_COMPACT_THRESHOLD):
+          name(reinterpret_cast<const char*>(n)), isPmem(true), mode(mode), compactThreshold(compactThreshold) {};
+
+      static Index fromProgmem(const char* n, Mode mode = SORTED) {
+          return Index(n, true, mode);
       };
 
   };
@@ -75,7 +99,8 @@ namespace sdstorage {
     char* key;
     char* value;
     KeyValue* next = nullptr;
-    KeyValue(const char* key, const char* value): key(strdup(key)), value(strdup(value)) {};
+    // A key without a value gets an empty one
+    KeyValue(const char* key, const char* value): key(strdup(key)), value(strdup(value ? value : "")) {};
     ~KeyValue() {
       if (key) free(key);
       if (value) free(value);
@@ -111,6 +136,38 @@ namespace sdstorage {
     }
   };
 
+  /*
+   * A position in an index, for stepping through its entries in key order
+   * one at a time with no limit on how many there are. Start it with
+   * idxSeek(...) (keys starting with a prefix) or idxSeekKey(...) (keys at
+   * or after a key), then call idxNext(...) until it returns false.
+   *
+   * A cursor is plain data - it doesn't hold a file open or any heap memory -
+   * so it can be kept between calls, or saved and resumed later. If the
+   * index file changed in the meantime (its size differs, or the offset is
+   * no longer where the cursor left off), it finds its place again by key.
+   *
+   * idxNext(...) returns false with isTooLong set, leaving the cursor where
+   * it was, if the next entry doesn't fit the buffers it was given, so it
+   * can be called again with bigger ones. fromKey holds any key a BTREE
+   * index can. SORTED and LOG_STRUCTURED keys can be longer: the cursor
+   * goes on from such a key by its offset, and only its first
+   * MAX_KEY_LENGTH characters are kept, so other keys after it that start
+   * with the same MAX_KEY_LENGTH characters are skipped.
+   */
+  struct IndexCursor {
+    static const uint8_t MAX_PREFIX_LENGTH = 31;
+    static const uint8_t MAX_KEY_LENGTH = 155;    // BTreeIndex::MAX_KEY_LENGTH
+    char prefix[MAX_PREFIX_LENGTH + 1] = { '\0' };  // only keys starting with this
+    char fromKey[MAX_KEY_LENGTH + 1] = { '\0' };    // next entry is after this key...
+    bool isFromInclusive = true;                  // ...or at it
+    bool isFromTruncated = false;                 // fromKey is the start of a longer key
+    uint32_t offset = 0;        // of the next line to read (not used by BTREE indexes)
+    uint32_t indexSize = 0;     // index file size when offset was found
+    bool isDone = false;
+    bool isTooLong = false;     // the last idxNext(...) stopped at an entry too long for its buffers
+  };
+
 };
 
 
@@ -24,6 +24,11 @@ bool SDStorage::begin(void* testState) {
     const char* secondSlash = strchr(_fileHelper.getRootDir() + 1, '/');
     if (secondSlash != nullptr) break; // Invalid root dir (subdirectories not allowed)
     if (!_storageProvider.begin()) break;
+    if (_txnManager->checkClean(testState)) {
+      // Shut down cleanly, so the directories exist and there's nothing to recover
+      sdInit = true;
+      break;
+    }
     if (!_storageProvider._exists(_fileHelper.getRootDir(), testState)) {
       if (!_storageProvider._mkdir(_fileHelper.getRootDir(), testState)) break;
     } 
@@ -33,7 +38,7 @@ bool SDStorage::begin(void* testState) {
     if (!_storageProvider._exists(_fileHelper.getWorkDir(), testState)) {
       if (!_storageProvider._mkdir(_fileHelper.getWorkDir(), testState)) break;
     } 
-    if (!fsck()) {
+    if (!fsck(testState)) {
 #if defined(DEBUG)
       Serial.println(F("SDStorage repair failed"));
 #endif
@@ -49,21 +54,50 @@ bool SDStorage::begin(void* testState) {
  * on the filename if necessary)
  */
 bool SDStorage::load(const char* filename, StreamableDTO* dto, bool isFilenamePmem = false, void* testState = nullptr) {
+  return load(filename, dto, nullptr, isFilenamePmem, testState);
+}
+
+bool SDStorage::load(const __FlashStringHelper* filename, StreamableDTO* dto, void* testState = nullptr) {
+  return load(reinterpret_cast<const char*>(filename), dto, nullptr, true, testState);
+}
+
+/*
+ * Same as load(...), but sees the uncommitted changes made in txn: a file it
+ * saved is read from its temp file, and a file it erased is treated as
+ * missing (the DTO is left as it is)
+ */
+bool SDStorage::load(const char* filename, StreamableDTO* dto, Transaction* txn, bool isFilenamePmem = false, 
+      void* testState = nullptr) {
   FileHelper::Filename fname(filename, isFilenamePmem);
   char resolvedFilename[FileHelper::MAX_FILENAME_LENGTH];
   bool result = false;
   do {
     if (!_fileHelper.canonicalFilename(fname, resolvedFilename, FileHelper::MAX_FILENAME_LENGTH)) break;
-    if (_storageProvider._exists(resolvedFilename, testState)) {
-      if (!_storageProvider._loadFromStream(resolvedFilename, dto, testState)) break;
+    const char* source = resolvedFilename;
+    char* txnTmpFilename = txn ? txn->getTmpFilename(resolvedFilename) : nullptr;
+    if (txnTmpFilename) {
+      if (strcmp_P(txnTmpFilename, _SDSTORAGE_TOMBSTONE) == 0) {
+        // erased in this txn
+        result = true;
+        break;
+      }
+      // Not written in this txn yet if there's no temp file
+      if (_storageProvider._exists(txnTmpFilename, testState)) source = txnTmpFilename;
+    } else {
+      // A save waiting for a group commit is newer than the file
+      char* groupTmpFilename = _txnManager->getGroupTmpFilename(resolvedFilename);
+      if (groupTmpFilename) source = groupTmpFilename;
+    }
+    if (_storageProvider._exists(source, testState)) {
+      if (!_storageProvider._loadFromStream(source, dto, testState)) break;
     }
     result = true;
   } while (false);
   return result;
 }
 
-bool SDStorage::load(const __FlashStringHelper* filename, StreamableDTO* dto, void* testState = nullptr) {
-  return load(reinterpret_cast<const char*>(filename), dto, true, testState);
+bool SDStorage::load(const __FlashStringHelper* filename, StreamableDTO* dto, Transaction* txn, void* testState = nullptr) {
+  return load(reinterpret_cast<const char*>(filename), dto, txn, true, testState);
 }
 
 /*
@@ -96,20 +130,32 @@ bool SDStorage::save(void* testState, const char* filename, StreamableDTO* dto,
   char resolvedFilename[FileHelper::MAX_FILENAME_LENGTH];
   bool result = false;
   bool implicitTx = false;
+  bool grouped = false;
+  bool isNewToGroup = false;
+  char groupFilename[FileHelper::MAX_FILENAME_LENGTH] = { '\0' };
   do {
     if (!_fileHelper.canonicalFilename(fname, resolvedFilename, FileHelper::MAX_FILENAME_LENGTH)) break;
     if (txn == nullptr) {
-      // make an implicit, single-file transaction
-      txn = beginTxn(testState, resolvedFilename);
+      // join the group commit if it's on, otherwise make an implicit, single-file transaction
+      txn = _txnManager->joinGroup(resolvedFilename, &isNewToGroup, testState);
+      grouped = (txn != nullptr);
+      if (!grouped) txn = beginTxn(testState, resolvedFilename);
       if (!txn) break;
-      implicitTx = true;
+      implicitTx = !grouped;
+    }
+    char* tmpFilename = groupFilename;
+    if (grouped) {
+      if (!_txnManager->groupWriteFilename(resolvedFilename, isNewToGroup, groupFilename, sizeof(groupFilename))) break;
+    } else {
+      tmpFilename = _txnManager->getTmpFilename(txn, resolvedFilename);
     }
-    char* tmpFilename = _txnManager->getTmpFilename(txn, resolvedFilename);  
     if (!tmpFilename || strlen(tmpFilename) == 0) break;
     if (!_storageProvider._writeToStream(tmpFilename, dto, testState)) break;
     result = true;
   } while (false);
-  if (result && implicitTx) {
+  if (grouped) {
+    result = _txnManager->endGroupWrite(resolvedFilename, groupFilename, isNewToGroup, result, testState);
+  } else if (result && implicitTx) {
     result = commitTxn(txn, testState);
   }
   return result;
@@ -133,7 +179,7 @@ bool SDStorage::exists(const char* filename, bool isFilenamePmem = false, void*
   bool result = false;
   do {
     if (!_fileHelper.canonicalFilename(fname, resolvedFilename, FileHelper::MAX_FILENAME_LENGTH)) break;
-    if (!_storageProvider._exists(resolvedFilename, testState)) break;
+    if (!_txnManager->getGroupTmpFilename(resolvedFilename) && !_storageProvider._exists(resolvedFilename, testState)) break;
     result = true;
   } while (false);
   return result;
@@ -172,15 +218,17 @@ bool SDStorage::erase(void* testState, const char* filename, bool isFilenamePmem
   bool result = false;
   do {
     if (!_fileHelper.canonicalFilename(fname, resolvedFilename, FileHelper::MAX_FILENAME_LENGTH)) break;
+    if (!txn && _txnManager->getGroupTmpFilename(resolvedFilename)) {
+      // Commit the saves waiting in the group first, or they'd bring the file back
+      if (!_txnManager->flushGroup(testState)) break;
+    }
     if (!_storageProvider._exists(resolvedFilename, testState)) break;
 
     if (txn) {
       char* tmpFilename = _txnManager->getTmpFilename(txn, resolvedFilename);
       if (!tmpFilename || strlen(tmpFilename) == 0) break;
       txn->put(resolvedFilename, _SDSTORAGE_TOMBSTONE, false, true); // tombstone the filename
-      char txnFilename[FileHelper::MAX_FILENAME_LENGTH];
-      if (!txn->getFilename(txnFilename, FileHelper::MAX_FILENAME_LENGTH)) break;
-      if (!_storageProvider._writeTxnToStream(txnFilename, txn, testState)) break;
+      if (!_txnManager->journal(txn, resolvedFilename, testState)) break;
       result = true;
 
     } else if (!_storageProvider._remove(resolvedFilename, testState)) break;
@@ -197,6 +245,16 @@ bool SDStorage::erase(void* testState, const __FlashStringHelper* filename, Tran
 bool SDStorage::erase_P(void* testState, const char* filename, Transaction* txn = nullptr) {
   return erase(testState, filename, true, txn);
 }
+bool SDStorage::sync(void* testState = nullptr) {
+  return _txnManager->markClean(testState);
+}
+
+bool SDStorage::end(void* testState = nullptr) {
+  bool result = sync(testState);
+  _storageProvider.end();
+  return result;
+}
+
 /*
  * Creates a new directory (after prepending the root dir on the 
  * dirName if necessary). Returns true if successful.
@@ -222,124 +280,162 @@ bool SDStorage::mkdir_P(const char* dirName, void* testState = nullptr) {
  * Cleans up the _workDir on initialization in case any transactions were
  * left after a power interruption. Finalized transactions are completed, and
  * all others are rolled back.
+ *
+ * It takes a single pass over the work dir. Journals (.txn) of unfinished
+ * transactions are deleted as they're found, and so are tmp files whose
+ * transaction didn't get as far as its .cmt - the tmp's name starts with its
+ * transaction's ID, so that's one exists() per transaction. Commits (.cmt)
+ * and their tmp files are left alone during the pass, and the commits are
+ * applied in ID order once it's done. Only MAX_PENDING_COMMITS IDs are kept,
+ * so a bigger backlog is applied in batches.
+ *
+ * Applying a commit moves each tmp file over its file. A tmp file that's
+ * gone was already moved, and one whose file is gone (FAT has no atomic
+ * replace, so the file is removed first) is simply moved into place.
  * 
  ******/
 
-bool SDStorage::fsck() {
-#if (!defined(__SDSTORAGE_TEST))
-  SdFat* _sd = &(_storageProvider._sd);
-  StreamableManager* _streams = &(_storageProvider._streams);
-  File workDirFile = _sd->open(_fileHelper.getWorkDir());
-  if (!workDirFile) {
+bool SDStorage::fsck(void* testState = nullptr) {
+  StorageProvider::DirList workDir;
+  if (!_storageProvider._openDir(&workDir, _fileHelper.getWorkDir(), testState)) {
 #if (defined(DEBUG))
     Serial.print(F("ERROR: SDStorage::fsck() - Could not open work dir: "));
     Serial.println(_fileHelper.getWorkDir());
 #endif
     return false;
   }
-  if (!workDirFile.isDirectory()) {
-#if (defined(DEBUG))
-    Serial.print(F("ERROR: SDStorage::fsck() - Not a directory: "));
-    Serial.println(_fileHelper.getWorkDir());
-#endif
+
+  // Both names share the "<workDir>/" prefix, so only the short name is
+  // written for each entry
+  char filename[FileHelper::MAX_FILENAME_LENGTH];
+  char ownerCommit[FileHelper::MAX_FILENAME_LENGTH];
+  size_t dirLen = strlen(_fileHelper.getWorkDir());
+  if (dirLen + 14 > FileHelper::MAX_FILENAME_LENGTH) {
+    _storageProvider._closeDir(&workDir, testState);
     return false;
   }
-  bool notifyDirty = true;
-  const char* commitExtension = strdup_P(_SDSTORAGE_TXN_COMMIT_EXTSN);
-  static const char fmt[] PROGMEM = "%s/%s"; 
-  while (true) {
-    File file = workDirFile.openNextFile();
-    if (!file) break; // no more files
-    if (notifyDirty) {
+  memcpy(filename, _fileHelper.getWorkDir(), dirLen);
+  filename[dirLen++] = '/';
+  memcpy(ownerCommit, filename, dirLen);
+  char* shortname = filename + dirLen;
+  static const char idFmt[] PROGMEM = "%04X";
+
+  uint16_t pending[MAX_PENDING_COMMITS];
+  uint8_t pendingCount = 0;
+  uint8_t applied = 0;
+  uint16_t entriesDone = 0;
+  bool hasOwner = false;          // last tmp owner looked up...
+  uint16_t owner = 0;
+  bool isOwnerCommitted = false;  // ...and whether it has a .cmt
+  bool success = true;
+
+  while (success) {
+    if (!_storageProvider._nextEntry(&workDir, shortname, 13, testState)) break; // no more files
 #if (defined(DEBUG))
-      Serial.println(F("SDStorage::fsck() - Recovering filesystem..."));
+    if (entriesDone == 0) Serial.println(F("SDStorage::fsck() - Recovering filesystem..."));
 #endif
-      notifyDirty = false;
+    entriesDone++;
+
+    uint16_t id;
+    bool hasId = Transaction::parseId(shortname, &id);
+    const char* ext = strchr(shortname, '.');
+    bool keep = false;
+    if (hasId && ext && strcmp_P(ext, _SDSTORAGE_TXN_COMMIT_EXTSN) == 0) {
+      // Finalized, so it's applied after the pass
+      if (pendingCount == MAX_PENDING_COMMITS) {
+        success = _fsckApplyCommits(pending, pendingCount, &applied, testState);
+        pendingCount = 0;
+        hasOwner = false;
+      }
+      uint8_t i = pendingCount++;
+      for (; i > 0 && pending[i - 1] > id; i--) pending[i] = pending[i - 1];
+      pending[i] = id;
+      keep = true;
+    } else if (hasId && ext && strcmp_P(ext, _SDSTORAGE_TXN_TMP_EXTSN) == 0) {
+      if (!hasOwner || owner != id) {
+        snprintf_P(ownerCommit + dirLen, 5, idFmt, id);
+        strcat_P(ownerCommit, _SDSTORAGE_TXN_COMMIT_EXTSN);
+        owner = id;
+        hasOwner = true;
+        isOwnerCommitted = _storageProvider._exists(ownerCommit, testState);
+      }
+      // A committed transaction's tmp files are renamed when it's applied
+      keep = isOwnerCommitted;
     }
-    char shortname[13];
-    file.getName(shortname, 13);
-    char filename[FileHelper::MAX_FILENAME_LENGTH];
-    snprintf_P(filename, FileHelper::MAX_FILENAME_LENGTH, fmt, _fileHelper.getWorkDir(), shortname);
-
-    if (endsWith(filename, commitExtension)) {
-      // Leftover commit file needs to be applied
-      Transaction* txn = new Transaction(&_fileHelper, filename);
-      _streams->load(&file, txn);
-      file.close();
-      bool commitErr = true;
-      do {
+
+    if (!keep) {
+      // Unfinished journals, their tmp files, and anything else
 #if (defined(DEBUG))
-        Serial.print(F("  Applying finalized transaction: "));
-        Serial.print(filename);
+      Serial.print(F("  Cleaning up: "));
+      Serial.print(filename);
 #endif
-        if (!_txnManager->applyChanges(txn)) {
+      if (!_storageProvider._remove(filename, testState)) {
 #if (defined(DEBUG))
-          Serial.println(F(" - FAILED"));
+        Serial.println(F(" - FAILED"));
 #endif
-          break;
-        }
-        _txnManager->cleanupTxn(txn);
-        commitErr = false;
-#if (defined(DEBUG))
-        Serial.println(F(" - SUCCESS"));
-#endif
-      } while (false);
-      if (commitErr) {
         /*
-         * Something failed that should not have failed. This means the files might
-         * be in an inconsistent state. Call the supplied errFunction.
+         * Nothing is in an inconsistent state, but the workdir needs to be
+         * cleaned up to prevent tmp file name collisions.
          */
 #if defined(DEBUG)
-        Serial.print(F("ERROR: SDStorage::fsck() - Failed to apply commit "));
-        Serial.println(filename);
+        Serial.print(F("ERROR: SDStorage::fsck() - Failed to clean up work dir "));
+        Serial.println(_fileHelper.getWorkDir());
         delay(250); // Allow message to print before potentially crashing
 #endif
         if (_errFunction != nullptr) _errFunction();
-        return false;
+        success = false;
+      }
+#if (defined(DEBUG))
+      else {
+        Serial.println(F(" - SUCCESS"));
       }
+#endif
     }
+    if (_recoveryProgress != nullptr) _recoveryProgress(entriesDone, applied);
   }
-  free(commitExtension);
-  workDirFile.close();
-
-  // All commits successfully applied, so delete all remaining files.
-  // This effectively aborts any incomplete transactions.
-  workDirFile = _sd->open(_fileHelper.getWorkDir());
-  while (true) {
-    File file = workDirFile.openNextFile();
-    if (!file) break; // no more files
-    char shortname[13];
-    file.getName(shortname, 13);
-    char filename[FileHelper::MAX_FILENAME_LENGTH];
-    snprintf_P(filename, FileHelper::MAX_FILENAME_LENGTH, fmt, _fileHelper.getWorkDir(), shortname);
+  _storageProvider._closeDir(&workDir, testState);
+
+  if (success && pendingCount > 0) {
+    success = _fsckApplyCommits(pending, pendingCount, &applied, testState);
+    if (_recoveryProgress != nullptr) _recoveryProgress(entriesDone, applied);
+  }
+  return success;
+}
+
+bool SDStorage::_fsckApplyCommits(const uint16_t* ids, uint8_t count, uint8_t* applied, void* testState = nullptr) {
+  char filename[FileHelper::MAX_FILENAME_LENGTH];
+  static const char fmt[] PROGMEM = "%s/%04X";
+  for (uint8_t i = 0; i < count; i++) {
+    snprintf_P(filename, FileHelper::MAX_FILENAME_LENGTH - 4, fmt, _fileHelper.getWorkDir(), ids[i]);
+    strcat_P(filename, _SDSTORAGE_TXN_COMMIT_EXTSN);
 #if (defined(DEBUG))
-    Serial.print(F("  Cleaning up: "));
+    Serial.print(F("  Applying finalized transaction: "));
     Serial.print(filename);
 #endif
-    if (!_sd->remove(filename)) {
+    Transaction* txn = _txnManager->loadTxn(filename, testState);
+    if (!txn || !_txnManager->applyChanges(txn, testState)) {
 #if (defined(DEBUG))
       Serial.println(F(" - FAILED"));
 #endif
+      if (txn) delete txn;
       /*
-       * Cleanup failed, but any outstanding commits were applied, so nothing
-       * is in an inconsistent state, although the workdir needs to be cleaned up
-       * to prevent tmp file name collisions.
+       * Something failed that should not have failed. This means the files might
+       * be in an inconsistent state. Call the supplied errFunction.
        */
 #if defined(DEBUG)
-      Serial.print(F("ERROR: SDStorage::fsck() - Failed to clean up work dir "));
-      Serial.println(_fileHelper.getWorkDir());
+      Serial.print(F("ERROR: SDStorage::fsck() - Failed to apply commit "));
+      Serial.println(filename);
       delay(250); // Allow message to print before potentially crashing
 #endif
       if (_errFunction != nullptr) _errFunction();
       return false;
-    } else {
+    }
+    _txnManager->cleanupTxn(txn, testState);
+    (*applied)++;
 #if (defined(DEBUG))
-      Serial.println(F(" - SUCCESS"));
+    Serial.println(F(" - SUCCESS"));
 #endif
-    }
   }
-  workDirFile.close();
-#endif
   return true;
 }
 
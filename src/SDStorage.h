@@ -76,6 +76,29 @@ class SDStorage {
      */
     bool begin(void* testState = nullptr);
 
+    /*
+     * Called while begin() recovers the work dir after a power loss, once
+     * for each work dir entry it handles, so a sketch can show progress on a
+     * card with a lot to clean up. entriesDone counts the entries checked so
+     * far, commitsApplied the interrupted commits finished so far. Set it
+     * before calling begin().
+     */
+    typedef void (*RecoveryProgressFunction)(uint16_t entriesDone, uint8_t commitsApplied);
+    void setRecoveryProgress(RecoveryProgressFunction recoveryProgress) {
+      _recoveryProgress = recoveryProgress;
+    };
+
+    /*
+     * Commits any group commit (see setGroupCommit) and writes a clean-shutdown
+     * marker, so the next begin() can skip checking the work dir for
+     * interrupted transactions. Returns false, without writing the marker, if
+     * a transaction is still open. The marker is removed again by the next
+     * write, so sync() can be called whenever the sketch is idle. end() also
+     * unmounts the card - call begin() before using it again.
+     */
+    bool sync(void* testState = nullptr);
+    bool end(void* testState = nullptr);
+
     /*
      * FILE OPERATIONS
      *
@@ -86,6 +109,9 @@ class SDStorage {
     bool mkdir_P(const char* dirName, void* testState = nullptr);
     bool load(const char* filename, StreamableDTO* dto, bool isFilenamePmem = false, void* testState = nullptr);
     bool load(const __FlashStringHelper* filename, StreamableDTO* dto, void* testState = nullptr);
+    // Reads the version of the file in txn, if it has saved or erased it
+    bool load(const char* filename, StreamableDTO* dto, Transaction* txn, bool isFilenamePmem = false, void* testState = nullptr);
+    bool load(const __FlashStringHelper* filename, StreamableDTO* dto, Transaction* txn, void* testState = nullptr);
     bool save(const char* filename, StreamableDTO* dto, Transaction* txn = nullptr, bool isFilenamePmem = false);
     bool save(void* testState, const char* filename, StreamableDTO* dto, Transaction* txn = nullptr, bool isFilenamePmem = false);
     bool save(const __FlashStringHelper* filename, StreamableDTO* dto, Transaction* txn = nullptr);
@@ -110,6 +136,13 @@ class SDStorage {
     bool idxUpsert(void* testState, Index idx, IndexEntry* entry, Transaction* txn = nullptr) {
       return _idxManager->idxUpsert(testState, idx, entry, txn);
     };
+    // Batch doesn't need to be sorted. The last entry for a repeated key wins
+    bool idxUpsertBatch(Index idx, IndexEntry* entries, size_t count, Transaction* txn = nullptr) {
+      return _idxManager->idxUpsertBatch(idx, entries, count, txn);
+    };
+    bool idxUpsertBatch(void* testState, Index idx, IndexEntry* entries, size_t count, Transaction* txn = nullptr) {
+      return _idxManager->idxUpsertBatch(testState, idx, entries, count, txn);
+    };
     bool idxRemove(Index idx, const char* key, Transaction* txn = nullptr) {
       return _idxManager->idxRemove(idx, key, txn);
     };
@@ -150,6 +183,61 @@ class SDStorage {
       free(ramNewKey);
       return result;
     };
+
+    /*
+     * Like idxUpsert(...) and idxRemove(...), but run a step at a time by
+     * poll(...), so rewriting a big SORTED index doesn't hold up loop(). Each
+     * step rewrites (or, for a LOG_STRUCTURED lookup, reads) about 512 bytes
+     * of the index, and a compaction the op sets off is stepped through the
+     * same way. Growing a full bloom filter is the exception: that pass over
+     * the index is done in one step. Returns nullptr if the arguments are
+     * invalid. The key and value are copied, but idx's name must stay valid
+     * until the operation is done (see AsyncOp.h).
+     *
+     * Operations run in the order they were started, each in its own
+     * implicit transaction. There are no async versions for explicit
+     * transactions, since their SORTED index changes are merged in one pass
+     * when the transaction commits anyway. An op doesn't wait for a lock:
+     * if another transaction has the index locked, the op stays QUEUED
+     * (and so do the ops after it) and is tried again on the next poll(...).
+     * Once running, it holds the index's lock until it's done, and the sync
+     * index methods fail on that index in the meantime rather than wait for
+     * a lock only poll(...) can release. Don't beginTxn(...) on the index
+     * then either (tryBeginTxn(...) fails instead of waiting).
+     */
+    AsyncOp* idxUpsertAsync(Index idx, IndexEntry* entry) {
+      return _idxManager->idxUpsertAsync(nullptr, idx, entry);
+    };
+    AsyncOp* idxUpsertAsync(void* testState, Index idx, IndexEntry* entry) {
+      return _idxManager->idxUpsertAsync(testState, idx, entry);
+    };
+    AsyncOp* idxRemoveAsync(Index idx, const char* key) {
+      return _idxManager->idxRemoveAsync(nullptr, idx, key);
+    };
+    AsyncOp* idxRemoveAsync(void* testState, Index idx, const char* key) {
+      return _idxManager->idxRemoveAsync(testState, idx, key);
+    };
+    AsyncOp* idxRemoveAsync(Index idx, const __FlashStringHelper* key) {
+      char* ramKey = strdup(key);
+      AsyncOp* op = _idxManager->idxRemoveAsync(nullptr, idx, ramKey);
+      free(ramKey);
+      return op;
+    };
+    AsyncOp* idxRemoveAsync(void* testState, Index idx, const __FlashStringHelper* key) {
+      char* ramKey = strdup(key);
+      AsyncOp* op = _idxManager->idxRemoveAsync(testState, idx, ramKey);
+      free(ramKey);
+      return op;
+    };
+
+    /*
+     * Runs the steps of started ...Async(...) operations for about
+     * budgetMicros (at least one step). Returns true while any are left.
+     */
+    bool poll(uint32_t budgetMicros) {
+      return _idxManager->poll(budgetMicros);
+    };
+
     bool idxLookup(Index idx, const char* key, char* buffer, size_t bufferSize, void* testState = nullptr) {
       return _idxManager->idxLookup(idx, key, buffer, bufferSize, testState);
     };
@@ -171,6 +259,69 @@ class SDStorage {
     bool idxPrefixSearch(Index idx, SearchResults* results, void* testState = nullptr) {
       return _idxManager->idxPrefixSearch(idx, results, testState);
     };
+    // The same reads, but seeing the changes made so far in txn (if idx is part of it)
+    bool idxLookup(Index idx, const char* key, char* buffer, size_t bufferSize, Transaction* txn, void* testState = nullptr) {
+      return _idxManager->idxLookup(idx, key, buffer, bufferSize, txn, testState);
+    };
+    bool idxLookup(Index idx, const __FlashStringHelper* key, char* buffer, size_t bufferSize, Transaction* txn, 
+          void* testState = nullptr) {
+      char* ramKey = strdup(key);
+      bool result = _idxManager->idxLookup(idx, ramKey, buffer, bufferSize, txn, testState);
+      free(ramKey);
+      return result;
+    };
+    bool idxHasKey(Index idx, const char* key, Transaction* txn, void* testState = nullptr) {
+      return _idxManager->idxHasKey(idx, key, txn, testState);
+    };
+    bool idxHasKey(Index idx, const __FlashStringHelper* key, Transaction* txn, void* testState = nullptr) {
+      char* ramKey = strdup(key);
+      bool result = _idxManager->idxHasKey(idx, ramKey, txn, testState);
+      free(ramKey);
+      return result;
+    };
+    bool idxPrefixSearch(Index idx, SearchResults* results, Transaction* txn, void* testState = nullptr) {
+      return _idxManager->idxPrefixSearch(idx, results, txn, testState);
+    };
+    // Pages through an index one entry at a time (see IndexCursor). idxNext returns
+    // false at the end (cursor.isDone) or if the entry doesn't fit the buffers (cursor.isTooLong)
+    bool idxSeek(Index idx, IndexCursor* cursor, const char* prefix = "", void* testState = nullptr) {
+      return _idxManager->idxSeek(idx, cursor, prefix, testState);
+    };
+    bool idxSeek(Index idx, IndexCursor* cursor, const __FlashStringHelper* prefix, void* testState = nullptr) {
+      char* ramPrefix = strdup(prefix);
+      bool result = _idxManager->idxSeek(idx, cursor, ramPrefix, testState);
+      free(ramPrefix);
+      return result;
+    };
+    bool idxSeekKey(Index idx, IndexCursor* cursor, const char* key, void* testState = nullptr) {
+      return _idxManager->idxSeekKey(idx, cursor, key, testState);
+    };
+    bool idxSeekKey(Index idx, IndexCursor* cursor, const __FlashStringHelper* key, void* testState = nullptr) {
+      char* ramKey = strdup(key);
+      bool result = _idxManager->idxSeekKey(idx, cursor, ramKey, testState);
+      free(ramKey);
+      return result;
+    };
+    bool idxNext(Index idx, IndexCursor* cursor, char* keyBuffer, size_t keyBufferSize,
+          char* valueBuffer, size_t valueBufferSize, void* testState = nullptr) {
+      return _idxManager->idxNext(idx, cursor, keyBuffer, keyBufferSize, valueBuffer, valueBufferSize, testState);
+    };
+    // Folds the delta log of a LOG_STRUCTURED index into the index file, or
+    // rebuilds a packed BTREE index (converting it from a SORTED index file)
+    bool idxCompact(Index idx, Transaction* txn = nullptr) {
+      return _idxManager->idxCompact(idx, txn);
+    };
+    bool idxCompact(void* testState, Index idx, Transaction* txn = nullptr) {
+      return _idxManager->idxCompact(testState, idx, txn);
+    };
+    // Rebuilds the bloom filter of an index, sized for its current entries. Indexes
+    // written before bloom filters existed don't get one until this is called
+    bool idxRebuild(Index idx, Transaction* txn = nullptr) {
+      return _idxManager->idxRebuild(idx, txn);
+    };
+    bool idxRebuild(void* testState, Index idx, Transaction* txn = nullptr) {
+      return _idxManager->idxRebuild(testState, idx, txn);
+    };
 
 
     /*
@@ -183,7 +334,10 @@ class SDStorage {
      * NOTE: If a file or index is added to a transaction, then the Transaction* MUST be passed
      *       to any write operation involving that file or index. Otherwise, SDStorage will try
      *       to create an implicit transaction and hang because the other transaction is already
-     *       holding a lock on the file or index.
+     *       holding a lock on the file or index (or fail, see setLockTimeout(...)).
+     *
+     * At most LockTable::CAPACITY files and indexes can be locked at once, across all
+     * transactions. beginTxn returns nullptr if there's no room.
      */
     template <typename... Args>
     Transaction* beginTxn(const char* filename, Args... moreFilenames) {
@@ -211,9 +365,119 @@ class SDStorage {
     };
 
     /*
-     * Applies the transaction's changes and unlocks the files.
+     * Like beginTxn(...), but if another transaction still holds a lock on one of
+     * the files or indexes after timeoutMs (0 = don't wait at all), gives up and
+     * returns nullptr instead of waiting.
+     */
+    template <typename... Args>
+    Transaction* tryBeginTxn(uint32_t timeoutMs, Args... filenames) {
+      return _txnManager->tryBeginTxn(timeoutMs, filenames...);
+    };
+    template <typename... Args>
+    Transaction* tryBeginTxn(void* testState, uint32_t timeoutMs, Args... filenames) {
+      return _txnManager->tryBeginTxn(testState, timeoutMs, filenames...);
+    };
+
+    /*
+     * How long beginTxn(...) and the implicit transactions of write operations
+     * wait for another transaction's lock before failing. By default they wait
+     * forever (LockTable::WAIT_FOREVER).
+     */
+    void setLockTimeout(uint32_t timeoutMs) {
+      _txnManager->_lockTimeoutMs = timeoutMs;
+    };
+
+    /*
+     * Group commit, for sketches that save often. Calls to save(...) without a
+     * Transaction* then share one transaction instead of committing one each,
+     * which saves several directory updates per write. The group is committed
+     * after maxWrites saves, by the first save windowMs or more after the group
+     * started (0 = no time limit), or by flushGroup(). Until then, load(...)
+     * and exists(...) see the saves, but they're lost if power is - fsck()
+     * applies a group all at once or not at all. maxWrites = 0 turns group
+     * commit off (the default). Pending saves are committed first either way.
+     *
+     * Files in the group stay locked to it. Index operations aren't grouped.
+     */
+    bool setGroupCommit(uint8_t maxWrites, uint32_t windowMs = 0, void* testState = nullptr) {
+      return _txnManager->setGroupCommit(maxWrites, windowMs, testState);
+    };
+    // Commits any saves waiting for a group commit, e.g. before sleeping
+    bool flushGroup(void* testState = nullptr) {
+      return _txnManager->flushGroup(testState);
+    };
+
+    /*
+     * Writes to the card are collected into whole 512-byte sectors, in one
+     * buffer shared by every open file (see sdstorage/SectorWriter.h). These count the writes passed on to SdFat
+     * and the sectors they touched (B+tree pages and bloom filter blocks are
+     * whole sectors already, and aren't counted). Turning buffering off sends
+     * every print(...) straight to SdFat, to compare.
+     */
+    const SectorWriter::Stats& getWriteStats() {
+      return _storageProvider._writeStats;
+    };
+    void resetWriteStats() {
+      _storageProvider._writeStats = SectorWriter::Stats();
+    };
+    void setWriteBuffering(bool isBuffered) {
+      _storageProvider._isWriteBuffered = isBuffered;
+    };
+
+    /*
+     * exists() checks are answered from a small cache of recently looked-up
+     * paths (see sdstorage/EntryCache.h) when they can be. hits counts the
+     * directory walks it saved; reset the counters before an operation to
+     * see how many that operation saved. If anything else changes the card
+     * (another library using SdFat directly, say), turn the cache off, or
+     * turn it off and on again afterwards to clear it.
+     */
+    const EntryCache::Stats& getEntryCacheStats() {
+      return _storageProvider._entries.stats();
+    };
+    void resetEntryCacheStats() {
+      _storageProvider._entries.resetStats();
+    };
+    void setEntryCaching(bool isCached) {
+      _storageProvider._entries.setEnabled(isCached);
+    };
+
+    // Lock counters, such as how often and how long transactions waited for each other
+    const LockTable::Stats& getLockStats() {
+      return Transaction::_locks.stats();
+    };
+    void resetLockStats() {
+      Transaction::_locks.resetStats();
+    };
+
+    /*
+     * Savepoints, for retrying one step of a big transaction. rollbackTo(...)
+     * undoes the transaction's changes since sp without losing the earlier
+     * ones. Taking a savepoint copies the tmp files written so far, and it
+     * keeps a copy of the transaction's entries in RAM until released, or
+     * until the transaction is committed or aborted.
+     */
+    Transaction::Savepoint* savepoint(Transaction* txn, void* testState = nullptr) {
+      return _txnManager->savepoint(txn, testState);
+    };
+    bool rollbackTo(Transaction* txn, Transaction::Savepoint* sp, void* testState = nullptr) {
+      return _txnManager->rollbackTo(txn, sp, testState);
+    };
+    bool releaseSavepoint(Transaction* txn, Transaction::Savepoint* sp, void* testState = nullptr) {
+      return _txnManager->releaseSavepoint(txn, sp, testState);
+    };
+
+    /*
+     * Applies the transaction's changes and unlocks the files. Changes to
+     * SORTED indexes still in their overlays are merged into them first,
+     * one pass per index. If that fails, the transaction is aborted instead.
      */
     bool commitTxn(Transaction* txn, void* testState = nullptr) {
+      if (!txn) return false;
+      if (!_idxManager->_applyOverlays(txn, testState)) {
+        _txnManager->abortTxn(txn, testState);
+        return false;
+      }
       return _txnManager->commitTxn(txn, testState);
     };
 
@@ -229,6 +493,7 @@ class SDStorage {
     friend class SDStorageTestHelper;
 
     void (*_errFunction)() = nullptr;
+    RecoveryProgressFunction _recoveryProgress = nullptr;
     FileHelper _fileHelper;
     StorageProvider _storageProvider;
     TransactionManager* _txnManager = nullptr;
@@ -239,7 +504,14 @@ class SDStorage {
      * left after a power interruption. Finalized transactions are completed, and
      * all others are rolled back.
      */
-    bool fsck();
+    bool fsck(void* testState = nullptr);
+
+    // Commits fsck() has found but not yet applied, kept in ID order
+    static const uint8_t MAX_PENDING_COMMITS = 8;
+
+    // Applies the commit files in ids, in order. Returns false (after
+    // calling _errFunction) if one fails.
+    bool _fsckApplyCommits(const uint16_t* ids, uint8_t count, uint8_t* applied, void* testState = nullptr);
 
 };
 
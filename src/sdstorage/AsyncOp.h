@@ -0,0 +1,49 @@
+#ifndef _SDStorage_AsyncOp_h
+#define _SDStorage_AsyncOp_h
+
+
+#include <Arduino.h>
+
+/*
+ * Handle on an index operation started by one of SDStorage's ...Async(...)
+ * methods. Operations run one after the other, a step at a time, from
+ * SDStorage::poll(...), and keep their implicit transaction (and its locks)
+ * between steps. Index rewrites, LOG_STRUCTURED lookups and compactions are
+ * split into steps; growing a bloom filter isn't. The caller owns the
+ * handle: delete it once isDone(). Deleting it sooner cancels the
+ * operation, rolling back its transaction.
+ */
+class AsyncOp {
+
+  public:
+    enum Status : uint8_t {
+      QUEUED,       // waiting for the operations started before it, or its index's lock
+      RUNNING,
+      SUCCEEDED,
+      FAILED
+    };
+
+    virtual ~AsyncOp() {};
+
+    // Disable moving and copying
+    AsyncOp(AsyncOp&& other) = delete;
+    AsyncOp& operator=(AsyncOp&& other) = delete;
+    AsyncOp(const AsyncOp&) = delete;
+    AsyncOp& operator=(const AsyncOp&) = delete;
+
+    Status getStatus() const { return _status; };
+    bool isDone() const { return _status == SUCCEEDED || _status == FAILED; };
+
+  protected:
+    AsyncOp() {};
+
+    Status _status = QUEUED;
+    AsyncOp* _next = nullptr;     // in the queue
+
+    friend class IndexManager;
+    friend class SDStorageTestHelper;
+
+};
+
+
+#endif
@@ -0,0 +1,506 @@
+#include "BTreeIndex.h"
+#include "IndexHelpers.h"
+
+using namespace SDStorageStrings;
+
+static const char _SDSTORAGE_BTREE_MAGIC[] PROGMEM = "SDBT";
+static const uint8_t _SDSTORAGE_BTREE_VERSION = 1;
+
+bool BTreeIndex::isValidEntry(const char* key, const char* value) {
+  if (isEmpty(key)) return false;
+  size_t keyLen = strlen(key);
+  size_t valueLen = value ? strlen(value) : 0;
+  return keyLen <= MAX_KEY_LENGTH && 2 + keyLen + valueLen <= MAX_RECORD_SIZE;
+}
+
+bool BTreeIndex::readHeader(const uint8_t* page, Header* header) {
+  if (memcmp_P(page, _SDSTORAGE_BTREE_MAGIC, 4) != 0 || page[4] != _SDSTORAGE_BTREE_VERSION
+        || page[5] > MAX_HEIGHT) {
+    return false;
+  }
+  header->height = page[5];
+  header->root = _get32(page + 8);
+  header->pageCount = _get32(page + 12);
+  header->keyCount = _get32(page + 16);
+  return true;
+}
+
+void BTreeIndex::writeHeader(const Header* header, uint8_t* page) {
+  memset(page, 0, PAGE_SIZE);
+  memcpy_P(page, _SDSTORAGE_BTREE_MAGIC, 4);
+  page[4] = _SDSTORAGE_BTREE_VERSION;
+  page[5] = header->height;
+  _put32(page + 8, header->root);
+  _put32(page + 12, header->pageCount);
+  _put32(page + 16, header->keyCount);
+}
+
+bool BTreeIndex::scan(const Header* header, Pager* pager, const char* fromKey,
+      StreamableManager::FilterFunction filter, void* state) {
+  if (header->height == 0) return true;
+  uint8_t page[PAGE_SIZE];
+  uint32_t path[MAX_HEIGHT];
+  uint8_t slots[MAX_HEIGHT];
+  if (!_descend(header, pager, fromKey ? fromKey : "", page, path, slots)) return false;
+  bool isExact = false;
+  uint8_t slot = fromKey ? _findSlot(page, fromKey, &isExact) : 0;
+  uint8_t leafLevel = header->height - 1;
+  char line[MAX_RECORD_SIZE];
+  while (true) {
+    uint16_t offset = _recordOffset(page, slot);
+    for (; slot < page[1]; slot++) {
+      const uint8_t* record = page + PAGE_HEADER_SIZE + offset;
+      uint8_t keyLen = record[0];
+      uint8_t valueLen = record[1];
+      memcpy(line, record + 2, keyLen);
+      line[keyLen] = '=';
+      memcpy(line + keyLen + 1, record + 2 + keyLen, valueLen);
+      line[keyLen + 1 + valueLen] = '\0';
+      if (!filter(line, nullptr, state)) return true;
+      offset += _recordSize(page, offset);
+    }
+
+    // Climb to the nearest ancestor with another child, then down its left edge
+    int8_t level = leafLevel - 1;
+    for (; level >= 0; level--) {
+      if (!pager->read(path[level], page, pager->ctx)) return false;
+      if (slots[level] < page[1]) break;
+    }
+    if (level < 0) return true; // that was the last leaf
+    uint32_t pageNum = _getChild(page, ++slots[level]);
+    for (level++; level <= leafLevel; level++) {
+      if (!pager->read(pageNum, page, pager->ctx)) return false;
+      path[level] = pageNum;
+      if (level < leafLevel) {
+        slots[level] = 0;
+        pageNum = _getChild(page, 0);
+      }
+    }
+    slot = 0;
+  }
+}
+
+bool BTreeIndex::upsert(Header* header, Pager* pager, const char* key, const char* value) {
+  if (!isValidEntry(key, value)) return false;
+  // Room for one record past the end, so a page can overflow before it's split
+  uint8_t page[PAGE_SIZE + MAX_RECORD_SIZE];
+  uint8_t record[MAX_RECORD_SIZE];
+  uint16_t recordSize = _leafRecord(key, value, record);
+
+  if (header->height == 0) {
+    _initPage(page, LEAF);
+    _insertRecord(page, 0, record, recordSize);
+    uint32_t pageNum = _writePage(header, pager, NO_PAGE, page);
+    if (pageNum == NO_PAGE) return false;
+    header->root = pageNum;
+    header->height = 1;
+    header->keyCount = 1;
+    return true;
+  }
+
+  uint32_t path[MAX_HEIGHT];
+  uint8_t slots[MAX_HEIGHT];
+  if (!_descend(header, pager, key, page, path, slots)) return false;
+  bool isExact = false;
+  uint8_t slot = _findSlot(page, key, &isExact);
+  if (isExact) {
+    _removeRecord(page, slot);
+  } else {
+    header->keyCount++;
+  }
+  _insertRecord(page, slot, record, recordSize);
+
+  // Write the leaf, then each parent whose child moved or split
+  uint8_t sibling[PAGE_SIZE];
+  char sepKey[MAX_KEY_LENGTH + 1];
+  uint32_t childNum = NO_PAGE;
+  uint32_t siblingNum = NO_PAGE;
+  for (int8_t level = header->height - 1; level >= 0; level--) {
+    if (level < header->height - 1) {
+      if (!pager->read(path[level], page, pager->ctx)) return false;
+      if (_getChild(page, slots[level]) == childNum && siblingNum == NO_PAGE) {
+        // Child was updated in place, so nothing above it changes
+        return true;
+      }
+      _setChild(page, slots[level], childNum);
+      if (siblingNum != NO_PAGE) {
+        recordSize = _internalRecord(sepKey, siblingNum, record);
+        _insertRecord(page, slots[level], record, recordSize);
+      }
+    }
+    siblingNum = NO_PAGE;
+    if (_get16(page + 2) > PAYLOAD_SIZE) {
+      _split(page, sibling, sepKey);
+      siblingNum = _writePage(header, pager, NO_PAGE, sibling);
+      if (siblingNum == NO_PAGE) return false;
+    }
+    childNum = _writePage(header, pager, path[level], page);
+    if (childNum == NO_PAGE) return false;
+  }
+  if (siblingNum != NO_PAGE) {
+    // The root split
+    if (header->height >= MAX_HEIGHT) return false;
+    _initPage(page, INTERNAL);
+    _put32(page + 4, childNum);
+    recordSize = _internalRecord(sepKey, siblingNum, record);
+    _insertRecord(page, 0, record, recordSize);
+    childNum = _writePage(header, pager, NO_PAGE, page);
+    if (childNum == NO_PAGE) return false;
+    header->height++;
+  }
+  header->root = childNum;
+  return true;
+}
+
+BTreeIndex::Result BTreeIndex::remove(Header* header, Pager* pager, const char* key) {
+  if (header->height == 0 || isEmpty(key)) return NOT_FOUND;
+  uint8_t page[PAGE_SIZE];
+  uint32_t path[MAX_HEIGHT];
+  uint8_t slots[MAX_HEIGHT];
+  if (!_descend(header, pager, key, page, path, slots)) return FAILED;
+  bool isExact = false;
+  uint8_t slot = _findSlot(page, key, &isExact);
+  if (!isExact) return NOT_FOUND;
+  _removeRecord(page, slot);
+  header->keyCount--;
+
+  // Write the leaf, then each parent whose child moved. Empty pages are
+  // dropped from their parent instead of being written.
+  uint32_t childNum = NO_PAGE;
+  bool isDropped = false;
+  for (int8_t level = header->height - 1; level >= 0; level--) {
+    bool isEmptyPage = (page[1] == 0);
+    if (level < header->height - 1) {
+      if (!pager->read(path[level], page, pager->ctx)) return FAILED;
+      slot = slots[level];
+      if (isDropped) {
+        isEmptyPage = (slot == 0 && page[1] == 0);  // dropping its only child
+        if (!isEmptyPage && slot == 0) {
+          _put32(page + 4, _getChild(page, 1));
+          _removeRecord(page, 0);
+        } else if (!isEmptyPage) {
+          _removeRecord(page, slot - 1);
+        }
+      } else {
+        if (_getChild(page, slot) == childNum) return OK; // updated in place
+        _setChild(page, slot, childNum);
+        isEmptyPage = false;
+      }
+    }
+    isDropped = isEmptyPage;
+    if (isDropped) continue;
+    childNum = _writePage(header, pager, path[level], page);
+    if (childNum == NO_PAGE) return FAILED;
+  }
+  if (isDropped) {
+    header->root = NO_PAGE;
+    header->height = 0;
+    return OK;
+  }
+  header->root = childNum;
+  while (header->height > 1) {
+    // Collapse a root that's down to one child
+    if (!pager->read(header->root, page, pager->ctx)) return FAILED;
+    if (page[1] > 0) break;
+    header->root = _get32(page + 4);
+    header->height--;
+  }
+  return OK;
+}
+
+bool BTreeIndex::bulkLoadFilter(const char* line, StreamableManager::DestinationStream* dest, void* statePtr) {
+  Builder* builder = static_cast<Builder*>(statePtr);
+  char scratch[strlen(line) + 1];
+  IndexLineView entry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+  if (isEmpty(entry.key) || !builder->add(entry.key, entry.value)) {
+#if (defined(DEBUG))
+    Serial.println(F("B+tree bulk load aborting - invalid index line"));
+#endif
+    builder->failed = true;
+    return false;
+  }
+  return true;
+}
+
+BTreeIndex::Builder::Builder(Header* header, Pager* pager): header(header), pager(pager) {
+  *header = Header();
+  header->pageCount = pager->committedPages;
+  _initPage(page, LEAF);
+}
+
+bool BTreeIndex::Builder::add(const char* key, const char* value) {
+  if (failed || !isValidEntry(key, value)) return false;
+  uint8_t record[MAX_RECORD_SIZE];
+  uint16_t recordSize = _leafRecord(key, value, record);
+  if (_get16(page + 2) + recordSize > PAYLOAD_SIZE) {
+    uint32_t pageNum = header->pageCount++;
+    if (!pager->write(pageNum, page, pager->ctx)) return false;
+    if (firstLeaf == NO_PAGE) firstLeaf = pageNum;
+    _initPage(page, LEAF);
+  }
+  _insertRecord(page, page[1], record, recordSize);
+  header->keyCount++;
+  return true;
+}
+
+bool BTreeIndex::Builder::finish() {
+  if (failed) return false;
+  if (page[1] > 0) {
+    uint32_t pageNum = header->pageCount++;
+    if (!pager->write(pageNum, page, pager->ctx)) return false;
+    if (firstLeaf == NO_PAGE) firstLeaf = pageNum;
+  }
+  if (firstLeaf == NO_PAGE) return true; // empty tree
+
+  // Each level of internal pages is built from the one below it
+  uint8_t child[PAGE_SIZE];
+  uint8_t record[MAX_RECORD_SIZE];
+  char key[MAX_KEY_LENGTH + 1];
+  uint32_t levelStart = firstLeaf;
+  uint32_t levelEnd = header->pageCount;
+  header->height = 1;
+  while (levelEnd - levelStart > 1) {
+    if (header->height >= MAX_HEIGHT) return false;
+    uint32_t nextStart = header->pageCount;
+    _initPage(page, INTERNAL);
+    _put32(page + 4, levelStart);
+    for (uint32_t childNum = levelStart + 1; childNum < levelEnd; childNum++) {
+      if (!_minKey(pager, childNum, child, key)) return false;
+      uint16_t recordSize = _internalRecord(key, childNum, record);
+      if (_get16(page + 2) + recordSize > PAYLOAD_SIZE) {
+        if (!pager->write(header->pageCount++, page, pager->ctx)) return false;
+        _initPage(page, INTERNAL);
+        _put32(page + 4, childNum);
+      } else {
+        _insertRecord(page, page[1], record, recordSize);
+      }
+    }
+    if (!pager->write(header->pageCount++, page, pager->ctx)) return false;
+    levelStart = nextStart;
+    levelEnd = header->pageCount;
+    header->height++;
+  }
+  header->root = levelStart;
+  return true;
+}
+
+/*
+ * Reads the pages from the root down to the leaf that could contain key,
+ * leaving the leaf in page. path gets the page number at each level, and
+ * slots the child followed at each internal level.
+ */
+bool BTreeIndex::_descend(const Header* header, Pager* pager, const char* key, uint8_t* page,
+      uint32_t* path, uint8_t* slots) {
+  uint32_t pageNum = header->root;
+  for (uint8_t level = 0; level < header->height; level++) {
+    if (!pager->read(pageNum, page, pager->ctx)) return false;
+    path[level] = pageNum;
+    bool isLeaf = (level == header->height - 1);
+    if (page[0] != (isLeaf ? LEAF : INTERNAL)) {
+#if (defined(DEBUG))
+      Serial.println(F("BTreeIndex - possible index corruption"));
+#endif
+      return false;
+    }
+    if (!isLeaf) {
+      slots[level] = _childSlot(page, key);
+      pageNum = _getChild(page, slots[level]);
+    }
+  }
+  return true;
+}
+
+/*
+ * Writes a page back to pageNum if it was written in this transaction, or
+ * else to a new page at the end. Returns where it was written, or NO_PAGE.
+ */
+uint32_t BTreeIndex::_writePage(Header* header, Pager* pager, uint32_t pageNum, const uint8_t* page) {
+  if (pageNum == NO_PAGE || pageNum < pager->committedPages) {
+    pageNum = header->pageCount++;
+  }
+  return pager->write(pageNum, page, pager->ctx) ? pageNum : NO_PAGE;
+}
+
+/*
+ * Moves the upper half of an overfull page's records into sibling, and
+ * copies the key that separates them into sepKey. For an internal page, the
+ * middle record moves up to the parent instead: its child becomes the
+ * sibling's child0.
+ */
+void BTreeIndex::_split(uint8_t* page, uint8_t* sibling, char* sepKey) {
+  uint8_t count = page[1];
+  uint16_t used = _get16(page + 2);
+  uint8_t splitSlot = 0;
+  uint16_t splitOffset = 0;
+  do {
+    splitOffset += _recordSize(page, splitOffset);
+    splitSlot++;
+  } while (splitSlot < count - 1 && splitOffset < used / 2);
+
+  _initPage(sibling, page[0]);
+  _copyKey(page, splitOffset, sepKey);
+  uint16_t moveOffset = splitOffset;
+  uint8_t moveCount = count - splitSlot;
+  if (page[0] == INTERNAL) {
+    uint16_t size = _recordSize(page, splitOffset);
+    _put32(sibling + 4, _get32(page + PAGE_HEADER_SIZE + splitOffset + size - 4));
+    moveOffset += size;
+    moveCount--;
+  }
+  memcpy(sibling + PAGE_HEADER_SIZE, page + PAGE_HEADER_SIZE + moveOffset, used - moveOffset);
+  sibling[1] = moveCount;
+  _put16(sibling + 2, used - moveOffset);
+  page[1] = splitSlot;
+  _put16(page + 2, splitOffset);
+}
+
+// Copies the smallest key under pageNum into key, using page as a buffer
+bool BTreeIndex::_minKey(Pager* pager, uint32_t pageNum, uint8_t* page, char* key) {
+  for (uint8_t level = 0; level < MAX_HEIGHT; level++) {
+    if (!pager->read(pageNum, page, pager->ctx)) return false;
+    if (page[0] == LEAF) {
+      if (page[1] == 0) return false;
+      _copyKey(page, 0, key);
+      return true;
+    }
+    pageNum = _get32(page + 4);
+  }
+  return false;
+}
+
+void BTreeIndex::_initPage(uint8_t* page, uint8_t type) {
+  memset(page, 0, PAGE_SIZE);
+  page[0] = type;
+}
+
+// Size of the record at offset (relative to the start of the records)
+uint16_t BTreeIndex::_recordSize(const uint8_t* page, uint16_t offset) {
+  const uint8_t* record = page + PAGE_HEADER_SIZE + offset;
+  return (page[0] == LEAF) ? 2 + record[0] + record[1] : 1 + record[0] + 4;
+}
+
+uint16_t BTreeIndex::_recordOffset(const uint8_t* page, uint8_t slot) {
+  uint16_t offset = 0;
+  for (uint8_t i = 0; i < slot && i < page[1]; i++) {
+    offset += _recordSize(page, offset);
+  }
+  return offset;
+}
+
+// Compares the key of the record at offset with key, like strcmp
+int BTreeIndex::_compareKey(const uint8_t* page, uint16_t offset, const char* key) {
+  const uint8_t* record = page + PAGE_HEADER_SIZE + offset;
+  uint8_t recordKeyLen = record[0];
+  const uint8_t* recordKey = record + ((page[0] == LEAF) ? 2 : 1);
+  size_t keyLen = strlen(key);
+  int cmp = memcmp(recordKey, key, (recordKeyLen < keyLen) ? recordKeyLen : keyLen);
+  if (cmp != 0) return cmp;
+  return (recordKeyLen < keyLen) ? -1 : (recordKeyLen > keyLen) ? 1 : 0;
+}
+
+void BTreeIndex::_copyKey(const uint8_t* page, uint16_t offset, char* key) {
+  const uint8_t* record = page + PAGE_HEADER_SIZE + offset;
+  memcpy(key, record + ((page[0] == LEAF) ? 2 : 1), record[0]);
+  key[record[0]] = '\0';
+}
+
+// Finds the first record with a key >= key (or the record count if there isn't one)
+uint8_t BTreeIndex::_findSlot(const uint8_t* page, const char* key, bool* isExact) {
+  uint16_t offset = 0;
+  for (uint8_t slot = 0; slot < page[1]; slot++) {
+    int cmp = _compareKey(page, offset, key);
+    if (cmp >= 0) {
+      *isExact = (cmp == 0);
+      return slot;
+    }
+    offset += _recordSize(page, offset);
+  }
+  *isExact = false;
+  return page[1];
+}
+
+// The child of an internal page that could contain key: the number of records with keys <= key
+uint8_t BTreeIndex::_childSlot(const uint8_t* page, const char* key) {
+  uint16_t offset = 0;
+  uint8_t slot = 0;
+  while (slot < page[1] && _compareKey(page, offset, key) <= 0) {
+    offset += _recordSize(page, offset);
+    slot++;
+  }
+  return slot;
+}
+
+// Child slot 0 is child0, and slot n is the child of record n-1
+uint32_t BTreeIndex::_getChild(const uint8_t* page, uint8_t slot) {
+  if (slot == 0) return _get32(page + 4);
+  uint16_t offset = _recordOffset(page, slot - 1);
+  return _get32(page + PAGE_HEADER_SIZE + offset + _recordSize(page, offset) - 4);
+}
+
+void BTreeIndex::_setChild(uint8_t* page, uint8_t slot, uint32_t child) {
+  if (slot == 0) {
+    _put32(page + 4, child);
+    return;
+  }
+  uint16_t offset = _recordOffset(page, slot - 1);
+  _put32(page + PAGE_HEADER_SIZE + offset + _recordSize(page, offset) - 4, child);
+}
+
+void BTreeIndex::_insertRecord(uint8_t* page, uint8_t slot, const uint8_t* record, uint16_t size) {
+  uint16_t used = _get16(page + 2);
+  uint16_t offset = _recordOffset(page, slot);
+  uint8_t* pos = page + PAGE_HEADER_SIZE + offset;
+  memmove(pos + size, pos, used - offset);
+  memcpy(pos, record, size);
+  page[1]++;
+  _put16(page + 2, used + size);
+}
+
+void BTreeIndex::_removeRecord(uint8_t* page, uint8_t slot) {
+  uint16_t used = _get16(page + 2);
+  uint16_t offset = _recordOffset(page, slot);
+  uint16_t size = _recordSize(page, offset);
+  uint8_t* pos = page + PAGE_HEADER_SIZE + offset;
+  memmove(pos, pos + size, used - offset - size);
+  page[1]--;
+  _put16(page + 2, used - size);
+}
+
+uint16_t BTreeIndex::_leafRecord(const char* key, const char* value, uint8_t* record) {
+  uint8_t keyLen = strlen(key);
+  uint8_t valueLen = value ? strlen(value) : 0;
+  record[0] = keyLen;
+  record[1] = valueLen;
+  memcpy(record + 2, key, keyLen);
+  if (valueLen > 0) memcpy(record + 2 + keyLen, value, valueLen);
+  return 2 + keyLen + valueLen;
+}
+
+uint16_t BTreeIndex::_internalRecord(const char* key, uint32_t child, uint8_t* record) {
+  uint8_t keyLen = strlen(key);
+  record[0] = keyLen;
+  memcpy(record + 1, key, keyLen);
+  _put32(record + 1 + keyLen, child);
+  return 1 + keyLen + 4;
+}
+
+uint16_t BTreeIndex::_get16(const uint8_t* p) {
+  return static_cast<uint16_t>(p[0]) | (static_cast<uint16_t>(p[1]) << 8);
+}
+
+void BTreeIndex::_put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+uint32_t BTreeIndex::_get32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+        | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+void BTreeIndex::_put32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
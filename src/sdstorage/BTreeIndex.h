@@ -0,0 +1,147 @@
+#ifndef _SDStorage_BTreeIndex_h
+#define _SDStorage_BTreeIndex_h
+
+
+#include <Arduino.h>
+#include <StreamableManager.h>
+#include "Strings.h"
+
+static const char _SDSTORAGE_BTREE_PAGES_EXTSN[] PROGMEM = ".bpg";
+
+/*
+ * A BTREE index keeps its entries in a B+tree of PAGE_SIZE pages (one SD
+ * sector each) in a page file, ~IDX/<name>.bpg. The index file itself
+ * (~IDX/<name>.idx) is a single page header pointing at the root page, and
+ * it's the only file a transaction has to rewrite.
+ *
+ * Committed pages are never modified. Changing one writes a copy to the end
+ * of the page file along with copies of its parents, up to a new root, and
+ * the new header goes to the transaction's tmp file. Readers only follow the
+ * committed header, so pages past its page count (e.g. from an aborted
+ * transaction) are garbage that the next write overwrites. Pages written
+ * earlier in the same transaction are updated in place, unless a savepoint
+ * was taken since.
+ *
+ * Page layout (multi-byte numbers are little-endian):
+ *
+ *    [type][record count][bytes used, 2][child0, 4][records...]
+ *
+ *    leaf record:      [key length][value length][key][value]
+ *    internal record:  [key length][key][child, 4]
+ *
+ * In an internal page, child0 holds the keys that sort before the first
+ * record's key, and each record's child holds the keys from its key up to
+ * the next record's key. Pages aren't merged when entries are removed, so
+ * the tree (and the page file) is only packed again by rebuilding it.
+ */
+class BTreeIndex {
+
+  public:
+    BTreeIndex() = delete;
+
+    static const uint16_t PAGE_SIZE = 512;
+    static const uint32_t NO_PAGE = 0xFFFFFFFF;
+
+    enum Result : uint8_t {
+      OK,
+      NOT_FOUND,
+      FAILED
+    };
+
+    struct Header {
+      uint32_t root = NO_PAGE;
+      uint32_t pageCount = 0;
+      uint32_t keyCount = 0;
+      uint8_t height = 0;           // 0 = empty tree
+    };
+
+    // Reads or writes page number pageNum (PAGE_SIZE bytes)
+    typedef bool (*PageReader)(uint32_t pageNum, uint8_t* page, void* ctx);
+    typedef bool (*PageWriter)(uint32_t pageNum, const uint8_t* page, void* ctx);
+
+    struct Pager {
+      PageReader read = nullptr;
+      PageWriter write = nullptr;
+      void* ctx = nullptr;
+      uint32_t committedPages = 0;  // pages below this are visible to readers - copy on write
+    };
+
+  private:
+    static const uint8_t MAX_HEIGHT = 8;
+    static const uint8_t PAGE_HEADER_SIZE = 8;
+    static const uint16_t PAYLOAD_SIZE = PAGE_SIZE - PAGE_HEADER_SIZE;
+
+    // A page split leaves both halves with room for one more record as long
+    // as 3 records fit in a page
+    static const uint8_t MAX_RECORD_SIZE = 160;
+    static const uint8_t MAX_KEY_LENGTH = MAX_RECORD_SIZE - 5;
+
+    static const uint8_t LEAF = 1;
+    static const uint8_t INTERNAL = 2;
+
+    /*
+     * Builds a packed tree from entries added in ascending key order, writing
+     * pages sequentially from the start of an empty page file
+     */
+    struct Builder {
+      Header* header;
+      Pager* pager;
+      uint8_t page[PAGE_SIZE];
+      uint32_t firstLeaf = NO_PAGE;
+      bool failed = false;
+      Builder(Header* header, Pager* pager);
+      bool add(const char* key, const char* value);
+      bool finish();
+    };
+
+    static bool isValidEntry(const char* key, const char* value);
+    static bool readHeader(const uint8_t* page, Header* header);
+    static void writeHeader(const Header* header, uint8_t* page);
+
+    /*
+     * Passes every entry from fromKey onward (or from the start if fromKey
+     * is nullptr) to filter as an index line, in key order, until filter
+     * returns false. Same as scanning a SORTED index file.
+     */
+    static bool scan(const Header* header, Pager* pager, const char* fromKey,
+          StreamableManager::FilterFunction filter, void* state);
+    static bool upsert(Header* header, Pager* pager, const char* key, const char* value);
+    static Result remove(Header* header, Pager* pager, const char* key);
+
+    // For feeding index lines (a SORTED index file or a scan) to a Builder
+    static bool bulkLoadFilter(const char* line, StreamableManager::DestinationStream* dest, void* statePtr);
+
+    static bool _descend(const Header* header, Pager* pager, const char* key, uint8_t* page,
+          uint32_t* path, uint8_t* slots);
+    static uint32_t _writePage(Header* header, Pager* pager, uint32_t pageNum, const uint8_t* page);
+    static void _split(uint8_t* page, uint8_t* sibling, char* sepKey);
+    static bool _minKey(Pager* pager, uint32_t pageNum, uint8_t* page, char* key);
+
+    static void _initPage(uint8_t* page, uint8_t type);
+    static uint16_t _recordSize(const uint8_t* page, uint16_t offset);
+    static uint16_t _recordOffset(const uint8_t* page, uint8_t slot);
+    static int _compareKey(const uint8_t* page, uint16_t offset, const char* key);
+    static void _copyKey(const uint8_t* page, uint16_t offset, char* key);
+    static uint8_t _findSlot(const uint8_t* page, const char* key, bool* isExact);
+    static uint8_t _childSlot(const uint8_t* page, const char* key);
+    static uint32_t _getChild(const uint8_t* page, uint8_t slot);
+    static void _setChild(uint8_t* page, uint8_t slot, uint32_t child);
+    static void _insertRecord(uint8_t* page, uint8_t slot, const uint8_t* record, uint16_t size);
+    static void _removeRecord(uint8_t* page, uint8_t slot);
+    static uint16_t _leafRecord(const char* key, const char* value, uint8_t* record);
+    static uint16_t _internalRecord(const char* key, uint32_t child, uint8_t* record);
+
+    static uint16_t _get16(const uint8_t* p);
+    static void _put16(uint8_t* p, uint16_t v);
+    static uint32_t _get32(const uint8_t* p);
+    static void _put32(uint8_t* p, uint32_t v);
+
+    friend class BloomFilter;
+    friend class IndexManager;
+    friend class StorageProvider;
+    friend class SDStorageTestHelper;
+
+};
+
+
+#endif
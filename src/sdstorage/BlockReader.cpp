@@ -0,0 +1,76 @@
+#include "BlockReader.h"
+
+char* BlockReader::nextLine(size_t maxLen) {
+  while (true) {
+    char* start = _block + _pos;
+    char* eol = static_cast<char*>(memchr(start, '\n', _len - _pos));
+    if (_isSkipping) {
+      if (eol) {
+        _pos += eol - start + 1;
+        _isSkipping = false;
+      } else {
+        _pos = _len;
+        if (!_fill()) return nullptr;
+      }
+      continue;
+    }
+    if (eol || (_isEnd && _pos < _len) || (_pos == 0 && _len == BLOCK_SIZE)) {
+      size_t lineLen;
+      if (eol) {
+        lineLen = eol - start;
+        _pos += lineLen + 1;
+      } else {
+        // The last line has no line ending, or it's too long for the block
+        lineLen = _len - _pos;
+        _isSkipping = !_isEnd;
+        _pos = _len;
+      }
+      if (lineLen > 0 && start[lineLen - 1] == '\r') lineLen--;
+      if (lineLen == 0) continue;
+      if (lineLen > maxLen - 1) lineLen = maxLen - 1;
+      start[lineLen] = '\0';
+      return start;
+    }
+    if (!_fill() && _pos == _len) return nullptr;
+  }
+}
+
+const uint8_t* BlockReader::nextBlock(size_t* len) {
+  if (_pos == _len && !_fill()) return nullptr;
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(_block + _pos);
+  *len = _len - _pos;
+  _pos = _len;
+  return start;
+}
+
+int BlockReader::available() {
+  if (_pos == _len) _fill();
+  return _len - _pos;
+}
+
+int BlockReader::peek() {
+  if (_pos == _len && !_fill()) return -1;
+  return static_cast<uint8_t>(_block[_pos]);
+}
+
+int BlockReader::read() {
+  if (_pos == _len && !_fill()) return -1;
+  return static_cast<uint8_t>(_block[_pos++]);
+}
+
+// Moves what's left to the front of the block and reads more after it. Returns false if nothing was read
+bool BlockReader::_fill() {
+  if (_pos > 0) {
+    memmove(_block, _block + _pos, _len - _pos);
+    _len -= _pos;
+    _pos = 0;
+  }
+  if (_isEnd || _len == BLOCK_SIZE) return false;
+  int n = _readFn(reinterpret_cast<uint8_t*>(_block + _len), BLOCK_SIZE - _len, _ctx);
+  if (n <= 0) {
+    _isEnd = true;
+    return false;
+  }
+  _len += n;
+  return true;
+}
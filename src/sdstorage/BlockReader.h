@@ -0,0 +1,70 @@
+#ifndef _SDStorage_BlockReader_h
+#define _SDStorage_BlockReader_h
+
+
+#include <Arduino.h>
+
+/*
+ * Read-ahead for index scans: reads its source a block at a time, and hands
+ * out whole lines as pointers into the block instead of a byte at a time.
+ * It's also a Stream over the same block, for StreamableManager::pipe(...),
+ * which is still a lot cheaper per byte than reading the file itself.
+ *
+ * The block is one sector unless SDSTORAGE_READ_BLOCK_SIZE is defined
+ * bigger, e.g. on boards with RAM to spare.
+ */
+#ifndef SDSTORAGE_READ_BLOCK_SIZE
+  #define SDSTORAGE_READ_BLOCK_SIZE 512
+#endif
+
+class BlockReader: public Stream {
+
+  public:
+    static const uint16_t BLOCK_SIZE = SDSTORAGE_READ_BLOCK_SIZE;
+
+    // Reads up to len bytes from ctx's file into buffer. Returns how many (0 at the end)
+    typedef int (*ReadFunction)(uint8_t* buffer, size_t len, void* ctx);
+
+    BlockReader(ReadFunction readFn, void* ctx): _readFn(readFn), _ctx(ctx) {};
+
+    // Disable moving and copying
+    BlockReader(BlockReader&& other) = delete;
+    BlockReader& operator=(BlockReader&& other) = delete;
+    BlockReader(const BlockReader&) = delete;
+    BlockReader& operator=(const BlockReader&) = delete;
+
+    /*
+     * The next non-empty line, without its line ending, '\0'-terminated in
+     * the block, so it's only good until the next read. Lines longer than
+     * maxLen - 1 are cut short, like StreamableManager::pipe(...) does.
+     * Returns nullptr once the source is used up.
+     */
+    char* nextLine(size_t maxLen);
+
+    /*
+     * Everything read ahead so far (or the next block, if nothing is), for
+     * copying as-is. Sets len and returns a pointer into the block, or
+     * nullptr once the source is used up.
+     */
+    const uint8_t* nextBlock(size_t* len);
+
+    int available() override;
+    int peek() override;
+    int read() override;
+    size_t write(uint8_t) override { return 0; };
+
+  private:
+    ReadFunction _readFn;
+    void* _ctx;
+    uint16_t _pos = 0;            // next unread byte
+    uint16_t _len = 0;            // bytes in the block
+    bool _isEnd = false;          // the source is used up
+    bool _isSkipping = false;     // dropping the rest of a line that was cut short
+    char _block[BLOCK_SIZE + 1];  // room for a '\0' after a last line with no line ending
+
+    bool _fill();
+
+};
+
+
+#endif
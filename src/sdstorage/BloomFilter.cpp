@@ -0,0 +1,136 @@
+#include "BloomFilter.h"
+#include "IndexHelpers.h"
+
+using namespace SDStorageStrings;
+
+static const char _SDSTORAGE_BLOOM_MAGIC[] PROGMEM = "SDBF";
+static const uint8_t _SDSTORAGE_BLOOM_VERSION = 1;
+
+uint32_t BloomFilter::blocksFor(uint32_t keyCount) {
+  uint32_t blocks = (keyCount + KEYS_PER_BLOCK - 1) / KEYS_PER_BLOCK;
+  return blocks > 0 ? blocks : 1;
+}
+
+bool BloomFilter::isFull(const Header* header) {
+  return header->keyCount > header->blockCount * KEYS_PER_BLOCK;
+}
+
+bool BloomFilter::readHeader(const uint8_t* page, Header* header) {
+  if (memcmp_P(page, _SDSTORAGE_BLOOM_MAGIC, 4) != 0 || page[4] != _SDSTORAGE_BLOOM_VERSION) return false;
+  header->blockCount = BTreeIndex::_get32(page + 8);
+  header->keyCount = BTreeIndex::_get32(page + 12);
+  return header->blockCount > 0;
+}
+
+void BloomFilter::writeHeader(const Header* header, uint8_t* page) {
+  memset(page, 0, BLOCK_SIZE);
+  memcpy_P(page, _SDSTORAGE_BLOOM_MAGIC, 4);
+  page[4] = _SDSTORAGE_BLOOM_VERSION;
+  BTreeIndex::_put32(page + 8, header->blockCount);
+  BTreeIndex::_put32(page + 12, header->keyCount);
+}
+
+BloomFilter::Result BloomFilter::contains(BTreeIndex::Pager* pager, const char* key) {
+  if (isEmpty(key)) return UNAVAILABLE;
+  uint8_t page[BLOCK_SIZE];
+  Header header;
+  if (!pager->read(0, page, pager->ctx) || !readHeader(page, &header)) return UNAVAILABLE;
+  uint32_t hash = _hash(key);
+  if (!pager->read(1 + _blockOf(hash, header.blockCount), page, pager->ctx)) return UNAVAILABLE;
+  return _testBits(page, hash) ? MAYBE : MISS;
+}
+
+bool BloomFilter::create(BTreeIndex::Pager* pager, Header* header, uint32_t blockCount) {
+  header->blockCount = blockCount;
+  header->keyCount = 0;
+  uint8_t page[BLOCK_SIZE];
+  writeHeader(header, page);
+  if (!pager->write(0, page, pager->ctx)) return false;
+  memset(page, 0, BLOCK_SIZE);
+  for (uint32_t block = 0; block < blockCount; block++) {
+    if (!pager->write(1 + block, page, pager->ctx)) return false;
+  }
+  return true;
+}
+
+/*
+ * Sets key's bits in its block. The caller writes the header (with the
+ * updated keyCount) once it's done adding keys.
+ */
+bool BloomFilter::add(BTreeIndex::Pager* pager, Header* header, const char* key) {
+  if (isEmpty(key) || header->blockCount == 0) return false;
+  uint8_t page[BLOCK_SIZE];
+  uint32_t hash = _hash(key);
+  uint32_t pageNum = 1 + _blockOf(hash, header->blockCount);
+  if (!pager->read(pageNum, page, pager->ctx)) return false;
+  header->keyCount++;
+  if (_testBits(page, hash)) return true; // already set - save the write
+  _setBits(page, hash);
+  return pager->write(pageNum, page, pager->ctx);
+}
+
+bool BloomFilter::buildFilter(const char* line, StreamableManager::DestinationStream* dest, void* statePtr) {
+  Builder* builder = static_cast<Builder*>(statePtr);
+  char scratch[strlen(line) + 1];
+  bool isRemove = false;
+  IndexLineView entry = builder->isDelta
+        ? IndexHelpers::viewDeltaLine(line, scratch, sizeof(scratch), &isRemove)
+        : IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+  if (isEmpty(entry.key) || isRemove) return true;
+  if (builder->blockCount == 0) {
+    builder->keyCount++;
+  } else {
+    uint32_t hash = _hash(entry.key);
+    if (_blockOf(hash, builder->blockCount) == builder->block) _setBits(builder->page, hash);
+  }
+  return true;
+}
+
+// 32-bit FNV-1a
+uint32_t BloomFilter::_hash(const char* key) {
+  uint32_t hash = 2166136261UL;
+  for (; *key; key++) {
+    hash ^= static_cast<uint8_t>(*key);
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+uint32_t BloomFilter::_blockOf(uint32_t hash, uint32_t blockCount) {
+  return hash % blockCount;
+}
+
+/*
+ * The bit positions come from a remix of the hash (so they don't depend on
+ * which block it picked), stepping by an odd stride so they're all distinct
+ */
+static void _bloomPositions(uint32_t hash, uint16_t* bit, uint16_t* stride) {
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6BUL;
+  hash ^= hash >> 13;
+  hash *= 0xC2B2AE35UL;
+  hash ^= hash >> 16;
+  *bit = hash & 0xFFFF;
+  *stride = (hash >> 16) | 1;
+}
+
+void BloomFilter::_setBits(uint8_t* block, uint32_t hash) {
+  uint16_t bit, stride;
+  _bloomPositions(hash, &bit, &stride);
+  for (uint8_t i = 0; i < HASH_COUNT; i++) {
+    uint16_t pos = bit % BLOCK_BITS;
+    block[pos >> 3] |= (1 << (pos & 7));
+    bit += stride;
+  }
+}
+
+bool BloomFilter::_testBits(const uint8_t* block, uint32_t hash) {
+  uint16_t bit, stride;
+  _bloomPositions(hash, &bit, &stride);
+  for (uint8_t i = 0; i < HASH_COUNT; i++) {
+    uint16_t pos = bit % BLOCK_BITS;
+    if (!(block[pos >> 3] & (1 << (pos & 7)))) return false;
+    bit += stride;
+  }
+  return true;
+}
@@ -0,0 +1,86 @@
+#ifndef _SDStorage_BloomFilter_h
+#define _SDStorage_BloomFilter_h
+
+
+#include <Arduino.h>
+#include <StreamableManager.h>
+#include "BTreeIndex.h"
+#include "Strings.h"
+
+static const char _SDSTORAGE_BLOOM_EXTSN[]       PROGMEM = ".blm";
+
+/*
+ * A bloom filter file is a sidecar to an index (~IDX/<name>.blm) that can
+ * tell a key is definitely NOT in the index without scanning it. It's a
+ * blocked bloom filter: each key hashes to one BLOCK_SIZE block (one SD
+ * sector), and all HASH_COUNT of its bits are in that block, so checking or
+ * adding a key reads or writes a single block. Block 0 is a header.
+ *
+ * Bloom filters can't forget keys, so removing or renaming entries leaves
+ * their bits set. That only costs false positives, which fall back to a
+ * normal index scan. The filter is sized for its entry count when it's
+ * created. Once more keys than that have been added it's rebuilt, with
+ * room for twice as many, so an index built one upsert at a time doesn't
+ * saturate it. Rebuilding also drops removed keys.
+ */
+class BloomFilter {
+
+  public:
+    BloomFilter() = delete;
+
+    enum Result : uint8_t {
+      UNAVAILABLE,  // no usable filter - scan the index
+      MISS,         // key is definitely not in the index
+      MAYBE         // key might be in the index
+    };
+
+    struct Header {
+      uint32_t blockCount = 0;
+      uint32_t keyCount = 0;      // keys added, including removed and repeated ones
+    };
+
+  private:
+    static const uint16_t BLOCK_SIZE = BTreeIndex::PAGE_SIZE;
+    static const uint16_t BLOCK_BITS = BLOCK_SIZE * 8;
+    static const uint8_t BITS_PER_KEY = 10;           // ~1% false positives at capacity
+    static const uint8_t HASH_COUNT = 7;
+    static const uint16_t KEYS_PER_BLOCK = BLOCK_BITS / BITS_PER_KEY;
+
+    /*
+     * Fills in one block of a new filter at a time from index lines, since
+     * the whole filter may not fit in RAM. Scan the index once with
+     * blockCount = 0 to count its keys, then once per block.
+     */
+    struct Builder {
+      uint32_t keyCount = 0;
+      uint32_t blockCount = 0;
+      uint32_t block = 0;         // the block being filled
+      bool isDelta = false;       // lines are delta log lines
+      uint8_t page[BLOCK_SIZE];
+    };
+
+    static uint32_t blocksFor(uint32_t keyCount);
+    // More keys have been added than the filter was sized for
+    static bool isFull(const Header* header);
+    static bool readHeader(const uint8_t* page, Header* header);
+    static void writeHeader(const Header* header, uint8_t* page);
+
+    static Result contains(BTreeIndex::Pager* pager, const char* key);
+    static bool create(BTreeIndex::Pager* pager, Header* header, uint32_t blockCount);
+    static bool add(BTreeIndex::Pager* pager, Header* header, const char* key);
+
+    // For feeding index lines (or delta log lines) to a Builder
+    static bool buildFilter(const char* line, StreamableManager::DestinationStream* dest, void* statePtr);
+
+    static uint32_t _hash(const char* key);
+    static uint32_t _blockOf(uint32_t hash, uint32_t blockCount);
+    static void _setBits(uint8_t* block, uint32_t hash);
+    static bool _testBits(const uint8_t* block, uint32_t hash);
+
+    friend class IndexManager;
+    friend class SDStorageTestHelper;
+
+};
+
+
+#endif
@@ -0,0 +1,74 @@
+#include "EntryCache.h"
+
+EntryCache::Entry EntryCache::get(const char* path) {
+  if (!_isEnabled || !path) return UNKNOWN;
+  uint8_t i = _find(path, _hash(path));
+  if (i == CAPACITY) {
+    _stats.misses++;
+    return UNKNOWN;
+  }
+  _stats.hits++;
+  _slots[i].lastUsed = ++_tick;
+  return _slots[i].entry;
+}
+
+void EntryCache::put(const char* path, Entry entry) {
+  if (!_isEnabled || !path) return;
+  if (entry == UNKNOWN) {
+    invalidate(path);
+    return;
+  }
+  size_t len = strlen(path);
+  if (len >= NAME_SIZE) return;
+  uint32_t h = _hash(path);
+  uint8_t i = _find(path, h);
+  if (i == CAPACITY) {
+    // A free slot, or else the one used longest ago (ages wrap with _tick)
+    i = 0;
+    for (uint8_t s = 0; s < CAPACITY; s++) {
+      if (_slots[s].entry == UNKNOWN) {
+        i = s;
+        break;
+      }
+      if (static_cast<uint16_t>(_tick - _slots[s].lastUsed) > static_cast<uint16_t>(_tick - _slots[i].lastUsed)) i = s;
+    }
+    _slots[i].hash = h;
+    memcpy(_slots[i].name, path, len + 1);
+  }
+  _slots[i].entry = entry;
+  _slots[i].lastUsed = ++_tick;
+}
+
+void EntryCache::invalidate(const char* path) {
+  if (!_isEnabled || !path) return;
+  uint8_t i = _find(path, _hash(path));
+  if (i == CAPACITY) return;
+  _slots[i].entry = UNKNOWN;
+  _stats.invalidations++;
+}
+
+void EntryCache::clear() {
+  for (uint8_t i = 0; i < CAPACITY; i++) _slots[i].entry = UNKNOWN;
+}
+
+void EntryCache::setEnabled(bool isEnabled) {
+  clear();
+  _isEnabled = isEnabled;
+}
+
+uint8_t EntryCache::_find(const char* path, uint32_t hash) {
+  for (uint8_t i = 0; i < CAPACITY; i++) {
+    if (_slots[i].entry != UNKNOWN && _slots[i].hash == hash && strcasecmp(_slots[i].name, path) == 0) return i;
+  }
+  return CAPACITY;
+}
+
+// FNV-1a of path with its letters upper-cased, so it matches however it's spelled
+uint32_t EntryCache::_hash(const char* path) {
+  uint32_t h = 2166136261UL;
+  for (; *path != '\0'; path++) {
+    h ^= static_cast<uint8_t>(toupper(static_cast<uint8_t>(*path)));
+    h *= 16777619UL;
+  }
+  return h;
+}
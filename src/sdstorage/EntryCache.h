@@ -0,0 +1,89 @@
+#ifndef _SDStorage_EntryCache_h
+#define _SDStorage_EntryCache_h
+
+
+#include <Arduino.h>
+
+/*
+ * What's known about the last few paths looked up on the card, so repeat
+ * exists() and isDirectory() checks (a FAT directory walk from the root
+ * each) don't go back to the card. A single index upsert checks the index,
+ * its tmp file and its directories several times over.
+ *
+ * Entries are only changed through StorageProvider, which updates them on
+ * every mkdir, remove, rename and file it creates, so anything that changes
+ * the card behind its back must clear() the cache, or turn it off. The
+ * least recently used entry is dropped to make room. Paths longer than
+ * NAME_SIZE - 1 aren't cached. FAT names aren't case sensitive, so neither
+ * are paths here: /R/A.DAT and /r/a.dat are the same entry.
+ */
+#ifndef SDSTORAGE_ENTRY_CACHE_SIZE
+  #if defined(__AVR__)
+    #define SDSTORAGE_ENTRY_CACHE_SIZE 4
+  #else
+    #define SDSTORAGE_ENTRY_CACHE_SIZE 8
+  #endif
+#endif
+
+class EntryCache {
+
+  public:
+    static const uint8_t CAPACITY = SDSTORAGE_ENTRY_CACHE_SIZE;
+    static const uint8_t NAME_SIZE = 40;
+
+    enum Entry : uint8_t {
+      UNKNOWN,    // not cached
+      MISSING,
+      EXISTS,     // a file or directory
+      IS_FILE,
+      IS_DIR
+    };
+
+    struct Stats {
+      uint32_t hits = 0;            // lookups answered from the cache, i.e. directory walks avoided
+      uint32_t misses = 0;          // lookups that went to the card
+      uint32_t invalidations = 0;   // entries dropped because a change could have left them stale
+    };
+
+    EntryCache() {};
+
+    // Disable moving and copying
+    EntryCache(EntryCache&& other) = delete;
+    EntryCache& operator=(EntryCache&& other) = delete;
+    EntryCache(const EntryCache&) = delete;
+    EntryCache& operator=(const EntryCache&) = delete;
+
+    // What's known about path, counting a hit or a miss. UNKNOWN if nothing
+    Entry get(const char* path);
+    void put(const char* path, Entry entry);
+    void invalidate(const char* path);
+    void clear();
+
+    // Turning the cache off clears it, and get(...) is always UNKNOWN until it's back on
+    void setEnabled(bool isEnabled);
+    bool isEnabled() const { return _isEnabled; };
+
+    const Stats& stats() { return _stats; };
+    void resetStats() { _stats = Stats(); };
+
+  private:
+    struct Slot {
+      uint32_t hash = 0;
+      uint16_t lastUsed = 0;
+      Entry entry = UNKNOWN;        // UNKNOWN if the slot is free
+      char name[NAME_SIZE];
+    };
+
+    Slot _slots[CAPACITY];
+    uint16_t _tick = 0;
+    bool _isEnabled = true;
+    Stats _stats;
+
+    // Slot holding path, or CAPACITY
+    uint8_t _find(const char* path, uint32_t hash);
+    static uint32_t _hash(const char* path);
+
+};
+
+
+#endif
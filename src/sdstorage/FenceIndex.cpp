@@ -0,0 +1,171 @@
+#include "FenceIndex.h"
+
+using namespace SDStorageStrings;
+
+void FenceIndex::Writer::addLine(const char* line) {
+  char key[FENCE_KEY_WIDTH + 1];
+  bool keyFits = lineKey(line, key, sizeof(key));
+  _addKey(key, keyFits, offset);
+  offset += strlen(line) + 1; // +1 for '\n'
+}
+
+/*
+ * Same as passing each line to addLine(...), for a run of raw index bytes
+ * that starts at the beginning of a line. Only the key at the start of each
+ * line is looked at.
+ */
+void FenceIndex::Writer::addBytes(const uint8_t* bytes, size_t len) {
+  for (size_t i = 0; i < len; i++, offset++) {
+    char c = static_cast<char>(bytes[i]);
+    if (_atLineStart) {
+      _atLineStart = false;
+      _inKey = true;
+      _keyLen = 0;
+      _lineOffset = offset;
+    }
+    if (c == '\n') {
+      if (_inKey) _endKey();
+      _atLineStart = true;
+    } else if (_inKey) {
+      if (c == '=') {
+        _endKey();
+      } else if (_keyLen > 0 || !isspace(c)) {
+        // One past the width means the key doesn't fit
+        if (_keyLen <= FENCE_KEY_WIDTH) _key[_keyLen++] = c;
+      }
+    }
+  }
+}
+
+void FenceIndex::Writer::finish() {
+  if (_inKey) _endKey(); // last line had no '=' or '\n'
+  if (dest) writeRecord(dest, lastKey, offset);
+}
+
+void FenceIndex::Writer::resume(const Tail* tail) {
+  offset = tail->indexSize;
+  strcpy(lastKey, tail->lastKey);
+  hasFence = tail->recordCount > 0;
+  lastFenceOffset = tail->lastFenceOffset;
+  if (dest && hasFence) writeRecord(dest, tail->lastFenceKey, lastFenceOffset);
+}
+
+void FenceIndex::Writer::_endKey() {
+  _inKey = false;
+  while (_keyLen > 0 && isspace(_key[_keyLen - 1])) --_keyLen;
+  bool keyFits = _keyLen <= FENCE_KEY_WIDTH;
+  _key[keyFits ? _keyLen : 0] = '\0';
+  _addKey(_key, keyFits, _lineOffset);
+}
+
+void FenceIndex::Writer::_addKey(const char* key, bool keyFits, uint32_t lineOffset) {
+  if (keyFits) {
+    strcpy(lastKey, key);
+  } else {
+    lastKey[0] = '\0';
+  }
+  if (dest && keyFits && !isEmpty(key)
+        && (!hasFence || lineOffset - lastFenceOffset >= FENCE_BLOCK_SIZE)) {
+    writeRecord(dest, key, lineOffset);
+    lastFenceOffset = lineOffset;
+    hasFence = true;
+  }
+}
+
+FenceIndex::Result FenceIndex::search(const char* key, bool isPrefix, uint32_t fenceSize, uint32_t indexSize,
+      RecordReader reader, void* ctx, Range* range) {
+  if (!key || !reader || !range || fenceSize < FENCE_RECORD_SIZE || fenceSize % FENCE_RECORD_SIZE != 0) {
+    return UNAVAILABLE;
+  }
+  uint32_t count = fenceSize / FENCE_RECORD_SIZE - 1; // not including the trailer
+  char record[FENCE_RECORD_SIZE];
+  char recordKey[FENCE_KEY_WIDTH + 1];
+  uint32_t recordOffset = 0;
+
+  // Check the trailer first
+  if (!reader(count, record, ctx) || !parseRecord(record, recordKey, &recordOffset)) return UNAVAILABLE;
+  if (recordOffset != indexSize) return UNAVAILABLE; // stale fence
+  range->start = 0;
+  range->end = indexSize;
+  if (!isEmpty(recordKey) && strcmp(key, recordKey) > 0) {
+    // Past the largest key. For a prefix search, any match would also sort
+    // at or after the prefix, so there can't be any.
+    return MISS;
+  }
+
+  // Find the number of fence keys <= key
+  uint32_t lo = 0;
+  uint32_t hi = count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (!reader(mid, record, ctx) || !parseRecord(record, recordKey, &recordOffset)) return UNAVAILABLE;
+    if (strcmp(recordKey, key) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo > 0) {
+    if (!reader(lo - 1, record, ctx) || !parseRecord(record, recordKey, &recordOffset)) return UNAVAILABLE;
+    range->start = recordOffset;
+  }
+  if (isPrefix) return FOUND;
+  if (lo < count) {
+    if (!reader(lo, record, ctx) || !parseRecord(record, recordKey, &recordOffset)) return UNAVAILABLE;
+    range->end = recordOffset;
+  }
+  return (range->start < range->end) ? FOUND : MISS;
+}
+
+bool FenceIndex::readTail(uint32_t fenceSize, uint32_t indexSize, RecordReader reader, void* ctx, Tail* tail) {
+  if (!reader || !tail || fenceSize < FENCE_RECORD_SIZE || fenceSize % FENCE_RECORD_SIZE != 0) return false;
+  char record[FENCE_RECORD_SIZE];
+  uint32_t recordOffset = 0;
+  tail->fenceSize = fenceSize;
+  tail->recordCount = fenceSize / FENCE_RECORD_SIZE - 1;
+  if (!reader(tail->recordCount, record, ctx) || !parseRecord(record, tail->lastKey, &recordOffset)) return false;
+  if (recordOffset != indexSize || isEmpty(tail->lastKey)) return false;
+  tail->indexSize = indexSize;
+  if (tail->recordCount == 0) return true;
+  return reader(tail->recordCount - 1, record, ctx) 
+        && parseRecord(record, tail->lastFenceKey, &tail->lastFenceOffset);
+}
+
+/*
+ * Extracts the trimmed key from an index line, the same way
+ * IndexHelpers::viewIndexLine does, into a buffer of bufferSize
+ */
+bool FenceIndex::lineKey(const char* line, char* buffer, size_t bufferSize) {
+  if (!line || !buffer || bufferSize == 0) return false;
+  while (isspace(*line)) ++line;
+  const char* eq = strchr(line, '=');
+  size_t len = eq ? static_cast<size_t>(eq - line) : strlen(line);
+  while (len > 0 && isspace(line[len - 1])) --len;
+  if (len >= bufferSize) return false;
+  memcpy(buffer, line, len);
+  buffer[len] = '\0';
+  return true;
+}
+
+void FenceIndex::writeRecord(Stream* dest, const char* key, uint32_t offset) {
+  char record[FENCE_RECORD_SIZE + 1];
+  static const char fmt[] PROGMEM = "%-*s=%010lu\n";
+  snprintf_P(record, sizeof(record), fmt, FENCE_KEY_WIDTH, key, static_cast<unsigned long>(offset));
+  dest->write(record, FENCE_RECORD_SIZE);
+}
+
+bool FenceIndex::parseRecord(const char* record, char* key, uint32_t* offset) {
+  if (record[FENCE_KEY_WIDTH] != '=' || record[FENCE_RECORD_SIZE - 1] != '\n') return false;
+  uint8_t len = FENCE_KEY_WIDTH;
+  while (len > 0 && record[len - 1] == ' ') --len;
+  memcpy(key, record, len);
+  key[len] = '\0';
+  uint32_t value = 0;
+  for (uint8_t i = FENCE_KEY_WIDTH + 1; i < FENCE_RECORD_SIZE - 1; i++) {
+    char c = record[i];
+    if (c < '0' || c > '9') return false;
+    value = value * 10 + (c - '0');
+  }
+  *offset = value;
+  return true;
+}
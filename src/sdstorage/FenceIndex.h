@@ -0,0 +1,125 @@
+#ifndef _SDStorage_FenceIndex_h
+#define _SDStorage_FenceIndex_h
+
+
+#include <Arduino.h>
+#include "Strings.h"
+
+static const char _SDSTORAGE_FENCE_EXTSN[]       PROGMEM = ".fnc";
+
+/*
+ * A fence file is a sparse sidecar to an index file (~IDX/<name>.fnc next
+ * to ~IDX/<name>.idx). Roughly every FENCE_BLOCK_SIZE bytes, the key of the
+ * next index line is recorded along with that line's byte offset. Records
+ * have a fixed width, so the fence can be binary-searched and a lookup only
+ * has to scan the one block of the index that could contain the key.
+ *
+ * Record layout (FENCE_RECORD_SIZE bytes):
+ *
+ *    <key, space-padded to FENCE_KEY_WIDTH>=<offset, 10 digits>\n
+ *
+ * The last record is a trailer holding the largest key in the index (blank
+ * if it's too long to fit) and the size of the index file it was built for.
+ * A fence whose trailer size doesn't match the index is stale and ignored.
+ * Lines whose key is longer than FENCE_KEY_WIDTH are never fenced, which
+ * only makes the surrounding block longer.
+ */
+class FenceIndex {
+
+  public:
+    FenceIndex() = delete;
+
+    enum Result : uint8_t {
+      UNAVAILABLE,  // no usable fence - scan the whole index
+      MISS,         // key is definitely not in the index
+      FOUND         // key can only be in the range [start, end)
+    };
+
+    struct Range {
+      uint32_t start = 0;
+      uint32_t end = 0;
+    };
+
+  private:
+    static const uint8_t FENCE_KEY_WIDTH = 31;
+    static const uint8_t FENCE_RECORD_SIZE = FENCE_KEY_WIDTH + 12; // +1 '=' +10 digits +1 '\n'
+    static const uint16_t FENCE_BLOCK_SIZE = 512;
+
+    /*
+     * The end of a fence: its trailer and the last record before it. Enough
+     * to carry on fencing lines appended to the index. See readTail(...)
+     */
+    struct Tail {
+      uint32_t fenceSize = 0;
+      uint32_t indexSize = 0;
+      uint32_t recordCount = 0;       // not including the trailer
+      char lastKey[FENCE_KEY_WIDTH + 1] = { '\0' };
+      char lastFenceKey[FENCE_KEY_WIDTH + 1] = { '\0' };
+      uint32_t lastFenceOffset = 0;
+    };
+
+    /*
+     * Builds a fence file while an index is being written. Every line written
+     * to the index must be passed to addLine(...), in order, or as raw bytes
+     * to addBytes(...) once the rest of the index is being copied as-is.
+     */
+    struct Writer {
+      Stream* dest;
+      uint32_t offset = 0;            // offset of the next index line
+      uint32_t lastFenceOffset = 0;
+      bool hasFence = false;
+      char lastKey[FENCE_KEY_WIDTH + 1] = { '\0' };
+      Writer(Stream* dest): dest(dest) {};
+      void addLine(const char* line);
+      void addBytes(const uint8_t* bytes, size_t len);
+      void finish();
+
+      /*
+       * Starts from the end of an existing fence instead of an empty index.
+       * Its last record (if any) is written again, so dest should replace
+       * the fence from the start of that record.
+       */
+      void resume(const Tail* tail);
+
+      private:
+        // For picking keys out of raw bytes
+        bool _inKey = false;
+        bool _atLineStart = true;
+        uint8_t _keyLen = 0;
+        uint32_t _lineOffset = 0;
+        char _key[FENCE_KEY_WIDTH + 2];
+        void _addKey(const char* key, bool keyFits, uint32_t lineOffset);
+        void _endKey();
+    };
+
+    // Reads record number recordNum into the record buffer (FENCE_RECORD_SIZE bytes)
+    typedef bool (*RecordReader)(uint32_t recordNum, char* record, void* ctx);
+
+    /*
+     * Binary-searches a fence of fenceSize bytes for the block of the index
+     * that could contain key. When isPrefix is true, only range.start is
+     * meaningful and range.end is the end of the index.
+     */
+    static Result search(const char* key, bool isPrefix, uint32_t fenceSize, uint32_t indexSize,
+          RecordReader reader, void* ctx, Range* range);
+
+    /*
+     * Reads the end of a fence of fenceSize bytes built for an index of
+     * indexSize bytes. Fails if the fence is stale or the largest key in the
+     * index was too long to record.
+     */
+    static bool readTail(uint32_t fenceSize, uint32_t indexSize, RecordReader reader, void* ctx, Tail* tail);
+
+    static bool lineKey(const char* line, char* buffer, size_t bufferSize);
+    static void writeRecord(Stream* dest, const char* key, uint32_t offset);
+    static bool parseRecord(const char* record, char* key, uint32_t* offset);
+
+    friend class IndexManager;
+    friend class IndexScanFilters;
+    friend class StorageProvider;
+    friend class SDStorageTestHelper;
+
+};
+
+
+#endif
@@ -197,6 +197,22 @@ bool FileHelper::indexFilename(sdstorage::Index idx, char* buffer, size_t buffer
   return success;
 }
 
+bool FileHelper::sidecarFilename(const char* filename, const char* extPmem, char* buffer, size_t bufferSize) {
+  if (!filename || !extPmem || !buffer || bufferSize == 0 || !verifyBufferSize(bufferSize)) return false;
+
+  const char* lastSlash = strrchr(filename, '/');
+  const char* dot = strrchr(filename, '.');
+  size_t baseLen = (dot && (!lastSlash || dot > lastSlash)) ? dot - filename : strlen(filename);
+  size_t extLen = strlen_P(extPmem);
+  if (baseLen + extLen + 1 > bufferSize) {
+    buffer[0] = '\0';
+    return false;
+  }
+  memcpy(buffer, filename, baseLen);
+  strcpy_P(buffer + baseLen, extPmem);
+  return true;
+}
+
 bool FileHelper::verifyBufferSize(size_t bufferSize) {
   if (bufferSize > MAX_FILENAME_LENGTH) {
 #if (defined(DEBUG))
@@ -8,6 +8,7 @@
 static const char _SDSTORAGE_WORK_DIR[]          PROGMEM = "~WORK";
 static const char _SDSTORAGE_IDX_DIR[]           PROGMEM = "~IDX";
 static const char _SDSTORAGE_INDEX_EXTSN[]       PROGMEM = ".idx";
+static const char _SDSTORAGE_CLEAN_MARKER[]      PROGMEM = "~CLEAN";
 
 class FileHelper {
 
@@ -57,6 +58,12 @@ class FileHelper {
      */
     bool indexFilename(sdstorage::Index idx, char* buffer, size_t bufferSize);
 
+    /*
+     * Returns the filename of a sidecar file that lives next to the given
+     * file, by swapping its extension for extPmem. e.g. foo.idx -> foo.fnc
+     */
+    static bool sidecarFilename(const char* filename, const char* extPmem, char* buffer, size_t bufferSize);
+
     /*
      * Various filename helpers
      */
@@ -0,0 +1,27 @@
+#ifndef _SDStorage_FileUse_h
+#define _SDStorage_FileUse_h
+
+
+#include <Arduino.h>
+
+/*
+ * What StorageProvider is calling the filesystem for. SdFat and PosixFs
+ * don't need to know, but MockSdFat has only a script to go on, and uses it
+ * to pick the data a read gets and the captor a write goes to.
+ */
+enum FileUse : uint8_t {
+  USE_ANY,              // exists, mkdir, remove, rename and replace
+  USE_DTO,              // a DTO or transaction file, loaded or saved whole
+  USE_TXN,              // a transaction's journal, written or appended to
+  USE_INDEX,            // an index, delta log or overlay, scanned or appended to
+  USE_INDEX_REWRITE,    // an index's tmp file, written from the start
+  USE_AUX,              // fence files, rewritten delta logs and markers, written whole
+  USE_SIZE,             // just looking at a file's size
+  USE_APPEND,           // both files of _appendFile(...)
+  USE_PAGES,            // a file of pages (B+trees, Bloom filters)
+  USE_DIR,              // a directory, to list
+  USE_IS_DIR            // anything, to see if it's a directory
+};
+
+
+#endif
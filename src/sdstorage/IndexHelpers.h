@@ -8,6 +8,15 @@
 using namespace sdstorage;
 using namespace SDStorageStrings;
 
+static const char _SDSTORAGE_DELTA_EXTSN[]       PROGMEM = ".dlt";
+static const char _SDSTORAGE_OVERLAY_EXTSN[]     PROGMEM = ".ovl";
+
+// A non-owning key/value view of an index line. See IndexHelpers::viewIndexLine
+struct IndexLineView {
+  const char* key = "";
+  const char* value = nullptr;
+};
+
 class IndexHelpers {
 
   public:
@@ -58,6 +67,68 @@ class IndexHelpers {
       return *value ? IndexEntry(key, value) : IndexEntry(key);
     };
 
+    /*
+     * Delta log lines (LOG_STRUCTURED indexes) are index lines prefixed with
+     * '+' for an upsert, or '-' and just the key for a removal
+     */
+    static bool toDeltaLine(IndexEntry* entry, bool isRemove, char* buffer, size_t bufferSize) {
+      if (!entry || !entry->key || isEmpty(entry->key) || !buffer || bufferSize < 2) return false;
+      if (isRemove) {
+        static const char fmt[] PROGMEM = "-%s";
+        int n = snprintf_P(buffer, bufferSize, fmt, entry->key);
+        if (n < 0 || static_cast<size_t>(n) >= bufferSize) {
+          buffer[bufferSize - 1] = '\0';
+          return false;
+        }
+        return true;
+      }
+      buffer[0] = '+';
+      return toIndexLine(entry, buffer + 1, bufferSize - 1);
+    };
+
+    /*
+     * Splits an index line into key and value the same way parseIndexEntry
+     * does, but into a caller-provided scratch buffer (strlen(line) + 1 bytes
+     * is enough) instead of the heap. The view points into scratch. An empty
+     * value is returned as nullptr.
+     */
+    static IndexLineView viewIndexLine(const char* line, char* scratch, size_t scratchSize) {
+      IndexLineView view;
+      if (!line || !*line || !scratch || scratchSize == 0) return view;
+      size_t len = strlen(line);
+      if (len >= scratchSize) len = scratchSize - 1;
+      memcpy(scratch, line, len);
+      scratch[len] = '\0';
+
+      char* start = scratch;
+      while (isspace(*start)) ++start;
+      char* end = start + strlen(start);
+      while (end > start && isspace(*(end - 1))) *--end = '\0';
+
+      char* eq = strchr(start, '=');
+      if (!eq) {
+        view.key = start;
+        return view;
+      }
+      *eq = '\0';
+      char* keyEnd = eq;
+      while (keyEnd > start && isspace(*(keyEnd - 1))) *--keyEnd = '\0';
+      char* value = eq + 1;
+      while (isspace(*value)) ++value;
+      view.key = start;
+      view.value = *value ? value : nullptr;
+      return view;
+    };
+
+    // Same as viewIndexLine, for delta log lines. The key is empty if the line isn't valid
+    static IndexLineView viewDeltaLine(const char* line, char* scratch, size_t scratchSize, bool* isRemove) {
+      if (!line || (line[0] != '+' && line[0] != '-')) return IndexLineView();
+      *isRemove = (line[0] == '-');
+      return viewIndexLine(line + 1, scratch, scratchSize);
+    };
+
+    friend class BloomFilter;
+    friend class BTreeIndex;
     friend class IndexManager;
     friend class IndexScanFilters;
     friend class SDStorageTestHelper;
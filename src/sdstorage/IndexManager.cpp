@@ -13,32 +13,192 @@ bool IndexManager::idxUpsert(void* testState, Index idx, IndexEntry* entry, Tran
 #endif
     return false;
   }
-  IndexTransaction iTxn = _makeIndexTransaction(testState, idx, txn);
-  if (!iTxn.idxFilename || !iTxn.txn) return false;
+  IndexOp op(this, IndexOp::UPSERT, idx, entry->key, entry->value, txn, testState);
+  while (_step(&op, 0));
+  return op._status == AsyncOp::SUCCEEDED;
+}
+
+void IndexManager::_startUpsert(IndexOp* op) {
+  void* testState = op->testState;
+  Index idx = op->idx;
+  IndexEntry* entry = &op->entry;
+  IndexTransaction& iTxn = op->iTxn;
+  if (!iTxn.idxFilename || !iTxn.txn) return _endOp(op, false);
 
-  IndexScanFilters::IdxScanCapture state(entry->key, entry->value);
+  op->state = new IndexScanFilters::IdxScanCapture(entry->key, entry->value);
   size_t bufSize = _storageProvider->getBufferSize();
   char newLine[bufSize];
   if (!IndexHelpers::toIndexLine(entry, newLine, bufSize)) {
     // Problem with IndexEntry conversion - leave state.didUpsert as false
-    return false;
+    return _endOp(op, false);
   }
-  bool success = false;
-  if (isEmpty(iTxn.tmpFilename)) {
+  if (idx.mode == Index::LOG_STRUCTURED) {
+    iTxn.success = IndexHelpers::toDeltaLine(entry, false, newLine, bufSize)
+          && _appendDelta(&iTxn, newLine, testState)
+          && _bloomAdd(idx, &iTxn, entry, 1, testState);
+    if (iTxn.success && _needsCompact(idx, &iTxn, testState)) return _startCompact(op);
+    return _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+  }
+  if (idx.mode == Index::BTREE) {
+    auto upsert = [](BTreeIndex::Header* header, BTreeIndex::Pager* pager, void* opState) -> bool {
+      IndexEntry* entry = static_cast<IndexEntry*>(opState);
+      return BTreeIndex::upsert(header, pager, entry->key, entry->value);
+    };
+    iTxn.success = _btWrite(&iTxn, upsert, entry, testState) && _bloomAdd(idx, &iTxn, entry, 1, testState);
+    return _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+  }
+  bool appended = false;
+  if (!iTxn.overlayTmpFilename && !_appendIfLast(&iTxn, entry->key, newLine, &appended, testState)) {
+    iTxn.success = false;
+    return _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+  }
+  if (appended) {
+    iTxn.success = _bloomAdd(idx, &iTxn, entry, 1, testState);
+    return _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+  }
+  if (_isOverlaid(idx, &iTxn)) {
+    iTxn.success = IndexHelpers::toDeltaLine(entry, false, newLine, bufSize)
+          && _toOverlay(&iTxn, newLine, testState)
+          && _bloomAdd(idx, &iTxn, entry, 1, testState);
+    if (iTxn.success && _needsCompact(idx, &iTxn, testState)) return _startCompact(op);
+    return _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+  }
+  _endAppend(&iTxn, testState);
+  op->fence = new FenceIndex::Writer(_storageProvider->_openWriteStream(iTxn.fenceTmpFilename, testState));
+  op->state->fence = op->fence;
+  if (isEmpty(iTxn.tmpFilename) || !op->fence->dest) {
     // Problem with transaction that was passed in - leave state.didUpsert as false
+    _finishRewrite(op, false);
   } else if (!_storageProvider->_exists(iTxn.idxFilename, testState)) {
     // First write to the index
-    success = _storageProvider->_writeIndexLine(iTxn.tmpFilename, newLine, testState);
-    state.didUpsert = true;
+    bool success = _storageProvider->_writeIndexLine(iTxn.tmpFilename, newLine, testState);
+    op->fence->addLine(newLine);
+    op->state->didUpsert = true;
+    _finishRewrite(op, success);
+  } else if (!_storageProvider->_beginRewrite(&op->rewrite, iTxn.idxFilename, iTxn.tmpFilename, 
+        IndexScanFilters::idxUpsertFilter, op->state, &op->state->copyTail, op->fence, testState)) {
+    _finishRewrite(op, false);
   } else {
-    success = _storageProvider->_updateIndex(iTxn.idxFilename, iTxn.tmpFilename, IndexScanFilters::idxUpsertFilter, &state, testState);
-    if (success && !state.didUpsert) {
-      // new key goes at the end
-      success = _storageProvider->_writeIndexLine(iTxn.tmpFilename, newLine, testState);
-      state.didUpsert = true;
+    op->phase = IndexOp::REWRITE;
+  }
+}
+
+bool IndexManager::idxUpsertBatch(Index idx, IndexEntry* entries, size_t count, Transaction* txn = nullptr) {
+  return idxUpsertBatch(nullptr, idx, entries, count, txn);
+}
+
+bool IndexManager::idxUpsertBatch(void* testState, Index idx, IndexEntry* entries, size_t count, Transaction* txn = nullptr) {
+  if (!idx.name || !entries || count == 0) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxUpsertBatch - index name and entries cannot be empty"));
+#endif
+    return false;
+  }
+  size_t bufSize = _storageProvider->getBufferSize();
+  char newLine[bufSize];
+  for (size_t i = 0; i < count; i++) {
+    // Validate the whole batch up front so the merge can't fail halfway
+    if (isEmpty(entries[i].key) || !IndexHelpers::toIndexLine(&entries[i], newLine, bufSize)
+          || (idx.mode == Index::BTREE && !BTreeIndex::isValidEntry(entries[i].key, entries[i].value))) {
+#if (defined(DEBUG))
+      Serial.print(F("IndexManager::idxUpsertBatch - invalid entry at position "));
+      Serial.println(i);
+#endif
+      return false;
+    }
+  }
+  IndexTransaction iTxn = _makeIndexTransaction(testState, idx, txn);
+  if (!iTxn.idxFilename || !iTxn.txn) return false;
+
+  if (idx.mode == Index::LOG_STRUCTURED) {
+    // No need to sort - later records in the delta log win
+    Stream* dest = _storageProvider->_openAppendStream(iTxn.deltaTmpFilename, testState);
+    bool success = (dest != nullptr);
+    for (size_t i = 0; success && i < count; i++) {
+      success = IndexHelpers::toDeltaLine(&entries[i], false, newLine, bufSize);
+      if (success) {
+        dest->print(newLine);
+        dest->write('\n');
+      }
     }
+    success = _storageProvider->_closeStream(dest, testState) && success;
+    iTxn.success = success && _bloomAdd(idx, &iTxn, entries, count, testState)
+          && _compactIfNeeded(idx, &iTxn, testState);
+    return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
+  }
+
+  if (idx.mode == Index::BTREE) {
+    // No need to sort - later entries overwrite earlier ones, and pages
+    // already copied by an earlier entry are updated in place
+    struct BatchOp { IndexEntry* entries; size_t count; } batch = { entries, count };
+    auto upsertAll = [](BTreeIndex::Header* header, BTreeIndex::Pager* pager, void* opState) -> bool {
+      BatchOp* op = static_cast<BatchOp*>(opState);
+      for (size_t i = 0; i < op->count; i++) {
+        if (!BTreeIndex::upsert(header, pager, op->entries[i].key, op->entries[i].value)) return false;
+      }
+      return true;
+    };
+    iTxn.success = _btWrite(&iTxn, upsertAll, &batch, testState)
+          && _bloomAdd(idx, &iTxn, entries, count, testState);
+    return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
   }
-  iTxn.success = (success & state.didUpsert);
+
+  if (_isOverlaid(idx, &iTxn)) {
+    // No need to sort - later records in the overlay win
+    Stream* dest = _openOverlay(&iTxn, testState);
+    bool success = (dest != nullptr);
+    for (size_t i = 0; success && i < count; i++) {
+      success = IndexHelpers::toDeltaLine(&entries[i], false, newLine, bufSize);
+      if (success) {
+        dest->print(newLine);
+        dest->write('\n');
+      }
+    }
+    success = _storageProvider->_closeStream(dest, testState) && success;
+    iTxn.success = success && _bloomAdd(idx, &iTxn, entries, count, testState)
+          && _compactIfNeeded(idx, &iTxn, testState);
+    return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
+  }
+
+  IndexEntry** sorted = new IndexEntry*[count];
+  if (!sorted) {
+    _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, false, testState);
+    return false;
+  }
+  _sortBatch(entries, count, sorted);
+
+  IndexScanFilters::IdxBatchCapture state(sorted, count);
+  state.bufferSize = bufSize;
+  bool success = false;
+  _endAppend(&iTxn, testState);
+  FenceIndex::Writer fence(_storageProvider->_openWriteStream(iTxn.fenceTmpFilename, testState));
+  state.fence = &fence;
+  if (isEmpty(iTxn.tmpFilename) || !fence.dest) {
+    // Problem with transaction that was passed in - leave success as false
+  } else {
+    success = true;
+    if (_storageProvider->_exists(iTxn.idxFilename, testState)) {
+      success = _storageProvider->_updateIndex(iTxn.idxFilename, iTxn.tmpFilename, 
+            IndexScanFilters::idxUpsertBatchFilter, &state, &state.copyTail, &fence, testState) && !state.failed;
+    }
+    if (success && state.pos < count) {
+      // Whatever's left sorts after the last key in the index
+      Stream* dest = _storageProvider->_openAppendStream(iTxn.tmpFilename, testState);
+      success = (dest != nullptr);
+      while (success && state.pos < count) {
+        IndexHelpers::toIndexLine(IndexScanFilters::_nextBatchEntry(&state), newLine, bufSize);
+        dest->print(newLine);
+        dest->write('\n');
+        fence.addLine(newLine);
+        state.pos++;
+      }
+      success = _storageProvider->_closeStream(dest, testState) && success;
+    }
+  }
+  fence.finish();
+  success = _storageProvider->_closeStream(fence.dest, testState) && success;
+  delete[] sorted;
+  iTxn.success = success && _bloomAdd(idx, &iTxn, entries, count, testState);
   return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
 }
 
@@ -53,16 +213,255 @@ bool IndexManager::idxRemove(void* testState, Index idx, const char* key, Transa
 #endif
     return false;
   }
-  IndexTransaction iTxn = _makeIndexTransaction(testState, idx, txn);
-  if (!iTxn.idxFilename || !iTxn.txn) return false;
+  IndexOp op(this, IndexOp::REMOVE, idx, key, nullptr, txn, testState);
+  while (_step(&op, 0));
+  return op._status == AsyncOp::SUCCEEDED;
+}
 
-  IndexScanFilters::IdxScanCapture state(key);
-  bool success = false;
-  if (!isEmpty(iTxn.tmpFilename) && _storageProvider->_exists(iTxn.idxFilename, testState)) {
-    success = _storageProvider->_updateIndex(iTxn.idxFilename, iTxn.tmpFilename, IndexScanFilters::idxRemoveFilter, &state, testState);
+void IndexManager::_startRemove(IndexOp* op) {
+  void* testState = op->testState;
+  Index idx = op->idx;
+  const char* key = op->entry.key;
+  IndexTransaction& iTxn = op->iTxn;
+  if (!iTxn.idxFilename || !iTxn.txn) return _endOp(op, false);
+
+  if (idx.mode == Index::LOG_STRUCTURED || _isOverlaid(idx, &iTxn)) {
+    // Only removes a key that's there, so it's looked up first
+    op->state = new IndexScanFilters::IdxScanCapture(key);
+    if (iTxn.isImplicitTxn) return _startLookup(op);
+    return _finishLookup(op, _txnScan(idx, &iTxn, op->state, testState));
   }
-  iTxn.success = (success & state.didRemove);
-  return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
+  if (idx.mode == Index::BTREE) {
+    auto remove = [](BTreeIndex::Header* header, BTreeIndex::Pager* pager, void* opState) -> bool {
+      return BTreeIndex::remove(header, pager, static_cast<const char*>(opState)) == BTreeIndex::OK;
+    };
+    iTxn.success = _btWrite(&iTxn, remove, const_cast<char*>(key), testState);
+    return _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+  }
+
+  op->state = new IndexScanFilters::IdxScanCapture(key);
+  _endAppend(&iTxn, testState);
+  if (isEmpty(iTxn.tmpFilename) || !_storageProvider->_exists(iTxn.idxFilename, testState)) {
+    return _finishRewrite(op, false);
+  }
+  op->fence = new FenceIndex::Writer(_storageProvider->_openWriteStream(iTxn.fenceTmpFilename, testState));
+  op->state->fence = op->fence;
+  if (!op->fence->dest || !_storageProvider->_beginRewrite(&op->rewrite, iTxn.idxFilename, iTxn.tmpFilename, 
+        IndexScanFilters::idxRemoveFilter, op->state, &op->state->copyTail, op->fence, testState)) {
+    return _finishRewrite(op, false);
+  }
+  op->phase = IndexOp::REWRITE;
+}
+
+AsyncOp* IndexManager::idxUpsertAsync(void* testState, Index idx, IndexEntry* entry) {
+  if (!idx.name || !entry || isEmpty(entry->key)) return nullptr;
+  return _enqueue(new IndexOp(this, IndexOp::UPSERT, idx, entry->key, entry->value, nullptr, testState));
+}
+
+AsyncOp* IndexManager::idxRemoveAsync(void* testState, Index idx, const char* key) {
+  if (!idx.name || isEmpty(key)) return nullptr;
+  return _enqueue(new IndexOp(this, IndexOp::REMOVE, idx, key, nullptr, nullptr, testState));
+}
+
+AsyncOp* IndexManager::_enqueue(IndexOp* op) {
+  op->isAsync = true;
+  AsyncOp** tail = &_queue;
+  while (*tail) tail = &(*tail)->_next;
+  *tail = op;
+  return op;
+}
+
+/*
+ * Runs queued operations, oldest first, until budgetMicros have passed. At
+ * least one step is run, and a step can't be interrupted, so the budget can
+ * be overrun by up to a step. An op whose index is locked by another txn
+ * stays queued (along with the ops behind it) until a later poll.
+ */
+bool IndexManager::poll(uint32_t budgetMicros) {
+  uint32_t start = micros();
+  while (_queue) {
+    IndexOp* op = static_cast<IndexOp*>(_queue);
+    if (!_step(op, ASYNC_STEP_BYTES)) {
+      _queue = op->_next;
+      op->_next = nullptr;
+    }
+    if (op->_status == AsyncOp::QUEUED) break;
+    if (micros() - start >= budgetMicros) break;
+  }
+  return _queue != nullptr;
+}
+
+// Runs the op's next step. Returns false once it's done
+bool IndexManager::_step(IndexOp* op, uint32_t maxBytes) {
+  if (op->phase == IndexOp::START) {
+    // poll(...) can't wait for a lock held by the sketch, as it'd never be released
+    IndexTransaction iTxn = _makeIndexTransaction(op->testState, op->idx, op->txn, !op->isAsync);
+    if (iTxn.isBusy) return true;
+    op->_status = AsyncOp::RUNNING;
+    op->iTxn = iTxn;
+    iTxn.idxFilename = nullptr; // now op->iTxn's
+    if (op->kind == IndexOp::UPSERT) {
+      _startUpsert(op);
+    } else {
+      _startRemove(op);
+    }
+  } else if (op->phase == IndexOp::LOOKUP) {
+    _storageProvider->_scanStep(&op->scan, maxBytes, op->testState);
+    if (op->scan.isDone) _nextLookup(op);
+  } else if (op->phase == IndexOp::REWRITE) {
+    _storageProvider->_rewriteStep(&op->rewrite, maxBytes, op->testState);
+    if (op->rewrite.isDone) _finishRewrite(op, true);
+  } else if (op->phase == IndexOp::COMPACT) {
+    _storageProvider->_rewriteStep(&op->compaction.rewrite, maxBytes, op->testState);
+    if (op->compaction.rewrite.isDone) _finishCompact(op, true);
+  }
+  return op->phase != IndexOp::DONE;
+}
+
+void IndexManager::_finishRewrite(IndexOp* op, bool success) {
+  void* testState = op->testState;
+  IndexTransaction& iTxn = op->iTxn;
+  if (op->rewrite.src) success = _storageProvider->_endRewrite(&op->rewrite, testState) && success;
+  // Other changes to the txn in between steps can move its entries around
+  _refreshTmpFilenames(&iTxn);
+  if (op->kind == IndexOp::UPSERT) {
+    if (success && op->phase == IndexOp::REWRITE && !op->state->didUpsert) {
+      // new key goes at the end
+      size_t bufSize = _storageProvider->getBufferSize();
+      char newLine[bufSize];
+      success = IndexHelpers::toIndexLine(&op->entry, newLine, bufSize)
+            && _storageProvider->_writeIndexLine(iTxn.tmpFilename, newLine, testState);
+      op->fence->addLine(newLine);
+      op->state->didUpsert = true;
+    }
+  }
+  if (op->fence) {
+    op->fence->finish();
+    success = _storageProvider->_closeStream(op->fence->dest, testState) && success;
+    delete op->fence;
+    op->fence = nullptr;
+  }
+  if (op->kind == IndexOp::UPSERT) {
+    iTxn.success = (success & op->state->didUpsert) && _bloomAdd(op->idx, &iTxn, &op->entry, 1, testState);
+  } else {
+    iTxn.success = (success & op->state->didRemove);
+  }
+  _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+}
+
+/*
+ * Nothing's been written in an implicit txn yet, so this is _mergedScan of a
+ * LOG_STRUCTURED index a step at a time: the delta log, then the block of
+ * the index the key would be in
+ */
+void IndexManager::_startLookup(IndexOp* op) {
+  void* testState = op->testState;
+  IndexTransaction& iTxn = op->iTxn;
+  op->phase = IndexOp::LOOKUP;
+  if (_bloomCheck(iTxn.idxFilename, op->state->key, testState) == BloomFilter::MISS) return _finishLookup(op, true);
+  char deltaFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(iTxn.idxFilename, _SDSTORAGE_DELTA_EXTSN, deltaFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return _finishLookup(op, false);
+  }
+  if (!_storageProvider->_exists(deltaFilename, testState)) return _lookupIndex(op);
+  if (!_storageProvider->_beginScan(&op->scan, deltaFilename, 0, IndexScanFilters::idxDeltaLookupFilter, 
+        op->state, testState)) {
+    return _finishLookup(op, false);
+  }
+  op->isScanningDelta = true;
+}
+
+// Like _idxScan
+void IndexManager::_lookupIndex(IndexOp* op) {
+  void* testState = op->testState;
+  const char* idxFilename = op->iTxn.idxFilename;
+  op->isScanningDelta = false;
+  if (!_storageProvider->_exists(idxFilename, testState)) return _finishLookup(op, false);
+  FenceIndex::Range range;
+  FenceIndex::Result fenceResult = _fenceRange(idxFilename, op->state->key, false, &range, testState);
+  if (fenceResult == FenceIndex::MISS) return _finishLookup(op, true);
+  if (fenceResult == FenceIndex::FOUND) op->state->scanLimit = range.end - range.start;
+  if (!_storageProvider->_beginScan(&op->scan, idxFilename, range.start, IndexScanFilters::idxLookupFilter, 
+        op->state, testState)) {
+    _finishLookup(op, false);
+  }
+}
+
+// Called when a lookup's scan is done
+void IndexManager::_nextLookup(IndexOp* op) {
+  _storageProvider->_endScan(&op->scan, op->testState);
+  if (op->isScanningDelta && !op->state->deltaHit) return _lookupIndex(op);
+  _finishLookup(op, true);
+}
+
+// Writes the remove once it's known whether the key is there
+void IndexManager::_finishLookup(IndexOp* op, bool success) {
+  void* testState = op->testState;
+  IndexTransaction& iTxn = op->iTxn;
+  if (op->scan.src) _storageProvider->_endScan(&op->scan, testState);
+  size_t bufSize = _storageProvider->getBufferSize();
+  char deltaLine[bufSize];
+  iTxn.success = success && op->state->keyExists
+        && IndexHelpers::toDeltaLine(&op->entry, true, deltaLine, bufSize);
+  if (op->idx.mode == Index::LOG_STRUCTURED) {
+    iTxn.success = iTxn.success && _appendDelta(&iTxn, deltaLine, testState);
+  } else {
+    iTxn.success = iTxn.success && _toOverlay(&iTxn, deltaLine, testState);
+  }
+  if (iTxn.success && _needsCompact(op->idx, &iTxn, testState)) return _startCompact(op);
+  _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+}
+
+void IndexManager::_startCompact(IndexOp* op) {
+  op->phase = IndexOp::COMPACT;
+  if (!_beginCompact(&op->iTxn, &op->compaction, op->testState)) return _finishCompact(op, false);
+  if (op->compaction.rewrite.isDone) _finishCompact(op, true);
+}
+
+void IndexManager::_finishCompact(IndexOp* op, bool success) {
+  void* testState = op->testState;
+  IndexTransaction& iTxn = op->iTxn;
+  iTxn.success = _endCompact(&iTxn, &op->compaction, success, testState);
+  _endOp(op, _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState));
+}
+
+void IndexManager::_endOp(IndexOp* op, bool success) {
+  op->phase = IndexOp::DONE;
+  op->_status = success ? AsyncOp::SUCCEEDED : AsyncOp::FAILED;
+}
+
+// Called when an op's handle is deleted
+void IndexManager::_cancel(IndexOp* op) {
+  AsyncOp** link = &_queue;
+  while (*link && *link != op) link = &(*link)->_next;
+  if (*link) *link = op->_next;
+  op->_next = nullptr;
+  if (op->phase == IndexOp::DONE) return;
+  if (op->rewrite.src) _storageProvider->_endRewrite(&op->rewrite, op->testState);
+  if (op->scan.src) _storageProvider->_endScan(&op->scan, op->testState);
+  if (op->phase == IndexOp::COMPACT) _endCompact(&op->iTxn, &op->compaction, false, op->testState);
+  if (op->fence) {
+    _storageProvider->_closeStream(op->fence->dest, op->testState);
+    delete op->fence;
+    op->fence = nullptr;
+  }
+  // Async ops always have an implicit txn, which is what the changes so far are in
+  if (op->phase != IndexOp::START && op->iTxn.isImplicitTxn && op->iTxn.txn) {
+    _txnManager->abortTxn(op->iTxn.txn, op->testState);
+  }
+  _endOp(op, false);
+}
+
+IndexManager::IndexOp::IndexOp(IndexManager* idxManager, Kind kind, Index idx, const char* key, const char* value, 
+      Transaction* txn, void* testState):
+    AsyncOp(), idxManager(idxManager), kind(kind), idx(idx), entry(key), txn(txn), testState(testState) {
+  if (value) entry.value = strdup(value);
+}
+
+IndexManager::IndexOp::~IndexOp() {
+  idxManager->_cancel(this);
+  if (state) delete state;
+  state = nullptr;
 }
 
 bool IndexManager::idxRename(Index idx, const char* oldKey, const char* newKey, Transaction* txn = nullptr) {
@@ -80,10 +479,29 @@ bool IndexManager::idxRename(void* testState, Index idx, const char* oldKey, con
   IndexTransaction iTxn = _makeIndexTransaction(testState, idx, txn);
   if (!iTxn.idxFilename || !iTxn.txn) return false;
 
+  if (idx.mode == Index::BTREE) {
+    struct RenameOp { const char* oldKey; const char* newKey; } rename = { oldKey, newKey };
+    auto renameKey = [](BTreeIndex::Header* header, BTreeIndex::Pager* pager, void* opState) -> bool {
+      RenameOp* op = static_cast<RenameOp*>(opState);
+      IndexScanFilters::IdxScanCapture oldState(op->oldKey);
+      IndexScanFilters::IdxScanCapture newState(op->newKey);
+      if (!_btLookup(header, pager, &oldState) || !oldState.keyExists) return false;
+      if (!_btLookup(header, pager, &newState) || newState.keyExists) return false;
+      if (!BTreeIndex::isValidEntry(op->newKey, oldState.value)) return false;
+      return BTreeIndex::remove(header, pager, op->oldKey) == BTreeIndex::OK
+            && BTreeIndex::upsert(header, pager, op->newKey, oldState.value);
+    };
+    IndexEntry renamed(newKey);
+    iTxn.success = _btWrite(&iTxn, renameKey, &rename, testState) && _bloomAdd(idx, &iTxn, &renamed, 1, testState);
+    return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
+  }
+
   boolean success = false;
+  bool isDelta = (idx.mode == Index::LOG_STRUCTURED || _isOverlaid(idx, &iTxn));
+  if (!isDelta) _endAppend(&iTxn, testState);
   IndexScanFilters::IdxScanCapture lookupState(oldKey);
   IndexScanFilters::IdxScanCapture state(oldKey, newKey, true);
-  success = _idxScan(iTxn.idxFilename, &lookupState, testState);
+  success = _txnScan(idx, &iTxn, &lookupState, testState);
 
   if (!success) {
 #if (defined(DEBUG))
@@ -99,11 +517,48 @@ bool IndexManager::idxRename(void* testState, Index idx, const char* oldKey, con
 #endif
     }
 
-    if (!isEmpty(iTxn.tmpFilename) && lookupState.keyExists) {
+    if (isDelta) {
+      // A removal and an upsert, in the delta log or the txn's overlay
+      success = false;
+      IndexScanFilters::IdxScanCapture newKeyState(newKey);
+      if (lookupState.keyExists) {
+        // fails if the index file doesn't exist yet, which still means newKey doesn't exist
+        _txnScan(idx, &iTxn, &newKeyState, testState);
+      }
+      if (lookupState.keyExists && !newKeyState.keyExists) {
+        IndexEntry removed(oldKey);
+        IndexEntry inserted = lookupState.value ? IndexEntry(newKey, lookupState.value) : IndexEntry(newKey);
+        size_t bufSize = _storageProvider->getBufferSize();
+        char removeLine[bufSize];
+        char insertLine[bufSize];
+        if (IndexHelpers::toDeltaLine(&removed, true, removeLine, bufSize)
+              && IndexHelpers::toDeltaLine(&inserted, false, insertLine, bufSize)) {
+          if (idx.mode == Index::LOG_STRUCTURED) {
+            state.didRemove = _appendDelta(&iTxn, removeLine, testState);
+            state.didInsert = state.didRemove && _appendDelta(&iTxn, insertLine, testState);
+          } else {
+            state.didRemove = _toOverlay(&iTxn, removeLine, testState);
+            state.didInsert = state.didRemove && _toOverlay(&iTxn, insertLine, testState);
+          }
+        }
+        success = state.didInsert && _bloomAdd(idx, &iTxn, &inserted, 1, testState)
+              && _compactIfNeeded(idx, &iTxn, testState);
+      }
+    } else if (!isEmpty(iTxn.tmpFilename) && lookupState.keyExists) {
       if (state.value) free(state.value);
       state.value = nullptr;
-      state.value = strdup(lookupState.value);
-      success = _storageProvider->_updateIndex(iTxn.idxFilename, iTxn.tmpFilename, IndexScanFilters::idxRenameFilter, &state, testState);
+      state.value = lookupState.value ? strdup(lookupState.value) : nullptr;
+      FenceIndex::Writer fence(_storageProvider->_openWriteStream(iTxn.fenceTmpFilename, testState));
+      state.fence = &fence;
+      success = (fence.dest != nullptr);
+      if (success) {
+        success = _storageProvider->_updateIndex(iTxn.idxFilename, iTxn.tmpFilename, IndexScanFilters::idxRenameFilter, &state, 
+              &state.copyTail, &fence, testState);
+      }
+      fence.finish();
+      success = _storageProvider->_closeStream(fence.dest, testState) && success;
+      IndexEntry renamed(newKey);
+      success = success && state.didInsert && _bloomAdd(idx, &iTxn, &renamed, 1, testState);
     }
   }
   iTxn.success = (success && state.didRemove && state.didInsert);
@@ -111,6 +566,11 @@ bool IndexManager::idxRename(void* testState, Index idx, const char* oldKey, con
 }
 
 bool IndexManager::idxLookup(Index idx, const char* key, char* buffer, size_t bufferSize, void* testState = nullptr) {
+  return idxLookup(idx, key, buffer, bufferSize, nullptr, testState);
+}
+
+bool IndexManager::idxLookup(Index idx, const char* key, char* buffer, size_t bufferSize, Transaction* txn, 
+      void* testState = nullptr) {
   if (!idx.name || isEmpty(key) || !buffer || bufferSize <= 0) {
 #if (defined(DEBUG))
     Serial.println(F("IndexManager::idxLookup - index name, key and buffer required"));
@@ -126,11 +586,11 @@ bool IndexManager::idxLookup(Index idx, const char* key, char* buffer, size_t bu
   }
   IndexScanFilters::IdxScanCapture state(key);
   bool success = false;
-  success = _idxScan(idxFilename, &state, testState);
+  success = _readScan(idx, idxFilename, txn, &state, testState);
   if (success) { // the scan worked, but was the key found?
     if (state.keyExists) {
       static const char fmt[] PROGMEM = "%s";
-      int n = snprintf_P(buffer, bufferSize, fmt, state.value);
+      int n = snprintf_P(buffer, bufferSize, fmt, state.value ? state.value : "");
       if (n < 0 || static_cast<size_t>(n) >= bufferSize) {
         // Truncated or error
         buffer[bufferSize - 1] = '\0';
@@ -145,6 +605,10 @@ bool IndexManager::idxLookup(Index idx, const char* key, char* buffer, size_t bu
 }
 
 bool IndexManager::idxHasKey(Index idx, const char* key, void* testState = nullptr) {
+  return idxHasKey(idx, key, nullptr, testState);
+}
+
+bool IndexManager::idxHasKey(Index idx, const char* key, Transaction* txn, void* testState = nullptr) {
   if (!idx.name || isEmpty(key)) {
 #if (defined(DEBUG))
     Serial.println(F("IndexManager::idxLookup - index name and key"));
@@ -160,11 +624,15 @@ bool IndexManager::idxHasKey(Index idx, const char* key, void* testState = nullp
   }
   IndexScanFilters::IdxScanCapture state(key);
   bool success = false;
-  success = _idxScan(idxFilename, &state, testState);
+  success = _readScan(idx, idxFilename, txn, &state, testState);
   return (success && state.keyExists);
 }
 
 bool IndexManager::idxPrefixSearch(Index idx, SearchResults* results, void* testState = nullptr) {
+  return idxPrefixSearch(idx, results, nullptr, testState);
+}
+
+bool IndexManager::idxPrefixSearch(Index idx, SearchResults* results, Transaction* txn, void* testState = nullptr) {
   if (!idx.name) {
 #if (defined(DEBUG))
     Serial.println(F("IndexManager::idxPrefixSearch - index is required"));
@@ -178,11 +646,26 @@ bool IndexManager::idxPrefixSearch(Index idx, SearchResults* results, void* test
 #endif
     return false;
   }
-  if (!_storageProvider->_exists(idxFilename, testState)) {
+  if (!_isModeValid(idx, idxFilename, txn, testState)) return false;
+  bool success = false;
+  IndexTransaction iTxn;
+  if (_readIndexTransaction(idx, txn, &iTxn)) {
+    success = _txnPrefixSearch(idx, &iTxn, results, testState);
+  } else if (idx.mode == Index::LOG_STRUCTURED) {
+    success = _deltaPrefixSearch(idxFilename, results, testState);
+  } else if (idx.mode == Index::BTREE) {
+    success = _btScan(idxFilename, results->searchPrefix, IndexScanFilters::idxPrefixSearchFilter, results, testState);
+  } else if (!_storageProvider->_exists(idxFilename, testState)) {
     // Index has no entries - return empty search results
     return true;
+  } else {
+    FenceIndex::Range range;
+    if (_fenceRange(idxFilename, results->searchPrefix, true, &range, testState) == FenceIndex::MISS) {
+      // Prefix sorts after every key in the index - return empty search results
+      return true;
+    }
+    success = _storageProvider->_scanIndexFrom(idxFilename, range.start, IndexScanFilters::idxPrefixSearchFilter, results, testState);
   }
-  bool success = _storageProvider->_scanIndex(idxFilename, IndexScanFilters::idxPrefixSearchFilter, results, testState);
   if (results->trieMode) {
     // clean up the partial matchResult
     if (results->matchResult) {
@@ -201,9 +684,210 @@ bool IndexManager::idxPrefixSearch(Index idx, SearchResults* results, void* test
   return success;
 };
 
+bool IndexManager::idxSeek(Index idx, IndexCursor* cursor, const char* prefix, void* testState = nullptr) {
+  if (!prefix) prefix = "";
+  return _cursorSeek(idx, cursor, prefix, prefix, testState);
+}
+
+bool IndexManager::idxSeekKey(Index idx, IndexCursor* cursor, const char* key, void* testState = nullptr) {
+  return _cursorSeek(idx, cursor, "", key ? key : "", testState);
+}
+
+/*
+ * Reads only as far as the next entry. For LOG_STRUCTURED indexes, the
+ * delta log is scanned on every step (it's kept small by compaction) and
+ * merged with the index, so removed keys are skipped and updated keys have
+ * their new values.
+ */
+bool IndexManager::idxNext(Index idx, IndexCursor* cursor, char* keyBuffer, size_t keyBufferSize,
+      char* valueBuffer, size_t valueBufferSize, void* testState = nullptr) {
+  if (!idx.name || !cursor || !keyBuffer || keyBufferSize == 0 || !valueBuffer || valueBufferSize == 0) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxNext - index name, cursor and buffers required"));
+#endif
+    return false;
+  }
+  cursor->isTooLong = false;
+  if (cursor->isDone) return false;
+  char idxFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!_fileHelper->indexFilename(idx, idxFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxNext - indexFilename failure"));
+#endif
+    return false;
+  }
+  char deltaFilename[FileHelper::MAX_FILENAME_LENGTH];
+  bool hasDelta = false;
+  if (idx.mode == Index::LOG_STRUCTURED) {
+    if (!FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_DELTA_EXTSN, deltaFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+      return false;
+    }
+    hasDelta = _storageProvider->_exists(deltaFilename, testState);
+  }
+  if (idx.mode != Index::BTREE && !_isCursorValid(idxFilename, cursor, testState)) {
+    // The index changed since the cursor's offset was found, so find it again by key
+    _cursorPosition(idxFilename, cursor, testState);
+  }
+  while (true) {
+    IndexScanFilters::IdxCursorCapture state(cursor, keyBuffer, keyBufferSize, valueBuffer, valueBufferSize);
+    if (hasDelta
+          && !_storageProvider->_scanIndex(deltaFilename, IndexScanFilters::idxCursorDeltaFilter, &state, testState)) {
+      return false;
+    }
+    bool success = true;
+    if (state.isTooLong) {
+      // Which entry is next isn't known without the delta record's whole key
+    } else if (idx.mode == Index::BTREE) {
+      success = _btScan(idxFilename, cursor->fromKey, IndexScanFilters::idxCursorFilter, &state, testState);
+    } else if (cursor->offset < cursor->indexSize) {
+      success = _storageProvider->_scanIndexFrom(idxFilename, cursor->offset, IndexScanFilters::idxCursorFilter,
+            &state, testState);
+    }
+    if (!success || state.failed) return false;
+    // The delta record wins if it sorts first, or supersedes the index line
+    bool isRemoved = state.hasDelta && state.isDeltaRemove && (!state.hasIndex || state.indexCmp >= 0);
+    if (state.isTooLong || (!isRemoved && state.isTruncated)) {
+      // Leave the cursor where it was, so it can be called again with bigger buffers
+#if (defined(DEBUG))
+      Serial.println(F("IndexManager::idxNext - key or value buffer too small"));
+#endif
+      cursor->isTooLong = true;
+      return false;
+    }
+    if (!state.hasIndex && !state.hasDelta) {
+      cursor->offset = state.offset;
+      cursor->isDone = true;
+      return false;
+    }
+    cursor->offset = state.offset;
+    // Longer keys (SORTED and LOG_STRUCTURED only) are gone on from by offset
+    cursor->isFromTruncated = strlen(keyBuffer) > IndexCursor::MAX_KEY_LENGTH;
+    strncpy(cursor->fromKey, keyBuffer, IndexCursor::MAX_KEY_LENGTH);
+    cursor->fromKey[IndexCursor::MAX_KEY_LENGTH] = '\0';
+    cursor->isFromInclusive = false;
+    if (!isRemoved) return true;
+  }
+}
+
+bool IndexManager::_cursorSeek(Index idx, IndexCursor* cursor, const char* prefix, const char* fromKey,
+      void* testState = nullptr) {
+  if (!idx.name || !cursor) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxSeek - index name and cursor required"));
+#endif
+    return false;
+  }
+  if (strlen(prefix) > IndexCursor::MAX_PREFIX_LENGTH || strlen(fromKey) > IndexCursor::MAX_KEY_LENGTH) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxSeek - key is too long for a cursor"));
+#endif
+    return false;
+  }
+  char idxFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!_fileHelper->indexFilename(idx, idxFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxSeek - indexFilename failure"));
+#endif
+    return false;
+  }
+  if (!_isModeValid(idx, idxFilename, nullptr, testState)) return false;
+  strcpy(cursor->prefix, prefix);
+  strcpy(cursor->fromKey, fromKey);
+  cursor->isFromInclusive = true;
+  cursor->isFromTruncated = false;
+  cursor->isDone = false;
+  cursor->isTooLong = false;
+  cursor->offset = 0;
+  cursor->indexSize = 0;
+  // B+tree scans find their place by key on every step
+  if (idx.mode != Index::BTREE) _cursorPosition(idxFilename, cursor, testState);
+  return true;
+}
+
+/*
+ * Whether the cursor's offset still holds up. A rewrite can leave the index
+ * the same size with its lines moved, so besides the size the offset must be
+ * at the start of a line, and that line must be where the cursor left off.
+ */
+bool IndexManager::_isCursorValid(const char* idxFilename, IndexCursor* cursor, void* testState = nullptr) {
+  if (_storageProvider->_fileSize(idxFilename, testState) != cursor->indexSize) return false;
+  if (cursor->offset == 0) return true;
+  if (_storageProvider->_byteAt(idxFilename, cursor->offset - 1, testState) != '\n') return false;
+  if (cursor->offset >= cursor->indexSize) return true;
+  IndexScanFilters::IdxCursorCheck state(cursor);
+  return _storageProvider->_scanIndexFrom(idxFilename, cursor->offset, IndexScanFilters::idxCursorCheckFilter,
+        &state, testState) && state.isValid;
+}
+
+// Points the cursor at the fence block where its next key would be
+void IndexManager::_cursorPosition(const char* idxFilename, IndexCursor* cursor, void* testState = nullptr) {
+  cursor->indexSize = _storageProvider->_fileSize(idxFilename, testState);
+  cursor->offset = 0;
+  if (cursor->indexSize == 0) return;
+  FenceIndex::Range range;
+  if (_fenceRange(idxFilename, cursor->fromKey, true, &range, testState) == FenceIndex::MISS) {
+    // Every key in the index sorts before the cursor
+    cursor->offset = cursor->indexSize;
+  } else {
+    cursor->offset = range.start;
+  }
+}
+
+bool IndexManager::idxCompact(Index idx, Transaction* txn = nullptr) {
+  return idxCompact(nullptr, idx, txn);
+}
+
+bool IndexManager::idxCompact(void* testState, Index idx, Transaction* txn = nullptr) {
+  if (!idx.name) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxCompact - index name cannot be empty"));
+#endif
+    return false;
+  }
+  if (idx.mode == Index::SORTED) {
+    // Sorted indexes have no delta log
+    return true;
+  }
+  IndexTransaction iTxn = _makeIndexTransaction(testState, idx, txn);
+  if (!iTxn.idxFilename || !iTxn.txn) return false;
+  _endAppend(&iTxn, testState);
+  iTxn.success = (idx.mode == Index::BTREE) ? _btCompact(&iTxn, testState) : _compact(&iTxn, testState);
+  return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
+}
+
+bool IndexManager::idxRebuild(Index idx, Transaction* txn = nullptr) {
+  return idxRebuild(nullptr, idx, txn);
+}
+
+bool IndexManager::idxRebuild(void* testState, Index idx, Transaction* txn = nullptr) {
+  if (!idx.name) {
+#if (defined(DEBUG))
+    Serial.println(F("IndexManager::idxRebuild - index name cannot be empty"));
+#endif
+    return false;
+  }
+  IndexTransaction iTxn = _makeIndexTransaction(testState, idx, txn);
+  if (!iTxn.idxFilename || !iTxn.txn) return false;
+  iTxn.success = _bloomRebuild(idx, &iTxn, false, testState);
+  return _txnManager->finalizeTxn(iTxn.txn, iTxn.isImplicitTxn, iTxn.success, testState);
+}
+
+void IndexManager::_sortBatch(IndexEntry* entries, size_t count, IndexEntry** sorted) {
+  for (size_t i = 0; i < count; i++) {
+    IndexEntry* entry = &entries[i];
+    size_t j = i;
+    while (j > 0 && strcmp(sorted[j - 1]->key, entry->key) > 0) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = entry;
+  }
+}
+
 /*
  * Scans the index looking for state->key and populating the state->keyExists and state->value
- * fields on the IdxScanCapture object passed in. Scanning stops when the key is found.
+ * fields on the IdxScanCapture object passed in. Scanning stops when the key is found. If the
+ * index has a fence file, only the block that could contain the key is scanned.
  */
 bool IndexManager::_idxScan(const char* idxFilename, IndexScanFilters::IdxScanCapture* state, void* testState = nullptr) {
   if (!idxFilename || !state || isEmpty(state->key)) {
@@ -214,26 +898,911 @@ bool IndexManager::_idxScan(const char* idxFilename, IndexScanFilters::IdxScanCa
   }
   boolean success = false;
   if (_storageProvider->_exists(idxFilename, testState)) {
-    success = _storageProvider->_scanIndex(idxFilename, IndexScanFilters::idxLookupFilter, state, testState);
+    FenceIndex::Range range;
+    FenceIndex::Result fenceResult = _fenceRange(idxFilename, state->key, false, &range, testState);
+    if (fenceResult == FenceIndex::MISS) {
+      // The key can't be in the index
+      success = true;
+    } else {
+      if (fenceResult == FenceIndex::FOUND) {
+        state->scanLimit = range.end - range.start;
+      }
+      success = _storageProvider->_scanIndexFrom(idxFilename, range.start, IndexScanFilters::idxLookupFilter, state, testState);
+    }
   }
   return success;
 }
 
-IndexManager::IndexTransaction IndexManager::_makeIndexTransaction(void* testState, Index idx, Transaction* txn) {
+FenceIndex::Result IndexManager::_fenceRange(const char* idxFilename, const char* key, bool isPrefix,
+      FenceIndex::Range* range, void* testState = nullptr) {
+  char fenceFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_FENCE_EXTSN, fenceFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return FenceIndex::UNAVAILABLE;
+  }
+  uint32_t indexSize = _storageProvider->_fileSize(idxFilename, testState);
+  return _storageProvider->_fenceLookup(fenceFilename, indexSize, key, isPrefix, range, testState);
+}
+
+/*
+ * Like _idxScan, but for LOG_STRUCTURED indexes the delta log is checked
+ * first, since any record there supersedes the index file
+ */
+bool IndexManager::_mergedScan(Index idx, const char* idxFilename, IndexScanFilters::IdxScanCapture* state, 
+      void* testState = nullptr) {
+  if (_bloomCheck(idxFilename, state->key, testState) == BloomFilter::MISS) {
+    // The key was never added to the index
+    return true;
+  }
+  if (idx.mode == Index::BTREE) {
+    // The first entry at or after the key is the only one that can match
+    state->scanLimit = 1;
+    return _btScan(idxFilename, state->key, IndexScanFilters::idxLookupFilter, state, testState);
+  }
+  if (idx.mode == Index::LOG_STRUCTURED) {
+    char deltaFilename[FileHelper::MAX_FILENAME_LENGTH];
+    if (!FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_DELTA_EXTSN, deltaFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+      return false;
+    }
+    if (_storageProvider->_exists(deltaFilename, testState)) {
+      if (!_storageProvider->_scanIndex(deltaFilename, IndexScanFilters::idxDeltaLookupFilter, state, testState)) {
+        return false;
+      }
+      if (state->deltaHit) return true;
+    }
+  }
+  return _idxScan(idxFilename, state, testState);
+}
+
+/*
+ * Like _mergedScan, but sees the changes made so far in a txn: its overlay
+ * or its copy of the delta log first, then lines it appended to a SORTED
+ * index, or the index it compacted
+ */
+bool IndexManager::_txnScan(Index idx, IndexTransaction* iTxn, IndexScanFilters::IdxScanCapture* state, 
+      void* testState = nullptr) {
+  if (iTxn->isImplicitTxn || idx.mode == Index::BTREE) {
+    // Nothing's been written in an implicit txn yet. BTREE writes do their own lookups.
+    return _mergedScan(idx, iTxn->idxFilename, state, testState);
+  }
+  const char* changes = (idx.mode == Index::LOG_STRUCTURED) ? iTxn->deltaTmpFilename : iTxn->overlayTmpFilename;
+  if (!isEmpty(changes) && _storageProvider->_exists(changes, testState)) {
+    if (!_storageProvider->_scanIndex(changes, IndexScanFilters::idxDeltaLookupFilter, state, testState)) {
+      return false;
+    }
+    if (state->deltaHit) return true;
+  }
+  if (!isEmpty(iTxn->tmpFilename) && _storageProvider->_exists(iTxn->tmpFilename, testState)) {
+    uint32_t appendOffset;
+    bool isAppending = _txnManager->getAppendOffset(iTxn->txn, iTxn->tmpFilename, &appendOffset);
+    if (!_idxScan(iTxn->tmpFilename, state, testState)) return false;
+    // Lines appended in this txn sort after the committed index, which still needs checking
+    if (state->keyExists || !isAppending) return true;
+  }
+  if (_bloomCheck(iTxn->idxFilename, state->key, testState) == BloomFilter::MISS) return true;
+  return _idxScan(iTxn->idxFilename, state, testState);
+}
+
+bool IndexManager::_readIndexTransaction(Index idx, Transaction* txn, IndexTransaction* iTxn) {
+  char idxFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!txn || !_fileHelper->indexFilename(idx, idxFilename, FileHelper::MAX_FILENAME_LENGTH)
+        || !txn->exists(idxFilename)) {
+    return false;
+  }
+  iTxn->txn = txn;
+  iTxn->idxFilename = strdup(idxFilename);
+  iTxn->tmpFilename = _txnManager->getTmpFilename(txn, idxFilename);
+  char filename[FileHelper::MAX_FILENAME_LENGTH];
+  if (idx.mode == Index::LOG_STRUCTURED
+        && FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_DELTA_EXTSN, filename, FileHelper::MAX_FILENAME_LENGTH)
+        && txn->exists(filename)) {
+    iTxn->deltaTmpFilename = _txnManager->getTmpFilename(txn, filename);
+  }
+  if (idx.mode == Index::SORTED
+        && FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_OVERLAY_EXTSN, filename, FileHelper::MAX_FILENAME_LENGTH)
+        && txn->exists(filename)) {
+    iTxn->overlayTmpFilename = _txnManager->getTmpFilename(txn, filename);
+  }
+  // Every write to a LOG_STRUCTURED index in a txn starts with a copy of the delta log
+  return iTxn->idxFilename && iTxn->tmpFilename && (idx.mode != Index::LOG_STRUCTURED || iTxn->deltaTmpFilename);
+}
+
+// Lookup in txn's version of the index, or the committed one if the txn hasn't touched it
+bool IndexManager::_readScan(Index idx, const char* idxFilename, Transaction* txn, IndexScanFilters::IdxScanCapture* state, 
+      void* testState = nullptr) {
+  if (!_isModeValid(idx, idxFilename, txn, testState)) return false;
+  IndexTransaction iTxn;
+  if (!_readIndexTransaction(idx, txn, &iTxn)) return _mergedScan(idx, idxFilename, state, testState);
+  if (idx.mode == Index::BTREE) {
+    state->scanLimit = 1;
+    return _btTxnScan(&iTxn, state->key, IndexScanFilters::idxLookupFilter, state, testState);
+  }
+  return _txnScan(idx, &iTxn, state, testState);
+}
+
+/*
+ * Like _deltaPrefixSearch, but merging the txn's overlay or copy of the
+ * delta log into its version of the index
+ */
+bool IndexManager::_txnPrefixSearch(Index idx, IndexTransaction* iTxn, SearchResults* results, void* testState = nullptr) {
+  if (idx.mode == Index::BTREE) {
+    return _btTxnScan(iTxn, results->searchPrefix, IndexScanFilters::idxPrefixSearchFilter, results, testState);
+  }
+  IndexScanFilters::IdxDeltaCapture state;
+  state.prefix = results->searchPrefix;
+  state.results = results;
+  const char* changes = (idx.mode == Index::LOG_STRUCTURED) ? iTxn->deltaTmpFilename : iTxn->overlayTmpFilename;
+  if (!isEmpty(changes) && _storageProvider->_exists(changes, testState)
+        && (!_storageProvider->_scanIndex(changes, IndexScanFilters::deltaLoadFilter, &state, testState) || state.failed)) {
+    return false;
+  }
+  uint32_t appendOffset;
+  bool isAppending = _txnManager->getAppendOffset(iTxn->txn, iTxn->tmpFilename, &appendOffset);
+  bool success = true;
+  if (!isAppending && _storageProvider->_exists(iTxn->tmpFilename, testState)) {
+    // Rewritten (or compacted) in this txn
+    success = _storageProvider->_scanIndex(iTxn->tmpFilename, IndexScanFilters::idxPrefixSearchMergeFilter, &state, testState);
+  } else {
+    if (_storageProvider->_exists(iTxn->idxFilename, testState)) {
+      FenceIndex::Range range;
+      if (_fenceRange(iTxn->idxFilename, results->searchPrefix, true, &range, testState) != FenceIndex::MISS) {
+        success = _storageProvider->_scanIndexFrom(iTxn->idxFilename, range.start, 
+              IndexScanFilters::idxPrefixSearchMergeFilter, &state, testState);
+      }
+    }
+    // Lines appended in this txn sort after the committed ones
+    if (success && isAppending) {
+      success = _storageProvider->_scanIndex(iTxn->tmpFilename, IndexScanFilters::idxPrefixSearchMergeFilter, &state, testState);
+    }
+  }
+  IndexScanFilters::_mergeDelta(&state, nullptr, nullptr);
+  return success;
+}
+
+bool IndexManager::_deltaPrefixSearch(const char* idxFilename, SearchResults* results, void* testState = nullptr) {
+  IndexScanFilters::IdxDeltaCapture state;
+  state.prefix = results->searchPrefix;
+  state.results = results;
+  char deltaFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_DELTA_EXTSN, deltaFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  if (_storageProvider->_exists(deltaFilename, testState)
+        && (!_storageProvider->_scanIndex(deltaFilename, IndexScanFilters::deltaLoadFilter, &state, testState) || state.failed)) {
+    return false;
+  }
+  bool success = true;
+  if (_storageProvider->_exists(idxFilename, testState)) {
+    FenceIndex::Range range;
+    if (_fenceRange(idxFilename, results->searchPrefix, true, &range, testState) != FenceIndex::MISS) {
+      success = _storageProvider->_scanIndexFrom(idxFilename, range.start, 
+            IndexScanFilters::idxPrefixSearchMergeFilter, &state, testState);
+    }
+  }
+  // Delta records that sort after the last index line scanned
+  IndexScanFilters::_mergeDelta(&state, nullptr, nullptr);
+  return success;
+}
+
+bool IndexManager::_appendDelta(IndexTransaction* iTxn, const char* line, void* testState = nullptr) {
+  Stream* dest = _storageProvider->_openAppendStream(iTxn->deltaTmpFilename, testState);
+  if (!dest) return false;
+  dest->print(line);
+  dest->write('\n');
+  return _storageProvider->_closeStream(dest, testState);
+}
+
+/*
+ * True once the delta log reaches the index's compactThreshold. A SORTED
+ * index's overlay is folded into the txn's copy of the index the same way,
+ * so it never has to be held in memory all at once. Overlays are always
+ * bounded, since idxCompact(...) has nothing to do for a SORTED index.
+ */
+bool IndexManager::_needsCompact(Index idx, IndexTransaction* iTxn, void* testState = nullptr) {
+  const char* changes = (idx.mode == Index::LOG_STRUCTURED) ? iTxn->deltaTmpFilename : iTxn->overlayTmpFilename;
+  uint16_t threshold = idx.compactThreshold;
+  if (idx.mode == Index::SORTED && threshold == 0) threshold = Index::DEFAULT_COMPACT_THRESHOLD;
+  if (threshold == 0 || isEmpty(changes)) return false;
+  return _storageProvider->_fileSize(changes, testState) >= threshold;
+}
+
+bool IndexManager::_compactIfNeeded(Index idx, IndexTransaction* iTxn, void* testState = nullptr) {
+  return !_needsCompact(idx, iTxn, testState) || _compact(iTxn, testState);
+}
+
+/*
+ * Folds the transaction's copy of the delta log (or its overlay) into the
+ * index in one pass, then empties it. If the txn already has its own copy
+ * of the index from an earlier compaction, that's what gets folded into.
+ */
+bool IndexManager::_compact(IndexTransaction* iTxn, void* testState = nullptr) {
+  Compaction compaction;
+  bool success = _beginCompact(iTxn, &compaction, testState);
+  while (success && !compaction.rewrite.isDone) _storageProvider->_rewriteStep(&compaction.rewrite, 0, testState);
+  return _endCompact(iTxn, &compaction, success, testState);
+}
+
+/*
+ * Loads the changes and starts the rewrite. compaction->rewrite.isDone if
+ * there's nothing to rewrite, i.e. no changes or no index yet.
+ */
+bool IndexManager::_beginCompact(IndexTransaction* iTxn, Compaction* compaction, void* testState = nullptr) {
+  compaction->rewrite.isDone = true;
+  const char* changes = !isEmpty(iTxn->deltaTmpFilename) ? iTxn->deltaTmpFilename : iTxn->overlayTmpFilename;
+  if (isEmpty(iTxn->tmpFilename) || isEmpty(changes)) return false;
+  IndexScanFilters::IdxDeltaCapture& state = compaction->state;
+  state.bufferSize = _storageProvider->getBufferSize();
+  if (!_storageProvider->_scanIndex(changes, IndexScanFilters::deltaLoadFilter, &state, testState) || state.failed) {
+    return false;
+  }
+  if (!state.head) return true; // nothing to compact
+
+  const char* source = iTxn->idxFilename;
+  uint32_t appendOffset;
+  if (!_txnManager->getAppendOffset(iTxn->txn, iTxn->tmpFilename, &appendOffset)
+        && _storageProvider->_exists(iTxn->tmpFilename, testState)) {
+    // The changes are all loaded, so their file can hold the txn's copy while it's rewritten
+    if (!_storageProvider->_replace(iTxn->tmpFilename, changes, testState)) return false;
+    source = changes;
+  }
+  compaction->fence = new FenceIndex::Writer(_storageProvider->_openWriteStream(iTxn->fenceTmpFilename, testState));
+  state.fence = compaction->fence;
+  if (!compaction->fence->dest) return false;
+  if (!_storageProvider->_exists(source, testState)) return true;
+  return _storageProvider->_beginRewrite(&compaction->rewrite, source, iTxn->tmpFilename, 
+        IndexScanFilters::idxCompactFilter, &state, &state.copyTail, compaction->fence, testState);
+}
+
+// Appends the changes that sort after the index, then empties the changes file if all went well
+bool IndexManager::_endCompact(IndexTransaction* iTxn, Compaction* compaction, bool success, void* testState = nullptr) {
+  if (compaction->rewrite.src) success = _storageProvider->_endRewrite(&compaction->rewrite, testState) && success;
+  if (!compaction->fence) return success;
+  IndexScanFilters::IdxDeltaCapture& state = compaction->state;
+  FenceIndex::Writer* fence = compaction->fence;
+  success = success && !state.failed;
+  if (success && state.head) {
+    // Whatever's left sorts after the last key in the index
+    Stream* dest = _storageProvider->_openAppendStream(iTxn->tmpFilename, testState);
+    success = (dest != nullptr);
+    size_t bufSize = _storageProvider->getBufferSize();
+    char newLine[bufSize];
+    while (success && state.head) {
+      IndexScanFilters::DeltaRecord* record = state.head;
+      state.head = record->next;
+      if (!record->isRemove && IndexScanFilters::_toIndexLine(record, newLine, bufSize)) {
+        dest->print(newLine);
+        dest->write('\n');
+        fence->addLine(newLine);
+      }
+      delete record;
+    }
+    success = _storageProvider->_closeStream(dest, testState) && success;
+  }
+  fence->finish();
+  success = _storageProvider->_closeStream(fence->dest, testState) && success;
+  delete fence;
+  compaction->fence = nullptr;
+  if (success) {
+    // Start the delta log over
+    const char* changes = !isEmpty(iTxn->deltaTmpFilename) ? iTxn->deltaTmpFilename : iTxn->overlayTmpFilename;
+    Stream* delta = _storageProvider->_openWriteStream(changes, testState);
+    success = (delta != nullptr);
+    success = _storageProvider->_closeStream(delta, testState) && success;
+  }
+  return success;
+}
+
+// Checks the committed bloom filter of an index, if it has one
+BloomFilter::Result IndexManager::_bloomCheck(const char* idxFilename, const char* key, void* testState = nullptr) {
+  char bloomFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_BLOOM_EXTSN, bloomFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return BloomFilter::UNAVAILABLE;
+  }
+  BTreeIndex::Pager pager;
+  if (!_storageProvider->_openPager(bloomFilename, false, &pager, testState)) return BloomFilter::UNAVAILABLE;
+  BloomFilter::Result result = BloomFilter::contains(&pager, key);
+  _storageProvider->_closePager(&pager, testState);
+  return result;
+}
+
+/*
+ * Adds the keys of entries to this txn's copy of the bloom filter, copying
+ * the committed filter the first time. An index that already has entries
+ * but no filter is left without one until idxRebuild(...), since a filter
+ * missing any of its keys would hide them from lookups.
+ */
+bool IndexManager::_bloomAdd(Index idx, IndexTransaction* iTxn, IndexEntry* entries, size_t count,
+      void* testState = nullptr) {
+  char bloomFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_BLOOM_EXTSN, bloomFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  BloomFilter::Header header;
+  uint8_t page[BloomFilter::BLOCK_SIZE];
+  BTreeIndex::Pager dest;
+  bool success = true;
+  if (iTxn->txn->exists(bloomFilename)) {
+    success = _storageProvider->_openPager(_txnManager->getTmpFilename(iTxn->txn, bloomFilename), true, &dest, testState)
+          && dest.read(0, page, dest.ctx) && BloomFilter::readHeader(page, &header);
+  } else {
+    BTreeIndex::Pager src;
+    bool hasBloom = _storageProvider->_openPager(bloomFilename, false, &src, testState)
+          && src.read(0, page, src.ctx) && BloomFilter::readHeader(page, &header);
+    if (!hasBloom && !_isEmptyIndex(idx, iTxn->idxFilename, testState)) {
+      _storageProvider->_closePager(&src, testState);
+      return true;
+    }
+    char* bloomTmpFilename = _txnManager->getAuxTmpFilename(iTxn->txn, bloomFilename, testState);
+    _refreshTmpFilenames(iTxn);
+    success = bloomTmpFilename && _storageProvider->_openPager(bloomTmpFilename, true, &dest, testState);
+    if (success && hasBloom) {
+      for (uint32_t pageNum = 0; success && pageNum <= header.blockCount; pageNum++) {
+        success = src.read(pageNum, page, src.ctx) && dest.write(pageNum, page, dest.ctx);
+      }
+    } else if (success) {
+      // First write to the index
+      success = BloomFilter::create(&dest, &header, BloomFilter::blocksFor(count));
+    }
+    _storageProvider->_closePager(&src, testState);
+  }
+  for (size_t i = 0; success && i < count; i++) {
+    success = BloomFilter::add(&dest, &header, entries[i].key);
+  }
+  if (success) {
+    BloomFilter::writeHeader(&header, page);
+    success = dest.write(0, page, dest.ctx);
+  }
+  _storageProvider->_closePager(&dest, testState);
+  if (success && BloomFilter::isFull(&header)) success = _bloomRebuild(idx, iTxn, true, testState);
+  return success;
+}
+
+/*
+ * Replaces the bloom filter with one sized for the entries in this txn's
+ * version of the index, or twice that if isGrowing. Each block is filled in
+ * by its own scan of the index, so only one block is ever held in RAM.
+ */
+bool IndexManager::_bloomRebuild(Index idx, IndexTransaction* iTxn, bool isGrowing, void* testState = nullptr) {
+  if (isEmpty(iTxn->tmpFilename)) return false;
+  char bloomFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_BLOOM_EXTSN, bloomFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  BloomFilter::Builder builder;
+  if (!_bloomScan(idx, iTxn, &builder, testState)) return false;
+  BloomFilter::Header header;
+  header.blockCount = BloomFilter::blocksFor(isGrowing ? builder.keyCount * 2 : builder.keyCount);
+  header.keyCount = builder.keyCount;
+
+  char* bloomTmpFilename = _txnManager->getAuxTmpFilename(iTxn->txn, bloomFilename, testState);
+  if (!bloomTmpFilename) return false;
+  _refreshTmpFilenames(iTxn);
+  BTreeIndex::Pager dest;
+  if (!_storageProvider->_openPager(bloomTmpFilename, true, &dest, testState)) return false;
+  builder.blockCount = header.blockCount;
+  BloomFilter::writeHeader(&header, builder.page);
+  bool success = dest.write(0, builder.page, dest.ctx);
+  for (builder.block = 0; success && builder.block < header.blockCount; builder.block++) {
+    memset(builder.page, 0, BloomFilter::BLOCK_SIZE);
+    success = _bloomScan(idx, iTxn, &builder, testState) && dest.write(1 + builder.block, builder.page, dest.ctx);
+  }
+  _storageProvider->_closePager(&dest, testState);
+  return success;
+}
+
+// Feeds every key in this txn's version of the index to builder
+bool IndexManager::_bloomScan(Index idx, IndexTransaction* iTxn, BloomFilter::Builder* builder, void* testState = nullptr) {
+  builder->isDelta = false;
+  if (idx.mode == Index::BTREE) return _btTxnScan(iTxn, nullptr, BloomFilter::buildFilter, builder, testState);
+  // The tmp file is a complete copy of the index once it's been written in this txn,
+  // unless it only holds lines to be appended to the committed index. An overlaid
+  // index isn't written until its overlay is first folded in.
+  uint32_t appendOffset;
+  bool isAppending = _txnManager->getAppendOffset(iTxn->txn, iTxn->tmpFilename, &appendOffset);
+  const char* source = !isAppending && _storageProvider->_exists(iTxn->tmpFilename, testState)
+        && _storageProvider->_fileSize(iTxn->tmpFilename, testState) > 0 
+        ? iTxn->tmpFilename : iTxn->idxFilename;
+  if (_storageProvider->_fileSize(source, testState) > 0
+        && !_storageProvider->_scanIndex(source, BloomFilter::buildFilter, builder, testState)) {
+    return false;
+  }
+  if (isAppending && !_storageProvider->_scanIndex(iTxn->tmpFilename, BloomFilter::buildFilter, builder, testState)) {
+    return false;
+  }
+  // Keys in the delta log, or upserted into this txn's overlay
+  const char* changes = (idx.mode == Index::LOG_STRUCTURED) ? iTxn->deltaTmpFilename : iTxn->overlayTmpFilename;
+  if (!isEmpty(changes)) {
+    builder->isDelta = true;
+    return _storageProvider->_scanIndex(changes, BloomFilter::buildFilter, builder, testState);
+  }
+  return true;
+}
+
+// True if the committed index has no entries (or doesn't exist yet)
+bool IndexManager::_isEmptyIndex(Index idx, const char* idxFilename, void* testState = nullptr) {
+  if (idx.mode == Index::BTREE) {
+    BTreeIndex::Header header;
+    BTreeIndex::Result result = _btReadHeader(idxFilename, &header, testState);
+    return result == BTreeIndex::NOT_FOUND || (result == BTreeIndex::OK && header.height == 0);
+  }
+  if (_storageProvider->_fileSize(idxFilename, testState) > 0) return false;
+  if (idx.mode == Index::LOG_STRUCTURED) {
+    char deltaFilename[FileHelper::MAX_FILENAME_LENGTH];
+    return FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_DELTA_EXTSN, deltaFilename, FileHelper::MAX_FILENAME_LENGTH)
+          && _storageProvider->_fileSize(deltaFilename, testState) == 0;
+  }
+  return true;
+}
+
+/*
+ * Runs write against the B+tree of a BTREE index as part of iTxn. It starts
+ * from the header an earlier write in the same txn left in the tmp file, if
+ * there is one, and writes the new header there.
+ */
+bool IndexManager::_btWrite(IndexTransaction* iTxn, BTreeWrite write, void* opState, void* testState = nullptr) {
+  if (isEmpty(iTxn->tmpFilename)) return false;
+  char pagesFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_BTREE_PAGES_EXTSN, pagesFilename, 
+        FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  BTreeIndex::Header header;
+  BTreeIndex::Pager pager;
+  const char* pagesFile = pagesFilename;
+  if (iTxn->txn->exists(pagesFilename)) {
+    // Rebuilt (or converted) earlier in this txn, so none of its pages are committed yet
+    pagesFile = _txnManager->getTmpFilename(iTxn->txn, pagesFilename);
+    pager.committedPages = 0;
+  } else if (_btReadHeader(iTxn->idxFilename, &header, testState) == BTreeIndex::FAILED) {
+#if (defined(DEBUG))
+    Serial.print(iTxn->idxFilename);
+    Serial.println(F(" is not a B+tree index. Convert it with idxCompact(...)"));
+#endif
+    return false;
+  } else {
+    pager.committedPages = header.pageCount;
+  }
+  // Pages written before a savepoint are only in its copy of the header, so
+  // they're copied on write too, or rolling back wouldn't undo the changes
+  const char* savedFilename = _txnManager->savepointCopy(iTxn->txn, iTxn->tmpFilename);
+  if (savedFilename && _btReadHeader(savedFilename, &header, testState) == BTreeIndex::OK
+        && header.pageCount > pager.committedPages) {
+    pager.committedPages = header.pageCount;
+  }
+  if (_btReadHeader(iTxn->tmpFilename, &header, testState) == BTreeIndex::FAILED) return false;
+
+  bool success = _storageProvider->_openPager(pagesFile, true, &pager, testState)
+        && write(&header, &pager, opState);
+  _storageProvider->_closePager(&pager, testState);
+  return success && _btWriteHeader(iTxn->tmpFilename, &header, testState);
+}
+
+// Scans a committed BTREE index, like _scanIndexFrom(...) does a SORTED one
+bool IndexManager::_btScan(const char* idxFilename, const char* fromKey, StreamableManager::FilterFunction filter,
+      void* state, void* testState = nullptr) {
+  BTreeIndex::Header header;
+  BTreeIndex::Result result = _btReadHeader(idxFilename, &header, testState);
+  if (result == BTreeIndex::NOT_FOUND || (result == BTreeIndex::OK && header.height == 0)) {
+    // Index has no entries
+    return true;
+  }
+  if (result == BTreeIndex::FAILED) {
+#if (defined(DEBUG))
+    Serial.print(idxFilename);
+    Serial.println(F(" is not a B+tree index"));
+#endif
+    return false;
+  }
+  char pagesFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_BTREE_PAGES_EXTSN, pagesFilename, 
+        FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  BTreeIndex::Pager pager;
+  if (!_storageProvider->_openPager(pagesFilename, false, &pager, testState)) return false;
+  bool success = BTreeIndex::scan(&header, &pager, fromKey, filter, state);
+  _storageProvider->_closePager(&pager, testState);
+  return success;
+}
+
+bool IndexManager::_btTxnScan(IndexTransaction* iTxn, const char* fromKey, StreamableManager::FilterFunction filter,
+      void* state, void* testState = nullptr) {
+  char pagesFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_BTREE_PAGES_EXTSN, pagesFilename, 
+        FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  BTreeIndex::Header header;
+  if (_btReadHeader(iTxn->tmpFilename, &header, testState) != BTreeIndex::OK) {
+    // Not written in this txn yet
+    BTreeIndex::Result result = _btReadHeader(iTxn->idxFilename, &header, testState);
+    if (result == BTreeIndex::NOT_FOUND) return true;
+    if (result == BTreeIndex::FAILED) return false;
+  }
+  if (header.height == 0) return true;
+  const char* pagesFile = iTxn->txn->exists(pagesFilename)
+        ? _txnManager->getTmpFilename(iTxn->txn, pagesFilename) : pagesFilename;
+  BTreeIndex::Pager pager;
+  bool success = _storageProvider->_openPager(pagesFile, false, &pager, testState)
+        && BTreeIndex::scan(&header, &pager, fromKey, filter, state);
+  _storageProvider->_closePager(&pager, testState);
+  return success;
+}
+
+bool IndexManager::_btLookup(BTreeIndex::Header* header, BTreeIndex::Pager* pager, 
+      IndexScanFilters::IdxScanCapture* state) {
+  state->scanLimit = 1; // only the first entry at or after the key can match
+  return BTreeIndex::scan(header, pager, state->key, IndexScanFilters::idxLookupFilter, state);
+}
+
+/*
+ * Bulk loads a new, packed page file from this txn's version of the B+tree,
+ * or from the lines of the index file if it's still a SORTED index. The new
+ * page file replaces the old one when the txn commits.
+ */
+bool IndexManager::_btCompact(IndexTransaction* iTxn, void* testState = nullptr) {
+  if (isEmpty(iTxn->tmpFilename)) return false;
+  char pagesFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_BTREE_PAGES_EXTSN, pagesFilename, 
+        FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  if (iTxn->txn->exists(pagesFilename)) {
+    // Already rebuilt in this txn
+    return true;
+  }
+  BTreeIndex::Header header;
+  BTreeIndex::Result source = _btReadHeader(iTxn->idxFilename, &header, testState);
+  if (source == BTreeIndex::OK && _btReadHeader(iTxn->tmpFilename, &header, testState) == BTreeIndex::FAILED) {
+    return false;
+  }
+  char* pagesTmpFilename = _txnManager->getAuxTmpFilename(iTxn->txn, pagesFilename, testState);
+  if (!pagesTmpFilename) return false;
+  _refreshTmpFilenames(iTxn);
+
+  BTreeIndex::Header newHeader;
+  BTreeIndex::Pager dest;
+  if (!_storageProvider->_openPager(pagesTmpFilename, true, &dest, testState)) return false;
+  BTreeIndex::Builder builder(&newHeader, &dest);
+  bool success = true;
+  if (source == BTreeIndex::FAILED) {
+    // Converting a SORTED index
+    success = _storageProvider->_scanIndex(iTxn->idxFilename, BTreeIndex::bulkLoadFilter, &builder, testState);
+  } else if (source == BTreeIndex::OK && header.height > 0) {
+    BTreeIndex::Pager src;
+    success = _storageProvider->_openPager(pagesFilename, false, &src, testState)
+          && BTreeIndex::scan(&header, &src, nullptr, BTreeIndex::bulkLoadFilter, &builder);
+    _storageProvider->_closePager(&src, testState);
+  }
+  success = success && builder.finish();
+  _storageProvider->_closePager(&dest, testState);
+  return success && _btWriteHeader(iTxn->tmpFilename, &newHeader, testState);
+}
+
+// Returns NOT_FOUND if the file doesn't exist, or FAILED if it isn't a B+tree header
+BTreeIndex::Result IndexManager::_btReadHeader(const char* filename, BTreeIndex::Header* header, 
+      void* testState = nullptr) {
+  BTreeIndex::Pager pager;
+  if (isEmpty(filename) || !_storageProvider->_openPager(filename, false, &pager, testState)) {
+    return BTreeIndex::NOT_FOUND;
+  }
+  uint8_t page[BTreeIndex::PAGE_SIZE];
+  bool isBTree = pager.read(0, page, pager.ctx) && BTreeIndex::readHeader(page, header);
+  _storageProvider->_closePager(&pager, testState);
+  return isBTree ? BTreeIndex::OK : BTreeIndex::FAILED;
+}
+
+bool IndexManager::_btWriteHeader(const char* filename, BTreeIndex::Header* header, void* testState = nullptr) {
+  BTreeIndex::Pager pager;
+  if (!_storageProvider->_openPager(filename, true, &pager, testState)) return false;
+  uint8_t page[BTreeIndex::PAGE_SIZE];
+  BTreeIndex::writeHeader(header, page);
+  bool success = pager.write(0, page, pager.ctx);
+  _storageProvider->_closePager(&pager, testState);
+  return success;
+}
+
+IndexManager::IndexTransaction IndexManager::_makeIndexTransaction(void* testState, Index idx, Transaction* txn, 
+      bool isWaiting = true) {
   IndexManager::IndexTransaction idxTxn;
   idxTxn.txn = txn;
-  idxTxn.idx = &idx;
   char idxFilename[FileHelper::MAX_FILENAME_LENGTH];
   if (_fileHelper->indexFilename(idx, idxFilename, FileHelper::MAX_FILENAME_LENGTH)) {
     idxTxn.idxFilename = strdup(idxFilename);
   }
   if (txn == nullptr) {
     idxTxn.isImplicitTxn = true;
-    idxTxn.txn = _txnManager->beginTxn(testState, idxTxn.idxFilename);
+    if (!idxTxn.idxFilename) return idxTxn;
+    if (_isLockedByOp(idxTxn.idxFilename)) {
+      // The op's lock is only released by poll(...), so waiting for it would never end
+#if (defined(DEBUG))
+      Serial.print(idxTxn.idxFilename);
+      Serial.println(F(" is locked by an async operation. Wait for it to finish"));
+#endif
+      return idxTxn;
+    }
+    if (isWaiting) {
+      idxTxn.txn = _txnManager->beginTxn(testState, idxTxn.idxFilename);
+    } else {
+      idxTxn.txn = _txnManager->tryBeginTxn(testState, 0, idxTxn.idxFilename);
+      idxTxn.isBusy = !idxTxn.txn && _txnManager->isLocked(idxTxn.idxFilename);
+    }
   } else {
     idxTxn.txn = txn;
   }
+  if (!idxTxn.txn || !idxTxn.idxFilename) return idxTxn;
+  if (!_isModeValid(idx, idxTxn.idxFilename, txn, testState)) {
+    if (idxTxn.isImplicitTxn) _txnManager->abortTxn(idxTxn.txn, testState);
+    idxTxn.txn = nullptr;
+    return idxTxn;
+  }
+  if (!_txnManager->getTmpFilename(idxTxn.txn, idxTxn.idxFilename)) return idxTxn;
+
+  // The fence file (and delta log) are rewritten along with the index, covered by the index's lock.
+  // BTREE indexes don't need a fence - the .idx file is just the B+tree's header
+  char fenceFilename[FileHelper::MAX_FILENAME_LENGTH];
+  bool hasFence = idx.mode != Index::BTREE
+        && FileHelper::sidecarFilename(idxTxn.idxFilename, _SDSTORAGE_FENCE_EXTSN, fenceFilename, FileHelper::MAX_FILENAME_LENGTH)
+        && _txnManager->getAuxTmpFilename(idxTxn.txn, fenceFilename, testState);
+  char deltaFilename[FileHelper::MAX_FILENAME_LENGTH];
+  bool hasDelta = false;
+  if (idx.mode == Index::LOG_STRUCTURED
+        && FileHelper::sidecarFilename(idxTxn.idxFilename, _SDSTORAGE_DELTA_EXTSN, deltaFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    bool isNewToTxn = !idxTxn.txn->exists(deltaFilename);
+    char* deltaTmpFilename = _txnManager->getAuxTmpFilename(idxTxn.txn, deltaFilename, testState);
+    hasDelta = (deltaTmpFilename != nullptr);
+    if (hasDelta && isNewToTxn) {
+      // Changes are appended to a copy of the committed delta log
+      if (_storageProvider->_exists(deltaFilename, testState)) {
+        hasDelta = _storageProvider->_updateIndex(deltaFilename, deltaTmpFilename, IndexScanFilters::copyFilter, nullptr, testState);
+      } else {
+        Stream* empty = _storageProvider->_openWriteStream(deltaTmpFilename, testState);
+        hasDelta = (empty != nullptr);
+        hasDelta = _storageProvider->_closeStream(empty, testState) && hasDelta;
+      }
+    }
+  }
+
+  char overlayFilename[FileHelper::MAX_FILENAME_LENGTH];
+  bool hasOverlay = _isOverlaid(idx, &idxTxn)
+        && FileHelper::sidecarFilename(idxTxn.idxFilename, _SDSTORAGE_OVERLAY_EXTSN, overlayFilename, FileHelper::MAX_FILENAME_LENGTH)
+        && idxTxn.txn->exists(overlayFilename);
+
+  // Adding to the txn can move its entries around, so get the tmp filenames last
+  if (hasFence) idxTxn.fenceTmpFilename = _txnManager->getTmpFilename(idxTxn.txn, fenceFilename);
+  if (hasDelta) idxTxn.deltaTmpFilename = _txnManager->getTmpFilename(idxTxn.txn, deltaFilename);
+  if (hasOverlay) idxTxn.overlayTmpFilename = _txnManager->getTmpFilename(idxTxn.txn, overlayFilename);
   idxTxn.tmpFilename = _txnManager->getTmpFilename(idxTxn.txn, idxTxn.idxFilename);
   return idxTxn;
 }
 
+/*
+ * Each mode ignores the files the others keep, so an index opened in the
+ * wrong mode would lose entries, or overwrite the index with lines it can't
+ * read. A SORTED or LOG_STRUCTURED index mustn't have a B+tree header (a
+ * BTREE index refuses lines the same way, in _btWrite), and only a
+ * LOG_STRUCTURED index can have records in a delta log. An empty delta log,
+ * as compaction leaves it, changes nothing. txn's copies of the files are
+ * checked too, if it has any.
+ */
+bool IndexManager::_isLockedByOp(const char* idxFilename) {
+  for (AsyncOp* queued = _queue; queued; queued = queued->_next) {
+    IndexOp* op = static_cast<IndexOp*>(queued);
+    if (op->iTxn.txn && op->iTxn.idxFilename && strcmp(op->iTxn.idxFilename, idxFilename) == 0) return true;
+  }
+  return false;
+}
+
+bool IndexManager::_isModeValid(Index idx, const char* idxFilename, Transaction* txn, void* testState = nullptr) {
+  if (idx.mode != Index::BTREE) {
+    BTreeIndex::Header header;
+    bool isBTree = _btReadHeader(idxFilename, &header, testState) == BTreeIndex::OK
+          || (txn && txn->exists(idxFilename)
+            && _btReadHeader(_txnManager->getTmpFilename(txn, idxFilename), &header, testState) == BTreeIndex::OK);
+    if (isBTree) {
+#if (defined(DEBUG))
+      Serial.print(idxFilename);
+      Serial.println(F(" is a B+tree index. Open it as BTREE"));
+#endif
+      return false;
+    }
+  }
+  if (idx.mode != Index::LOG_STRUCTURED) {
+    char deltaFilename[FileHelper::MAX_FILENAME_LENGTH];
+    if (!FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_DELTA_EXTSN, deltaFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+      return false;
+    }
+    // A missing delta log reads as empty
+    bool hasDelta = _storageProvider->_fileSize(deltaFilename, testState) > 0
+          || (txn && txn->exists(deltaFilename)
+            && _storageProvider->_fileSize(_txnManager->getTmpFilename(txn, deltaFilename), testState) > 0);
+    if (hasDelta) {
+#if (defined(DEBUG))
+      Serial.print(idxFilename);
+      Serial.println(F(" has a delta log. Open it as LOG_STRUCTURED, or compact it first"));
+#endif
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Fast path for upserting a key that sorts after every key in a SORTED
+ * index, like a timestamp or sequence number. The line is written to an
+ * otherwise empty tmp file that the commit appends to the index, instead of
+ * rewriting the whole index. The fence's trailer holds the largest key, so
+ * nothing else needs reading. Further appends in the same txn add to the
+ * same tmp file. Sets *appended if it applies, and returns false if an
+ * append was attempted and failed.
+ */
+bool IndexManager::_appendIfLast(IndexTransaction* iTxn, const char* key, const char* line, bool* appended, 
+      void* testState = nullptr) {
+  *appended = false;
+  char fenceFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (isEmpty(iTxn->tmpFilename) || isEmpty(iTxn->fenceTmpFilename)
+        || !FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_FENCE_EXTSN, fenceFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return true;
+  }
+  FenceIndex::Tail tail;
+  uint32_t appendOffset;
+  bool isAppending = _txnManager->getAppendOffset(iTxn->txn, iTxn->tmpFilename, &appendOffset);
+  uint32_t tmpSize = _storageProvider->_fileSize(iTxn->tmpFilename, testState);
+  if (isAppending) {
+    // The fence tmp file carries on from the committed fence
+    if (!_storageProvider->_fenceTail(iTxn->fenceTmpFilename, appendOffset + tmpSize, &tail, testState)) return true;
+  } else {
+    if (tmpSize > 0) return true; // already rewritten in this txn
+    uint32_t indexSize = _storageProvider->_fileSize(iTxn->idxFilename, testState);
+    if (indexSize == 0 || !_storageProvider->_fenceTail(fenceFilename, indexSize, &tail, testState)) return true;
+  }
+  if (strcmp(key, tail.lastKey) <= 0) return true;
+
+  // The fence's trailer and last record are replaced (see FenceIndex::Writer::resume)
+  uint32_t fenceOffset = tail.fenceSize - (tail.recordCount > 0 ? 2 : 1) * FenceIndex::FENCE_RECORD_SIZE;
+  if (!isAppending) {
+    bool marked = _txnManager->putAppendOffset(iTxn->txn, iTxn->tmpFilename, tail.indexSize, testState);
+    _refreshTmpFilenames(iTxn);
+    marked = marked && _txnManager->putAppendOffset(iTxn->txn, iTxn->fenceTmpFilename, fenceOffset, testState);
+    _refreshTmpFilenames(iTxn);
+    if (!marked) return false;
+    fenceOffset = 0;
+  }
+  *appended = true;
+  FenceIndex::Writer fence(_storageProvider->_openWriteStreamAt(iTxn->fenceTmpFilename, fenceOffset, testState));
+  if (!fence.dest) return false;
+  fence.resume(&tail);
+  fence.addLine(line);
+  fence.finish();
+  if (!_storageProvider->_closeStream(fence.dest, testState)) return false;
+  return _storageProvider->_writeIndexLine(iTxn->tmpFilename, line, testState);
+}
+
+/*
+ * Called before rewriting a SORTED index. The rewrite replaces whatever
+ * _appendIfLast(...) wrote earlier in the txn, so its tmp files go back to
+ * being full replacements. On failure, tmpFilename is cleared so the rewrite
+ * fails too.
+ */
+void IndexManager::_endAppend(IndexTransaction* iTxn, void* testState = nullptr) {
+  uint32_t appendOffset;
+  if (isEmpty(iTxn->tmpFilename) || !_txnManager->getAppendOffset(iTxn->txn, iTxn->tmpFilename, &appendOffset)) return;
+  bool success = _storageProvider->_remove(iTxn->tmpFilename, testState)
+        && (!iTxn->fenceTmpFilename || _storageProvider->_remove(iTxn->fenceTmpFilename, testState))
+        && _txnManager->removeAppendOffset(iTxn->txn, iTxn->tmpFilename, testState);
+  _refreshTmpFilenames(iTxn);
+  success = success && _txnManager->removeAppendOffset(iTxn->txn, iTxn->fenceTmpFilename, testState);
+  _refreshTmpFilenames(iTxn);
+  if (!success) iTxn->tmpFilename = nullptr;
+}
+
+void IndexManager::_refreshTmpFilenames(IndexTransaction* iTxn) {
+  char filename[FileHelper::MAX_FILENAME_LENGTH];
+  if (iTxn->fenceTmpFilename
+        && FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_FENCE_EXTSN, filename, FileHelper::MAX_FILENAME_LENGTH)) {
+    iTxn->fenceTmpFilename = _txnManager->getTmpFilename(iTxn->txn, filename);
+  }
+  if (iTxn->deltaTmpFilename
+        && FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_DELTA_EXTSN, filename, FileHelper::MAX_FILENAME_LENGTH)) {
+    iTxn->deltaTmpFilename = _txnManager->getTmpFilename(iTxn->txn, filename);
+  }
+  if (iTxn->overlayTmpFilename
+        && FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_OVERLAY_EXTSN, filename, FileHelper::MAX_FILENAME_LENGTH)) {
+    iTxn->overlayTmpFilename = _txnManager->getTmpFilename(iTxn->txn, filename);
+  }
+  iTxn->tmpFilename = _txnManager->getTmpFilename(iTxn->txn, iTxn->idxFilename);
+}
+
+/*
+ * In an implicit txn there's only the one change, so it's written straight
+ * to the index
+ */
+bool IndexManager::_isOverlaid(Index idx, IndexTransaction* iTxn) {
+  return idx.mode == Index::SORTED && !iTxn->isImplicitTxn;
+}
+
+/*
+ * Opens this txn's overlay of a SORTED index for appending, adding it to
+ * the txn the first time. Lines already appended to the index in this txn
+ * (see _appendIfLast) are moved into it first, so they're merged in order.
+ */
+Stream* IndexManager::_openOverlay(IndexTransaction* iTxn, void* testState = nullptr) {
+  if (!iTxn->overlayTmpFilename) {
+    char overlayFilename[FileHelper::MAX_FILENAME_LENGTH];
+    if (!FileHelper::sidecarFilename(iTxn->idxFilename, _SDSTORAGE_OVERLAY_EXTSN, overlayFilename, FileHelper::MAX_FILENAME_LENGTH)
+          || !_txnManager->getAuxTmpFilename(iTxn->txn, overlayFilename, testState)) {
+      return nullptr;
+    }
+    iTxn->overlayTmpFilename = _txnManager->getTmpFilename(iTxn->txn, overlayFilename);
+    _refreshTmpFilenames(iTxn);
+    uint32_t appendOffset;
+    if (!isEmpty(iTxn->tmpFilename) && _txnManager->getAppendOffset(iTxn->txn, iTxn->tmpFilename, &appendOffset)) {
+      if (!_storageProvider->_updateIndex(iTxn->tmpFilename, iTxn->overlayTmpFilename, IndexScanFilters::toDeltaFilter, 
+            nullptr, testState)) {
+        return nullptr;
+      }
+      _endAppend(iTxn, testState);
+      if (isEmpty(iTxn->tmpFilename)) return nullptr;
+    }
+  }
+  return _storageProvider->_openAppendStream(iTxn->overlayTmpFilename, testState);
+}
+
+bool IndexManager::_toOverlay(IndexTransaction* iTxn, const char* deltaLine, void* testState = nullptr) {
+  Stream* dest = _openOverlay(iTxn, testState);
+  if (!dest) return false;
+  dest->print(deltaLine);
+  dest->write('\n');
+  return _storageProvider->_closeStream(dest, testState);
+}
+
+/*
+ * Merges each overlay in txn into its index, just before the txn commits.
+ * The merged index then replaces the index like any other change, and the
+ * overlay's tmp file is removed so the commit has nothing to do for it.
+ */
+bool IndexManager::_applyOverlays(Transaction* txn, void* testState = nullptr) {
+  if (!txn) return false;
+  struct OverlayCapture {
+    IndexManager* idxManager;
+    Transaction* txn;
+    void* ts;
+    bool success = true;
+    OverlayCapture(IndexManager* idxManager, Transaction* txn, void* ts): idxManager(idxManager), txn(txn), ts(ts) {};
+  } capture(this, txn, testState);
+  auto applyOverlay = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valuePmem, void* capturePtr) -> bool {
+    OverlayCapture* c = static_cast<OverlayCapture*>(capturePtr);
+    size_t len = strlen(filename);
+    if (len < 4 || strcmp_P(filename + len - 4, _SDSTORAGE_OVERLAY_EXTSN) != 0) return true;
+    c->success = c->idxManager->_applyOverlay(c->txn, filename, tmpFilename, c->ts);
+    return c->success;
+  };
+  txn->processEntries(applyOverlay, &capture);
+  return capture.success;
+}
+
+bool IndexManager::_applyOverlay(Transaction* txn, const char* overlayFilename, const char* overlayTmpFilename, 
+      void* testState = nullptr) {
+  if (!_storageProvider->_exists(overlayTmpFilename, testState)) return true; // already merged
+  IndexTransaction iTxn;
+  iTxn.txn = txn;
+  char filename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!FileHelper::sidecarFilename(overlayFilename, _SDSTORAGE_INDEX_EXTSN, filename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  iTxn.idxFilename = strdup(filename);
+  iTxn.tmpFilename = _txnManager->getTmpFilename(txn, iTxn.idxFilename);
+  if (!FileHelper::sidecarFilename(overlayFilename, _SDSTORAGE_FENCE_EXTSN, filename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  iTxn.fenceTmpFilename = _txnManager->getTmpFilename(txn, filename);
+  iTxn.overlayTmpFilename = const_cast<char*>(overlayTmpFilename);
+  bool success = _compact(&iTxn, testState) && _storageProvider->_remove(overlayTmpFilename, testState);
+#if (defined(DEBUG))
+  if (!success) {
+    Serial.print(F("IndexManager::_applyOverlay - could not merge "));
+    Serial.println(overlayFilename);
+  }
+#endif
+  return success;
+}
+
@@ -3,6 +3,10 @@
 
 
 #include "../Index.h"
+#include "AsyncOp.h"
+#include "BloomFilter.h"
+#include "BTreeIndex.h"
+#include "FenceIndex.h"
 #include "FileHelper.h"
 #include "IndexHelpers.h"
 #include "IndexScanFilters.h"
@@ -33,11 +37,14 @@ class IndexManager {
     TransactionManager* _txnManager;
 
     struct IndexTransaction {
-      Index* idx = nullptr;
       Transaction* txn = nullptr;
       char* idxFilename = nullptr;
       char* tmpFilename = nullptr;
+      char* fenceTmpFilename = nullptr;
+      char* deltaTmpFilename = nullptr;  // LOG_STRUCTURED only
+      char* overlayTmpFilename = nullptr;  // SORTED only, once changed in an explicit txn
       bool isImplicitTxn = false;
+      bool isBusy = false;      // the implicit txn wasn't begun, as another txn has the index locked
       bool success = false;
       ~IndexTransaction() {
         if (idxFilename) free(idxFilename);
@@ -45,8 +52,53 @@ class IndexManager {
       }
     };
 
+    /*
+     * A compaction (see _compact), run a step at a time like an IndexOp's
+     * rewrite. The changes being folded in are loaded when it begins.
+     */
+    struct Compaction {
+      IndexScanFilters::IdxDeltaCapture state;
+      FenceIndex::Writer* fence = nullptr;   // nullptr if there was nothing to compact
+      StorageProvider::IndexRewrite rewrite;
+    };
+
+    /*
+     * An idxUpsert or idxRemove as a series of steps, so a long index rewrite,
+     * a LOG_STRUCTURED lookup or a compaction can be spread over several
+     * poll(...) calls. The sync versions run the same steps to the end in
+     * one go.
+     */
+    struct IndexOp: public AsyncOp {
+      enum Kind : uint8_t { UPSERT, REMOVE };
+      enum Phase : uint8_t { START, LOOKUP, REWRITE, COMPACT, DONE };
+      IndexManager* idxManager;
+      const Kind kind;
+      const Index idx;
+      IndexEntry entry;          // copy of the key (and value) to change
+      Transaction* txn;          // nullptr = implicit
+      void* testState;
+      bool isAsync = false;      // run by poll(...), so it doesn't wait for the index's lock
+      Phase phase = START;
+      IndexTransaction iTxn;     // made when the op starts
+      IndexScanFilters::IdxScanCapture* state = nullptr;
+      FenceIndex::Writer* fence = nullptr;
+      StorageProvider::IndexRewrite rewrite;
+      StorageProvider::IndexScan scan;       // LOOKUP
+      bool isScanningDelta = false;          // LOOKUP - the delta log, before the index
+      Compaction compaction;
+      IndexOp(IndexManager* idxManager, Kind kind, Index idx, const char* key, const char* value, 
+            Transaction* txn, void* testState);
+      ~IndexOp();
+    };
+
+    // Bytes of index an async step rewrites
+    static const uint16_t ASYNC_STEP_BYTES = 512;
+    AsyncOp* _queue = nullptr;   // ops waiting for poll(...), oldest first
+
     bool idxUpsert(Index idx, IndexEntry* entry, Transaction* txn = nullptr);
     bool idxUpsert(void* testState, Index idx, IndexEntry* entry, Transaction* txn = nullptr);
+    bool idxUpsertBatch(Index idx, IndexEntry* entries, size_t count, Transaction* txn = nullptr);
+    bool idxUpsertBatch(void* testState, Index idx, IndexEntry* entries, size_t count, Transaction* txn = nullptr);
     bool idxRemove(Index idx, const char* key, Transaction* txn = nullptr);
     bool idxRemove(void* testState, Index idx, const char* key, Transaction* txn = nullptr);
     bool idxRename(Index idx, const char* oldKey, const char* newKey, Transaction* txn = nullptr);
@@ -54,12 +106,123 @@ class IndexManager {
     bool idxLookup(Index idx, const char* key, char* buffer, size_t bufferSize, void* testState = nullptr);
     bool idxHasKey(Index idx, const char* key, void* testState = nullptr);
     bool idxPrefixSearch(Index idx, SearchResults* results, void* testState = nullptr);
+    bool idxLookup(Index idx, const char* key, char* buffer, size_t bufferSize, Transaction* txn, void* testState = nullptr);
+    bool idxHasKey(Index idx, const char* key, Transaction* txn, void* testState = nullptr);
+    bool idxPrefixSearch(Index idx, SearchResults* results, Transaction* txn, void* testState = nullptr);
+    bool idxSeek(Index idx, IndexCursor* cursor, const char* prefix, void* testState = nullptr);
+    bool idxSeekKey(Index idx, IndexCursor* cursor, const char* key, void* testState = nullptr);
+    bool idxNext(Index idx, IndexCursor* cursor, char* keyBuffer, size_t keyBufferSize,
+          char* valueBuffer, size_t valueBufferSize, void* testState = nullptr);
+    AsyncOp* idxUpsertAsync(void* testState, Index idx, IndexEntry* entry);
+    AsyncOp* idxRemoveAsync(void* testState, Index idx, const char* key);
+    bool poll(uint32_t budgetMicros);
+    bool idxCompact(Index idx, Transaction* txn = nullptr);
+    bool idxCompact(void* testState, Index idx, Transaction* txn = nullptr);
+    bool idxRebuild(Index idx, Transaction* txn = nullptr);
+    bool idxRebuild(void* testState, Index idx, Transaction* txn = nullptr);
+
+    // IndexOp steps
+    AsyncOp* _enqueue(IndexOp* op);
+    bool _step(IndexOp* op, uint32_t maxBytes);
+    void _startUpsert(IndexOp* op);
+    void _startRemove(IndexOp* op);
+    void _finishRewrite(IndexOp* op, bool success);
+    void _startLookup(IndexOp* op);
+    void _lookupIndex(IndexOp* op);
+    void _nextLookup(IndexOp* op);
+    void _finishLookup(IndexOp* op, bool success);
+    void _startCompact(IndexOp* op);
+    void _finishCompact(IndexOp* op, bool success);
+    void _endOp(IndexOp* op, bool success);
+    void _cancel(IndexOp* op);
+
+    // Creates an implicit txn if the one passed in is nullptr. Unless isWaiting,
+    // it gives up straight away (setting isBusy) if the index is locked
+    IndexTransaction _makeIndexTransaction(void* testState, Index idx, Transaction* txn, bool isWaiting = true);
+    // True if a running async op's txn has the index locked
+    bool _isLockedByOp(const char* idxFilename);
+    // False if the index's files (or txn's copies of them) were written in another mode
+    bool _isModeValid(Index idx, const char* idxFilename, Transaction* txn, void* testState = nullptr);
+
+    // Adding a file to a txn can move its entries around, so the tmp filenames need fetching again
+    void _refreshTmpFilenames(IndexTransaction* iTxn);
+
+    // Append fast path for SORTED indexes
+    bool _appendIfLast(IndexTransaction* iTxn, const char* key, const char* line, bool* appended, 
+          void* testState = nullptr);
+    void _endAppend(IndexTransaction* iTxn, void* testState = nullptr);
 
-    // Creates an implicit txn if the one passed in is nullptr
-    IndexTransaction _makeIndexTransaction(void* testState, Index idx, Transaction* txn);
+    /*
+     * Changes to a SORTED index in an explicit txn are collected in an
+     * overlay (a delta log that only lives in the txn, ~IDX/<name>.ovl),
+     * and merged into the index in one pass when the txn commits
+     */
+    bool _isOverlaid(Index idx, IndexTransaction* iTxn);
+    Stream* _openOverlay(IndexTransaction* iTxn, void* testState = nullptr);
+    bool _toOverlay(IndexTransaction* iTxn, const char* deltaLine, void* testState = nullptr);
+    bool _applyOverlays(Transaction* txn, void* testState = nullptr);
+    bool _applyOverlay(Transaction* txn, const char* overlayFilename, const char* overlayTmpFilename, 
+          void* testState = nullptr);
     
+    // Stable insertion sort of the batch by key, into sorted
+    void _sortBatch(IndexEntry* entries, size_t count, IndexEntry** sorted);
+
     // General purpose index scanner
     bool IndexManager::_idxScan(const char* idxFilename, IndexScanFilters::IdxScanCapture* state, void* testState = nullptr);
+
+    // Index scanner that merges in the delta log of LOG_STRUCTURED indexes
+    bool _mergedScan(Index idx, const char* idxFilename, IndexScanFilters::IdxScanCapture* state, void* testState = nullptr);
+    bool _deltaPrefixSearch(const char* idxFilename, SearchResults* results, void* testState = nullptr);
+
+    // Index scanner that sees the changes made so far in a txn
+    bool _txnScan(Index idx, IndexTransaction* iTxn, IndexScanFilters::IdxScanCapture* state, void* testState = nullptr);
+
+    /*
+     * Read-your-writes. The IndexTransaction describes what txn has written
+     * to idx so far, without adding anything to the txn. Returns false if
+     * idx isn't part of txn, so the committed index should be read.
+     */
+    bool _readIndexTransaction(Index idx, Transaction* txn, IndexTransaction* iTxn);
+    bool _readScan(Index idx, const char* idxFilename, Transaction* txn, IndexScanFilters::IdxScanCapture* state, 
+          void* testState = nullptr);
+    bool _txnPrefixSearch(Index idx, IndexTransaction* iTxn, SearchResults* results, void* testState = nullptr);
+
+    // IndexCursor helpers
+    bool _cursorSeek(Index idx, IndexCursor* cursor, const char* prefix, const char* fromKey, void* testState = nullptr);
+    bool _isCursorValid(const char* idxFilename, IndexCursor* cursor, void* testState = nullptr);
+    void _cursorPosition(const char* idxFilename, IndexCursor* cursor, void* testState = nullptr);
+
+    // Delta log helpers for LOG_STRUCTURED indexes
+    bool _appendDelta(IndexTransaction* iTxn, const char* line, void* testState = nullptr);
+    bool _needsCompact(Index idx, IndexTransaction* iTxn, void* testState = nullptr);
+    bool _compactIfNeeded(Index idx, IndexTransaction* iTxn, void* testState = nullptr);
+    bool _compact(IndexTransaction* iTxn, void* testState = nullptr);
+    bool _beginCompact(IndexTransaction* iTxn, Compaction* compaction, void* testState = nullptr);
+    bool _endCompact(IndexTransaction* iTxn, Compaction* compaction, bool success, void* testState = nullptr);
+
+    // B+tree helpers for BTREE indexes. See BTreeIndex.h
+    typedef bool (*BTreeWrite)(BTreeIndex::Header* header, BTreeIndex::Pager* pager, void* opState);
+    bool _btWrite(IndexTransaction* iTxn, BTreeWrite write, void* opState, void* testState = nullptr);
+    bool _btScan(const char* idxFilename, const char* fromKey, StreamableManager::FilterFunction filter,
+          void* state, void* testState = nullptr);
+    // Scans the txn's version of the B+tree, like _btScan does the committed one
+    bool _btTxnScan(IndexTransaction* iTxn, const char* fromKey, StreamableManager::FilterFunction filter,
+          void* state, void* testState = nullptr);
+    bool _btCompact(IndexTransaction* iTxn, void* testState = nullptr);
+    BTreeIndex::Result _btReadHeader(const char* filename, BTreeIndex::Header* header, void* testState = nullptr);
+    bool _btWriteHeader(const char* filename, BTreeIndex::Header* header, void* testState = nullptr);
+    static bool _btLookup(BTreeIndex::Header* header, BTreeIndex::Pager* pager, IndexScanFilters::IdxScanCapture* state);
+
+    // Bloom filter helpers. See BloomFilter.h
+    BloomFilter::Result _bloomCheck(const char* idxFilename, const char* key, void* testState = nullptr);
+    bool _bloomAdd(Index idx, IndexTransaction* iTxn, IndexEntry* entries, size_t count, void* testState = nullptr);
+    bool _bloomRebuild(Index idx, IndexTransaction* iTxn, bool isGrowing, void* testState = nullptr);
+    bool _bloomScan(Index idx, IndexTransaction* iTxn, BloomFilter::Builder* builder, void* testState = nullptr);
+    bool _isEmptyIndex(Index idx, const char* idxFilename, void* testState = nullptr);
+
+    // Finds the block of an index that could contain key using its fence file
+    FenceIndex::Result _fenceRange(const char* idxFilename, const char* key, bool isPrefix,
+          FenceIndex::Range* range, void* testState = nullptr);
     
     friend class IndexScanFilters;
     friend class SDStorage;
@@ -3,6 +3,7 @@
 
 
 #include "../Index.h"
+#include "FenceIndex.h"
 #include "IndexHelpers.h"
 #include <StreamableManager.h>
 #include "Strings.h"
@@ -25,11 +26,16 @@ class IndexScanFilters {
       const bool isUpsert;       // in
       size_t bufferSize = 64;    // in
       char* value = nullptr;     // out
-      char* prevKey = nullptr;   // out
       bool keyExists = false;    // out
       bool didUpsert = false;    // out
       bool didRemove = false;    // out
       bool didInsert = false;    // out
+      bool deltaHit = false;     // out - key has a record in the delta log
+      FenceIndex::Writer* fence = nullptr; // in - fed every line written
+      uint32_t scanLimit = 0;    // in - max bytes to scan (0 = no limit)
+      uint32_t scanned = 0;      // internal
+      bool isPastKey = false;    // internal - passed where key would sort, so it isn't in the index
+      bool copyTail = false;     // out - nothing left to change, copy the rest of the index as-is
       IdxScanCapture(const char* key): 
           key(key), newKey(nullptr), valueIn(nullptr), isUpsert(false) {};
       IdxScanCapture(const char* key, const char* value): 
@@ -37,25 +43,96 @@ class IndexScanFilters {
       IdxScanCapture(const char* oldKey, const char* newKey, bool):
           key(oldKey), newKey(newKey), valueIn(nullptr), isUpsert(false) {};
       ~IdxScanCapture() {
-        if (prevKey) free(prevKey);
         if (value) free(value);
-        prevKey = nullptr;
         value = nullptr;
       }
     };
 
+    // For merging a sorted batch of entries into an index in one pass
+    struct IdxBatchCapture {
+      IndexEntry** entries;      // in - sorted by key
+      const size_t count;        // in
+      size_t bufferSize = 64;    // in
+      size_t pos = 0;            // out - next entry to be written
+      bool failed = false;       // out
+      bool copyTail = false;     // out - batch is used up, copy the rest of the index as-is
+      FenceIndex::Writer* fence = nullptr; // in - fed every line written
+      IdxBatchCapture(IndexEntry** entries, size_t count):
+          entries(entries), count(count) {};
+    };
+
+    // A record from the delta log of a LOG_STRUCTURED index
+    struct DeltaRecord {
+      char* key;
+      char* value;
+      const bool isRemove;
+      DeltaRecord* next = nullptr;
+      DeltaRecord(const char* key, const char* value, bool isRemove):
+          key(strdup(key)), value(value ? strdup(value) : nullptr), isRemove(isRemove) {};
+      ~DeltaRecord() {
+        if (key) free(key);
+        if (value) free(value);
+        key = nullptr;
+        value = nullptr;
+      }
+    };
+
+    // For merging the delta log of a LOG_STRUCTURED index with its index file
+    struct IdxDeltaCapture {
+      const char* prefix = nullptr;      // in - only load records with this prefix
+      SearchResults* results = nullptr;  // in - merge into search results instead of an index
+      size_t bufferSize = 64;            // in
+      FenceIndex::Writer* fence = nullptr; // in - fed every line written
+      DeltaRecord* head = nullptr;       // internal - sorted by key, last record per key wins
+      bool failed = false;               // out
+      bool copyTail = false;             // out - delta log is used up, copy the rest of the index as-is
+      ~IdxDeltaCapture() {
+        while (head) {
+          DeltaRecord* toDelete = head;
+          head = head->next;
+          delete toDelete;
+        }
+      }
+    };
+
+    /*
+     * For one step of an IndexCursor. The delta log (if any) is scanned
+     * first for the smallest key after the cursor, then the index from the
+     * cursor's offset, and whichever sorts first is the next entry. It's
+     * written straight into the caller's buffers.
+     */
+    struct IdxCursorCapture {
+      const IndexCursor* cursor;   // in
+      char* key;                   // in/out
+      const size_t keySize;        // in
+      char* value;                 // in/out
+      const size_t valueSize;      // in
+      uint32_t offset;             // in/out - of the next index line not used up
+      bool hasDelta = false;       // out - key/value hold the first delta record after the cursor...
+      bool isDeltaRemove = false;  // out - ...which may be a removal
+      bool hasIndex = false;       // out - found an index line after the cursor
+      int indexCmp = 0;            // out - that line's key vs the delta record's key
+      bool isTruncated = false;    // out - value of the entry in key/value didn't fit
+      bool isTooLong = false;      // out - the next entry's key didn't fit key, so it's not known
+      bool failed = false;         // out
+      IdxCursorCapture(const IndexCursor* cursor, char* key, size_t keySize, char* value, size_t valueSize):
+          cursor(cursor), key(key), keySize(keySize), value(value), valueSize(valueSize),
+          offset(cursor->offset) {};
+    };
+
+    // Whether the line at a cursor's offset is one it could go on from. See IndexManager::idxNext
+    struct IdxCursorCheck {
+      const IndexCursor* cursor;   // in
+      bool isValid = true;         // out
+      IdxCursorCheck(const IndexCursor* cursor): cursor(cursor) {};
+    };
+
     static bool idxUpsertFilter(const char* line, StreamableManager::DestinationStream* dest, 
           void* statePtr) {
 
       IdxScanCapture* state = static_cast<IdxScanCapture*>(statePtr);
-      if (state->didUpsert) {
-        // Upsert already happened. Pipe the rest in fast mode.
-        return _pipeFast(line, dest);
-      }
-
-      char* l = strdup(line);
-      IndexEntry currEntry = IndexHelpers::parseIndexEntry(l);
-      free(l);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
 
       if (isEmpty(currEntry.key)) {
 #if (defined(DEBUG))
@@ -71,58 +148,104 @@ class IndexScanFilters {
         IndexEntry newEntry(state->key, state->valueIn);
         char newLine[state->bufferSize];
         IndexHelpers::toIndexLine(&newEntry, newLine, state->bufferSize);
-        dest->println(newLine);
+        _emit(state, dest, newLine);
         state->didUpsert = true;
 
-      } else if (strcmp(state->key, currEntry.key) < 0 &&       // state->key is before key
-              (!state->prevKey                                  // this is the first key OR
-               || strcmp(state->key, state->prevKey) > 0)) {    // state->key is after prevKey
+      } else if (strcmp(state->key, currEntry.key) < 0) {  // state->key is before key
 
           // insert new entry before current
           IndexEntry newEntry(state->key, state->valueIn);
           char newLine[state->bufferSize];
           IndexHelpers::toIndexLine(&newEntry, newLine, state->bufferSize);
-          dest->println(newLine);
-          dest->println(line);
+          _emit(state, dest, newLine);
+          _emit(state, dest, line);
           state->didUpsert = true;
 
       } else {
         // state-key comes after this key, so keep going
-        dest->println(line);
-        if (state->prevKey) free(state->prevKey);
-        state->prevKey = nullptr;
-        state->prevKey = strdup(currEntry.key);
+        _emit(state, dest, line);
       }
+      if (state->didUpsert) return _copyTail(&state->copyTail);
       return true;
     };
 
+    /*
+     * Merges a batch of entries (sorted by key) into the index. Entries
+     * before the current line are inserted, a matching entry replaces the
+     * current line, and whatever's left after the last line must be appended
+     * by the caller.
+     */
+    static bool idxUpsertBatchFilter(const char* line, StreamableManager::DestinationStream* dest, 
+          void* statePtr) {
+      IdxBatchCapture* state = static_cast<IdxBatchCapture*>(statePtr);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+
+      if (isEmpty(currEntry.key)) {
+#if (defined(DEBUG))
+        Serial.println(F("idxUpsertBatch aborting - possible index corruption"));
+#endif
+        state->failed = true; // signal txn rollback
+        return false; // stop piping index lines
+      }
+
+      bool replaced = false;
+      while (state->pos < state->count) {
+        IndexEntry* next = _nextBatchEntry(state);
+        int cmp = strcmp(next->key, currEntry.key);
+        if (cmp > 0) break; // current line comes first
+        char newLine[state->bufferSize];
+        IndexHelpers::toIndexLine(next, newLine, state->bufferSize);
+        dest->println(newLine);
+        if (state->fence) state->fence->addLine(newLine);
+        state->pos++;
+        replaced = (cmp == 0);
+        if (replaced) break; // replaced the current line
+      }
+      if (!replaced) {
+        dest->println(line);
+        if (state->fence) state->fence->addLine(line);
+      }
+      if (state->pos >= state->count) return _copyTail(&state->copyTail);
+      return true;
+    }
+
+    /*
+     * Returns the entry at state->pos, skipping ahead past duplicate keys
+     * so the last one in the batch wins
+     */
+    static IndexEntry* _nextBatchEntry(IdxBatchCapture* state) {
+      while (state->pos + 1 < state->count
+            && strcmp(state->entries[state->pos]->key, state->entries[state->pos + 1]->key) == 0) {
+        state->pos++;
+      }
+      return state->entries[state->pos];
+    }
+
     static bool idxRemoveFilter(const char* line, StreamableManager::DestinationStream* dest, 
           void* statePtr) {
       IdxScanCapture* state = static_cast<IdxScanCapture*>(statePtr);
-      if (state->didRemove) {
-        // Remove already happened. Pipe the rest in fast mode.
-        return _pipeFast(line, dest);
-      }
-      char* l = strdup(line);
-      IndexEntry currEntry = IndexHelpers::parseIndexEntry(l);
-      free(l);
-      if (strcmp(state->key, currEntry.key) == 0) {
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+      int cmp = strcmp(state->key, currEntry.key);
+      if (cmp == 0) {
         /* skip it */ 
         state->didRemove = true;
-      } else { dest->println(line); }
+      } else {
+        // Indexes are sorted, so once past the key it isn't in the index
+        state->isPastKey = (cmp < 0);
+        _emit(state, dest, line);
+      }
+      // Once removed (or it can't be), there's nothing left to change
+      if (state->didRemove || state->isPastKey) return _copyTail(&state->copyTail);
       return true;
     }
 
     static bool idxRenameFilter(const char* line, StreamableManager::DestinationStream* dest, 
           void* statePtr) {
       IdxScanCapture* state = static_cast<IdxScanCapture*>(statePtr);
-      if (state->didRemove && state->didInsert) {
-        // Rename already happened. Pipe the rest in fast mode.
-        return _pipeFast(line, dest);
-      }
-      char* l = strdup(line);
-      IndexEntry currEntry = IndexHelpers::parseIndexEntry(l);
-      free(l);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
 
       if (strcmp(state->key, currEntry.key) == 0) {
         /* skip the old key */
@@ -130,46 +253,190 @@ class IndexScanFilters {
       } else if (strcmp(state->newKey, currEntry.key) == 0) {
         // new key already exists - abort
         return false;
-      } else if (strcmp(state->newKey, currEntry.key) < 0 &&     // state->newKey is before key
-              (!state->prevKey                                   // this is the first key OR
-               || strcmp(state->newKey, state->prevKey) > 0)) {  // state->newKey is after prevKey
+      } else if (!state->didInsert                              // not inserted yet AND
+              && strcmp(state->newKey, currEntry.key) < 0) {     // state->newKey is before key
           // insert new newKey/value before line
           IndexEntry newEntry(state->newKey, state->value);
           char newLine[state->bufferSize];
           IndexHelpers::toIndexLine(&newEntry, newLine, state->bufferSize);
-          dest->println(newLine);
-          dest->println(line);
+          _emit(state, dest, newLine);
+          _emit(state, dest, line);
           state->didInsert = true;
       } else {
         // state-key comes after this key, so keep going
+        _emit(state, dest, line);
+      }
+      if (!state->didRemove && strcmp(state->key, currEntry.key) < 0) {
+        // Indexes are sorted, so the old key isn't in the index
+        state->isPastKey = true;
+      }
+      // Once renamed (or it can't be), there's nothing left to change
+      if ((state->didRemove && state->didInsert) || state->isPastKey) return _copyTail(&state->copyTail);
+      return true;
+    }
+
+    static bool copyFilter(const char* line, StreamableManager::DestinationStream* dest, 
+          void* statePtr) {
+      dest->println(line);
+      return true;
+    }
+
+    // Copies index lines as delta log upserts
+    static bool toDeltaFilter(const char* line, StreamableManager::DestinationStream* dest,
+          void* statePtr) {
+      char deltaLine[strlen(line) + 2];
+      deltaLine[0] = '+';
+      strcpy(deltaLine + 1, line);
+      dest->println(deltaLine);
+      return true;
+    }
+
+    /*
+     * Scans the whole delta log for state->key, since later records
+     * supersede earlier ones
+     */
+    static bool idxDeltaLookupFilter(const char* line, StreamableManager::DestinationStream* dest, 
+          void* statePtr) {
+      IdxScanCapture* state = static_cast<IdxScanCapture*>(statePtr);
+      char scratch[strlen(line) + 1];
+      bool isRemove = false;
+      IndexLineView currEntry = IndexHelpers::viewDeltaLine(line, scratch, sizeof(scratch), &isRemove);
+      if (strcmp(state->key, currEntry.key) == 0) {
+        state->deltaHit = true;
+        state->keyExists = !isRemove;
+        if (state->value) free(state->value);
+        state->value = nullptr;
+        if (!isRemove && currEntry.value) state->value = strdup(currEntry.value);
+      }
+      return true;
+    }
+
+    /*
+     * Loads the delta log into a sorted list, keeping only the last record
+     * per key. Delta logs and overlays are kept small (see
+     * IndexManager::_compactIfNeeded), so the list stays short. Sets failed
+     * if a record can't be allocated.
+     */
+    static bool deltaLoadFilter(const char* line, StreamableManager::DestinationStream* dest, 
+          void* statePtr) {
+      IdxDeltaCapture* state = static_cast<IdxDeltaCapture*>(statePtr);
+      char scratch[strlen(line) + 1];
+      bool isRemove = false;
+      IndexLineView currEntry = IndexHelpers::viewDeltaLine(line, scratch, sizeof(scratch), &isRemove);
+      if (isEmpty(currEntry.key)) {
+#if (defined(DEBUG))
+        Serial.println(F("Skipping invalid delta log line"));
+#endif
+        return true;
+      }
+      if (state->prefix && !startsWith(currEntry.key, state->prefix)) return true;
+      DeltaRecord** pos = &state->head;
+      while (*pos && strcmp((*pos)->key, currEntry.key) < 0) pos = &(*pos)->next;
+      DeltaRecord* record = new DeltaRecord(currEntry.key, currEntry.value, isRemove);
+      if (!record || !record->key || (currEntry.value && !record->value)) {
+#if (defined(DEBUG))
+        Serial.println(F("Out of memory loading delta log"));
+#endif
+        delete record;
+        state->failed = true;
+        return false;
+      }
+      if (*pos && strcmp((*pos)->key, currEntry.key) == 0) {
+        // replace the earlier record for this key
+        DeltaRecord* toDelete = *pos;
+        record->next = toDelete->next;
+        delete toDelete;
+      } else {
+        record->next = *pos;
+      }
+      *pos = record;
+      return true;
+    }
+
+    /*
+     * Folds the loaded delta log into the index. Records left over after the
+     * last line must be appended by the caller.
+     */
+    static bool idxCompactFilter(const char* line, StreamableManager::DestinationStream* dest, 
+          void* statePtr) {
+      IdxDeltaCapture* state = static_cast<IdxDeltaCapture*>(statePtr);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+      if (isEmpty(currEntry.key)) {
+#if (defined(DEBUG))
+        Serial.println(F("idxCompact aborting - possible index corruption"));
+#endif
+        state->failed = true; // signal txn rollback
+        return false; // stop piping index lines
+      }
+      if (!_mergeDelta(state, dest, currEntry.key)) {
         dest->println(line);
-        if (state->prevKey) free(state->prevKey);
-        state->prevKey = nullptr;
-        state->prevKey = strdup(currEntry.key);
+        if (state->fence) state->fence->addLine(line);
       }
+      if (!state->head) return _copyTail(&state->copyTail);
       return true;
     }
 
+    /*
+     * Writes (or adds to the search results) the delta records that sort
+     * before or at key, dropping removals. Returns true if there was a record
+     * for key itself, which supersedes the index line. A null key flushes
+     * every remaining record.
+     */
+    static bool _mergeDelta(IdxDeltaCapture* state, StreamableManager::DestinationStream* dest, const char* key) {
+      while (state->head && (!key || strcmp(state->head->key, key) <= 0)) {
+        DeltaRecord* record = state->head;
+        state->head = record->next;
+        bool isMatch = key && strcmp(record->key, key) == 0;
+        if (!record->isRemove) {
+          if (state->results) {
+            _addSearchMatch(state->results, record->key, record->value);
+          } else {
+            char newLine[state->bufferSize];
+            _toIndexLine(record, newLine, state->bufferSize);
+            dest->println(newLine);
+            if (state->fence) state->fence->addLine(newLine);
+          }
+        }
+        delete record;
+        if (isMatch) return true;
+      }
+      return false;
+    }
+
+    static bool _toIndexLine(DeltaRecord* record, char* buffer, size_t bufferSize) {
+      IndexEntry entry = record->value ? IndexEntry(record->key, record->value) : IndexEntry(record->key);
+      return IndexHelpers::toIndexLine(&entry, buffer, bufferSize);
+    }
+
     static bool idxLookupFilter(const char* line, StreamableManager::DestinationStream* dest, 
           void* statePtr) {
       IdxScanCapture* state = static_cast<IdxScanCapture*>(statePtr);
-      char* l = strdup(line);
-      IndexEntry currEntry = IndexHelpers::parseIndexEntry(l);
-      free(l);
-      if (strcmp(state->key, currEntry.key) == 0) {
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+      int cmp = strcmp(state->key, currEntry.key);
+      if (cmp == 0) {
         state->keyExists = true;
-        state->value = strdup(currEntry.value);
+        state->value = currEntry.value ? strdup(currEntry.value) : nullptr;
         return false; // stop scanning
       }
+      if (cmp < 0) {
+        // Indexes are sorted, so the key isn't in the index
+        return false;
+      }
+      if (state->scanLimit > 0) {
+        // Only scanning one fence block
+        state->scanned += strlen(line) + 1;
+        if (state->scanned >= state->scanLimit) return false;
+      }
       return true; // keep going
     }
 
     static bool idxPrefixSearchFilter(const char* line, StreamableManager::DestinationStream* dest, 
           void* statePtr) {
       SearchResults* results = static_cast<SearchResults*>(statePtr);
-      char* l = strdup(line);
-      IndexEntry currEntry = IndexHelpers::parseIndexEntry(l);
-      free(l);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
 
       char* prefix = results->searchPrefix;
       if (strlen(prefix) > 0 && !startsWith(currEntry.key, prefix) && strcmp(currEntry.key, prefix) > 0) {
@@ -178,44 +445,162 @@ class IndexScanFilters {
         return false;
       }
       if (strlen(prefix) == 0 || startsWith(currEntry.key, prefix)) {
-        // Handle up to 10 matches, then switch to trie mode
-        if (results->matchCount < 10) {
-          KeyValue* match = new KeyValue(currEntry.key, currEntry.value);
-          appendMatchResult(results, match);
-          results->matchCount++;
-        } else {
-          results->trieMode = true;
+        _addSearchMatch(results, currEntry.key, currEntry.value);
+      }
+      return true;
+    }
+
+    // Same as idxPrefixSearchFilter, but merging in the matching delta log records
+    static bool idxPrefixSearchMergeFilter(const char* line, StreamableManager::DestinationStream* dest, 
+          void* statePtr) {
+      IdxDeltaCapture* state = static_cast<IdxDeltaCapture*>(statePtr);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+
+      char* prefix = state->results->searchPrefix;
+      if (strlen(prefix) > 0 && !startsWith(currEntry.key, prefix) && strcmp(currEntry.key, prefix) > 0) {
+        // Past the prefix. The caller adds any remaining delta records.
+        return false;
+      }
+      if (strlen(prefix) == 0 || startsWith(currEntry.key, prefix)) {
+        if (!_mergeDelta(state, dest, currEntry.key)) {
+          _addSearchMatch(state->results, currEntry.key, currEntry.value);
         }
+      }
+      return true;
+    }
+
+    // Keeps the smallest key after the cursor, and the last record for it
+    static bool idxCursorDeltaFilter(const char* line, StreamableManager::DestinationStream* dest,
+          void* statePtr) {
+      IdxCursorCapture* state = static_cast<IdxCursorCapture*>(statePtr);
+      char scratch[strlen(line) + 1];
+      bool isRemove = false;
+      IndexLineView currEntry = IndexHelpers::viewDeltaLine(line, scratch, sizeof(scratch), &isRemove);
+      if (isEmpty(currEntry.key) || _cursorPos(state->cursor, currEntry.key) != 0) return true;
+      if (state->hasDelta && strcmp(currEntry.key, state->key) > 0) return true;
+      if (!_setCursorEntry(state, &currEntry)) return false;
+      state->hasDelta = true;
+      state->isDeltaRemove = isRemove;
+      return true;
+    }
+
+    // Finds the first index line after the cursor, and whether it comes before the delta record
+    static bool idxCursorFilter(const char* line, StreamableManager::DestinationStream* dest,
+          void* statePtr) {
+      IdxCursorCapture* state = static_cast<IdxCursorCapture*>(statePtr);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+      if (isEmpty(currEntry.key)) {
+#if (defined(DEBUG))
+        Serial.println(F("idxNext aborting - possible index corruption"));
+#endif
+        state->failed = true;
+        return false;
+      }
+      int8_t pos = _cursorPos(state->cursor, currEntry.key);
+      if (pos < 0) {
+        // Already returned - skip it
+        state->offset += strlen(line) + 1;
+        return true;
+      }
+      if (pos > 0) return false; // past the prefix, so there are no more
+      state->hasIndex = true;
+      state->indexCmp = state->hasDelta ? strcmp(currEntry.key, state->key) : -1;
+      if (state->indexCmp <= 0) {
+        // This line is next, or the delta record supersedes it. Either way it's used up.
+        state->offset += strlen(line) + 1;
+      }
+      if (state->indexCmp < 0) _setCursorEntry(state, &currEntry);
+      return false;
+    }
+
+    /*
+     * Looks at the first line only. Before the cursor has returned anything,
+     * its offset is the start of the fence block holding fromKey, so the line
+     * there can't sort after fromKey; afterwards, it's the line after the last
+     * one used up, so it must sort after fromKey.
+     */
+    static bool idxCursorCheckFilter(const char* line, StreamableManager::DestinationStream* dest,
+          void* statePtr) {
+      IdxCursorCheck* state = static_cast<IdxCursorCheck*>(statePtr);
+      char scratch[strlen(line) + 1];
+      IndexLineView currEntry = IndexHelpers::viewIndexLine(line, scratch, sizeof(scratch));
+      int cmp = _cursorCmp(state->cursor, currEntry.key);
+      state->isValid = !isEmpty(currEntry.key) && (state->cursor->isFromInclusive ? cmp <= 0 : cmp > 0);
+      return false;
+    }
 
-        // Populate the trieResult and bloom filter
-        uint8_t pLen = strlen(prefix);
-        uint8_t pos = pLen;
-        if (strlen(currEntry.key) > pLen) {
-          char c = currEntry.key[pos];
-          if (c >= 32 && c <= 122) { // Ensure it's an acceptable ASCII character
-            uint8_t index = c - 32;  // Map ASCII to 0-90
-            uint8_t wordIndex = index / 32; // Determine which 32-bit word to use
-            uint8_t bitIndex = index % 32; // Determine the bit within the word
-            if ((results->trieBloom[wordIndex] & (1UL << bitIndex)) == 0) { // Check if this char is new
-              results->trieBloom[wordIndex] |= (1UL << bitIndex);  // Mark this char as seen
-              // Add it to the trieResult
-              KeyValue* kv;
-              char cmpStr[pLen+2];
-              strncpy(cmpStr, prefix, pLen);
-              cmpStr[pLen] = c;
-              cmpStr[pLen+1] = '\0';
-              char key[2] = { c, '\0' };
-              if (strcmp(currEntry.key, cmpStr) == 0) {
-                kv = new KeyValue(key, currEntry.value);
-              } else {
-                kv = new KeyValue(key, "");
-              }
-              appendTrieResult(results, kv);
+    /*
+     * Where key is relative to a cursor: -1 if it's at or before the entry
+     * the cursor last returned, 1 if it sorts past the cursor's prefix, or 0
+     * if it could be the next entry
+     */
+    static int8_t _cursorPos(const IndexCursor* cursor, const char* key) {
+      int cmp = _cursorCmp(cursor, key);
+      if (cmp < 0 || (cmp == 0 && !cursor->isFromInclusive)) return -1;
+      if (!isEmpty(cursor->prefix) && !startsWith(key, cursor->prefix)) return 1;
+      return 0;
+    }
+
+    // key vs the cursor's fromKey. Keys starting with a truncated fromKey compare equal to it
+    static int _cursorCmp(const IndexCursor* cursor, const char* key) {
+      if (cursor->isFromTruncated) return strncmp(key, cursor->fromKey, IndexCursor::MAX_KEY_LENGTH);
+      return strcmp(key, cursor->fromKey);
+    }
+
+    // Copies an entry into the caller's buffers. Fails if the key doesn't fit.
+    static bool _setCursorEntry(IdxCursorCapture* state, IndexLineView* entry) {
+      if (strlen(entry->key) >= state->keySize) {
+        state->isTooLong = true;
+        return false;
+      }
+      strcpy(state->key, entry->key);
+      const char* value = entry->value ? entry->value : "";
+      strncpy(state->value, value, state->valueSize - 1);
+      state->value[state->valueSize - 1] = '\0';
+      state->isTruncated = strlen(value) >= state->valueSize;
+      return true;
+    }
+
+    static void _addSearchMatch(SearchResults* results, const char* key, const char* value) {
+      char* prefix = results->searchPrefix;
+      // Handle up to 10 matches, then switch to trie mode
+      if (results->matchCount < 10) {
+        KeyValue* match = new KeyValue(key, value);
+        appendMatchResult(results, match);
+        results->matchCount++;
+      } else {
+        results->trieMode = true;
+      }
+
+      // Populate the trieResult and bloom filter
+      uint8_t pLen = strlen(prefix);
+      uint8_t pos = pLen;
+      if (strlen(key) > pLen) {
+        char c = key[pos];
+        if (c >= 32 && c <= 122) { // Ensure it's an acceptable ASCII character
+          uint8_t index = c - 32;  // Map ASCII to 0-90
+          uint8_t wordIndex = index / 32; // Determine which 32-bit word to use
+          uint8_t bitIndex = index % 32; // Determine the bit within the word
+          if ((results->trieBloom[wordIndex] & (1UL << bitIndex)) == 0) { // Check if this char is new
+            results->trieBloom[wordIndex] |= (1UL << bitIndex);  // Mark this char as seen
+            // Add it to the trieResult
+            KeyValue* kv;
+            char cmpStr[pLen+2];
+            strncpy(cmpStr, prefix, pLen);
+            cmpStr[pLen] = c;
+            cmpStr[pLen+1] = '\0';
+            char trieKey[2] = { c, '\0' };
+            if (strcmp(key, cmpStr) == 0) {
+              kv = new KeyValue(trieKey, value);
+            } else {
+              kv = new KeyValue(trieKey, "");
             }
+            appendTrieResult(results, kv);
           }
         }
       }
-      return true;
     }
 
     static void _appendKeyValue(KeyValue* head, KeyValue* result) {
@@ -240,9 +625,20 @@ class IndexScanFilters {
     }
 
 
-    static bool _pipeFast(const char* line, StreamableManager::DestinationStream* dest) {
+    /*
+     * For filters that have nothing left to change. Stops the pipe so that
+     * _updateIndex(...) copies the rest of the index in blocks instead of
+     * line by line.
+     */
+    static bool _copyTail(bool* copyTail) {
+      *copyTail = true;
+      return false;
+    };
+
+    // Writes a line to the new index, keeping its fence up to date
+    static void _emit(IdxScanCapture* state, StreamableManager::DestinationStream* dest, const char* line) {
       dest->println(line);
-      return true;
+      if (state->fence) state->fence->addLine(line);
     };
 
     friend class IndexManager;
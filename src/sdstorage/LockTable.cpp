@@ -0,0 +1,135 @@
+#include "LockTable.h"
+
+LockTable::LockTable() {
+  for (uint8_t b = 0; b < BUCKET_COUNT; b++) _buckets[b] = NONE;
+  for (uint8_t i = 0; i < CAPACITY; i++) _slots[i].next = (i + 1 < CAPACITY) ? i + 1 : NONE;
+  _free = 0;
+}
+
+bool LockTable::lock(const char* path, const void* owner, uint32_t timeoutMs) {
+  uint32_t h = hash(path);
+  uint16_t check = _check(path);
+  Result result = _tryLock(h, check, owner);
+  if (result == BUSY) {
+    _stats.contended++;
+#if defined(DEBUG)
+    Serial.print(F("Lock contention on "));
+    Serial.println(path);
+#endif
+    uint32_t start = millis();
+    while (result == BUSY && (timeoutMs == WAIT_FOREVER || millis() - start < timeoutMs)) {
+      yield();
+      result = _tryLock(h, check, owner);
+    }
+    uint32_t waited = millis() - start;
+    if (waited > _stats.maxWaitMs) _stats.maxWaitMs = waited;
+    if (result == BUSY) _stats.timeouts++;
+  }
+  if (result == FULL) {
+    _stats.full++;
+#if defined(DEBUG)
+    Serial.print(F("Lock table full, can't lock "));
+    Serial.println(path);
+#endif
+  }
+  if (result == COLLISION) {
+    _stats.collisions++;
+#if defined(DEBUG)
+    Serial.print(F("Another locked path has the same hash, can't lock "));
+    Serial.println(path);
+#endif
+  }
+  return result == LOCKED;
+}
+
+LockTable::Result LockTable::tryLock(const char* path, const void* owner) {
+  Result result = _tryLock(hash(path), _check(path), owner);
+  if (result == BUSY) _stats.contended++;
+  if (result == FULL) _stats.full++;
+  if (result == COLLISION) _stats.collisions++;
+  return result;
+}
+
+LockTable::Result LockTable::_tryLock(uint32_t hash, uint16_t check, const void* owner) {
+  uint8_t i = _find(hash);
+  if (i != NONE && _slots[i].check != check) return COLLISION;
+  if (i != NONE) return (_slots[i].owner == owner) ? LOCKED : BUSY;
+  if (_free == NONE) return FULL;
+  i = _free;
+  _free = _slots[i].next;
+  uint8_t bucket = hash % BUCKET_COUNT;
+  _slots[i].hash = hash;
+  _slots[i].check = check;
+  _slots[i].owner = owner;
+  _slots[i].lockedAt = millis();
+  _slots[i].next = _buckets[bucket];
+  _buckets[bucket] = i;
+  _stats.acquired++;
+  if (++_stats.held > _stats.maxHeld) _stats.maxHeld = _stats.held;
+  return LOCKED;
+}
+
+void LockTable::unlock(const char* path, const void* owner, bool isPmem = false) {
+  uint32_t h = hash(path, isPmem);
+  uint8_t prev;
+  uint8_t i = _find(h, &prev);
+  if (i == NONE || _slots[i].owner != owner || _slots[i].check != _check(path, isPmem)) return;
+  if (prev == NONE) {
+    _buckets[h % BUCKET_COUNT] = _slots[i].next;
+  } else {
+    _slots[prev].next = _slots[i].next;
+  }
+  uint32_t heldFor = millis() - _slots[i].lockedAt;
+  _stats.totalHoldMs += heldFor;
+  if (heldFor > _stats.maxHoldMs) _stats.maxHoldMs = heldFor;
+  _stats.held--;
+  _slots[i].owner = nullptr;
+  _slots[i].next = _free;
+  _free = i;
+}
+
+bool LockTable::isLocked(const char* path, bool isPmem = false) {
+  uint8_t i = _find(hash(path, isPmem));
+  return i != NONE && _slots[i].check == _check(path, isPmem);
+}
+
+void LockTable::resetStats() {
+  uint8_t held = _stats.held;
+  _stats = Stats();
+  _stats.held = held;
+  _stats.maxHeld = held;
+}
+
+uint8_t LockTable::_find(uint32_t hash, uint8_t* prev = nullptr) {
+  uint8_t before = NONE;
+  uint8_t i = _buckets[hash % BUCKET_COUNT];
+  while (i != NONE && _slots[i].hash != hash) {
+    before = i;
+    i = _slots[i].next;
+  }
+  if (prev) *prev = before;
+  return i;
+}
+
+uint32_t LockTable::hash(const char* path, bool isPmem = false) {
+  uint32_t h = 2166136261UL;
+  if (!path) return h;
+  char c;
+  while ((c = isPmem ? pgm_read_byte(path) : *path) != '\0') {
+    h ^= static_cast<uint8_t>(c);
+    h *= 16777619UL;
+    path++;
+  }
+  return h;
+}
+
+uint16_t LockTable::_check(const char* path, bool isPmem = false) {
+  uint32_t h = 5381;
+  if (!path) return h;
+  char c;
+  while ((c = isPmem ? pgm_read_byte(path) : *path) != '\0') {
+    h = h * 33 + static_cast<uint8_t>(c);
+    path++;
+  }
+  return static_cast<uint16_t>((h >> 16) ^ h);
+}
@@ -0,0 +1,101 @@
+#ifndef _SDStorage_LockTable_h
+#define _SDStorage_LockTable_h
+
+
+#include <Arduino.h>
+
+/*
+ * The file locks held by transactions. It's a fixed-size table keyed by a
+ * 32-bit hash of each file's canonical path, so checking a lock doesn't
+ * allocate or compare strings. Hashes are chained in a few buckets, so
+ * paths landing in the same bucket don't collide. Each lock also keeps a
+ * second, independent 16-bit hash of its path, so two paths with the same
+ * full hash are told apart: locking the second one fails straight away with
+ * COLLISION instead of waiting for a lock that isn't really on it, which in
+ * a single-threaded sketch could be held by the waiting code's own caller
+ * and never be released. Only paths matching on both hashes share a lock.
+ *
+ * Locks live in RAM and are lost on reboot, so it's vital that
+ * SDStorage::fsck() cleans up any lingering transaction files.
+ */
+class LockTable {
+
+  public:
+    static const uint8_t CAPACITY = 16;            // files locked at once, across all txns
+    static const uint32_t WAIT_FOREVER = 0xFFFFFFFF;
+
+    enum Result : uint8_t {
+      LOCKED,     // the lock is now held by the owner (or already was)
+      BUSY,       // held by another owner
+      FULL,       // all CAPACITY locks are held
+      COLLISION   // another path with the same hash is locked
+    };
+
+    struct Stats {
+      uint8_t held = 0;             // locks held now
+      uint8_t maxHeld = 0;
+      uint32_t acquired = 0;
+      uint32_t contended = 0;       // lock attempts that found it held by another txn...
+      uint32_t timeouts = 0;        // ...and gave up waiting
+      uint32_t full = 0;            // lock attempts that failed because the table was full
+      uint32_t collisions = 0;      // lock attempts that failed because another path had the same hash
+      uint32_t maxWaitMs = 0;
+      uint32_t maxHoldMs = 0;       // of released locks
+      uint32_t totalHoldMs = 0;
+    };
+
+    LockTable();
+
+    // Disable moving and copying
+    LockTable(LockTable&& other) = delete;
+    LockTable& operator=(LockTable&& other) = delete;
+    LockTable(const LockTable&) = delete;
+    LockTable& operator=(const LockTable&) = delete;
+
+    /*
+     * Locks path to owner, waiting up to timeoutMs for another owner to
+     * release it (0 = don't wait). Returns false if it couldn't be locked,
+     * without waiting if the table is full or another path's hash collides.
+     */
+    bool lock(const char* path, const void* owner, uint32_t timeoutMs = WAIT_FOREVER);
+    Result tryLock(const char* path, const void* owner);
+
+    // Releases path if owner holds it
+    void unlock(const char* path, const void* owner, bool isPmem = false);
+    bool isLocked(const char* path, bool isPmem = false);
+
+    const Stats& stats() { return _stats; };
+    void resetStats();
+
+    // 32-bit FNV-1a
+    static uint32_t hash(const char* path, bool isPmem = false);
+
+  private:
+    static const uint8_t BUCKET_COUNT = 8;
+    static const uint8_t NONE = 0xFF;
+
+    struct Slot {
+      uint32_t hash = 0;
+      uint16_t check = 0;           // see _check(...)
+      const void* owner = nullptr;
+      uint32_t lockedAt = 0;        // millis()
+      uint8_t next = NONE;          // next slot in the bucket, or in the free list
+    };
+
+    Slot _slots[CAPACITY];
+    uint8_t _buckets[BUCKET_COUNT];
+    uint8_t _free = 0;              // first unused slot
+    Stats _stats;
+
+    Result _tryLock(uint32_t hash, uint16_t check, const void* owner);
+
+    // djb2, folded to 16 bits. Unrelated to hash(...), so paths are unlikely to collide on both
+    static uint16_t _check(const char* path, bool isPmem = false);
+
+    // Slot holding hash, or NONE. prev is set to the slot before it in its bucket
+    uint8_t _find(uint32_t hash, uint8_t* prev = nullptr);
+
+};
+
+
+#endif
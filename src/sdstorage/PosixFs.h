@@ -0,0 +1,250 @@
+#ifndef _SDStorage_PosixFs_h
+#define _SDStorage_PosixFs_h
+
+
+#include <Arduino.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The part of SdFat's API that SDStorage uses, over a directory on a POSIX
+ * host, so the library's real code paths (fsck included) can be run and
+ * benchmarked natively. Build with -DSDSTORAGE_POSIX to use it in place of
+ * SdFat. Paths like "/ROOT/file.dat" are looked up under
+ * SDSTORAGE_POSIX_DIR ("." unless defined).
+ *
+ * It keeps FAT's rules where they differ from POSIX's: rename() won't
+ * replace an existing file, and remove() won't remove a directory. The
+ * POSIX rename() that does replace one is there as replace(). FILE_WRITE
+ * starts at the end of the file like SdFat's O_AT_END, rather than
+ * appending every write with O_APPEND, so a seek before writing works.
+ * Point SDSTORAGE_POSIX_DIR at a tmpfs (e.g. /dev/shm/...) to run from RAM.
+ */
+
+#ifndef SDSTORAGE_POSIX_DIR
+  #define SDSTORAGE_POSIX_DIR "."
+#endif
+#ifndef FILE_READ
+  #define FILE_READ O_RDONLY
+#endif
+#ifndef O_AT_END
+  #define O_AT_END 0x40000000     // not passed on to open(), the file is just positioned at its end
+#endif
+#ifndef FILE_WRITE
+  #define FILE_WRITE (O_RDWR | O_CREAT | O_AT_END)
+#endif
+
+typedef int oflag_t;
+
+/*
+ * An open file or directory. Like SdFat's File it's a handle that can be
+ * copied, and must be closed exactly once. Also like SdFat, each handle
+ * keeps track of the file's size itself, so size() and available() don't
+ * go to the OS, and don't see changes made through another handle.
+ */
+class PosixFile: public Stream {
+
+  public:
+    PosixFile() {};
+
+    operator bool() const { return _file || _dir; };
+    bool isOpen() const { return _file || _dir; };
+    bool isDirectory() const { return _dir != nullptr; };
+
+    int available() override {
+      if (!_file) return 0;
+      long pos = ftell(_file);
+      return (pos >= 0 && pos < static_cast<long>(_size)) ? _size - pos : 0;
+    };
+    int peek() override {
+      if (!_file) return -1;
+      int c = getc(_file);
+      if (c != EOF) ungetc(c, _file);
+      return c == EOF ? -1 : c;
+    };
+    int read() override {
+      if (!_file) return -1;
+      int c = getc(_file);
+      return c == EOF ? -1 : c;
+    };
+    int read(void* buffer, size_t len) {
+      if (!_file) return -1;
+      return fread(buffer, 1, len, _file);
+    };
+    size_t write(uint8_t c) override { return write(&c, 1); };
+    size_t write(const uint8_t* buffer, size_t len) override {
+      if (!_file || _isReadOnly) return 0;
+      size_t written = fwrite(buffer, 1, len, _file);
+      long pos = ftell(_file);
+      if (pos > static_cast<long>(_size)) _size = pos;
+      return written;
+    };
+    using Print::write;
+
+    uint32_t position() { return _file ? ftell(_file) : 0; };
+    bool seek(uint32_t pos) { return _file && fseek(_file, pos, SEEK_SET) == 0; };
+    bool seekSet(uint32_t pos) { return seek(pos); };
+    bool seekEnd(int32_t offset = 0) { return _file && fseek(_file, offset, SEEK_END) == 0; };
+    uint32_t size() { return _file ? _size : 0; };
+    uint64_t fileSize() { return size(); };
+    bool truncate(uint32_t length) {
+      if (!_file || _isReadOnly || fflush(_file) != 0 || ftruncate(fileno(_file), length) != 0) return false;
+      _size = length;
+      return seek(length);
+    };
+    bool sync() { return _file && fflush(_file) == 0 && fsync(fileno(_file)) == 0; };
+    bool close() {
+      bool success = true;
+      if (_file) success = fclose(_file) == 0;
+      if (_dir) success = closedir(_dir) == 0;
+      _file = nullptr;
+      _dir = nullptr;
+      return success;
+    };
+
+    // The next entry of a directory, skipping "." and ".."
+    PosixFile openNextFile(oflag_t flags = O_RDONLY) {
+      PosixFile next;
+      if (!_dir) return next;
+      struct dirent* entry;
+      while ((entry = readdir(_dir)) != nullptr) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[sizeof(_path)];
+        if (snprintf(path, sizeof(path), "%s/%s", _path, entry->d_name) >= static_cast<int>(sizeof(path))) continue;
+        next._open(path, flags);
+        if (next) break;
+      }
+      return next;
+    };
+    void rewindDirectory() { if (_dir) rewinddir(_dir); };
+
+    size_t getName(char* name, size_t size) {
+      const char* slash = strrchr(_path, '/');
+      const char* shortName = slash ? slash + 1 : _path;
+      if (size == 0 || strlen(shortName) >= size) return 0;
+      strcpy(name, shortName);
+      return strlen(name);
+    };
+
+  private:
+    FILE* _file = nullptr;
+    DIR* _dir = nullptr;
+    bool _isReadOnly = false;
+    uint32_t _size = 0;
+    char _path[256] = "";
+
+    // hostPath is the full host path
+    bool _open(const char* hostPath, oflag_t flags) {
+      if (strlen(hostPath) >= sizeof(_path)) return false;
+      strcpy(_path, hostPath);
+      struct stat st;
+      if (stat(hostPath, &st) == 0 && S_ISDIR(st.st_mode)) {
+        _dir = opendir(hostPath);
+        return _dir != nullptr;
+      }
+      bool isAtEnd = flags & O_AT_END;
+      int fd = ::open(hostPath, flags & ~O_AT_END, 0644);
+      if (fd < 0) return false;
+      if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+      }
+      _size = st.st_size;
+      _isReadOnly = (flags & O_ACCMODE) == O_RDONLY;
+      _file = fdopen(fd, _isReadOnly ? "r" : ((flags & O_ACCMODE) == O_WRONLY ? "w" : "r+"));
+      if (!_file) {
+        ::close(fd);
+        return false;
+      }
+      if (isAtEnd && fseek(_file, 0, SEEK_END) != 0) {
+        close();
+        return false;
+      }
+      return true;
+    };
+
+    friend class PosixFs;
+
+};
+
+typedef PosixFile File;
+
+class PosixFs {
+
+  public:
+    PosixFs() {};
+
+    // Disable moving and copying
+    PosixFs(PosixFs&& other) = delete;
+    PosixFs& operator=(PosixFs&& other) = delete;
+    PosixFs(const PosixFs&) = delete;
+    PosixFs& operator=(const PosixFs&) = delete;
+
+    bool begin(uint8_t sdCsPin) {
+      struct stat st;
+      return stat(SDSTORAGE_POSIX_DIR, &st) == 0 && S_ISDIR(st.st_mode);
+    };
+    void end() {};
+
+    bool exists(const char* path) {
+      char hostPath[256];
+      struct stat st;
+      return _hostPath(path, hostPath, sizeof(hostPath)) && stat(hostPath, &st) == 0;
+    };
+    bool mkdir(const char* path) {
+      char hostPath[256];
+      return _hostPath(path, hostPath, sizeof(hostPath)) && ::mkdir(hostPath, 0755) == 0;
+    };
+    bool remove(const char* path) {
+      char hostPath[256];
+      return _hostPath(path, hostPath, sizeof(hostPath)) && unlink(hostPath) == 0;
+    };
+    bool rmdir(const char* path) {
+      char hostPath[256];
+      return _hostPath(path, hostPath, sizeof(hostPath)) && ::rmdir(hostPath) == 0;
+    };
+    bool rename(const char* oldPath, const char* newPath) {
+      char oldHostPath[256];
+      char newHostPath[256];
+      if (!_hostPath(oldPath, oldHostPath, sizeof(oldHostPath)) || !_hostPath(newPath, newHostPath, sizeof(newHostPath))) return false;
+      struct stat st;
+      if (stat(newHostPath, &st) == 0) return false;
+      return ::rename(oldHostPath, newHostPath) == 0;
+    };
+    // Unlike rename(), atomically replaces newPath if it exists. FAT can't do this
+    bool replace(const char* oldPath, const char* newPath) {
+      char oldHostPath[256];
+      char newHostPath[256];
+      if (!_hostPath(oldPath, oldHostPath, sizeof(oldHostPath)) || !_hostPath(newPath, newHostPath, sizeof(newHostPath))) return false;
+      struct stat st;
+      if (stat(newHostPath, &st) == 0 && S_ISDIR(st.st_mode)) return false;
+      return ::rename(oldHostPath, newHostPath) == 0;
+    };
+    PosixFile open(const char* path, oflag_t flags = O_RDONLY) {
+      PosixFile file;
+      char hostPath[256];
+      if (_hostPath(path, hostPath, sizeof(hostPath))) file._open(hostPath, flags);
+      return file;
+    };
+
+    // Flash strings are ordinary strings on a host
+    bool exists(const __FlashStringHelper* path) { return exists(reinterpret_cast<const char*>(path)); };
+    bool remove(const __FlashStringHelper* path) { return remove(reinterpret_cast<const char*>(path)); };
+    PosixFile open(const __FlashStringHelper* path, oflag_t flags = O_RDONLY) {
+      return open(reinterpret_cast<const char*>(path), flags);
+    };
+
+  private:
+    bool _hostPath(const char* path, char* hostPath, size_t size) {
+      if (!path) return false;
+      int len = snprintf(hostPath, size, "%s%s%s", SDSTORAGE_POSIX_DIR, (path[0] == '/') ? "" : "/", path);
+      return len > 0 && static_cast<size_t>(len) < size;
+    };
+
+};
+
+
+#endif
@@ -0,0 +1,59 @@
+#include "SectorWriter.h"
+
+SectorWriter::SectorWriter(Stream* dest, uint32_t offset, SharedBuffer* buffer, Stats* stats = nullptr, 
+      bool isTakingBuffer = false): _dest(dest), _pos(offset), _buffer(buffer), _stats(stats) {
+  if (!buffer || (buffer->owner && !isTakingBuffer)) return;
+  if (buffer->owner) buffer->owner->flush();
+  buffer->owner = this;
+}
+
+SectorWriter::~SectorWriter() {
+  if (_isBuffered()) _buffer->owner = nullptr;
+}
+
+size_t SectorWriter::write(const uint8_t* buffer, size_t len) {
+  if (_hasFailed) return 0;
+  if (!_isBuffered()) {
+    _put(buffer, len);
+    return _hasFailed ? 0 : len;
+  }
+  size_t done = 0;
+  while (done < len && !_hasFailed) {
+    if (_fill == 0 && _pos % SECTOR_SIZE == 0 && len - done >= SECTOR_SIZE) {
+      // Whole sectors don't need copying
+      size_t whole = (len - done) / SECTOR_SIZE * SECTOR_SIZE;
+      _put(buffer + done, whole);
+      done += whole;
+      continue;
+    }
+    // Fill up to the end of the current sector
+    size_t room = SECTOR_SIZE - (_pos + _fill) % SECTOR_SIZE;
+    size_t n = (len - done < room) ? len - done : room;
+    memcpy(_buffer->data + _fill, buffer + done, n);
+    _fill += n;
+    done += n;
+    if ((_pos + _fill) % SECTOR_SIZE == 0) flush();
+  }
+  return _hasFailed ? 0 : len;
+}
+
+void SectorWriter::flush() {
+  if (_fill == 0) return;
+  _put(_buffer->data, _fill);
+  _fill = 0;
+}
+
+void SectorWriter::_put(const uint8_t* buffer, size_t len) {
+  if (len == 0 || !_dest) return;
+  size_t written = _dest->write(buffer, len);
+  count(_stats, _pos, written);
+  _pos += written;
+  if (written != len) _hasFailed = true;
+}
+
+void SectorWriter::count(Stats* stats, uint32_t pos, size_t len) {
+  if (!stats || len == 0) return;
+  stats->sectorWrites += (pos + len - 1) / SECTOR_SIZE - pos / SECTOR_SIZE + 1;
+  stats->writeCalls++;
+  stats->bytesWritten += len;
+}
@@ -0,0 +1,91 @@
+#ifndef _SDStorage_SectorWriter_h
+#define _SDStorage_SectorWriter_h
+
+
+#include <Arduino.h>
+
+/*
+ * Collects small writes (a DTO's lines, an index line, a journal record)
+ * into SECTOR_SIZE blocks lined up with the file's sectors, so the card
+ * gets one write per sector instead of one per print(...). A run of whole
+ * sectors written at a sector boundary goes straight through.
+ *
+ * Nothing reaches dest until a sector fills up, so flush() must be called
+ * before dest is closed. With buffering off, every write goes straight
+ * through, which is useful for measuring the difference.
+ *
+ * A write to dest that comes up short is remembered: write(...) returns 0
+ * from then on, and hasFailed() is true, so a caller can check once after
+ * flush() instead of after every print(...).
+ */
+class SectorWriter: public Stream {
+
+  public:
+    static const uint16_t SECTOR_SIZE = 512;
+
+    struct Stats {
+      uint32_t sectorWrites = 0;    // sectors written to (whole or part)
+      uint32_t writeCalls = 0;      // writes passed on to files
+      uint32_t bytesWritten = 0;
+    };
+
+    /*
+     * One sector's buffer, shared by the writers given it, since there's
+     * rarely more than one big write going at a time. A writer gets it when
+     * it's made if no other writer has it, or if it takes it (flushing the
+     * writer that had it), and keeps it until it's deleted. Until then the
+     * others write straight through.
+     */
+    struct SharedBuffer {
+      uint8_t data[SECTOR_SIZE];
+      SectorWriter* owner = nullptr;
+    };
+
+    /*
+     * offset is where in its file dest is writing, so blocks can be lined up
+     * with its sectors. Without a buffer (nullptr), every write goes straight
+     * through. stats (if not null) is updated on every write to dest
+     */
+    SectorWriter(Stream* dest, uint32_t offset, SharedBuffer* buffer, Stats* stats = nullptr, 
+          bool isTakingBuffer = false);
+    ~SectorWriter();
+
+    // Disable moving and copying
+    SectorWriter(SectorWriter&& other) = delete;
+    SectorWriter& operator=(SectorWriter&& other) = delete;
+    SectorWriter(const SectorWriter&) = delete;
+    SectorWriter& operator=(const SectorWriter&) = delete;
+
+    size_t write(uint8_t c) override { return write(&c, 1); };
+    size_t write(const uint8_t* buffer, size_t len) override;
+    using Print::write;
+    int available() override { return 0; };
+    int peek() override { return -1; };
+    int read() override { return -1; };
+
+    // Writes out whatever's buffered
+    void flush() override;
+
+    // True once a write to dest has come up short
+    bool hasFailed() const { return _hasFailed; };
+
+    Stream* getDest() { return _dest; };
+
+    // Adds a write of len bytes at pos in a file to stats, for writes made without a SectorWriter
+    static void count(Stats* stats, uint32_t pos, size_t len);
+
+  private:
+    Stream* _dest;
+    uint32_t _pos;              // file offset of the buffer's first byte
+    SharedBuffer* _buffer;
+    Stats* _stats;
+    uint16_t _fill = 0;
+    bool _hasFailed = false;
+
+    bool _isBuffered() const { return _buffer && _buffer->owner == this; };
+    void _put(const uint8_t* buffer, size_t len);
+
+};
+
+
+#endif
@@ -3,175 +3,543 @@
 /******
  * 
  * The following wrapper methods allow sending a state object to a 
- * mock version of SdFat when testing on a simulator. These all expect
- * the absolute filename as returned by realFilename(...)
+ * mock version of SdFat when testing on a simulator, through _fs(...).
+ * These all expect the absolute filename as returned by realFilename(...)
  * 
  ******/
 
 bool StorageProvider::_exists(const char* filename, void* testState = nullptr) {
-#if defined(__SDSTORAGE_TEST)
-  return _sd.exists(filename, testState);
-#else
-  return _sd.exists(filename);
-#endif
+  EntryCache::Entry cached = _entries.get(filename);
+  if (cached != EntryCache::UNKNOWN) return cached != EntryCache::MISSING;
+  bool exists = _fs(testState).exists(filename);
+  _entries.put(filename, exists ? EntryCache::EXISTS : EntryCache::MISSING);
+  return exists;
 }
 
 bool StorageProvider::_mkdir(const char* filename, void* testState = nullptr) {
-#if defined(__SDSTORAGE_TEST)
-  return _sd.mkdir(filename, testState);
-#else
-  return _sd.mkdir(filename);
-#endif
+  bool success = _fs(testState).mkdir(filename);
+  _entries.put(filename, success ? EntryCache::IS_DIR : EntryCache::UNKNOWN);
+  return success;
 }
 
 bool StorageProvider::_writeTxnToStream(const char* filename, Transaction* txn, void* testState = nullptr) {
-  Stream* dest = nullptr;
-#if defined(__SDSTORAGE_TEST)
-  dest = _sd.writeTxnFileStream(filename, testState);
-  if (!dest) return false;
-#else
-  File file = _sd.open(filename, FILE_WRITE);
+  File file = _fs(testState, USE_TXN).open(filename, O_RDWR | O_CREAT | O_TRUNC);
   if (!file) return false;
-  dest = &file;
-#endif
-  _streams.send(dest, txn);
-#if (!defined(__SDSTORAGE_TEST))
-  file.close();
-#endif
-  return true;
+  _entries.put(filename, EntryCache::IS_FILE);
+  SectorWriter writer(&file, 0, _sectorBuffer(), &_writeStats);
+  _streams.send(&writer, txn);
+  return _endWrite(&writer, &file);
+}
+
+// Adds one key=value record to the end of a transaction file
+bool StorageProvider::_appendTxnRecord(const char* filename, const char* key, const char* value, bool isValuePmem = false, 
+      void* testState = nullptr) {
+  File file = _fs(testState, USE_TXN).open(filename, FILE_WRITE);
+  if (!file) return false;
+  _entries.put(filename, EntryCache::IS_FILE);
+  SectorWriter writer(&file, file.size(), _sectorBuffer(), &_writeStats);
+  writer.print(key);
+  writer.write('=');
+  if (isValuePmem) {
+    writer.print(reinterpret_cast<const __FlashStringHelper*>(value));
+  } else {
+    writer.print(value);
+  }
+  writer.write('\n');
+  return _endWrite(&writer, &file);
 }
 
 bool StorageProvider::_isDir(const char* filename, void* testState = nullptr) {
-  bool isDir = false;
-#if defined(__SDSTORAGE_TEST)
-  isDir = _sd.isDirectory(filename, testState);
-#else
-  File file = _sd.open(filename);
-  isDir = file.isDirectory();
+  EntryCache::Entry cached = _entries.get(filename);
+  if (cached == EntryCache::IS_DIR) return true;
+  if (cached == EntryCache::IS_FILE || cached == EntryCache::MISSING) return false;
+  File file = _fs(testState, USE_IS_DIR).open(filename);
+  bool isDir = file.isDirectory();
   file.close();
-#endif
+  // A path that isn't a directory might not exist at all
+  if (isDir) {
+    _entries.put(filename, EntryCache::IS_DIR);
+  } else if (cached == EntryCache::EXISTS) {
+    _entries.put(filename, EntryCache::IS_FILE);
+  }
   return isDir;
 }
 
+// Not cached: one look at the directory's first entry is enough
+bool StorageProvider::_isEmptyDir(const char* filename, void* testState = nullptr) {
+  DirList list;
+  if (!_openDir(&list, filename, testState)) return false;
+  char name[13];
+  bool isEmpty = !_nextEntry(&list, name, sizeof(name), testState);
+  _closeDir(&list, testState);
+  return isEmpty;
+}
+
+bool StorageProvider::_openDir(DirList* list, const char* path, void* testState = nullptr) {
+  File* dir = new File();
+  *dir = _fs(testState, USE_DIR).open(path);
+  if (!*dir || !dir->isDirectory()) {
+    dir->close();
+    delete dir;
+    return false;
+  }
+  list->dir = dir;
+  return true;
+}
+
+bool StorageProvider::_nextEntry(DirList* list, char* name, size_t len, void* testState = nullptr) {
+  File file = list->dir->openNextFile();
+  if (!file) return false;
+  file.getName(name, len);
+  file.close();
+  return true;
+}
+
+void StorageProvider::_closeDir(DirList* list, void* testState = nullptr) {
+  if (list->dir) {
+    list->dir->close();
+    delete list->dir;
+  }
+  list->dir = nullptr;
+}
+
 bool StorageProvider::_remove(const char* filename, void* testState = nullptr) {
-#if defined(__SDSTORAGE_TEST)
-  return _sd.remove(filename, testState);
-#else
-  return _sd.remove(filename);
-#endif
+  bool success = _fs(testState).remove(filename);
+  _entries.put(filename, success ? EntryCache::MISSING : EntryCache::UNKNOWN);
+  return success;
 }
 
 bool StorageProvider::_rename(const char* oldFilename, const char* newFilename, void* testState = nullptr) {
-#if defined(__SDSTORAGE_TEST)
-  return _sd.rename(oldFilename, newFilename, testState);
+  bool success = _fs(testState).rename(oldFilename, newFilename);
+  _entries.put(oldFilename, success ? EntryCache::MISSING : EntryCache::UNKNOWN);
+  _entries.put(newFilename, success ? EntryCache::EXISTS : EntryCache::UNKNOWN);
+  return success;
+}
+
+bool StorageProvider::_replace(const char* tmpFilename, const char* filename, void* testState = nullptr) {
+  bool success = false;
+#if defined(_SDSTORAGE_FS_HAS_REPLACE)
+  success = _fs(testState).replace(tmpFilename, filename);
 #else
-  return _sd.rename(oldFilename, newFilename);
+  // Removing filename only fails if it's already gone, and then the rename is all that's left to do
+  if (_exists(tmpFilename, testState)) {
+    _fs(testState).remove(filename);
+    success = _fs(testState).rename(tmpFilename, filename);
+  }
 #endif
+  _entries.put(tmpFilename, success ? EntryCache::MISSING : EntryCache::UNKNOWN);
+  _entries.put(filename, success ? EntryCache::IS_FILE : EntryCache::UNKNOWN);
+  return success;
 }
 
 bool StorageProvider::_loadFromStream(const char* filename, StreamableDTO* dto, void* testState = nullptr) {
-  Stream* src = nullptr;
-#if defined(__SDSTORAGE_TEST)
-  src = _sd.loadFileStream(filename, testState);
-#else
-  File file = _sd.open(filename, FILE_READ);
-  src = &file;
-#endif
-  bool result = _streams.load(src, dto);  
-#if defined(__SDSTORAGE_TEST)
-  StringStream* ss = static_cast<StringStream*>(src);
-  delete ss;
-#else
+  File file = _fs(testState, USE_DTO).open(filename, FILE_READ);
+  bool result = _streams.load(&file, dto);  
   file.close();
-#endif
   return result;
 }
 
 bool StorageProvider::_writeToStream(const char* filename, StreamableDTO* dto, void* testState = nullptr) {
-  Stream* dest = nullptr;
-#if defined(__SDSTORAGE_TEST)
-  dest = _sd.writeFileStream(filename, testState);
-  if (!dest) return false;
-#else
-  File file = _sd.open(filename, FILE_WRITE);
+  File file = _fs(testState, USE_DTO).open(filename, O_RDWR | O_CREAT | O_TRUNC);
   if (!file) return false;  
-  dest = &file;
-#endif
-  _streams.send(dest, dto);  
-#if (!defined(__SDSTORAGE_TEST))
-  file.close();
-#endif
-  return true;
+  _entries.put(filename, EntryCache::IS_FILE);
+  SectorWriter writer(&file, 0, _sectorBuffer(), &_writeStats);
+  _streams.send(&writer, dto);
+  return _endWrite(&writer, &file);
 }
 
 bool StorageProvider::_writeIndexLine(const char* indexFilename, const char* line, void* testState = nullptr) {
-  Stream* dest = nullptr;
-#if defined(__SDSTORAGE_TEST)
-  dest = _sd.writeIndexFileStream(indexFilename, testState);
-  if (!dest) return false;
-#else
-  File file = _sd.open(indexFilename, FILE_WRITE);
+  File file = _fs(testState, USE_INDEX).open(indexFilename, FILE_WRITE);
   if (!file) return false;
-  dest = &file;
-#endif
-  for (size_t i = 0; i < strlen(line); i++) {
-    dest->write(line[i]);
-  }
-  dest->write('\n');
-#if (!defined(__SDSTORAGE_TEST))
-  file.close();
-#endif
-  return true;
+  _entries.put(indexFilename, EntryCache::IS_FILE);
+  SectorWriter writer(&file, file.size(), _sectorBuffer(), &_writeStats);
+  writer.write(line, strlen(line));
+  writer.write('\n');
+  return _endWrite(&writer, &file);
 }
 
 bool StorageProvider::_updateIndex(
       const char* indexFilename, const char* tmpFilename, 
       StreamableManager::FilterFunction filter, void* statePtr, void* testState = nullptr) {
-  Stream* src = nullptr;
-  Stream* dest = nullptr;
-#if defined(__SDSTORAGE_TEST)
-  src = _sd.readIndexFileStream(indexFilename, testState);
-  dest = _sd.writeIndexFileStream(tmpFilename, testState);
-#else
-  File srcFile = _sd.open(indexFilename, FILE_READ);
-  if (!srcFile) return false;
-  File destFile = _sd.open(tmpFilename, FILE_WRITE);
-  if (!destFile) {
-    srcFile.close();
+  return _updateIndex(indexFilename, tmpFilename, filter, statePtr, nullptr, nullptr, testState);
+}
+
+bool StorageProvider::_updateIndex(
+      const char* indexFilename, const char* tmpFilename, 
+      StreamableManager::FilterFunction filter, void* statePtr, bool* copyTail, 
+      FenceIndex::Writer* fence, void* testState = nullptr) {
+  IndexRewrite rewrite;
+  if (!_beginRewrite(&rewrite, indexFilename, tmpFilename, filter, statePtr, copyTail, fence, testState)) return false;
+  while (!rewrite.isDone) _rewriteStep(&rewrite, 0, testState);
+  return _endRewrite(&rewrite, testState);
+}
+
+// BlockReader::ReadFunction for a File
+int StorageProvider::_readFile(uint8_t* buffer, size_t len, void* ctx) {
+  return static_cast<File*>(ctx)->read(buffer, len);
+}
+
+/*
+ * Reads up to limit bytes of src, then to the end of that line, and no
+ * further, so pipe(...) only handles whole lines
+ */
+class LineLimitStream: public Stream {
+  public:
+    LineLimitStream(Stream* src, uint32_t limit): _src(src), _limit(limit) {};
+    int available() override { return isAtLimit() ? 0 : _src->available(); };
+    int peek() override { return isAtLimit() ? -1 : _src->peek(); };
+    int read() override {
+      if (isAtLimit()) return -1;
+      int c = _src->read();
+      if (c != -1) {
+        _read++;
+        _last = c;
+      }
+      return c;
+    };
+    size_t write(uint8_t) override { return 0; };
+    bool isAtLimit() { return _read >= _limit && _last == '\n'; };
+  private:
+    Stream* _src;
+    uint32_t _limit;
+    uint32_t _read = 0;
+    int _last = -1;
+};
+
+bool StorageProvider::_beginRewrite(IndexRewrite* rewrite, const char* indexFilename, const char* tmpFilename, 
+      StreamableManager::FilterFunction filter, void* statePtr, bool* copyTail, 
+      FenceIndex::Writer* fence, void* testState = nullptr) {
+  File* srcFile = new File();
+  *srcFile = _fs(testState, USE_INDEX).open(indexFilename, FILE_READ);
+  if (!*srcFile) {
+    delete srcFile;
     return false;
   }
-  src = &srcFile;
-  dest = &destFile;
-#endif
-  _streams.pipe(src, dest, filter, false, statePtr);
-#if defined(__SDSTORAGE_TEST)
-  StringStream* ss = static_cast<StringStream*>(src);
-  delete ss;
-#else
-  srcFile.close();
-  destFile.close();
-#endif
+  File* destFile = new File();
+  *destFile = _fs(testState, USE_INDEX_REWRITE).open(tmpFilename, O_RDWR | O_CREAT | O_TRUNC);
+  if (!*destFile) {
+    srcFile->close();
+    delete srcFile;
+    delete destFile;
+    return false;
+  }
+  rewrite->src = srcFile;
+  rewrite->dest = _newWriter(destFile, 0, true);
+  rewrite->reader = new BlockReader(_readFile, srcFile);
+  if (!rewrite->dest || !rewrite->reader) {
+    _endRewrite(rewrite, testState);
+    return false;
+  }
+  _entries.put(tmpFilename, EntryCache::IS_FILE);
+  rewrite->filter = filter;
+  rewrite->statePtr = statePtr;
+  rewrite->copyTail = copyTail;
+  rewrite->fence = fence;
+  rewrite->isCopyingTail = false;
+  rewrite->isDone = false;
   return true;
 }
 
+void StorageProvider::_rewriteStep(IndexRewrite* rewrite, uint32_t maxBytes, void* testState = nullptr) {
+  if (rewrite->isDone) return;
+  if (!rewrite->isCopyingTail) {
+    bool isAtLimit = false;
+    if (maxBytes == 0) {
+      _streams.pipe(rewrite->reader, rewrite->dest, rewrite->filter, false, rewrite->statePtr);
+    } else {
+      LineLimitStream limited(rewrite->reader, maxBytes);
+      _streams.pipe(&limited, rewrite->dest, rewrite->filter, false, rewrite->statePtr);
+      isAtLimit = limited.isAtLimit();
+    }
+    if (rewrite->copyTail && *rewrite->copyTail) {
+      rewrite->isCopyingTail = true;
+    } else if (!isAtLimit || rewrite->reader->available() <= 0) {
+      // Stopped by the filter, or the whole index has been through it
+      rewrite->isDone = true;
+    }
+    return;
+  }
+
+  // pipe(...) stops right after the line the filter stopped on
+  uint32_t copied = 0;
+  while (maxBytes == 0 || copied < maxBytes) {
+    size_t len;
+    const uint8_t* block = rewrite->reader->nextBlock(&len);
+    if (!block) {
+      rewrite->isDone = true;
+      break;
+    }
+    rewrite->dest->write(block, len);
+    if (rewrite->fence) rewrite->fence->addBytes(block, len);
+    copied += len;
+  }
+}
+
+bool StorageProvider::_endRewrite(IndexRewrite* rewrite, void* testState = nullptr) {
+  if (rewrite->reader) delete rewrite->reader;
+  rewrite->reader = nullptr;
+  File* srcFile = static_cast<File*>(rewrite->src);
+  if (srcFile) {
+    srcFile->close();
+    delete srcFile;
+  }
+  bool success = _closeStream(rewrite->dest, testState);
+  rewrite->src = nullptr;
+  rewrite->dest = nullptr;
+  return success;
+}
+
 bool StorageProvider::_scanIndex(const char* indexFilename, StreamableManager::FilterFunction filter, void* statePtr, 
       void* testState = nullptr) {
-  Stream* src = nullptr;
-#if defined(__SDSTORAGE_TEST)
-  src = _sd.readIndexFileStream(indexFilename, testState);
-#else
-  File srcFile = _sd.open(indexFilename, FILE_READ);
+  return _scanIndexFrom(indexFilename, 0, filter, statePtr, testState);
+}
+
+/*
+ * Scans go through a BlockReader rather than pipe(...), so the filter gets
+ * each line straight out of the block. There's no destination, so dest is
+ * always null.
+ */
+bool StorageProvider::_scanIndexFrom(const char* indexFilename, uint32_t offset, 
+      StreamableManager::FilterFunction filter, void* statePtr, void* testState = nullptr) {
+  File srcFile = _fs(testState, USE_INDEX).open(indexFilename, FILE_READ);
   if (!srcFile) return false;
-  src = &srcFile;
-#endif
-  _streams.pipe(src, nullptr, filter, false, statePtr);
-#if defined(__SDSTORAGE_TEST)
-  StringStream* ss = static_cast<StringStream*>(src);
-  delete ss;
-#else
+  if (offset > 0 && !srcFile.seek(offset)) {
+    srcFile.close();
+    return false;
+  }
+  BlockReader reader(_readFile, &srcFile);
+  _scanLines(&reader, 0, filter, statePtr);
   srcFile.close();
-#endif
   return true;
 }
 
+bool StorageProvider::_beginScan(IndexScan* scan, const char* indexFilename, uint32_t offset, 
+      StreamableManager::FilterFunction filter, void* statePtr, void* testState = nullptr) {
+  File* srcFile = new File();
+  *srcFile = _fs(testState, USE_INDEX).open(indexFilename, FILE_READ);
+  if (!*srcFile || (offset > 0 && !srcFile->seek(offset))) {
+    srcFile->close();
+    delete srcFile;
+    return false;
+  }
+  scan->src = srcFile;
+  scan->reader = new BlockReader(_readFile, srcFile);
+  if (!scan->reader) {
+    _endScan(scan, testState);
+    return false;
+  }
+  scan->filter = filter;
+  scan->statePtr = statePtr;
+  scan->isDone = false;
+  return true;
+}
+
+void StorageProvider::_scanStep(IndexScan* scan, uint32_t maxBytes, void* testState = nullptr) {
+  if (scan->isDone) return;
+  scan->isDone = _scanLines(scan->reader, maxBytes, scan->filter, scan->statePtr);
+}
+
+void StorageProvider::_endScan(IndexScan* scan, void* testState = nullptr) {
+  if (scan->reader) delete scan->reader;
+  scan->reader = nullptr;
+  File* srcFile = static_cast<File*>(scan->src);
+  if (srcFile) {
+    srcFile->close();
+    delete srcFile;
+  }
+  scan->src = nullptr;
+}
+
+// True once the filter stops or the reader is used up, false if maxBytes (0 = no limit) ran out first
+bool StorageProvider::_scanLines(BlockReader* reader, uint32_t maxBytes, StreamableManager::FilterFunction filter, 
+      void* statePtr) {
+  size_t maxLen = getBufferSize();
+  uint32_t scanned = 0;
+  char* line;
+  while (maxBytes == 0 || scanned < maxBytes) {
+    if ((line = reader->nextLine(maxLen)) == nullptr || !filter(line, nullptr, statePtr)) return true;
+    if (maxBytes > 0) scanned += strlen(line) + 1;
+  }
+  return false;
+}
+
+uint32_t StorageProvider::_fileSize(const char* filename, void* testState = nullptr) {
+  File file = _fs(testState, USE_SIZE).open(filename, FILE_READ);
+  if (!file) return 0;
+  uint32_t size = file.size();
+  file.close();
+  return size;
+}
+
+int StorageProvider::_byteAt(const char* filename, uint32_t offset, void* testState = nullptr) {
+  File file = _fs(testState, USE_INDEX).open(filename, FILE_READ);
+  if (!file) return -1;
+  int c = file.seek(offset) ? file.read() : -1;
+  file.close();
+  return c;
+}
 
+Stream* StorageProvider::_openWriteStream(const char* filename, void* testState = nullptr) {
+  if (!filename) return nullptr;
+  Stream* stream = nullptr;
+  File* file = new File();
+  *file = _fs(testState, USE_AUX).open(filename, O_RDWR | O_CREAT | O_TRUNC);
+  if (*file) {
+    stream = _newWriter(file, 0);
+  } else {
+    delete file;
+  }
+  _entries.put(filename, stream ? EntryCache::IS_FILE : EntryCache::UNKNOWN);
+  return stream;
+}
+
+Stream* StorageProvider::_openAppendStream(const char* filename, void* testState = nullptr) {
+  if (!filename) return nullptr;
+  Stream* stream = nullptr;
+  File* file = new File();
+  *file = _fs(testState, USE_INDEX).open(filename, FILE_WRITE);
+  if (*file) {
+    stream = _newWriter(file, file->size());
+  } else {
+    delete file;
+  }
+  _entries.put(filename, stream ? EntryCache::IS_FILE : EntryCache::UNKNOWN);
+  return stream;
+}
+
+Stream* StorageProvider::_openWriteStreamAt(const char* filename, uint32_t offset, void* testState = nullptr) {
+  if (!filename) return nullptr;
+  Stream* stream = nullptr;
+  File* file = new File();
+  *file = _fs(testState, USE_AUX).open(filename, O_RDWR | O_CREAT);
+  if (*file && file->size() >= offset && file->truncate(offset) && file->seekEnd()) {
+    stream = _newWriter(file, offset);
+  } else {
+    if (*file) file->close();
+    delete file;
+  }
+  _entries.put(filename, stream ? EntryCache::IS_FILE : EntryCache::UNKNOWN);
+  return stream;
+}
+
+bool StorageProvider::_closeStream(Stream* stream, void* testState = nullptr) {
+  if (!stream) return true;
+  SectorWriter* writer = static_cast<SectorWriter*>(stream);
+  Stream* dest = writer->getDest();
+  bool success = _endWrite(writer, dest);
+  delete static_cast<File*>(dest);
+  delete writer;
+  return success;
+}
+
+/*
+ * Flushes writer and closes the file it's writing to. False if any of it
+ * didn't reach the card
+ */
+bool StorageProvider::_endWrite(SectorWriter* writer, Stream* dest) {
+  writer->flush();
+  bool success = !writer->hasFailed();
+  return static_cast<File*>(dest)->close() && success;
+}
+
+/*
+ * Wraps an open file that's writing at offset, to be
+ * released by _closeStream(...). Returns nullptr if dest is null. A writer
+ * that's taking the buffer gets it even if another writer has it
+ */
+SectorWriter* StorageProvider::_newWriter(Stream* dest, uint32_t offset, bool isTakingBuffer = false) {
+  if (!dest) return nullptr;
+  SectorWriter* writer = new SectorWriter(dest, offset, _sectorBuffer(), &_writeStats, isTakingBuffer);
+  if (!writer) {
+    File* file = static_cast<File*>(dest);
+    file->close();
+    delete file;
+  }
+  return writer;
+}
+
+bool StorageProvider::_appendFile(const char* filename, uint32_t offset, const char* srcFilename, 
+      void* testState = nullptr) {
+  // dest may or may not have been created if it fails
+  _entries.invalidate(filename);
+  File src = _fs(testState, USE_APPEND).open(srcFilename, FILE_READ);
+  if (!src) return false;
+  File dest = _fs(testState, USE_APPEND).open(filename, O_RDWR | O_CREAT);
+  bool success = dest && dest.size() >= offset && dest.truncate(offset) && dest.seekEnd();
+  uint8_t block[BTreeIndex::PAGE_SIZE];
+  // The first block only goes up to the end of dest's sector, so the rest line up with its sectors
+  size_t len = sizeof(block) - offset % sizeof(block);
+  int n;
+  while (success && (n = src.read(block, len)) > 0) {
+    success = (dest.write(block, n) == static_cast<size_t>(n));
+    SectorWriter::count(&_writeStats, offset, n);
+    offset += n;
+    len = sizeof(block);
+  }
+  src.close();
+  if (dest) success = dest.close() && success;
+  if (success) _entries.put(filename, EntryCache::IS_FILE);
+  return success;
+}
+
+FenceIndex::Result StorageProvider::_fenceLookup(const char* fenceFilename, uint32_t indexSize, 
+      const char* key, bool isPrefix, FenceIndex::Range* range, void* testState = nullptr) {
+  FenceIndex::Result result = FenceIndex::UNAVAILABLE;
+  File file = _fs(testState, USE_AUX).open(fenceFilename, FILE_READ);
+  if (!file) return result;
+  auto reader = [](uint32_t recordNum, char* record, void* ctx) -> bool {
+    File* f = static_cast<File*>(ctx);
+    if (!f->seek(recordNum * FenceIndex::FENCE_RECORD_SIZE)) return false;
+    return f->read(record, FenceIndex::FENCE_RECORD_SIZE) == FenceIndex::FENCE_RECORD_SIZE;
+  };
+  result = FenceIndex::search(key, isPrefix, file.size(), indexSize, reader, &file, range);
+  file.close();
+  return result;
+}
+
+bool StorageProvider::_fenceTail(const char* fenceFilename, uint32_t indexSize, FenceIndex::Tail* tail, 
+      void* testState = nullptr) {
+  bool result = false;
+  File file = _fs(testState, USE_AUX).open(fenceFilename, FILE_READ);
+  if (!file) return result;
+  auto reader = [](uint32_t recordNum, char* record, void* ctx) -> bool {
+    File* f = static_cast<File*>(ctx);
+    if (!f->seek(recordNum * FenceIndex::FENCE_RECORD_SIZE)) return false;
+    return f->read(record, FenceIndex::FENCE_RECORD_SIZE) == FenceIndex::FENCE_RECORD_SIZE;
+  };
+  result = FenceIndex::readTail(file.size(), indexSize, reader, &file, tail);
+  file.close();
+  return result;
+}
+
+bool StorageProvider::_openPager(const char* filename, bool forWrite, BTreeIndex::Pager* pager, 
+      void* testState = nullptr) {
+  if (!filename || !pager) return false;
+  File* file = new File();
+  *file = _fs(testState, USE_PAGES).open(filename, forWrite ? (O_RDWR | O_CREAT) : FILE_READ);
+  if (!*file) {
+    delete file;
+    return false;
+  }
+  pager->read = [](uint32_t pageNum, uint8_t* page, void* ctx) -> bool {
+    File* f = static_cast<File*>(ctx);
+    if (!f->seek(pageNum * BTreeIndex::PAGE_SIZE)) return false;
+    return f->read(page, BTreeIndex::PAGE_SIZE) == BTreeIndex::PAGE_SIZE;
+  };
+  pager->write = [](uint32_t pageNum, const uint8_t* page, void* ctx) -> bool {
+    File* f = static_cast<File*>(ctx);
+    if (!f->seek(pageNum * BTreeIndex::PAGE_SIZE)) return false;
+    return f->write(page, BTreeIndex::PAGE_SIZE) == BTreeIndex::PAGE_SIZE;
+  };
+  if (forWrite) _entries.put(filename, EntryCache::IS_FILE);
+  pager->ctx = file;
+  return true;
+}
+
+void StorageProvider::_closePager(BTreeIndex::Pager* pager, void* testState = nullptr) {
+  if (!pager || !pager->ctx) return;
+  File* file = static_cast<File*>(pager->ctx);
+  file->close();
+  delete file;
+  pager->ctx = nullptr;
+}
@@ -6,9 +6,17 @@
 #include <StreamableManager.h>
 #if defined(__SDSTORAGE_TEST)
   #include "../../test/test-suite-sim/MockSdFat.h"
+#elif defined(SDSTORAGE_POSIX)
+  #include "PosixFs.h"
 #else
   #include <SdFat.h>
 #endif
+#include "BlockReader.h"
+#include "BTreeIndex.h"
+#include "EntryCache.h"
+#include "FenceIndex.h"
+#include "FileUse.h"
+#include "SectorWriter.h"
 #include "Transaction.h"
 
 class StorageProvider {
@@ -24,36 +32,198 @@ class StorageProvider {
 
     const size_t getBufferSize() const { return _streams.getBufferSize(); };
 
-  private:
-    uint8_t _sdCsPin;         // SD card chip select pin
-    StreamableManager _streams;
+    /*
+     * The filesystem: SdFat on the device, a directory when built for a
+     * POSIX host (see PosixFs.h), or the mock when testing. Each has the
+     * same File API, and all but SdFat can replace(...) a file in one go
+     */
 #if defined(__SDSTORAGE_TEST)
-    MockSdFat _sd;
+    typedef MockSdFat Fs;
+    #define _SDSTORAGE_FS_HAS_REPLACE
+#elif defined(SDSTORAGE_POSIX)
+    typedef PosixFs Fs;
+    #define _SDSTORAGE_FS_HAS_REPLACE
 #else
-    SdFat _sd;
+    typedef SdFat Fs;
 #endif
 
+  private:
+    uint8_t _sdCsPin;         // SD card chip select pin
+    StreamableManager _streams;
+    Fs _sd;
+    bool _isWriteBuffered = true;
+    SectorWriter::SharedBuffer _writeBuffer;    // the one sector buffer all writers share
+    SectorWriter::Stats _writeStats;
+    EntryCache _entries;
+
     bool begin() {
+      _entries.clear();
       return _sd.begin(_sdCsPin);
     }
+    void end() {
+      _entries.clear();
+      _sd.end();
+    }
+
+    /*
+     * The filesystem, for a call made for use. When testing, the state
+     * capture object and use are passed to MockSdFat first, so it knows
+     * which script and captors the call goes to
+     */
+#if defined(__SDSTORAGE_TEST)
+    Fs& _fs(void* testState, FileUse use = USE_ANY) {
+      _sd.use(testState, use);
+      return _sd;
+    };
+#else
+    Fs& _fs(void* testState, FileUse use = USE_ANY) { return _sd; };
+#endif
 
     /*
      * Wrap the underlying calls to _sd so that a state capture object
-     * can be passed to MockSdFat when testing
+     * can be passed to MockSdFat when testing. _exists(...) and _isDir(...)
+     * are answered from _entries when they can be, and everything that
+     * creates, removes or renames a file keeps it up to date.
      */
     bool _exists(const char* filename, void* testState = nullptr);
     bool _mkdir(const char* filename, void* testState = nullptr);
     bool _loadFromStream(const char* filename, StreamableDTO* dto, void* testState = nullptr);
     bool _writeToStream(const char* filename, StreamableDTO* dto, void* testState = nullptr);
     bool _writeTxnToStream(const char* filename, Transaction* txn, void* testState = nullptr);
+    bool _appendTxnRecord(const char* filename, const char* key, const char* value, bool isValuePmem = false, 
+          void* testState = nullptr);
     bool _isDir(const char* filename, void* testState = nullptr);
+    bool _isEmptyDir(const char* filename, void* testState = nullptr);
+
+    /*
+     * Goes through what's in a directory an entry at a time, for fsck().
+     * _nextEntry(...) writes each one's name (not its path) and returns
+     * false once there's nothing left. Entries can be removed in between.
+     */
+    struct DirList {
+      File* dir = nullptr;
+    };
+    bool _openDir(DirList* list, const char* path, void* testState = nullptr);
+    bool _nextEntry(DirList* list, char* name, size_t len, void* testState = nullptr);
+    void _closeDir(DirList* list, void* testState = nullptr);
     bool _remove(const char* filename, void* testState = nullptr);
     bool _rename(const char* oldFilename, const char* newFilename, void* testState = nullptr);
+    /*
+     * Moves tmpFilename over filename, whether or not filename exists, and
+     * fails without touching filename if tmpFilename doesn't exist. On a
+     * POSIX host it's a single rename(), which is atomic. FAT can't rename
+     * over a file, so on SdFat filename is removed first, and a power loss
+     * in between leaves just tmpFilename, which fsck() moves into place.
+     */
+    bool _replace(const char* tmpFilename, const char* filename, void* testState = nullptr);
     bool _writeIndexLine(const char* indexFilename, const char* line, void* testState = nullptr);
     bool _updateIndex(const char* indexFilename, const char* tmpFilename, 
           StreamableManager::FilterFunction filter, void* statePtr, void* testState = nullptr);
+    /*
+     * Same, but if the filter sets *copyTail and stops, the rest of the index
+     * is copied to the tmp file as-is, a block at a time, instead of being
+     * parsed and written line by line. The copied bytes are fed to fence (if
+     * not null) so it stays in step.
+     */
+    bool _updateIndex(const char* indexFilename, const char* tmpFilename, 
+          StreamableManager::FilterFunction filter, void* statePtr, bool* copyTail, 
+          FenceIndex::Writer* fence, void* testState = nullptr);
+
+    /*
+     * An index rewrite that's run a step at a time by _rewriteStep(...), so
+     * a long one can be spread over several calls. _updateIndex(...) is the
+     * same thing in one step.
+     */
+    struct IndexRewrite {
+      Stream* src = nullptr;
+      BlockReader* reader = nullptr;  // reads ahead of src
+      Stream* dest = nullptr;
+      StreamableManager::FilterFunction filter = nullptr;
+      void* statePtr = nullptr;
+      bool* copyTail = nullptr;
+      FenceIndex::Writer* fence = nullptr;
+      bool isCopyingTail = false;
+      bool isDone = false;
+    };
+    bool _beginRewrite(IndexRewrite* rewrite, const char* indexFilename, const char* tmpFilename, 
+          StreamableManager::FilterFunction filter, void* statePtr, bool* copyTail, 
+          FenceIndex::Writer* fence, void* testState = nullptr);
+    /*
+     * Pipes about maxBytes (0 = all) of the index through the filter, always
+     * whole lines, or copies that much of the tail. Sets rewrite->isDone once
+     * the index is used up, or the filter stopped without asking for the tail.
+     */
+    void _rewriteStep(IndexRewrite* rewrite, uint32_t maxBytes, void* testState = nullptr);
+    // False if any of the rewritten index didn't reach the card
+    bool _endRewrite(IndexRewrite* rewrite, void* testState = nullptr);
+
+    static int _readFile(uint8_t* buffer, size_t len, void* ctx);
+
     bool _scanIndex(const char* indexFilename, StreamableManager::FilterFunction filter, 
           void* statePtr, void* testState = nullptr);
+    bool _scanIndexFrom(const char* indexFilename, uint32_t offset, StreamableManager::FilterFunction filter, 
+          void* statePtr, void* testState = nullptr);
+
+    /*
+     * A scan that's run a step at a time by _scanStep(...), like an
+     * IndexRewrite. _scanIndexFrom(...) is the same thing in one step.
+     */
+    struct IndexScan {
+      Stream* src = nullptr;
+      BlockReader* reader = nullptr;
+      StreamableManager::FilterFunction filter = nullptr;
+      void* statePtr = nullptr;
+      bool isDone = false;
+    };
+    bool _beginScan(IndexScan* scan, const char* indexFilename, uint32_t offset, 
+          StreamableManager::FilterFunction filter, void* statePtr, void* testState = nullptr);
+    // Feeds about maxBytes (0 = all) of lines to the filter. Sets scan->isDone once it stops or the file's used up
+    void _scanStep(IndexScan* scan, uint32_t maxBytes, void* testState = nullptr);
+    void _endScan(IndexScan* scan, void* testState = nullptr);
+    bool _scanLines(BlockReader* reader, uint32_t maxBytes, StreamableManager::FilterFunction filter, void* statePtr);
+    uint32_t _fileSize(const char* filename, void* testState = nullptr);
+    // The byte at offset, or -1 if the file can't be read that far
+    int _byteAt(const char* filename, uint32_t offset, void* testState = nullptr);
+
+    /*
+     * Opens a file for writing, truncating it if it exists. Writes are
+     * buffered a sector at a time (see SectorWriter.h), so the stream must
+     * be released with _closeStream(...), which is false if any of what was
+     * written didn't reach the card
+     */
+    Stream* _openWriteStream(const char* filename, void* testState = nullptr);
+    // Same, but appends to the file instead of truncating it
+    Stream* _openAppendStream(const char* filename, void* testState = nullptr);
+    // Same, but writes from offset, dropping anything after it
+    Stream* _openWriteStreamAt(const char* filename, uint32_t offset, void* testState = nullptr);
+    bool _closeStream(Stream* stream, void* testState = nullptr);
+    SectorWriter* _newWriter(Stream* dest, uint32_t offset, bool isTakingBuffer = false);
+    bool _endWrite(SectorWriter* writer, Stream* dest);
+    SectorWriter::SharedBuffer* _sectorBuffer() { return _isWriteBuffered ? &_writeBuffer : nullptr; };
+
+    /*
+     * Truncates filename to offset, then appends the contents of srcFilename
+     * to it. Repeating it gives the same result, so an interrupted commit can
+     * be applied again.
+     */
+    bool _appendFile(const char* filename, uint32_t offset, const char* srcFilename, void* testState = nullptr);
+
+    /*
+     * Binary-searches a fence file for the block of an index of indexSize
+     * bytes that could contain key. See FenceIndex.h
+     */
+    FenceIndex::Result _fenceLookup(const char* fenceFilename, uint32_t indexSize, const char* key,
+          bool isPrefix, FenceIndex::Range* range, void* testState = nullptr);
+    // Reads the end of a fence file, for appending to its index. See FenceIndex.h
+    bool _fenceTail(const char* fenceFilename, uint32_t indexSize, FenceIndex::Tail* tail, void* testState = nullptr);
+
+    /*
+     * Opens a file of BTreeIndex::PAGE_SIZE pages for random access through
+     * pager (creating it if forWrite is true). The file must be released
+     * with _closePager(...)
+     */
+    bool _openPager(const char* filename, bool forWrite, BTreeIndex::Pager* pager, void* testState = nullptr);
+    void _closePager(BTreeIndex::Pager* pager, void* testState = nullptr);
 
     friend class SDStorage;
     friend class SDStorageTestHelper;
@@ -2,15 +2,16 @@
 
 static uint16_t Transaction::_idSeq = 0;
 
-static StreamableDTO* Transaction::_locks = new StreamableDTO();
+static LockTable Transaction::_locks;
 
 using namespace SDStorageStrings;
 
 Transaction::Transaction(FileHelper* fileHelper):
       StreamableDTO(), _fileHelper(fileHelper) {
-  char idBuffer[12];
-  static const char fmt[] PROGMEM = "%u";
-  snprintf_P(idBuffer, sizeof(idBuffer), fmt, _idSeq++);
+  _id = _idSeq++;
+  char idBuffer[5];
+  static const char fmt[] PROGMEM = "%04X";
+  snprintf_P(idBuffer, sizeof(idBuffer), fmt, _id);
   setBaseFilename(idBuffer);
 }
 
@@ -24,6 +25,8 @@ Transaction::Transaction(FileHelper* fileHelper, const char* txnFilename):
   char shortName[13];
   _fileHelper->getFilenameFromFullName(txnFilename, shortName, sizeof(shortName));
 
+  parseId(shortName, &_id);
+
   // trim off the file extension
   char* dot = strchr(shortName, '.');
   if (dot) {
@@ -32,6 +35,26 @@ Transaction::Transaction(FileHelper* fileHelper, const char* txnFilename):
   setBaseFilename(shortName);
 }
 
+bool Transaction::parseId(const char* shortFilename, uint16_t* id) {
+  uint16_t result = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    char c = shortFilename[i];
+    uint8_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else {
+      return false;
+    }
+    result = (result << 4) | digit;
+  }
+  *id = result;
+  return true;
+}
+
 void Transaction::setBaseFilename(const char* shortFilename) {
   char* workDir = _fileHelper->getWorkDir();
   size_t workDirLen = strlen(workDir);
@@ -46,37 +69,93 @@ void Transaction::setBaseFilename(const char* shortFilename) {
   *p = '\0'; // null-terminate
 }
 
-void Transaction::add(const char* filename) {
-  bool didLog = false;
-  while (_locks->exists(filename)) {
-    // wait until the key is removed (lock released)
-#if defined(DEBUG)
-    if (!didLog) {
-      Serial.print(F("Lock contention on "));
-      Serial.println(filename);
-      didLog = true;
-    }
-#endif
-  }
-  _locks->putEmpty(filename);
-  char idBuffer[12];
-  static const char fmt[] PROGMEM = "%u";
-  snprintf_P(idBuffer, sizeof(idBuffer), fmt, _idSeq++);
-  size_t bufferSize = strlen(_fileHelper->getWorkDir()) + 1 + strlen(idBuffer) + 5;
-  char tmpFilename[bufferSize];
+bool Transaction::add(const char* filename) {
+  if (!_locks.lock(filename, this, _lockTimeoutMs)) return false;
+  putTmpFilename(filename);
+  return true;
+}
+
+void Transaction::addAux(const char* filename) {
+  putTmpFilename(filename);
+}
+
+void Transaction::putTmpFilename(const char* filename) {
+  char tmpFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!newTmpFilename(tmpFilename, sizeof(tmpFilename))) return;
+  put(filename, tmpFilename);
+}
+
+bool Transaction::newTmpFilename(char* buffer, size_t bufferSize) {
+  // <txn id><seq>, so fsck() can tell which transaction a tmp file belongs to
+  char idBuffer[9];
+  static const char fmt[] PROGMEM = "%04X%04X";
+  snprintf_P(idBuffer, sizeof(idBuffer), fmt, _id, _tmpSeq++);
   char* extRAM = strdup_P(_SDSTORAGE_TXN_TMP_EXTSN);
   static const char fmt1[] PROGMEM = "%s/%s%s";
-  snprintf_P(tmpFilename, bufferSize, fmt1, _fileHelper->getWorkDir(), idBuffer, extRAM);
+  int n = snprintf_P(buffer, bufferSize, fmt1, _fileHelper->getWorkDir(), idBuffer, extRAM);
   free(extRAM);
-  put(filename, tmpFilename);
+  return n > 0 && static_cast<size_t>(n) < bufferSize;
+}
+
+void Transaction::putAppendOffset(const char* tmpFilename, uint32_t offset) {
+  char marker[20];
+  strcpy_P(marker, _SDSTORAGE_TXN_APPEND);
+  size_t len = strlen(marker);
+  static const char fmt[] PROGMEM = "%lu";
+  snprintf_P(marker + len, sizeof(marker) - len, fmt, static_cast<unsigned long>(offset));
+  put(tmpFilename, marker);
+}
+
+bool Transaction::getAppendOffset(const char* tmpFilename, uint32_t* offset) {
+  if (!tmpFilename) return false;
+  char* marker = get(tmpFilename);
+  if (!isAppendMarker(marker)) return false;
+  *offset = strtoul(marker + strlen_P(_SDSTORAGE_TXN_APPEND), nullptr, 10);
+  return true;
+}
+
+void Transaction::removeAppendOffset(const char* tmpFilename) {
+  if (tmpFilename && isAppendMarker(get(tmpFilename))) remove(tmpFilename);
+}
+
+void Transaction::putSavepointBackup(const char* backupFilename) {
+  put(backupFilename, _SDSTORAGE_TXN_SAVEPOINT, false, true);
+}
+
+bool Transaction::isSavepointBackup(const char* value) {
+  return value && strcmp_P(value, _SDSTORAGE_TXN_SAVEPOINT) == 0;
+}
+
+bool Transaction::isAppendMarker(const char* value) {
+  return value && strncmp_P(value, _SDSTORAGE_TXN_APPEND, strlen_P(_SDSTORAGE_TXN_APPEND)) == 0;
+}
+
+void Transaction::removeDropped() {
+  // Entries can't be removed while they're being processed, so find them one at a time
+  auto findFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capture) -> bool {
+    char** dropped = static_cast<char**>(capture);
+    if (*dropped || strcmp_P(tmpFilename, _SDSTORAGE_TXN_DROPPED) != 0) return true;
+    *dropped = strdup(filename);
+    return false;
+  };
+  char* dropped = nullptr;
+  do {
+    if (dropped) {
+      remove(dropped);
+      free(dropped);
+      dropped = nullptr;
+    }
+    processEntries(findFunction, &dropped);
+  } while (dropped);
 }
 
 void Transaction::releaseLocks() {
+  // Only the files this txn locked are released - sidecars and append markers were never locked
   auto unlockFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capture) -> bool {
-    bool result = _locks->remove(filename, keyPmem);
+    _locks.unlock(filename, capture, keyPmem);
     return true;
   };
-  processEntries(unlockFunction, nullptr);
+  processEntries(unlockFunction, this);
 }
 
 bool Transaction::getFilename(char* buffer, size_t bufferSize) {
@@ -5,11 +5,15 @@
 #include <StreamableDTO.h>
 #include "Strings.h"
 #include "FileHelper.h"
+#include "LockTable.h"
 
 
 static const char _SDSTORAGE_TXN_TMP_EXTSN[]    PROGMEM = ".tmp";
 static const char _SDSTORAGE_TXN_TX_EXTSN[]     PROGMEM = ".txn";
 static const char _SDSTORAGE_TXN_COMMIT_EXTSN[] PROGMEM = ".cmt";
+static const char _SDSTORAGE_TXN_APPEND[]       PROGMEM = "{APPEND}";
+static const char _SDSTORAGE_TXN_DROPPED[]      PROGMEM = "{DROPPED}";
+static const char _SDSTORAGE_TXN_SAVEPOINT[]    PROGMEM = "{SAVEPOINT}";
 
 /*
  * Represents a group of one or more files that have been "locked" to this
@@ -18,9 +22,43 @@ static const char _SDSTORAGE_TXN_COMMIT_EXTSN[] PROGMEM = ".cmt";
 class Transaction: public StreamableDTO {
 
   public:
+
+    /*
+     * A point in a transaction that it can be rolled back to, undoing the
+     * changes made since without losing the ones before. It holds a copy of
+     * the transaction's entries, and the name of a copy of each tmp file
+     * that had been written, taken when the savepoint was made. It belongs
+     * to its transaction, and is deleted with it.
+     */
+    class Savepoint {
+      public:
+        // Disable moving and copying
+        Savepoint(Savepoint&& other) = delete;
+        Savepoint& operator=(Savepoint&& other) = delete;
+        Savepoint(const Savepoint&) = delete;
+        Savepoint& operator=(const Savepoint&) = delete;
+
+      private:
+        Savepoint() {};
+        ~Savepoint() {};
+
+        StreamableDTO _entries;           // the transaction's entries
+        StreamableDTO _backups;           // tmp filename -> copy of it
+        Savepoint* _older = nullptr;      // the savepoint taken before this one
+
+        friend class Transaction;
+        friend class TransactionManager;
+        friend class SDStorageTestHelper;
+    };
+
     Transaction() = delete;
     virtual ~Transaction() {
       releaseLocks();
+      while (_savepoints) {
+        Savepoint* older = _savepoints->_older;
+        delete _savepoints;
+        _savepoints = older;
+      }
       if (_baseFilename) delete[] _baseFilename;
       _baseFilename = nullptr;
     };
@@ -35,35 +73,74 @@ class Transaction: public StreamableDTO {
     bool _isCommitted = false;
     char* _baseFilename = nullptr;
     FileHelper* _fileHelper;
+    uint16_t _id = 0;
+    uint16_t _tmpSeq = 0;               // numbers this transaction's tmp files
+    Savepoint* _savepoints = nullptr;   // newest first
 
     Transaction(FileHelper* fileHelper);
     Transaction(FileHelper* fileHelper, const char* txnFilename);
 
     void setBaseFilename(const char* shortFilename);
 
+    /*
+     * Reads the transaction ID that starts a work dir filename: <id>.txn,
+     * <id>.cmt, or <id><seq>.tmp for the tmp files the transaction owns. IDs
+     * are 4 hex digits. Returns false if the name doesn't start with one.
+     */
+    static bool parseId(const char* shortFilename, uint16_t* id);
+
     // Sequence restarts from 0 with every reboot, so it's vital that
     // the SDStorage::fsck() process cleans up any lingering
     // transaction files
     static uint16_t _idSeq;
 
-    // Puts filename as key (no values) to lock a file. These locks
-    // are lost on reboot, so it's vital that SDStorage::fsck() process
-    // cleans up any lingering transaction files
-    static StreamableDTO* _locks; // file access locks
+    // File access locks, shared by all transactions
+    static LockTable _locks;
+
+    // How long add(...) waits for another transaction's lock
+    uint32_t _lockTimeoutMs = LockTable::WAIT_FOREVER;
 
     // Sets the _isCommitted flag to true
     void setCommitted();
 
-    // Filename of this transaction's file: <workDir>/<id>.<extension>
+    // Filename of this transaction's file: <workDir>/<id>.<extension>, with
+    // the id in hex
     bool getFilename(char* buffer, size_t bufferSize);
 
     // Temp filename where uncommitted changes will be written
     char* getTmpFilename(const char* filename, bool isPmem = false);
 
-    // Lock (waiting if necessary) and add to transaction
-    void add(const char* filename);
+    // Lock (waiting up to _lockTimeoutMs if necessary) and add to transaction.
+    // Returns false if the lock couldn't be had.
+    bool add(const char* filename);
+
+    // Add to transaction without locking. Used for sidecar files, which
+    // are covered by the lock on the file they belong to
+    void addAux(const char* filename);
     void releaseLocks();
 
+    // Assigns a new temp filename to a file in this transaction
+    void putTmpFilename(const char* filename);
+    bool newTmpFilename(char* buffer, size_t bufferSize);
+
+    // Records a savepoint's copy of a tmp file, as a <backupFilename>={SAVEPOINT}
+    // entry, so it's removed along with the transaction's other tmp files
+    void putSavepointBackup(const char* backupFilename);
+    static bool isSavepointBackup(const char* value);
+
+    // Marks a temp file as holding data to append to its file at offset
+    // (dropping anything after it), rather than a full replacement. Stored
+    // as a <tmpFilename>={APPEND}<offset> entry.
+    void putAppendOffset(const char* tmpFilename, uint32_t offset);
+    bool getAppendOffset(const char* tmpFilename, uint32_t* offset);
+    void removeAppendOffset(const char* tmpFilename);
+
+    // True for the entries added by putAppendOffset(...)
+    static bool isAppendMarker(const char* value);
+
+    // Removes the entries a replayed journal recorded as {DROPPED}
+    void removeDropped();
+
     friend class SDStorage;
     friend class TransactionManager;
     friend class SDStorageTestHelper;
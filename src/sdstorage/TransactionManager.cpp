@@ -32,8 +32,12 @@ bool TransactionManager::abortTxn(Transaction* txn, void* testState = nullptr) {
 
   auto cleanupFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capture) -> bool {
     TransactionCapture* c = static_cast<TransactionCapture*>(capture);
-    if (strcmp_P(tmpFilename, _SDSTORAGE_TOMBSTONE) == 0) {
-      // Tombstone - nothing to clean up
+    if (Transaction::isSavepointBackup(tmpFilename)) {
+      // A savepoint's copy of a tmp file is named by the key
+      tmpFilename = filename;
+    }
+    if (strcmp_P(tmpFilename, _SDSTORAGE_TOMBSTONE) == 0 || Transaction::isAppendMarker(tmpFilename)) {
+      // Tombstone or append marker - nothing to clean up
     } else if (c->storageProvider->_exists(tmpFilename, c->ts)) {
       if (!c->storageProvider->_remove(tmpFilename, c->ts)) {
 #if defined(DEBUG)
@@ -111,9 +115,18 @@ bool TransactionManager::addFileToTxn(Transaction* txn, void* testState, const c
     result = true;
   }
 
+  if (result && _group && txn != _group && _group->getTmpFilename(resolvedFilename)) {
+    // The file has implicit writes waiting in the group, which holds its lock
+    result = flushGroup(testState);
+  }
+  if (result && !txn->add(resolvedFilename)) {
+#if defined(DEBUG)
+    Serial.print(F("Could not lock "));
+    Serial.println(resolvedFilename);
+#endif
+    result = false;
+  }
   if (result) {
-
-    txn->add(resolvedFilename);
     char* tmpFilename = txn->getTmpFilename(resolvedFilename);
     if (tmpFilename && _storageProvider->_exists(tmpFilename, testState)) {
   #if defined(DEBUG)
@@ -152,6 +165,263 @@ char* TransactionManager::getTmpFilename(Transaction* txn, const char* filename,
   return tmpFilename;
 }
 
+/*
+ * Returns the temp filename for a sidecar file, adding it to the transaction
+ * (without a lock) if it isn't already part of it. The transaction file is
+ * rewritten so fsck() knows about the new temp file.
+ */
+char* TransactionManager::getAuxTmpFilename(Transaction* txn, const char* filename, void* testState = nullptr) {
+  if (!txn || !filename) return nullptr;
+  if (!txn->getTmpFilename(filename)) {
+    txn->addAux(filename);
+    if (!journal(txn, filename, testState)) return nullptr;
+  }
+  return getTmpFilename(txn, filename);
+}
+
+bool TransactionManager::getAppendOffset(Transaction* txn, const char* tmpFilename, uint32_t* offset) {
+  return txn && txn->getAppendOffset(tmpFilename, offset);
+}
+
+/*
+ * Marks tmpFilename to be appended to its file at offset on commit, instead
+ * of replacing it. Appending drops anything past offset first, so fsck() can
+ * safely apply it again if the commit was interrupted.
+ */
+bool TransactionManager::putAppendOffset(Transaction* txn, const char* tmpFilename, uint32_t offset, 
+      void* testState = nullptr) {
+  if (!txn || !tmpFilename) return false;
+  char key[strlen(tmpFilename) + 1];  // put(...) can move the entry tmpFilename points into
+  strcpy(key, tmpFilename);
+  txn->putAppendOffset(key, offset);
+  return journal(txn, key, testState);
+}
+
+// Makes tmpFilename a full replacement for its file again
+bool TransactionManager::removeAppendOffset(Transaction* txn, const char* tmpFilename, void* testState = nullptr) {
+  uint32_t offset;
+  if (!getAppendOffset(txn, tmpFilename, &offset)) return true;
+  char key[strlen(tmpFilename) + 1];
+  strcpy(key, tmpFilename);
+  txn->removeAppendOffset(key);
+  return journal(txn, key, testState);
+}
+
+/*
+ * Appends the txn's entry for filename to the transaction file, so fsck()
+ * knows about the change without the whole file being rewritten. Loading
+ * the file replays the records in order: the last record for a file wins,
+ * and a {DROPPED} record (written when there's no entry) removes it.
+ */
+bool TransactionManager::journal(Transaction* txn, const char* filename, void* testState = nullptr) {
+  char txnFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!txn || !filename || !txn->getFilename(txnFilename, FileHelper::MAX_FILENAME_LENGTH)) return false;
+  char* tmpFilename = txn->getTmpFilename(filename);
+  if (!tmpFilename) {
+    return _storageProvider->_appendTxnRecord(txnFilename, filename, _SDSTORAGE_TXN_DROPPED, true, testState);
+  }
+  return _storageProvider->_appendTxnRecord(txnFilename, filename, tmpFilename, false, testState);
+}
+
+// Rebuilds a txn from its transaction file, e.g. so fsck() can finish committing it
+Transaction* TransactionManager::loadTxn(const char* txnFilename, void* testState = nullptr) {
+  Transaction* txn = new Transaction(_fileHelper, txnFilename);
+  if (!_storageProvider->_loadFromStream(txnFilename, txn, testState)) {
+    delete txn;
+    return nullptr;
+  }
+  txn->removeDropped();
+  return txn;
+}
+
+/*
+ * Takes a savepoint: copies the txn's entries, and each tmp file written so
+ * far to a new tmp file of the txn's (journaled as a {SAVEPOINT} entry, so
+ * commit, abort and fsck() remove it). The savepoint is the txn's, so it's
+ * deleted with it.
+ */
+Transaction::Savepoint* TransactionManager::savepoint(Transaction* txn, void* testState = nullptr) {
+  if (!txn) return nullptr;
+  Transaction::Savepoint* sp = new Transaction::Savepoint();
+  auto copyFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capture) -> bool {
+    // Other savepoints' copies are looked after by those savepoints
+    if (!Transaction::isSavepointBackup(tmpFilename)) {
+      static_cast<StreamableDTO*>(capture)->put(filename, tmpFilename, keyPmem, valPmem);
+    }
+    return true;
+  };
+  txn->processEntries(copyFunction, &sp->_entries);
+  sp->_older = txn->_savepoints;
+  txn->_savepoints = sp;
+
+  struct SavepointCapture {
+    TransactionManager* txnManager;
+    Transaction* txn;
+    Transaction::Savepoint* sp;
+    void* ts;
+    bool success = true;
+    SavepointCapture(TransactionManager* txnManager, Transaction* txn, Transaction::Savepoint* sp, void* ts):
+        txnManager(txnManager), txn(txn), sp(sp), ts(ts) {};
+  } capture(this, txn, sp, testState);
+  auto backupFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capturePtr) -> bool {
+    SavepointCapture* c = static_cast<SavepointCapture*>(capturePtr);
+    StorageProvider* storageProvider = c->txnManager->_storageProvider;
+    if (!_isTmpFilename(tmpFilename) || !storageProvider->_exists(tmpFilename, c->ts)) return true;
+    char backupFilename[FileHelper::MAX_FILENAME_LENGTH];
+    c->success = c->txn->newTmpFilename(backupFilename, sizeof(backupFilename));
+    if (c->success) {
+      // Journaled before it's written, like any other tmp file
+      c->txn->putSavepointBackup(backupFilename);
+      c->success = c->txnManager->journal(c->txn, backupFilename, c->ts);
+    }
+    if (c->success) {
+      c->sp->_backups.put(tmpFilename, backupFilename);
+      c->success = storageProvider->_appendFile(backupFilename, 0, tmpFilename, c->ts);
+    }
+#if defined(DEBUG)
+    if (!c->success) {
+      Serial.print(F("Could not copy "));
+      Serial.println(tmpFilename);
+    }
+#endif
+    return c->success;
+  };
+  sp->_entries.processEntries(backupFunction, &capture);
+  if (!capture.success) {
+    releaseSavepoint(txn, sp, testState);
+    return nullptr;
+  }
+  return sp;
+}
+
+/*
+ * Undoes the txn's changes since sp was taken: tmp files written since are
+ * removed, the ones written before are restored from their copies, files
+ * added since are dropped from the txn (and unlocked), and all other entries
+ * are put back the way they were. Savepoints taken after sp are released,
+ * but sp itself can be rolled back to again.
+ */
+bool TransactionManager::rollbackTo(Transaction* txn, Transaction::Savepoint* sp, void* testState = nullptr) {
+  if (!txn || !sp) return false;
+  Transaction::Savepoint* found = txn->_savepoints;
+  while (found && found != sp) found = found->_older;
+  if (!found) {
+#if defined(DEBUG)
+    Serial.println(F("Not a savepoint of this transaction"));
+#endif
+    return false;
+  }
+  while (txn->_savepoints != sp) releaseSavepoint(txn, txn->_savepoints, testState);
+
+  struct RollbackCapture {
+    TransactionManager* txnManager;
+    Transaction* txn;
+    Transaction::Savepoint* sp;
+    StreamableDTO added;      // files added since sp
+    void* ts;
+    bool success = true;
+    RollbackCapture(TransactionManager* txnManager, Transaction* txn, Transaction::Savepoint* sp, void* ts):
+        txnManager(txnManager), txn(txn), sp(sp), ts(ts) {};
+  } capture(this, txn, sp, testState);
+
+  // Entries can't be removed while they're being processed, so the files
+  // added since sp are found first
+  auto findAddedFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capturePtr) -> bool {
+    RollbackCapture* c = static_cast<RollbackCapture*>(capturePtr);
+    if (!Transaction::isSavepointBackup(tmpFilename) && !c->sp->_entries.exists(filename)) {
+      c->added.put(filename, tmpFilename);
+    }
+    return true;
+  };
+  txn->processEntries(findAddedFunction, &capture);
+  auto dropFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capturePtr) -> bool {
+    RollbackCapture* c = static_cast<RollbackCapture*>(capturePtr);
+    StorageProvider* storageProvider = c->txnManager->_storageProvider;
+    if (_isTmpFilename(tmpFilename) && storageProvider->_exists(tmpFilename, c->ts) 
+          && !storageProvider->_remove(tmpFilename, c->ts)) {
+      c->success = false;
+    }
+    Transaction::_locks.unlock(filename, c->txn);
+    c->txn->remove(filename);
+    return c->txnManager->journal(c->txn, filename, c->ts) && c->success;
+  };
+  capture.added.processEntries(dropFunction, &capture);
+
+  // Everything that was in the txn at sp
+  auto restoreFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valPmem, void* capturePtr) -> bool {
+    RollbackCapture* c = static_cast<RollbackCapture*>(capturePtr);
+    StorageProvider* storageProvider = c->txnManager->_storageProvider;
+    if (_isTmpFilename(tmpFilename)) {
+      char* backupFilename = c->sp->_backups.get(tmpFilename);
+      if (backupFilename) {
+        c->success = storageProvider->_appendFile(tmpFilename, 0, backupFilename, c->ts);
+      } else if (storageProvider->_exists(tmpFilename, c->ts)) {
+        c->success = storageProvider->_remove(tmpFilename, c->ts);
+      }
+    }
+    char* current = c->txn->get(filename);
+    if (c->success && (!current || strcmp(current, tmpFilename) != 0)) {
+      c->txn->put(filename, tmpFilename, keyPmem, valPmem);
+      c->success = c->txnManager->journal(c->txn, filename, c->ts);
+    }
+#if defined(DEBUG)
+    if (!c->success) {
+      Serial.print(F("Could not roll back "));
+      Serial.println(filename);
+    }
+#endif
+    return c->success;
+  };
+  if (capture.success) sp->_entries.processEntries(restoreFunction, &capture);
+  return capture.success;
+}
+
+/*
+ * Removes sp's copies of the tmp files, and sp along with the savepoints
+ * taken after it. The txn's changes are kept.
+ */
+bool TransactionManager::releaseSavepoint(Transaction* txn, Transaction::Savepoint* sp, void* testState = nullptr) {
+  if (!txn || !sp) return false;
+  Transaction::Savepoint* found = txn->_savepoints;
+  while (found && found != sp) found = found->_older;
+  if (!found) return false;
+
+  TransactionCapture capture(_storageProvider, testState);
+  capture.txn = txn;
+  auto removeFunction = [](const char* tmpFilename, const char* backupFilename, bool keyPmem, bool valPmem, void* capturePtr) -> bool {
+    TransactionCapture* c = static_cast<TransactionCapture*>(capturePtr);
+    if (c->storageProvider->_exists(backupFilename, c->ts) && !c->storageProvider->_remove(backupFilename, c->ts)) {
+      // Left in the txn for commit, abort or fsck() to remove
+      c->success = false;
+    } else {
+      c->txn->remove(backupFilename);
+    }
+    return true;
+  };
+  Transaction::Savepoint* stop = sp->_older;
+  while (txn->_savepoints != stop) {
+    Transaction::Savepoint* released = txn->_savepoints;
+    released->_backups.processEntries(removeFunction, &capture);
+    txn->_savepoints = released->_older;
+    delete released;
+  }
+  return capture.success;
+}
+
+const char* TransactionManager::savepointCopy(Transaction* txn, const char* tmpFilename) {
+  if (!txn || isEmpty(tmpFilename)) return nullptr;
+  for (Transaction::Savepoint* sp = txn->_savepoints; sp; sp = sp->_older) {
+    char* backupFilename = sp->_backups.get(tmpFilename);
+    if (backupFilename) return backupFilename;
+  }
+  return nullptr;
+}
+
+bool TransactionManager::_isTmpFilename(const char* value) {
+  return value && strcmp_P(value, _SDSTORAGE_TOMBSTONE) != 0 && !Transaction::isAppendMarker(value)
+      && !Transaction::isSavepointBackup(value);
+}
+
 bool TransactionManager::finalizeTxn(Transaction* txn, bool autoCommit, bool success, void* testState) {
   if (autoCommit) {
     if (success) {
@@ -188,21 +458,32 @@ bool TransactionManager::applyChanges(Transaction* txn, void* testState = nullpt
   auto applyChangesFunction = [](const char* filename, const char* tmpFilename, bool keyPmem, bool valuePmem, void* capture) -> bool {
     TransactionCapture* c = static_cast<TransactionCapture*>(capture);
 
+    uint32_t appendOffset = 0;
     if (strcmp_P(tmpFilename, _SDSTORAGE_TOMBSTONE) == 0) {
       // tombstone - delete the file
       c->storageProvider->_remove(filename, c->ts);
-    } else if (!c->storageProvider->_exists(tmpFilename, c->ts)) {
-      // No changes to apply (tmpFile was never written)
-    } else {
-      if (c->storageProvider->_exists(filename, c->ts) && !c->storageProvider->_remove(filename, c->ts)) {
+    } else if (Transaction::isAppendMarker(tmpFilename)) {
+      // Applied along with the entry for the file it belongs to
+    } else if (Transaction::isSavepointBackup(tmpFilename)) {
+      // Not needed once committed. If it's left behind, the next fsck() removes it
+      if (c->storageProvider->_exists(filename, c->ts)) c->storageProvider->_remove(filename, c->ts);
+    } else if (c->txn && c->txn->getAppendOffset(tmpFilename, &appendOffset)) {
+      if (!c->storageProvider->_exists(tmpFilename, c->ts)) {
+        // No changes to apply (tmpFile was never written, or was already appended)
+      } else if (!c->storageProvider->_appendFile(filename, appendOffset, tmpFilename, c->ts)
+            || !c->storageProvider->_remove(tmpFilename, c->ts)) {
 #if defined(DEBUG)
-        Serial.print(F("Old file could not be removed: "));
+        Serial.print(F("Could not append "));
+        Serial.print(tmpFilename);
+        Serial.print(F(" to "));
         Serial.println(filename);
 #endif
         c->success = false;
         return false;
       }
-      if (!c->storageProvider->_rename(tmpFilename, filename, c->ts)) {
+    } else if (!c->storageProvider->_replace(tmpFilename, filename, c->ts)) {
+      // Only a problem if there was something to apply (tmpFile was written, and not already moved)
+      if (c->storageProvider->_exists(tmpFilename, c->ts)) {
 #if defined(DEBUG)
         Serial.print(F("Could not move "));
         Serial.print(tmpFilename);
@@ -217,6 +498,7 @@ bool TransactionManager::applyChanges(Transaction* txn, void* testState = nullpt
   };
 
   TransactionCapture capture(_storageProvider, testState);
+  capture.txn = txn;
   txn->processEntries(applyChangesFunction, &capture);
   if (!capture.success) {
 #if defined(DEBUG)
@@ -233,3 +515,166 @@ bool TransactionManager::applyChanges(Transaction* txn, void* testState = nullpt
   return true;
 }
 
+
+bool TransactionManager::setGroupCommit(uint8_t maxWrites, uint32_t windowMs, void* testState = nullptr) {
+  bool success = flushGroup(testState);
+  _groupMaxWrites = maxWrites;
+  _groupWindowMs = windowMs;
+  return success;
+}
+
+/*
+ * Adds filename to the group, starting a new group if there isn't one, or
+ * the current one has been open longer than the window
+ */
+Transaction* TransactionManager::joinGroup(const char* filename, bool* isNewToGroup, void* testState = nullptr) {
+  *isNewToGroup = false;
+  if (_groupMaxWrites == 0) return nullptr;
+  if (_group && _groupWindowMs > 0 && millis() - _groupStartedAt >= _groupWindowMs && !flushGroup(testState)) {
+    return nullptr;
+  }
+  if (!_group) {
+    _group = _openTxn(testState, _lockTimeoutMs, filename);
+    if (!_group) return nullptr;
+    _groupWrites = 0;
+    _groupStartedAt = millis();
+    *isNewToGroup = true;
+    return _group;
+  }
+  if (_group->getTmpFilename(filename)) return _group;
+  if (!addFileToTxn(_group, testState, filename) || !journal(_group, filename, testState)) {
+    // Probably out of locks, so commit what's there and start a new group
+    _dropFromGroup(filename, testState);
+    if (!flushGroup(testState)) return nullptr;
+    return joinGroup(filename, isNewToGroup, testState);
+  }
+  *isNewToGroup = true;
+  return _group;
+}
+
+/*
+ * The tmp file to write filename to. A file that's already in the group is
+ * written to a new one, so its earlier write is still there if this one
+ * fails. The new tmp file isn't journaled until endGroupWrite swaps it in,
+ * but fsck() can tell it's the group's from its name.
+ */
+bool TransactionManager::groupWriteFilename(const char* filename, bool isNewToGroup, char* buffer, size_t bufferSize) {
+  if (!_group) return false;
+  if (!isNewToGroup) return _group->newTmpFilename(buffer, bufferSize);
+  char* tmpFilename = _group->getTmpFilename(filename);
+  if (!tmpFilename || strlen(tmpFilename) >= bufferSize) return false;
+  strcpy(buffer, tmpFilename);
+  return true;
+}
+
+/*
+ * Commits the group if it's full or its window has passed. If the write
+ * failed, the group stays open for the other files: a file new to the
+ * group is dropped from it, and one that was already in it keeps its
+ * earlier write. Otherwise the file's entry is swapped over to the tmp
+ * file it was written to.
+ */
+bool TransactionManager::endGroupWrite(const char* filename, const char* writeFilename, bool isNewToGroup, bool success, 
+      void* testState = nullptr) {
+  if (!_group) return false;
+  if (!success) {
+    if (isNewToGroup) {
+      _dropFromGroup(filename, testState);
+      journal(_group, filename, testState);
+    } else if (!isEmpty(writeFilename) && _storageProvider->_exists(writeFilename, testState)) {
+      _storageProvider->_remove(writeFilename, testState);
+    }
+    return false;
+  }
+  if (!isNewToGroup) {
+    char* oldTmpFilename = strdup(_group->getTmpFilename(filename));
+    _group->put(filename, writeFilename);
+    success = journal(_group, filename, testState);
+    if (success) {
+      // The earlier write can go now. If it can't, fsck() removes it
+      _storageProvider->_remove(oldTmpFilename, testState);
+    } else {
+      _group->put(filename, oldTmpFilename);
+      _storageProvider->_remove(writeFilename, testState);
+    }
+    free(oldTmpFilename);
+    if (!success) return false;
+  }
+  _groupWrites++;
+  if (_groupWrites >= _groupMaxWrites || (_groupWindowMs > 0 && millis() - _groupStartedAt >= _groupWindowMs)) {
+    return flushGroup(testState);
+  }
+  return true;
+}
+
+// Commits the group's writes, if there are any
+bool TransactionManager::flushGroup(void* testState = nullptr) {
+  if (!_group) return true;
+  Transaction* group = _group;
+  _group = nullptr;
+  return commitTxn(group, testState);
+}
+
+// The group's tmp file for filename, if it has implicit writes waiting to be committed
+char* TransactionManager::getGroupTmpFilename(const char* filename) {
+  return _group ? _group->getTmpFilename(filename) : nullptr;
+}
+
+void TransactionManager::_dropFromGroup(const char* filename, void* testState = nullptr) {
+  char* tmpFilename = _group->getTmpFilename(filename);
+  if (!tmpFilename) return;
+  if (_storageProvider->_exists(tmpFilename, testState)) _storageProvider->_remove(tmpFilename, testState);
+  Transaction::_locks.unlock(filename, _group);
+  _group->remove(filename);
+}
+
+bool TransactionManager::markClean(void* testState = nullptr) {
+  if (!flushGroup(testState)) return false;
+  if (Transaction::_locks.stats().held > 0) {
+#if defined(DEBUG)
+    Serial.println(F("Transactions still open, not marking clean"));
+#endif
+    return false;
+  }
+  if (_isMarkedClean) return true;
+  // Anything left in the work directory still needs recovering
+  if (!_storageProvider->_isEmptyDir(_fileHelper->getWorkDir(), testState)) {
+#if defined(DEBUG)
+    Serial.println(F("Work directory isn't empty, not marking clean"));
+#endif
+    return false;
+  }
+  char markerFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!_fileHelper->canonicalFilename(FileHelper::Filename::fromProgmem(_SDSTORAGE_CLEAN_MARKER), 
+        markerFilename, FileHelper::MAX_FILENAME_LENGTH)) {
+    return false;
+  }
+  Stream* marker = _storageProvider->_openWriteStream(markerFilename, testState);
+  if (!marker || !_storageProvider->_closeStream(marker, testState)) return false;
+  _isMarkedClean = true;
+  return true;
+}
+
+// True if the card was marked clean when it was last used
+bool TransactionManager::checkClean(void* testState = nullptr) {
+  char markerFilename[FileHelper::MAX_FILENAME_LENGTH];
+  _isMarkedClean = _fileHelper->canonicalFilename(FileHelper::Filename::fromProgmem(_SDSTORAGE_CLEAN_MARKER), 
+        markerFilename, FileHelper::MAX_FILENAME_LENGTH)
+        && _storageProvider->_exists(markerFilename, testState);
+  return _isMarkedClean;
+}
+
+bool TransactionManager::_clearCleanMarker(void* testState = nullptr) {
+  if (!_isMarkedClean) return true;
+  char markerFilename[FileHelper::MAX_FILENAME_LENGTH];
+  if (!_fileHelper->canonicalFilename(FileHelper::Filename::fromProgmem(_SDSTORAGE_CLEAN_MARKER), 
+        markerFilename, FileHelper::MAX_FILENAME_LENGTH)
+        || !_storageProvider->_remove(markerFilename, testState)) {
+#if defined(DEBUG)
+    Serial.println(F("Could not remove the clean-shutdown marker"));
+#endif
+    return false;
+  }
+  _isMarkedClean = false;
+  return true;
+}
@@ -30,6 +30,27 @@ class TransactionManager {
     void (*_errFunction)();
     FileHelper* _fileHelper;
     StorageProvider* _storageProvider;
+    uint32_t _lockTimeoutMs = LockTable::WAIT_FOREVER;  // for beginTxn(...)
+
+    /*
+     * Group commit: implicit single-file writes share one transaction (the
+     * group), which is committed after _groupMaxWrites writes, or by the first
+     * write _groupWindowMs or more after the group started, or by flushGroup().
+     * The group is an ordinary transaction on the card, so fsck() either applies
+     * all of its writes or none of them.
+     */
+    uint8_t _groupMaxWrites = 0;    // 0 = off
+    uint32_t _groupWindowMs = 0;
+    Transaction* _group = nullptr;
+    uint8_t _groupWrites = 0;
+    uint32_t _groupStartedAt = 0;
+
+    /*
+     * Clean-shutdown marker (<rootDir>/~CLEAN). While it's on the card, the
+     * work dir holds no transaction files, so begin() can skip fsck(). It's
+     * removed before the next transaction file is written.
+     */
+    bool _isMarkedClean = false;
 
     /*
      * Create a new transaction, locking the affected files
@@ -47,6 +68,14 @@ class TransactionManager {
     template <typename... Args>
     Transaction* beginTxn(void* testState, sdstorage::Index idx, Args... moreFilenames);
 
+    /*
+     * Like beginTxn, but waits at most timeoutMs for each lock
+     */
+    template <typename... Args>
+    Transaction* tryBeginTxn(uint32_t timeoutMs, Args... filenames);
+    template <typename... Args>
+    Transaction* tryBeginTxn(void* testState, uint32_t timeoutMs, Args... filenames);
+
     /*
      * Applies the transaction's changes and unlocks the files.
      */
@@ -57,10 +86,30 @@ class TransactionManager {
      */
     bool abortTxn(Transaction* txn, void* testState = nullptr);
 
+    /*
+     * Savepoints: rollbackTo undoes the changes made to txn since sp without
+     * losing the earlier ones, so one failed step can be retried. sp stays
+     * valid, but later savepoints are released. releaseSavepoint keeps the
+     * changes and frees sp (and later savepoints) along with its copies of
+     * the tmp files. Savepoints are deleted with their transaction.
+     */
+    Transaction::Savepoint* savepoint(Transaction* txn, void* testState = nullptr);
+    bool rollbackTo(Transaction* txn, Transaction::Savepoint* sp, void* testState = nullptr);
+    bool releaseSavepoint(Transaction* txn, Transaction::Savepoint* sp, void* testState = nullptr);
+
+    // The newest savepoint's copy of one of txn's tmp files, or nullptr if
+    // no savepoint has copied it
+    const char* savepointCopy(Transaction* txn, const char* tmpFilename);
+
+    // True if a txn entry's value is a tmp filename, rather than a marker
+    static bool _isTmpFilename(const char* value);
+
     /*
      * Recursive transaction helper methods to handle the variadic 'moreFilenames' argument
      */
     template <typename... Args>
+    Transaction* _openTxn(void* testState, uint32_t lockTimeoutMs, Args... filenames);
+    template <typename... Args>
     bool _beginTxn(Transaction* txn, void* testState, const char* filename, Args... moreFilenames);
     template <typename... Args>
     bool _beginTxn(Transaction* txn, void* testState, const __FlashStringHelper* filename, Args... moreFilenames);
@@ -68,11 +117,43 @@ class TransactionManager {
     bool _beginTxn(Transaction* txn, void* testState, sdstorage::Index idx, Args... moreFilenames);
     bool _beginTxn(Transaction* txn, void* testState) { return true; }; // termination case
 
+    /*
+     * Clean-shutdown marker methods. markClean commits the group first, and
+     * fails if any other transaction is still open or anything is left in
+     * the work directory for fsck to recover.
+     */
+    bool markClean(void* testState = nullptr);
+    bool checkClean(void* testState = nullptr);
+    bool _clearCleanMarker(void* testState = nullptr);
+
+    /*
+     * Group commit methods. joinGroup returns nullptr if group commit is off,
+     * or the file couldn't be added to the group. The write goes to the tmp
+     * file from groupWriteFilename, and every joinGroup must be followed by
+     * endGroupWrite, which commits the group if it's due.
+     */
+    bool setGroupCommit(uint8_t maxWrites, uint32_t windowMs, void* testState = nullptr);
+    Transaction* joinGroup(const char* filename, bool* isNewToGroup, void* testState = nullptr);
+    bool groupWriteFilename(const char* filename, bool isNewToGroup, char* buffer, size_t bufferSize);
+    bool endGroupWrite(const char* filename, const char* writeFilename, bool isNewToGroup, bool success, 
+          void* testState = nullptr);
+    bool flushGroup(void* testState = nullptr);
+    char* getGroupTmpFilename(const char* filename);
+    void _dropFromGroup(const char* filename, void* testState = nullptr);
+
     /*
      * Transaction helper methods
      */
     bool addFileToTxn(Transaction* txn, void* testState, const char* filename, bool isPmem = false);
     char* getTmpFilename(Transaction* txn, const char* filename, bool isPmem = false);
+    // True if any txn has filename locked
+    bool isLocked(const char* filename) { return Transaction::_locks.isLocked(filename); };
+    char* getAuxTmpFilename(Transaction* txn, const char* filename, void* testState = nullptr);
+    bool getAppendOffset(Transaction* txn, const char* tmpFilename, uint32_t* offset);
+    bool putAppendOffset(Transaction* txn, const char* tmpFilename, uint32_t offset, void* testState = nullptr);
+    bool removeAppendOffset(Transaction* txn, const char* tmpFilename, void* testState = nullptr);
+    bool journal(Transaction* txn, const char* filename, void* testState = nullptr);
+    Transaction* loadTxn(const char* txnFilename, void* testState = nullptr);
     void cleanupTxn(Transaction* txn, void* testState = nullptr);
     bool applyChanges(Transaction* txn, void* testState = nullptr);
     bool finalizeTxn(Transaction* txn, bool autoCommit, bool success, void* testState);
@@ -82,12 +163,14 @@ class TransactionManager {
       StorageProvider* storageProvider;
       void* ts;
       bool success = true;
+      Transaction* txn = nullptr;
       TransactionCapture(StorageProvider* storageProvider, void* testState):
           storageProvider(storageProvider), ts(testState) {};
     };
 
     friend class SDStorage;
     friend class IndexManager;
+    friend class SDStorageTestHelper;
 
 };
 
@@ -110,10 +193,27 @@ Transaction* TransactionManager::beginTxn(sdstorage::Index idx, Args... moreFile
 
 template <typename... Args>
 Transaction* TransactionManager::beginTxn(void* testState, const char* filename, Args... moreFilenames) {
+  return _openTxn(testState, _lockTimeoutMs, filename, moreFilenames...);
+}
+
+template <typename... Args>
+Transaction* TransactionManager::tryBeginTxn(uint32_t timeoutMs, Args... filenames) {
+  return tryBeginTxn(nullptr, timeoutMs, filenames...);
+}
+
+template <typename... Args>
+Transaction* TransactionManager::tryBeginTxn(void* testState, uint32_t timeoutMs, Args... filenames) {
+  return _openTxn(testState, timeoutMs, filenames...);
+}
+
+template <typename... Args>
+Transaction* TransactionManager::_openTxn(void* testState, uint32_t lockTimeoutMs, Args... filenames) {
   Transaction* txn = new Transaction(_fileHelper);
+  txn->_lockTimeoutMs = lockTimeoutMs;
   bool success = false;
   do {
-    if (!_beginTxn(txn, testState, filename, moreFilenames...)) break;
+    if (!_beginTxn(txn, testState, filenames...)) break;
+    if (!_clearCleanMarker(testState)) break;
     char txnFilename[FileHelper::MAX_FILENAME_LENGTH];
     if (!txn->getFilename(txnFilename, FileHelper::MAX_FILENAME_LENGTH)) break;
     if (!_storageProvider->_writeTxnToStream(txnFilename, txn, testState)) break;
@@ -4,9 +4,73 @@
 
 #include <Arduino.h>
 #include <StringStream.h>
+#include "../../src/sdstorage/FileUse.h"
+
+// SdFat's open flags, for when there's no SdFat or fcntl.h to define them
+#ifndef O_RDONLY
+  #define O_RDONLY 0x00
+#endif
+#ifndef O_WRONLY
+  #define O_WRONLY 0x01
+#endif
+#ifndef O_RDWR
+  #define O_RDWR 0x02
+#endif
+#ifndef O_ACCMODE
+  #define O_ACCMODE (O_RDONLY | O_WRONLY | O_RDWR)
+#endif
+#ifndef O_CREAT
+  #define O_CREAT 0x10
+#endif
+#ifndef O_TRUNC
+  #define O_TRUNC 0x20
+#endif
+#ifndef O_AT_END
+  #define O_AT_END 0x4000     // the file is positioned at its end, as with SdFat
+#endif
+#ifndef FILE_READ
+  #define FILE_READ O_RDONLY
+#endif
+#ifndef FILE_WRITE
+  #define FILE_WRITE (O_RDWR | O_CREAT | O_AT_END)
+#endif
 
 static const char _MOCK_TESTROOT[] PROGMEM = "TESTROOT";
 
+/*
+ * Generates a sorted index of lineCount lines ("k00000=v" ...) on the fly,
+ * for indexes too big to hold in RAM
+ */
+class GeneratedIndexStream: public StringStream {
+  public:
+    GeneratedIndexStream(uint16_t lineCount, uint16_t* linesRead): 
+        StringStream(""), _lineCount(lineCount), _linesRead(linesRead) {};
+    int available() override { return (_lineNum < _lineCount) ? 1 : 0; };
+    int peek() override {
+      if (_lineNum >= _lineCount) return -1;
+      if (_pos == 0) snprintf_P(_line, sizeof(_line), PSTR("k%05u=v\n"), _lineNum);
+      return _line[_pos];
+    };
+    int read() override {
+      int c = peek();
+      if (c == '\n') {
+        _pos = 0;
+        _lineNum++;
+        if (_linesRead) (*_linesRead)++;
+      } else if (c != -1) {
+        _pos++;
+      }
+      return c;
+    };
+
+  private:
+    const uint16_t _lineCount;
+    uint16_t* _linesRead;
+    uint16_t _lineNum = 0;
+    uint8_t _pos = 0;
+    char _line[12];
+};
+
 class MockSdFat {
 
   public:
@@ -18,135 +82,738 @@ class MockSdFat {
     MockSdFat(const MockSdFat&) = delete;
     MockSdFat& operator=(const MockSdFat&) = delete;
 
+    /*
+     * A RAM file for random access block reads and writes (B+tree pages).
+     * The data is kept '\0'-terminated, so text files can be read as strings
+     */
+    struct BlockFile {
+      char* name = nullptr;
+      uint8_t* data = nullptr;
+      uint32_t size = 0;
+      uint32_t capacity = 0;
+      bool read(uint32_t offset, uint8_t* buffer, uint16_t len) {
+        if (offset + len > size) return false;
+        memcpy(buffer, data + offset, len);
+        return true;
+      };
+      bool write(uint32_t offset, const uint8_t* buffer, size_t len) {
+        if (offset > size) return false;
+        if (offset + len + 1 > capacity) {
+          uint32_t grownCapacity = capacity ? capacity : 64;
+          while (grownCapacity < offset + len + 1) grownCapacity *= 2;
+          uint8_t* grown = static_cast<uint8_t*>(realloc(data, grownCapacity));
+          if (!grown) return false;
+          data = grown;
+          capacity = grownCapacity;
+        }
+        memcpy(data + offset, buffer, len);
+        if (offset + len > size) {
+          size = offset + len;
+          data[size] = '\0';
+        }
+        return true;
+      };
+      bool truncate(uint32_t offset) {
+        if (offset > size) return false;
+        size = offset;
+        if (data) data[size] = '\0';
+        return true;
+      };
+      void clear() {
+        if (name) free(name);
+        if (data) free(data);
+        name = nullptr;
+        data = nullptr;
+        size = 0;
+        capacity = 0;
+      };
+    };
+
+    /*
+     * A filesystem of real files and directories held in RAM, for running
+     * whole workloads (throughput benchmarks, power failures part way through
+     * an operation) instead of scripting each call. Point TestState::fs at
+     * one, and every MockSdFat call made with that state works on its files:
+     * the on...Return, on...Data and ...Captor fields are then ignored.
+     *
+     * Like SdFat, files can only be created in a directory that exists,
+     * rename() fails if the new name is taken, and remove() only removes
+     * files. Directories can't be renamed.
+     */
+    class RamFs {
+
+      public:
+        struct Stats {
+          uint32_t opens = 0;           // files opened for reading or writing
+          uint32_t dirOps = 0;          // exists, isDirectory, mkdir, remove and rename calls, and directory opens
+          uint32_t bytesRead = 0;
+          uint32_t bytesWritten = 0;
+        };
+
+        struct RamFile;
+
+        // Writes from a position in a file, straight into its data
+        class Writer: public Stream {
+          public:
+            Writer(RamFs* fs, RamFile* file): _fs(fs), _file(file) {};
+            int available() override { return 0; };
+            int peek() override { return -1; };
+            int read() override { return -1; };
+            size_t write(uint8_t c) override { return write(&c, 1); };
+            size_t write(const uint8_t* buffer, size_t len) override {
+              if (_fs->isPoweredOff || !_file->write(_pos, buffer, len)) return 0;
+              _pos += len;
+              _fs->stats.bytesWritten += len;
+              return len;
+            };
+            void seek(uint32_t pos) { _pos = pos; };
+          private:
+            RamFs* _fs;
+            RamFile* _file;
+            uint32_t _pos = 0;
+        };
+
+        // A file's one writer lives as long as the file does
+        struct RamFile: public BlockFile {
+          bool isDir = false;
+          Writer writer;
+          RamFile(RamFs* fs): writer(fs, this) {};
+          ~RamFile() { clear(); };
+        };
+
+        Stats stats;
+        /*
+         * Counts down on every change (opening a file for writing, mkdir,
+         * remove, rename, appendFile). When it reaches 0 the power is cut:
+         * that change and all the ones after it fail, and so do writes to
+         * streams that are already open. 0 means never.
+         */
+        uint32_t failAfter = 0;
+        bool isPoweredOff = false;
+        bool failNextOpen = false;    // the next open for writing fails, and nothing else does
+
+        RamFs() {};
+        ~RamFs() {
+          for (uint16_t i = 0; i < _count; i++) delete _files[i];
+          if (_files) free(_files);
+        };
+
+        // Disable moving and copying
+        RamFs(RamFs&& other) = delete;
+        RamFs& operator=(RamFs&& other) = delete;
+        RamFs(const RamFs&) = delete;
+        RamFs& operator=(const RamFs&) = delete;
+
+        // Files and directories, in no particular order
+        uint16_t getFileCount() const { return _count; };
+        const char* getFilename(uint16_t i) const { return i < _count ? _files[i]->name : nullptr; };
+        void resetStats() { stats = Stats(); };
+
+        // The file's contents, or nullptr if it doesn't exist
+        const char* getData(const char* filename) {
+          RamFile* file = _find(filename);
+          if (!file || file->isDir) return nullptr;
+          return file->data ? reinterpret_cast<const char*>(file->data) : "";
+        };
+
+        uint32_t fileSize(const char* filename) {
+          RamFile* file = _find(filename);
+          return (file && !file->isDir) ? file->size : 0;
+        };
+
+        bool exists(const char* filename) {
+          stats.dirOps++;
+          return _find(filename) != nullptr;
+        };
+
+        bool isDirectory(const char* filename) {
+          stats.dirOps++;
+          RamFile* file = _find(filename);
+          return file && file->isDir;
+        };
+
+        /*
+         * Writes the name (not the path) of the first thing in the directory
+         * that sorts after the name after (from the start if it's empty).
+         * Going by name rather than position means entries can be removed
+         * along the way, as they can from a FAT directory. Returns false
+         * once there's nothing left.
+         */
+        bool nextInDir(const char* filename, const char* after, char* name, size_t len) {
+          stats.dirOps++;
+          size_t dirLen = strlen(filename);
+          const char* next = nullptr;
+          for (uint16_t i = 0; i < _count; i++) {
+            const char* entry = _files[i]->name;
+            if (strncmp(entry, filename, dirLen) != 0 || entry[dirLen] != '/') continue;
+            entry += dirLen + 1;
+            if (strchr(entry, '/') || strcmp(entry, after) <= 0) continue;
+            if (!next || strcmp(entry, next) < 0) next = entry;
+          }
+          if (!next || len == 0) return false;
+          strncpy(name, next, len - 1);
+          name[len - 1] = '\0';
+          return true;
+        };
+
+        bool mkdir(const char* filename) {
+          stats.dirOps++;
+          if (_find(filename) || !_isParentDir(filename) || !_change()) return false;
+          RamFile* dir = _add(filename);
+          if (dir) dir->isDir = true;
+          return dir != nullptr;
+        };
+
+        bool remove(const char* filename) {
+          stats.dirOps++;
+          for (uint16_t i = 0; i < _count; i++) {
+            if (strcmp(_files[i]->name, filename) != 0) continue;
+            if (_files[i]->isDir || !_change()) return false;
+            delete _files[i];
+            _files[i] = _files[--_count];
+            return true;
+          }
+          return false;
+        };
+
+        bool rename(const char* oldFilename, const char* newFilename) {
+          stats.dirOps++;
+          RamFile* file = _find(oldFilename);
+          if (!file || file->isDir || _find(newFilename) || !_isParentDir(newFilename)) return false;
+          if (!_change()) return false;
+          char* name = strdup(newFilename);
+          if (!name) return false;
+          free(file->name);
+          file->name = name;
+          return true;
+        };
+
+        // Renames over newFilename if it exists, as one change, like POSIX rename()
+        bool replace(const char* oldFilename, const char* newFilename) {
+          stats.dirOps++;
+          RamFile* file = _find(oldFilename);
+          RamFile* replaced = _find(newFilename);
+          if (!file || file->isDir || (replaced && replaced->isDir) || !_isParentDir(newFilename)) return false;
+          if (!_change()) return false;
+          char* name = strdup(newFilename);
+          if (!name) return false;
+          for (uint16_t i = 0; replaced && i < _count; i++) {
+            if (_files[i] != replaced) continue;
+            delete replaced;
+            _files[i] = _files[--_count];
+            break;
+          }
+          free(file->name);
+          file->name = name;
+          return true;
+        };
+
+        /*
+         * The file or directory, for a MockSdFat::File, or nullptr if it
+         * can't be opened. Opening a file for writing is a change, which
+         * creates it if create is true, and empties it if truncate is.
+         */
+        RamFile* open(const char* filename, bool forWrite, bool create, bool truncate) {
+          RamFile* file = _find(filename);
+          if (file && file->isDir) {
+            stats.dirOps++;
+            return forWrite ? nullptr : file;
+          }
+          stats.opens++;
+          if (!forWrite) return file;
+          if (failNextOpen) {
+            failNextOpen = false;
+            return nullptr;
+          }
+          if (!_change()) return nullptr;
+          if (!file && create && _isParentDir(filename)) file = _add(filename);
+          if (file && truncate) file->truncate(0);
+          return file;
+        };
+
+        // The file's writer, at offset (or the end, if offset is -1), dropping anything after it
+        Stream* openWrite(const char* filename, int32_t offset = 0) {
+          RamFile* file = open(filename, true, true, false);
+          if (!file || (offset >= 0 && !file->truncate(offset))) return nullptr;
+          file->writer.seek(file->size);
+          return &file->writer;
+        };
+
+      private:
+        RamFile** _files = nullptr;
+        uint16_t _count = 0;
+        uint16_t _capacity = 0;
+
+        RamFile* _find(const char* filename) {
+          for (uint16_t i = 0; i < _count; i++) {
+            if (strcmp(_files[i]->name, filename) == 0) return _files[i];
+          }
+          return nullptr;
+        };
+
+        RamFile* _add(const char* filename) {
+          if (_count == _capacity) {
+            uint16_t grownCapacity = _capacity ? _capacity * 2 : 16;
+            RamFile** grown = static_cast<RamFile**>(realloc(_files, grownCapacity * sizeof(RamFile*)));
+            if (!grown) return nullptr;
+            _files = grown;
+            _capacity = grownCapacity;
+          }
+          RamFile* file = new RamFile(this);
+          file->name = strdup(filename);
+          _files[_count++] = file;
+          return file;
+        };
+
+        // Whether the directory filename would go in exists ("/" always does)
+        bool _isParentDir(const char* filename) {
+          const char* slash = strrchr(filename, '/');
+          if (!slash || slash == filename) return true;
+          size_t len = slash - filename;
+          for (uint16_t i = 0; i < _count; i++) {
+            RamFile* file = _files[i];
+            if (file->isDir && strlen(file->name) == len && strncmp(file->name, filename, len) == 0) return true;
+          }
+          return false;
+        };
+
+        // Counts down to the power failure, returning false once it's happened
+        bool _change() {
+          if (isPoweredOff) return false;
+          if (failAfter > 0 && --failAfter == 0) isPoweredOff = true;
+          return !isPoweredOff;
+        };
+
+    };
+
     struct TestState {
       uint8_t existsCallCount = 0;
       bool onExistsReturn[8] = { false };
       bool onExistsAlways = false;
       bool onExistsAlwaysReturn = false;
+      char* onExistsMissing = nullptr;  // with onExistsAlways, this file still doesn't exist
       bool onIsDirectoryReturn = false;
       bool onRemoveReturn = false;
       bool onRenameReturn = false;
+      bool onAppendReturn = false;
       char* mkdirCaptor = nullptr;
       char* onLoadData = nullptr;
       char* onReadIdxData = nullptr;
+      char* onReadFenceData = nullptr;
+      char* onReadDeltaData = nullptr;
+      uint16_t onReadIdxLines = 0;  // if set, committed index reads are generated instead of onReadIdxData
+      uint16_t generatedLinesRead = 0;  // lines read from generated indexes
       char* loadFilenameCaptor = nullptr;
       char* writeTxnFilenameCaptor = nullptr;
       char* removeCaptor = nullptr;
       char* renameOldCaptor = nullptr;
       char* renameNewCaptor = nullptr;
+      char* appendFilenameCaptor = nullptr;
+      uint32_t appendOffsetCaptor = 0;
       char* readIdxFilenameCaptor = nullptr;
       char* writeIdxFilenameCaptor = nullptr;
+      char* writeAuxFilenameCaptor = nullptr;
       StringStream writeDataCaptor;
       StringStream writeTxnDataCaptor;
       StringStream writeIdxDataCaptor;
+      StringStream writeAuxDataCaptor;
+      BlockFile blockFiles[4];    // USE_PAGES files (see openBlockFile), kept across remove/rename
+      RamFs* fs = nullptr;        // if set, all calls work on its files instead (not owned)
 
       ~TestState() {
+        for (uint8_t i = 0; i < 4; i++) blockFiles[i].clear();
         if (mkdirCaptor) free(mkdirCaptor);
+        if (onExistsMissing) free(onExistsMissing);
         if (onLoadData) free(onLoadData);
         if (loadFilenameCaptor) free(loadFilenameCaptor);
         if (onReadIdxData) free(onReadIdxData);
+        if (onReadFenceData) free(onReadFenceData);
+        if (onReadDeltaData) free(onReadDeltaData);
         if (writeTxnFilenameCaptor) free(writeTxnFilenameCaptor);
         if (removeCaptor) free(removeCaptor);
         if (renameOldCaptor) free(renameOldCaptor);
         if (renameNewCaptor) free(renameNewCaptor);
+        if (appendFilenameCaptor) free(appendFilenameCaptor);
         if (readIdxFilenameCaptor) free(readIdxFilenameCaptor);
         if (writeIdxFilenameCaptor) free(writeIdxFilenameCaptor);
+        if (writeAuxFilenameCaptor) free(writeAuxFilenameCaptor);
         mkdirCaptor = nullptr;
         onLoadData = nullptr;
         onReadIdxData = nullptr;
+        onReadFenceData = nullptr;
+        onReadDeltaData = nullptr;
         loadFilenameCaptor = nullptr;
         writeTxnFilenameCaptor = nullptr;
         removeCaptor = nullptr;
         renameOldCaptor = nullptr;
         renameNewCaptor = nullptr;
+        appendFilenameCaptor = nullptr;
         readIdxFilenameCaptor = nullptr;
         writeIdxFilenameCaptor = nullptr;
+        writeAuxFilenameCaptor = nullptr;
       };
     };
 
+    /*
+     * An open file or directory, like SdFat's File: a handle that can be
+     * copied, and must be closed exactly once. With a RamFs it's one of its
+     * files. Without one it reads a copy of the scripted data, or writes to
+     * the captor, for the FileUse it was opened with (see open(...)).
+     */
+    class File: public Stream {
+
+      public:
+        File() {};
+
+        operator bool() const { return _isOpen; };
+        bool isOpen() const { return _isOpen; };
+        bool isDirectory() const { return _isDir; };
+
+        int available() override {
+          if (_file) return _pos < _file->size ? _file->size - _pos : 0;
+          return _stream ? _stream->available() : 0;
+        };
+        int peek() override {
+          if (_file) return _pos < _file->size ? _file->data[_pos] : -1;
+          return _stream ? _stream->peek() : -1;
+        };
+        int read() override {
+          uint8_t c;
+          return read(&c, 1) == 1 ? c : -1;
+        };
+        int read(void* buffer, size_t len) {
+          uint8_t* bytes = static_cast<uint8_t*>(buffer);
+          size_t n = 0;
+          if (_file) {
+            n = _pos < _file->size ? _file->size - _pos : 0;
+            if (n > len) n = len;
+            if (n > 0) memcpy(bytes, _file->data + _pos, n);
+            if (_fs) _fs->stats.bytesRead += n;
+          } else if (_stream) {
+            int c;
+            while (n < len && (c = _stream->read()) != -1) bytes[n++] = c;
+          } else {
+            return _isOpen ? 0 : -1;
+          }
+          _pos += n;
+          return n;
+        };
+        size_t write(uint8_t c) override { return write(&c, 1); };
+        size_t write(const uint8_t* buffer, size_t len) override {
+          if (!_isOpen || _isReadOnly) return 0;
+          if (_captor) return static_cast<Stream*>(_captor)->write(buffer, len);
+          if (!_file) return len;
+          if ((_fs && _fs->isPoweredOff) || !_file->write(_pos, buffer, len)) return 0;
+          _pos += len;
+          if (_fs) _fs->stats.bytesWritten += len;
+          return len;
+        };
+        using Print::write;
+
+        uint32_t position() { return _pos; };
+        // Generated files can only seek forward
+        bool seek(uint32_t pos) {
+          if (_file) {
+            if (pos > _file->size) return false;
+            _pos = pos;
+            return true;
+          }
+          while (_stream && _pos < pos && _stream->read() != -1) _pos++;
+          return _stream && _pos == pos;
+        };
+        bool seekEnd() {
+          if (_file) _pos = _file->size;
+          return _isOpen;
+        };
+        uint32_t size() {
+          if (_file) return _file->size;
+          if (_captor) return strlen(_captor->get());
+          return _size;
+        };
+        bool truncate(uint32_t length) {
+          if (!_isOpen || _isReadOnly) return false;
+          if (_offsetCaptor) *_offsetCaptor = length;
+          if (_captor) return _truncateCaptor(length);
+          if (!_file || !_file->truncate(length)) return _file == nullptr;
+          _pos = length;
+          return true;
+        };
+        bool close() {
+          bool success = _isOpen && (!_onCloseReturn || *_onCloseReturn);
+          if (_isCopy && _file) {
+            _file->clear();
+            delete _file;
+          }
+          if (_stream) delete _stream;
+          if (_path) free(_path);
+          *this = File();
+          return success;
+        };
+
+        // The next entry of a directory, by name, so entries can be removed along the way
+        File openNextFile() {
+          File entry;
+          if (!_isDir || !_fs || !_path || !_fs->nextInDir(_path, _name, _name, sizeof(_name))) return entry;
+          entry._isOpen = true;
+          strcpy(entry._name, _name);
+          return entry;
+        };
+
+        size_t getName(char* name, size_t size) {
+          if (size == 0 || strlen(_name) >= size) return 0;
+          strcpy(name, _name);
+          return strlen(name);
+        };
+
+      private:
+        bool _isOpen = false;
+        bool _isDir = false;
+        bool _isReadOnly = true;
+        bool _isCopy = false;                   // _file is a copy of scripted data, freed on close
+        RamFs* _fs = nullptr;
+        BlockFile* _file = nullptr;
+        uint32_t _pos = 0;
+        GeneratedIndexStream* _stream = nullptr;    // freed on close
+        StringStream* _captor = nullptr;
+        uint32_t _size = 0;                     // for a sink with no file or captor
+        bool* _onCloseReturn = nullptr;
+        uint32_t* _offsetCaptor = nullptr;
+        char* _path = nullptr;                  // a directory's, freed on close
+        char _name[13] = { '\0' };              // a file's name, or the last entry a directory listed
+
+        // Keeps only the first length bytes written to the captor so far
+        bool _truncateCaptor(uint32_t length) {
+          const char* data = _captor->get();
+          if (length > strlen(data)) return false;
+          char kept[length + 1];
+          memcpy(kept, data, length);
+          kept[length] = '\0';
+          _captor->reset();
+          _captor->print(kept);
+          return true;
+        };
+
+        friend class MockSdFat;
+
+    };
+
     bool begin(uint8_t sdCsPin) { return true; };
+    void end() {};
 
-    bool mkdir(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      ts->mkdirCaptor = strdup(filename);
+    /*
+     * Sets the state, and what the calls after it are for, until the next
+     * time it's called. StorageProvider calls it before each one
+     */
+    void use(void* testState, FileUse use) {
+      _ts = static_cast<TestState*>(testState);
+      _use = use;
+    };
+
+    bool mkdir(const char* filename) {
+      if (_ts->fs) return _ts->fs->mkdir(filename);
+      _capture(&_ts->mkdirCaptor, filename);
       return true;
     };
 
-    bool exists(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
+    bool exists(const char* filename) {
+      TestState* ts = _ts;
+      if (ts->fs) return ts->fs->exists(filename);
       bool result = false;
       if (ts->onExistsAlways) {
-        result = ts->onExistsAlwaysReturn;
+        result = ts->onExistsAlwaysReturn && !(ts->onExistsMissing && strcmp(filename, ts->onExistsMissing) == 0);
       } else {
         result = ts->onExistsReturn[ts->existsCallCount++];
       }
       return result;
     };
 
-    bool remove(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      if (ts->removeCaptor) free(ts->removeCaptor);
-      ts->removeCaptor = nullptr;
-      ts->removeCaptor = strdup(filename);
+    bool remove(const char* filename) {
+      TestState* ts = _ts;
+      if (ts->fs) return ts->fs->remove(filename);
+      _capture(&ts->removeCaptor, filename);
+      BlockFile* file = _findBlockFile(filename, ts);
+      if (file) file->clear();
       return ts->onRemoveReturn;
     };
 
-    bool rename(const char* oldFilename, const char* newFilename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      if (ts->renameOldCaptor) free(ts->renameOldCaptor);
-      ts->renameOldCaptor = nullptr;
-      ts->renameOldCaptor = strdup(oldFilename);
-      if (ts->renameNewCaptor) free(ts->renameNewCaptor);
-      ts->renameNewCaptor = nullptr;
-      ts->renameNewCaptor = strdup(newFilename);
+    bool rename(const char* oldFilename, const char* newFilename) {
+      TestState* ts = _ts;
+      if (ts->fs) return ts->fs->rename(oldFilename, newFilename);
+      _capture(&ts->renameOldCaptor, oldFilename);
+      _capture(&ts->renameNewCaptor, newFilename);
+      BlockFile* file = _findBlockFile(oldFilename, ts);
+      if (file) {
+        BlockFile* replaced = _findBlockFile(newFilename, ts);
+        if (replaced) replaced->clear();
+        free(file->name);
+        file->name = strdup(newFilename);
+      }
       return ts->onRenameReturn;
     };
 
-    Stream* loadFileStream(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      if (ts->loadFilenameCaptor) free(ts->loadFilenameCaptor);
-      ts->loadFilenameCaptor = nullptr;
-      ts->loadFilenameCaptor = strdup(filename);
-      StringStream* ss = new StringStream(ts->onLoadData);
-      return ss;
+    // Scripted like rename(...), with the same captors
+    bool replace(const char* oldFilename, const char* newFilename) {
+      if (_ts->fs) return _ts->fs->replace(oldFilename, newFilename);
+      return rename(oldFilename, newFilename);
     };
 
-    bool isDirectory(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      return ts->onIsDirectoryReturn;
+    /*
+     * Without a RamFs, what a file gets depends on what it's for:
+     *   USE_DTO      reads onLoadData, writes writeDataCaptor
+     *   USE_TXN      writes writeTxnDataCaptor, which holds the whole journal
+     *   USE_INDEX    reads the index data (see _readData(...)), or generated
+     *                lines if onReadIdxLines is set, and appends to writeIdxDataCaptor
+     *   USE_INDEX_REWRITE  empties writeIdxDataCaptor, then writes to it
+     *   USE_AUX      writes writeAuxDataCaptor (never emptied when opened, but
+     *                it can be truncated), reads onReadFenceData, or what was
+     *                written to a tmp file
+     *   USE_SIZE     is the size of the index data
+     *   USE_APPEND   opens any source, and any destination, which captures
+     *                the offset it's truncated to and closes with onAppendReturn
+     *   USE_PAGES    is one of blockFiles
+     *   USE_DIR      is an empty directory
+     *   USE_IS_DIR   is a directory if onIsDirectoryReturn is set
+     */
+    File open(const char* filename, int flags = O_RDONLY) {
+      TestState* ts = _ts;
+      File file;
+      bool forWrite = (flags & O_ACCMODE) != O_RDONLY;
+      const char* slash = strrchr(filename, '/');
+      strncpy(file._name, slash ? slash + 1 : filename, sizeof(file._name) - 1);
+      file._isReadOnly = !forWrite;
+
+      if (ts->fs) {
+        RamFs::RamFile* ramFile = ts->fs->open(filename, forWrite, flags & O_CREAT, flags & O_TRUNC);
+        if (!ramFile) return file;
+        file._fs = ts->fs;
+        file._isDir = ramFile->isDir;
+        if (file._isDir) {
+          file._path = strdup(filename);
+          file._name[0] = '\0';
+        } else {
+          file._file = ramFile;
+          if (flags & O_AT_END) file._pos = ramFile->size;
+        }
+        file._isOpen = true;
+        return file;
+      }
+
+      const char* data = nullptr;
+      switch (_use) {
+        case USE_DTO:
+          if (forWrite) {
+            file._captor = &ts->writeDataCaptor;
+          } else {
+            _capture(&ts->loadFilenameCaptor, filename);
+            data = ts->onLoadData;
+          }
+          break;
+        case USE_TXN:
+          _capture(&ts->writeTxnFilenameCaptor, filename);
+          file._captor = &ts->writeTxnDataCaptor;
+          break;
+        case USE_INDEX_REWRITE:
+          ts->writeIdxDataCaptor.reset();
+          // Fall through
+        case USE_INDEX:
+          if (forWrite) {
+            _capture(&ts->writeIdxFilenameCaptor, filename);
+            file._captor = &ts->writeIdxDataCaptor;
+          } else {
+            _capture(&ts->readIdxFilenameCaptor, filename);
+            if (ts->onReadIdxLines > 0 && !_hasExtension(filename, ".tmp")) {
+              file._stream = new GeneratedIndexStream(ts->onReadIdxLines, &ts->generatedLinesRead);
+            } else {
+              data = _readData(filename, ts);
+            }
+          }
+          break;
+        case USE_AUX:
+          if (forWrite) {
+            _capture(&ts->writeAuxFilenameCaptor, filename);
+            file._captor = &ts->writeAuxDataCaptor;
+          } else {
+            data = _hasExtension(filename, ".tmp") ? ts->writeAuxDataCaptor.get() : ts->onReadFenceData;
+            if (!data) return file;
+          }
+          break;
+        case USE_SIZE:
+          data = _readData(filename, ts);
+          break;
+        case USE_APPEND:
+          if (forWrite) {
+            _capture(&ts->appendFilenameCaptor, filename);
+            file._offsetCaptor = &ts->appendOffsetCaptor;
+            file._onCloseReturn = &ts->onAppendReturn;
+            file._size = 0xFFFFFFFF;
+          }
+          break;
+        case USE_PAGES:
+          file._file = openBlockFile(filename, forWrite && (flags & O_CREAT), ts);
+          if (!file._file) return file;
+          break;
+        case USE_DIR:
+          file._isDir = true;
+          break;
+        case USE_IS_DIR:
+          file._isDir = ts->onIsDirectoryReturn;
+          break;
+        default:
+          break;
+      }
+      if (data) {
+        file._file = new BlockFile();
+        file._isCopy = true;
+        file._file->write(0, reinterpret_cast<const uint8_t*>(data), strlen(data));
+      }
+      file._isOpen = true;
+      return file;
     };
 
-    Stream* writeFileStream(const char* filename, void* testState) {
+    // One of blockFiles, creating it if create is true. Tests can use it to set up or check a page file
+    BlockFile* openBlockFile(const char* filename, bool create, void* testState) {
       TestState* ts = static_cast<TestState*>(testState);
-      return &(ts->writeDataCaptor);
+      BlockFile* file = _findBlockFile(filename, ts);
+      for (uint8_t i = 0; !file && create && i < 4; i++) {
+        if (!ts->blockFiles[i].name) {
+          file = &ts->blockFiles[i];
+          file->name = strdup(filename);
+        }
+      }
+      return file;
     };
 
-    Stream* writeTxnFileStream(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      if (ts->writeTxnFilenameCaptor) free(ts->writeTxnFilenameCaptor);
-      ts->writeTxnFilenameCaptor = nullptr;
-      ts->writeTxnFilenameCaptor = strdup(filename);
-      return &(ts->writeTxnDataCaptor);
+  private:
+    TestState* _ts = nullptr;
+    FileUse _use = USE_ANY;
+
+    void _capture(char** captor, const char* filename) {
+      if (*captor) free(*captor);
+      *captor = strdup(filename);
     };
 
-    Stream* readIndexFileStream(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      if (ts->readIdxFilenameCaptor) free(ts->readIdxFilenameCaptor);
-      ts->readIdxFilenameCaptor = nullptr;
-      ts->readIdxFilenameCaptor = strdup(filename);
-      StringStream* ss = new StringStream(ts->onReadIdxData);
-      return ss;
+    BlockFile* _findBlockFile(const char* filename, TestState* ts) {
+      for (uint8_t i = 0; i < 4; i++) {
+        if (ts->blockFiles[i].name && strcmp(ts->blockFiles[i].name, filename) == 0) return &ts->blockFiles[i];
+      }
+      return nullptr;
     };
 
-    Stream* writeIndexFileStream(const char* filename, void* testState) {
-      TestState* ts = static_cast<TestState*>(testState);
-      if (ts->writeIdxFilenameCaptor) free(ts->writeIdxFilenameCaptor);
-      ts->writeIdxFilenameCaptor = nullptr;
-      ts->writeIdxFilenameCaptor = strdup(filename);
-      return &(ts->writeIdxDataCaptor);
+    // Delta logs read onReadDeltaData, tmp files read back whatever was written to them
+    const char* _readData(const char* filename, TestState* ts) {
+      if (_hasExtension(filename, ".dlt")) return ts->onReadDeltaData;
+      if (_hasExtension(filename, ".tmp")) return ts->writeIdxDataCaptor.get();
+      return ts->onReadIdxData;
+    };
+
+    bool _hasExtension(const char* filename, const char* ext) {
+      size_t len = strlen(filename);
+      return len >= 4 && strcmp(filename + len - 4, ext) == 0;
     };
 
 };
 
+typedef MockSdFat::File File;
+
 
 #endif
\ No newline at end of file
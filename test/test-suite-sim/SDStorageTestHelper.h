@@ -3,6 +3,11 @@
 
 
 #include <Arduino.h>
+#include <StreamableManager.h>
+#include <StringStream.h>
+#include <sdstorage/BloomFilter.h>
+#include <sdstorage/BTreeIndex.h>
+#include <sdstorage/FenceIndex.h>
 #include <sdstorage/FileHelper.h>
 #include <sdstorage/IndexHelpers.h>
 #include <sdstorage/Strings.h>
@@ -45,6 +50,15 @@ class SDStorageTestHelper {
     bool getIndexFilename(SDStorage* sdStorage, Index idx, char* buffer, size_t bufferSize) {
       return sdStorage->_fileHelper.indexFilename(idx, buffer, bufferSize);
     };
+    Transaction* loadTxn(SDStorage* sdStorage, const char* txnFilename, void* testState) {
+      return sdStorage->_txnManager->loadTxn(txnFilename, testState);
+    };
+    char* getTmpFilename(Transaction* txn, const char* filename) {
+      return txn->getTmpFilename(filename);
+    };
+    char* getAuxTmpFilename(SDStorage* sdStorage, Transaction* txn, const char* filename, void* testState) {
+      return sdStorage->_txnManager->getAuxTmpFilename(txn, filename, testState);
+    };
     FileHelper::Filename toFilename(const __FlashStringHelper* filename) {
       return FileHelper::Filename(filename);
     };
@@ -58,6 +72,140 @@ class SDStorageTestHelper {
       free(l);
       return result;
     };
+    IndexLineView viewIndexLine(const __FlashStringHelper* line, char* scratch, size_t scratchSize) {
+      char l[strlen_P(reinterpret_cast<const char*>(line)) + 1];
+      strcpy_P(l, reinterpret_cast<const char*>(line));
+      return IndexHelpers::viewIndexLine(l, scratch, scratchSize);
+    };
+    void writeFenceRecord(Stream* dest, const char* key, uint32_t offset) {
+      FenceIndex::writeRecord(dest, key, offset);
+    };
+    FenceIndex::Result fenceSearch(const char* key, bool isPrefix, const char* fence, uint32_t indexSize,
+          FenceIndex::Range* range) {
+      auto reader = [](uint32_t recordNum, char* record, void* ctx) -> bool {
+        const char* f = static_cast<const char*>(ctx);
+        memcpy(record, f + recordNum * FenceIndex::FENCE_RECORD_SIZE, FenceIndex::FENCE_RECORD_SIZE);
+        return true;
+      };
+      return FenceIndex::search(key, isPrefix, strlen(fence), indexSize, reader, const_cast<char*>(fence), range);
+    };
+    // Builds a fence for index (lines ending in '\n'), one line at a time
+    void fenceFromLines(const char* index, Stream* dest) {
+      FenceIndex::Writer fence(dest);
+      char line[FenceIndex::FENCE_RECORD_SIZE];
+      while (*index) {
+        const char* eol = strchr(index, '\n');
+        size_t len = eol - index;
+        if (len >= sizeof(line)) len = sizeof(line) - 1;
+        strncpy(line, index, len);
+        line[len] = '\0';
+        fence.addLine(line);
+        index = eol + 1;
+      }
+      fence.finish();
+    };
+    // Same, but feeding everything after the first line as raw chunkSize byte chunks
+    void fenceFromBytes(const char* index, size_t chunkSize, Stream* dest) {
+      FenceIndex::Writer fence(dest);
+      const char* eol = strchr(index, '\n');
+      char line[FenceIndex::FENCE_RECORD_SIZE];
+      size_t len = eol - index;
+      if (len >= sizeof(line)) len = sizeof(line) - 1;
+      strncpy(line, index, len);
+      line[len] = '\0';
+      fence.addLine(line);
+      const uint8_t* bytes = reinterpret_cast<const uint8_t*>(eol + 1);
+      size_t remaining = strlen(eol + 1);
+      while (remaining > 0) {
+        size_t n = remaining < chunkSize ? remaining : chunkSize;
+        fence.addBytes(bytes, n);
+        bytes += n;
+        remaining -= n;
+      }
+      fence.finish();
+    };
+
+    // B+tree pages in RAM
+    struct RamPages {
+      uint8_t* data;
+      uint32_t count;
+      RamPages(uint32_t count): data(static_cast<uint8_t*>(malloc(count * BTreeIndex::PAGE_SIZE))), count(count) {};
+      ~RamPages() { if (data) free(data); };
+    };
+    void ramPager(RamPages* pages, BTreeIndex::Pager* pager) {
+      pager->read = [](uint32_t pageNum, uint8_t* page, void* ctx) -> bool {
+        RamPages* p = static_cast<RamPages*>(ctx);
+        if (!p->data || pageNum >= p->count) return false;
+        memcpy(page, p->data + pageNum * BTreeIndex::PAGE_SIZE, BTreeIndex::PAGE_SIZE);
+        return true;
+      };
+      pager->write = [](uint32_t pageNum, const uint8_t* page, void* ctx) -> bool {
+        RamPages* p = static_cast<RamPages*>(ctx);
+        if (!p->data || pageNum >= p->count) return false;
+        memcpy(p->data + pageNum * BTreeIndex::PAGE_SIZE, page, BTreeIndex::PAGE_SIZE);
+        return true;
+      };
+      pager->ctx = pages;
+    };
+    bool btUpsert(BTreeIndex::Header* header, BTreeIndex::Pager* pager, const char* key, const char* value) {
+      return BTreeIndex::upsert(header, pager, key, value);
+    };
+    BTreeIndex::Result btRemove(BTreeIndex::Header* header, BTreeIndex::Pager* pager, const char* key) {
+      return BTreeIndex::remove(header, pager, key);
+    };
+    // Scans the whole tree into a comma-separated list of its keys
+    bool btScanKeys(BTreeIndex::Header* header, BTreeIndex::Pager* pager, StringStream* dest) {
+      auto append = [](const char* line, StreamableManager::DestinationStream* d, void* statePtr) -> bool {
+        StringStream* keys = static_cast<StringStream*>(statePtr);
+        while (*line && *line != '=') keys->print(*line++);
+        keys->print(',');
+        return true;
+      };
+      return BTreeIndex::scan(header, pager, nullptr, append, dest);
+    };
+    bool btLookup(BTreeIndex::Header* header, BTreeIndex::Pager* pager, const char* key, char* buffer, size_t bufferSize) {
+      struct Lookup { const char* key; char* buffer; size_t bufferSize; bool found; } lookup = { key, buffer, bufferSize, false };
+      auto match = [](const char* line, StreamableManager::DestinationStream* d, void* statePtr) -> bool {
+        Lookup* l = static_cast<Lookup*>(statePtr);
+        const char* eq = strchr(line, '=');
+        size_t keyLen = strlen(l->key);
+        if (eq && static_cast<size_t>(eq - line) == keyLen && strncmp(line, l->key, keyLen) == 0) {
+          strncpy(l->buffer, eq + 1, l->bufferSize - 1);
+          l->buffer[l->bufferSize - 1] = '\0';
+          l->found = true;
+        }
+        return false; // only the first entry at or after the key can match
+      };
+      return BTreeIndex::scan(header, pager, key, match, &lookup) && lookup.found;
+    };
+    bool btBulkLoad(BTreeIndex::Header* header, BTreeIndex::Pager* pager, 
+          void (*entry)(uint8_t n, char* key, char* value), uint8_t count) {
+      BTreeIndex::Builder builder(header, pager);
+      char key[BTreeIndex::MAX_KEY_LENGTH + 1];
+      char value[BTreeIndex::MAX_RECORD_SIZE];
+      for (uint8_t n = 0; n < count; n++) {
+        entry(n, key, value);
+        if (!builder.add(key, value)) return false;
+      }
+      return builder.finish();
+    };
+    bool getBloomFilename(SDStorage* sdStorage, Index idx, char* buffer, size_t bufferSize) {
+      char idxFilename[FileHelper::MAX_FILENAME_LENGTH];
+      return sdStorage->_fileHelper.indexFilename(idx, idxFilename, FileHelper::MAX_FILENAME_LENGTH)
+            && FileHelper::sidecarFilename(idxFilename, _SDSTORAGE_BLOOM_EXTSN, buffer, bufferSize);
+    };
+    uint32_t bloomBlocksFor(uint32_t keyCount) {
+      return BloomFilter::blocksFor(keyCount);
+    };
+    bool bloomCreate(BTreeIndex::Pager* pager, BloomFilter::Header* header, uint32_t blockCount) {
+      return BloomFilter::create(pager, header, blockCount);
+    };
+    bool bloomAdd(BTreeIndex::Pager* pager, BloomFilter::Header* header, const char* key) {
+      return BloomFilter::add(pager, header, key);
+    };
+    BloomFilter::Result bloomContains(BTreeIndex::Pager* pager, const char* key) {
+      return BloomFilter::contains(pager, key);
+    };
 };
 
 
@@ -18,7 +18,8 @@ done
 
 COMPILE_CMD="arduino-cli compile -e -b arduino:avr:mega \
   --libraries ~/Arduino/libraries \
-  --build-property build.extra_flags=\"-DDEBUG -D__SDSTORAGE_TEST\""
+  --build-property build.extra_flags=\"-DDEBUG -D__SDSTORAGE_TEST\" \
+  --build-property compiler.c.elf.extra_flags=\"-Wl,--wrap=malloc\""
 
 if $SIM_MODE; then
   # Capture verbose output to extract the avr-objcopy path, but still display it
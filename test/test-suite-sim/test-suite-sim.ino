@@ -5,6 +5,14 @@
 #include "MockSdFat.h"
 #include "SDStorageTestHelper.h"
 
+// Counts heap allocations. build.sh links with -Wl,--wrap=malloc
+volatile uint32_t mallocCount = 0;
+extern "C" void* __real_malloc(size_t size);
+extern "C" void* __wrap_malloc(size_t size) {
+  mallocCount++;
+  return __real_malloc(size);
+}
+
 SDStorageTestHelper helper;
 StreamableManager _streams;
 SDStorage* sdStorage = nullptr;
@@ -20,6 +28,8 @@ void errFunction() {
 void before() {
   if (!sdStorage) {
     sdStorage = new SDStorage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+    // Tests script every exists() call, so none can be answered from the cache
+    sdStorage->setEntryCaching(false);
     MockSdFat::TestState ts;
     ts.onExistsReturn[0] = false; // root exists?
     ts.onExistsReturn[1] = false; // workdir exists?
@@ -28,6 +38,13 @@ void before() {
   }
 }
 
+// Scripts the exists() calls for the next operation
+void scriptExists(MockSdFat::TestState* ts, bool e0, bool e1 = false, bool e2 = false, bool e3 = false, bool e4 = false, bool e5 = false) {
+  ts->existsCallCount = 0;
+  bool script[] = { e0, e1, e2, e3, e4, e5 };
+  for (uint8_t i = 0; i < 6; i++) ts->onExistsReturn[i] = script[i];
+}
+
 void testBegin(TestInvocation* t) {
   t->setName(F("SDStorage initialization"));
   t->assert(beginSuccess, F("begin() failed"));
@@ -36,6 +53,37 @@ void testBegin(TestInvocation* t) {
   t->assertEqual(helper.getIdxDir(sdStorage), F("/TESTROOT/~IDX"));
 }
 
+void testCleanShutdown(TestInvocation* t) {
+  t->setName(F("Clean-shutdown marker lets begin() skip recovery"));
+  MockSdFat::TestState ts;
+  ts.onRemoveReturn = true;
+  scriptExists(&ts, true, false); // file1.dat exists, its tmp file doesn't
+  Transaction* txn = sdStorage->beginTxn(&ts, F("file1.dat"));
+  t->assert(txn, F("beginTxn failed"));
+  t->assert(!sdStorage->sync(&ts), F("Should not mark clean with a txn open"));
+  t->assert(!ts.writeAuxFilenameCaptor, F("Marker should not have been written"));
+  if (txn) delete txn;
+  t->assert(sdStorage->sync(&ts), F("sync failed"));
+  t->assertEqual(ts.writeAuxFilenameCaptor, F("/TESTROOT/~CLEAN"), F("Marker not written"));
+
+  scriptExists(&ts, true); // the marker exists
+  t->assert(sdStorage->begin(&ts), F("begin failed"));
+  t->assertEqual(ts.existsCallCount, 1, F("begin should only check for the marker"));
+  t->assert(!ts.mkdirCaptor, F("begin should not create directories"));
+
+  scriptExists(&ts, true, false);
+  txn = sdStorage->beginTxn(&ts, F("file1.dat"));
+  t->assert(txn, F("beginTxn failed"));
+  t->assertEqual(ts.removeCaptor, F("/TESTROOT/~CLEAN"), F("Marker should be removed before the txn file is written"));
+  if (txn) delete txn;
+  free(ts.removeCaptor);
+  ts.removeCaptor = nullptr;
+  scriptExists(&ts, true, false);
+  txn = sdStorage->beginTxn(&ts, F("file1.dat"));
+  t->assert(!ts.removeCaptor, F("Marker should only be removed once"));
+  if (txn) delete txn;
+}
+
 void testConstructor(TestInvocation* t) {
   t->setName(F("Constructor/destructor memory leaks"));
   auto errFunc = []() {};
@@ -194,6 +242,147 @@ void testCreateTransaction_existingTmpFile(TestInvocation* t) {
   if (txn) delete txn;
 }
 
+void testLockTable(TestInvocation* t) {
+  t->setName(F("Lock table"));
+  LockTable locks;
+  int txn1, txn2; // owners
+  char path[16];
+  t->assert(locks.tryLock("/A/FILE.DAT", &txn1) == LockTable::LOCKED, F("Lock failed"));
+  t->assert(locks.tryLock("/A/FILE.DAT", &txn1) == LockTable::LOCKED, F("Owner should be able to lock again"));
+  t->assert(locks.tryLock("/A/FILE.DAT", &txn2) == LockTable::BUSY, F("Lock should be held by txn1"));
+  t->assert(!locks.lock("/A/FILE.DAT", &txn2, 5), F("Lock should have timed out"));
+  locks.unlock("/A/FILE.DAT", &txn2);
+  t->assert(locks.isLocked("/A/FILE.DAT"), F("Only the owner can unlock"));
+  locks.unlock("/A/FILE.DAT", &txn1);
+  t->assert(!locks.isLocked("/A/FILE.DAT"), F("Unlock failed"));
+
+  // More paths than buckets, so buckets chain
+  for (uint8_t i = 0; i < LockTable::CAPACITY; i++) {
+    sprintf(path, "/F%02u.DAT", i);
+    t->assert(locks.lock(path, &txn1, 0), F("Lock failed"));
+  }
+  t->assert(locks.tryLock("/MORE.DAT", &txn2) == LockTable::FULL, F("Table should be full"));
+  locks.unlock("/F07.DAT", &txn1);
+  locks.unlock("/F03.DAT", &txn1);
+  bool allLocked = true;
+  for (uint8_t i = 0; i < LockTable::CAPACITY; i++) {
+    sprintf(path, "/F%02u.DAT", i);
+    allLocked &= (locks.isLocked(path) == (i != 7 && i != 3));
+  }
+  t->assert(allLocked, F("Unlocking from a chain lost other locks"));
+  t->assert(locks.lock("/MORE.DAT", &txn2, 0), F("Freed slot should be reused"));
+  locks.unlock("/F00.DAT", &txn1);
+
+  // Both have the FNV-1a hash 0xA0EE63A9
+  t->assert(LockTable::hash("/C01475B.DAT") == LockTable::hash("/C05E8C8.DAT"), F("Paths should collide"));
+  t->assert(locks.lock("/C01475B.DAT", &txn1, 0), F("Lock failed"));
+  t->assert(locks.tryLock("/C05E8C8.DAT", &txn1) == LockTable::COLLISION, F("Same owner shouldn't get a colliding lock"));
+  t->assert(!locks.lock("/C05E8C8.DAT", &txn2, LockTable::WAIT_FOREVER), F("Colliding lock should fail, not wait"));
+  t->assert(!locks.isLocked("/C05E8C8.DAT"), F("Colliding path isn't locked"));
+  locks.unlock("/C05E8C8.DAT", &txn1);
+  t->assert(locks.isLocked("/C01475B.DAT"), F("Unlocking a colliding path released the lock"));
+  locks.unlock("/C01475B.DAT", &txn1);
+
+  const LockTable::Stats& stats = locks.stats();
+  t->assertEqual(stats.held, 14, F("Wrong held count"));
+  t->assertEqual(stats.maxHeld, LockTable::CAPACITY, F("Wrong max held count"));
+  t->assertEqual(stats.acquired, LockTable::CAPACITY + 3, F("Wrong acquired count"));
+  t->assertEqual(stats.contended, 2, F("Wrong contended count"));
+  t->assertEqual(stats.timeouts, 1, F("Wrong timeout count"));
+  t->assertEqual(stats.full, 1, F("Wrong full count"));
+  t->assertEqual(stats.collisions, 2, F("Wrong collision count"));
+  t->assert(stats.maxWaitMs >= 5, F("Wait not timed"));
+}
+
+void testTryBeginTxn(TestInvocation* t) {
+  t->setName(F("Try to begin a transaction on a locked file"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // file1.dat exists
+  ts.onExistsReturn[1] = false; // file1's temp file does not exist yet
+  ts.onExistsReturn[2] = true; // file2.dat exists
+  ts.onExistsReturn[3] = false; // file2's temp file does not exist yet
+  ts.onExistsReturn[4] = true; // file1.dat exists for the second txn
+  sdStorage->resetLockStats();
+
+  Transaction* txn1 = sdStorage->beginTxn(&ts, F("file1.dat"));
+  t->assert(txn1, F("beginTxn failed"));
+  Transaction* txn2 = sdStorage->tryBeginTxn(&ts, 0, F("file2.dat"), F("file1.dat"));
+  t->assert(!txn2, F("file1.dat is locked by txn1"));
+  t->assertEqual(sdStorage->getLockStats().held, 1, F("txn2 should have released file2.dat"));
+  t->assertEqual(sdStorage->getLockStats().contended, 1, F("Contention not counted"));
+
+  // Implicit txns give up too
+  sdStorage->setLockTimeout(0);
+  ts.existsCallCount = 0;
+  ts.onExistsReturn[0] = true; // file1.dat exists
+  StreamableDTO dto;
+  t->assert(!sdStorage->save(&ts, F("file1.dat"), &dto), F("Save should not wait for txn1"));
+  t->assertEqual(sdStorage->getLockStats().timeouts, 2, F("Save should have failed on the lock"));
+  sdStorage->setLockTimeout(LockTable::WAIT_FOREVER);
+
+  ts.onRemoveReturn = true;
+  t->assert(sdStorage->abortTxn(txn1, &ts), F("abortTxn failed"));
+  ts.existsCallCount = 0;
+  ts.onExistsReturn[0] = true; // file1.dat exists
+  ts.onExistsReturn[1] = false; // file1's temp file does not exist yet
+  txn2 = sdStorage->tryBeginTxn(&ts, 0, F("file1.dat"));
+  t->assert(txn2, F("file1.dat should be unlocked"));
+  if (txn2) delete txn2;
+  t->assertEqual(sdStorage->getLockStats().held, 0, F("Locks left behind"));
+}
+
+void testGroupCommit(TestInvocation* t) {
+  t->setName(F("Group commit of implicit saves"));
+  MockSdFat::TestState ts;
+  StreamableDTO dto;
+  dto.put("k", "v");
+  t->assert(sdStorage->setGroupCommit(3, 0, &ts), F("setGroupCommit failed"));
+
+  scriptExists(&ts, true, false); // file1.dat exists, its tmp file doesn't
+  t->assert(sdStorage->save(&ts, F("file1.dat"), &dto), F("First save failed"));
+  scriptExists(&ts, true, false); // same for file2.dat
+  t->assert(sdStorage->save(&ts, F("file2.dat"), &dto), F("Second save failed"));
+  t->assert(ts.renameOldCaptor == nullptr, F("Nothing should be committed yet"));
+  t->assert(contains(ts.writeTxnDataCaptor.get(), F("file1.dat")) && contains(ts.writeTxnDataCaptor.get(), F("file2.dat")),
+        F("Both files should be in the group's txn file"));
+
+  scriptExists(&ts, true); // the group's tmp file exists
+  StreamableDTO loaded;
+  t->assert(sdStorage->load(F("file1.dat"), &loaded, &ts), F("Load failed"));
+  t->assert(endsWith(ts.loadFilenameCaptor, F(".tmp")), F("Load should read the save waiting in the group"));
+  t->assert(sdStorage->exists(F("file2.dat"), &ts), F("Saved file should exist"));
+
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onRenameReturn = true;
+  ts.onRemoveReturn = true;
+  t->assert(sdStorage->save(&ts, F("file1.dat"), &dto), F("Third save failed"));
+  t->assert(endsWith(ts.renameOldCaptor, F(".dat")) || endsWith(ts.renameNewCaptor, F(".dat")), F("Group should have been committed"));
+  t->assert(endsWith(ts.removeCaptor, F(".cmt")), F("Last file removed should have been .cmt file"));
+  t->assertEqual(sdStorage->getLockStats().held, 0, F("Group should have released its locks"));
+
+  // An explicit txn on a file in the group commits the group first
+  ts.onExistsAlways = false;
+  scriptExists(&ts, true, false);
+  t->assert(sdStorage->save(&ts, F("file1.dat"), &dto), F("Save failed"));
+  free(ts.removeCaptor);
+  ts.removeCaptor = nullptr;
+  scriptExists(&ts, true, false); // file2.dat exists, its tmp file doesn't
+  Transaction* txn = sdStorage->tryBeginTxn(&ts, 0, F("file2.dat"));
+  t->assert(txn, F("beginTxn on a file not in the group failed"));
+  t->assert(ts.removeCaptor == nullptr, F("Group should still be waiting"));
+  delete txn;
+  // file1.dat exists, then the group's commit moves its tmp file over file1.dat, then the new tmp file doesn't exist
+  scriptExists(&ts, true, false);
+  txn = sdStorage->tryBeginTxn(&ts, 0, F("file1.dat"));
+  t->assert(endsWith(ts.removeCaptor, F(".cmt")), F("Group should have been committed first"));
+  t->assert(txn, F("beginTxn on a file in the group failed"));
+  delete txn;
+  t->assertEqual(sdStorage->getLockStats().held, 0, F("Locks left behind"));
+
+  t->assert(sdStorage->setGroupCommit(0, 0, &ts), F("setGroupCommit failed"));
+}
+
 void testTransactionalEraseFile_happyPath(TestInvocation* t) {
   t->setName(F("Transactional erase file - happy path"));
   MockSdFat::TestState ts;
@@ -213,6 +402,79 @@ void testTransactionalEraseFile_happyPath(TestInvocation* t) {
   if (txn) delete txn;
 }
 
+void testTxnJournal(TestInvocation* t) {
+  t->setName(F("Transaction file is an append-only journal"));
+  MockSdFat::TestState ts;
+  scriptExists(&ts, true, false, true, false, true, true); // both files and not their tmp files, then erases
+
+  Transaction* txn = sdStorage->beginTxn(&ts, F("file1.dat"), F("file2.dat"));
+  t->assert(txn, F("beginTxn failed"));
+  ts.writeTxnDataCaptor.reset();
+  t->assert(sdStorage->erase(&ts, F("file1.dat"), txn), F("Erase file1.dat failed"));
+  t->assert(sdStorage->erase(&ts, F("file2.dat"), txn), F("Erase file2.dat failed"));
+  t->assertEqual(ts.writeTxnDataCaptor.get(), F("/TESTROOT/file1.dat={TOMBSTONE}\n/TESTROOT/file2.dat={TOMBSTONE}\n"),
+        F("Each erase should append one record"));
+  if (txn) delete txn;
+
+  ts.onLoadData = strdup(F("/TESTROOT/a.dat=/TESTROOT/~WORK/1.tmp\n/TESTROOT/b.dat=/TESTROOT/~WORK/2.tmp\n"
+        "/TESTROOT/~WORK/1.tmp={APPEND}10\n/TESTROOT/a.dat={TOMBSTONE}\n/TESTROOT/~WORK/1.tmp={DROPPED}\n"));
+  Transaction* replayed = helper.loadTxn(sdStorage, "/TESTROOT/~WORK/9.cmt", &ts);
+  t->assert(replayed, F("loadTxn failed"));
+  if (!replayed) return;
+  t->assertEqual(replayed->get("/TESTROOT/a.dat"), F("{TOMBSTONE}"), F("Last record for a file should win"));
+  t->assertEqual(replayed->get("/TESTROOT/b.dat"), F("/TESTROOT/~WORK/2.tmp"), F("Wrong tmp file for b.dat"));
+  t->assert(!replayed->exists("/TESTROOT/~WORK/1.tmp"), F("Dropped entry should be removed"));
+  delete replayed;
+}
+
+void testSavepoint(TestInvocation* t) {
+  t->setName(F("Roll a transaction back to a savepoint"));
+  MockSdFat::TestState ts;
+  scriptExists(&ts, true, false); // file1.dat exists, its tmp file doesn't yet
+  Transaction* txn = sdStorage->beginTxn(&ts, F("file1.dat"));
+  if (!t->assert(txn, F("beginTxn failed"))) return;
+  char* tmpFilename = strdup(txn->get("/TESTROOT/file1.dat"));
+
+  // file1.dat has been written to its tmp file
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onAppendReturn = true;
+  ts.onRemoveReturn = true;
+  ts.writeTxnDataCaptor.reset();
+  Transaction::Savepoint* sp = sdStorage->savepoint(txn, &ts);
+  t->assert(sp, F("savepoint failed"));
+  char* backupFilename = strdup(ts.appendFilenameCaptor);
+  t->assert(strcmp(backupFilename, tmpFilename) != 0, F("tmp file should have been copied"));
+  t->assertEqual(txn->get(backupFilename), F("{SAVEPOINT}"), F("Copy should be part of the transaction"));
+  char expected[128];
+  sprintf(expected, "%s={SAVEPOINT}\n", backupFilename);
+  t->assertEqual(ts.writeTxnDataCaptor.get(), expected, F("Copy should have been journaled"));
+
+  // The next step erases file1.dat and adds another file, then fails
+  t->assert(sdStorage->erase(&ts, F("file1.dat"), txn), F("Erase file1.dat failed"));
+  char* auxTmpFilename = strdup(helper.getAuxTmpFilename(sdStorage, txn, "/TESTROOT/file1.fnc", &ts));
+
+  ts.writeTxnDataCaptor.reset();
+  t->assert(sdStorage->rollbackTo(txn, sp, &ts), F("rollbackTo failed"));
+  t->assertEqual(txn->get("/TESTROOT/file1.dat"), tmpFilename, F("file1.dat should be back on its tmp file"));
+  t->assertEqual(ts.appendFilenameCaptor, tmpFilename, F("tmp file should have been restored from its copy"));
+  t->assert(!txn->exists("/TESTROOT/file1.fnc"), F("File added after the savepoint should be dropped"));
+  t->assertEqual(ts.removeCaptor, auxTmpFilename, F("Its tmp file should be removed"));
+  sprintf(expected, "/TESTROOT/file1.fnc={DROPPED}\n/TESTROOT/file1.dat=%s\n", tmpFilename);
+  t->assertEqual(ts.writeTxnDataCaptor.get(), expected, F("Rollback should have been journaled"));
+  t->assert(txn->exists(backupFilename), F("Savepoint should still be usable"));
+
+  t->assert(sdStorage->releaseSavepoint(txn, sp, &ts), F("releaseSavepoint failed"));
+  t->assertEqual(ts.removeCaptor, backupFilename, F("Copy should have been removed"));
+  t->assert(!txn->exists(backupFilename), F("Copy should no longer be part of the transaction"));
+  t->assert(!sdStorage->rollbackTo(txn, sp, &ts), F("Released savepoint should be rejected"));
+
+  free(tmpFilename);
+  free(backupFilename);
+  free(auxTmpFilename);
+  delete txn;
+}
+
 void testTransactionalEraseFile_notInTransaction(TestInvocation* t) {
   t->setName(F("Transactional erase file - not in transaction"));
   MockSdFat::TestState ts;
@@ -307,6 +569,34 @@ void testLoadFile(TestInvocation* t) {
   t->assertEqual(dto.get(F("foo")), F("bar"));
 }
 
+void testLoadFile_inTxn(TestInvocation* t) {
+  t->setName(F("Load sees the uncommitted changes of a transaction"));
+  MockSdFat::TestState ts;
+  scriptExists(&ts, true, false, true, false, true); // both files exist, their tmp files don't; file2 exists for erase
+
+  Transaction* txn = sdStorage->beginTxn(&ts, F("file1.dat"), F("file2.dat"));
+  t->assert(txn, F("beginTxn failed"));
+  StreamableDTO dto;
+  dto.put("foo", "baz");
+  t->assert(sdStorage->save(&ts, F("file1.dat"), &dto, txn), F("Save failed"));
+  t->assert(sdStorage->erase(&ts, F("file2.dat"), txn), F("Erase failed"));
+
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onLoadData = strdup(F("foo=bar\n"));
+  StreamableDTO loaded;
+  t->assert(sdStorage->load(F("file1.dat"), &loaded, txn, &ts), F("Load in txn failed"));
+  t->assert(endsWith(ts.loadFilenameCaptor, F(".tmp")), F("Load should read the txn's tmp file"));
+  t->assert(sdStorage->load(F("file1.dat"), &loaded, &ts), F("Load failed"));
+  t->assert(endsWith(ts.loadFilenameCaptor, F("file1.dat")), F("Load without the txn should read the committed file"));
+  free(ts.loadFilenameCaptor);
+  ts.loadFilenameCaptor = nullptr;
+  StreamableDTO erased;
+  t->assert(sdStorage->load(F("file2.dat"), &erased, txn, &ts), F("Load of an erased file should succeed"));
+  t->assert(!ts.loadFilenameCaptor && !erased.exists("foo"), F("File erased in the txn should be missing"));
+  if (txn) delete txn;
+}
+
 void testSaveFile_noTxn(TestInvocation* t) {
   t->setName(F("Save a file without a transaction"));
   MockSdFat::TestState ts;
@@ -367,6 +657,76 @@ void testParseIndexEntry(TestInvocation *t) {
   t->assertEqual(entry5.value, F("value"), F("Expected value = 'value'"));
 }
 
+void testViewIndexLine(TestInvocation *t) {
+  t->setName(F("View line as key/value without allocating"));
+  char scratch[32];
+  IndexLineView view1 = helper.viewIndexLine(F(""), scratch, sizeof(scratch));
+  t->assertEqual(view1.key, F(""));
+  t->assert(!view1.value, F("Expected value to be nullptr"));
+
+  IndexLineView view2 = helper.viewIndexLine(F("myKey"), scratch, sizeof(scratch));
+  t->assertEqual(view2.key, F("myKey"), F("Expected key = 'myKey'"));
+  t->assert(!view2.value, F("Expected value to be nullptr"));
+
+  IndexLineView view3 = helper.viewIndexLine(F("  myKey  =   myValue  "), scratch, sizeof(scratch));
+  t->assertEqual(view3.key, F("myKey"), F("Expected trimmed key"));
+  t->assertEqual(view3.value, F("myValue"), F("Expected trimmed value"));
+
+  IndexLineView view4 = helper.viewIndexLine(F("  = value  "), scratch, sizeof(scratch));
+  t->assertEqual(view4.key, F(""), F("Expected empty key"));
+  t->assertEqual(view4.value, F("value"), F("Expected value = 'value'"));
+
+  IndexLineView view5 = helper.viewIndexLine(F("myKey=  "), scratch, sizeof(scratch));
+  t->assertEqual(view5.key, F("myKey"));
+  t->assert(!view5.value, F("Expected empty value to be nullptr"));
+}
+
+void testIdxScan_allocations(TestInvocation *t) {
+  t->setName(F("Index scans don't allocate per line"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onReadIdxLines = 10000;
+  Index myIdx(F("myIndex"));
+
+  // A missing key scans every line
+  mallocCount = 0;
+  t->assert(!sdStorage->idxHasKey(myIdx, F("k99999"), &ts), F("Key should not have existed"));
+  uint32_t lookupAllocs = mallocCount;
+  t->assert(lookupAllocs < 10, F("Lookup allocations grow with index size"));
+
+  SearchResults results("k09");
+  mallocCount = 0;
+  t->assert(sdStorage->idxPrefixSearch(myIdx, &results, &ts), F("Prefix search failed"));
+  uint32_t searchAllocs = mallocCount;
+  t->assert(results.trieMode, F("Expected trie mode"));
+  // Only the 10 matches and 10 trie entries allocate, not the 1000 matching lines
+  t->assert(searchAllocs < 100, F("Prefix search allocations grow with index size"));
+}
+
+void testIdxScan_earlyTermination(TestInvocation *t) {
+  t->setName(F("Key-directed scans stop at the key's sort position"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onReadIdxLines = 10000;
+  Index myIdx(F("myIndex"));
+
+  // Scans read a block ahead, so allow up to a block's worth of 9 byte lines past the stop
+  const uint16_t readAhead = SDSTORAGE_READ_BLOCK_SIZE / 9;
+  // k00100x would sort between k00100 and k00101
+  t->assert(!sdStorage->idxHasKey(myIdx, F("k00100x"), &ts), F("Key should not have existed"));
+  t->assert(ts.generatedLinesRead >= 102 && ts.generatedLinesRead <= 102 + readAhead, 
+    F("Lookup should stop at the first key after it"));
+  ts.generatedLinesRead = 0;
+  t->assert(!sdStorage->idxHasKey(myIdx, F("a"), &ts), F("Key should not have existed"));
+  t->assert(ts.generatedLinesRead <= readAhead + 1, F("Key sorting first should only read one block"));
+  ts.generatedLinesRead = 0;
+  t->assert(sdStorage->idxHasKey(myIdx, F("k00042"), &ts), F("Key should have existed"));
+  t->assert(ts.generatedLinesRead >= 43 && ts.generatedLinesRead <= 43 + readAhead, 
+    F("Lookup should stop at the key"));
+}
+
 void testIdxUpsert_firstEntryNoTxn(TestInvocation *t) {
   t->setName(F("Index upsert - firstEntryImplicitTxn"));
   MockSdFat::TestState ts;
@@ -383,6 +743,23 @@ void testIdxUpsert_firstEntryNoTxn(TestInvocation *t) {
   t->assert(endsWith(ts.removeCaptor, F(".cmt")), F("Last file removed should have been .cmt file"));
 }
 
+/*
+ * Commits txn as if all its tmp files were written, merging any index
+ * overlays. The index's own tmp file isn't written until its overlay is
+ * merged, so it doesn't exist yet.
+ */
+bool commitWithOverlays(Transaction* txn, MockSdFat::TestState* ts) {
+  char idxFilename[FileHelper::MAX_FILENAME_LENGTH];
+  helper.getIndexFilename(sdStorage, Index(F("myIndex")), idxFilename, sizeof(idxFilename));
+  if (ts->onExistsMissing) free(ts->onExistsMissing);
+  ts->onExistsMissing = strdup(helper.getTmpFilename(txn, idxFilename));
+  ts->onExistsAlways = true;
+  ts->onExistsAlwaysReturn = true;
+  ts->onRenameReturn = true;
+  ts->onRemoveReturn = true;
+  return sdStorage->commitTxn(txn, ts);
+}
+
 void testIdxUpsert_firstEntryWithTxn(TestInvocation *t) {
   t->setName(F("Index upsert - firstEntryWithTxn"));
   MockSdFat::TestState ts;
@@ -398,14 +775,11 @@ void testIdxUpsert_firstEntryWithTxn(TestInvocation *t) {
 
   IndexEntry entry(F("fan"), F("1"));
   t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("First entry insert failed"));
-  t->assertEqual(ts.writeIdxDataCaptor.get(), F("fan=1\n"), F("Unexpected first index entry written"));
-
-  ts.onExistsAlways = true; // simplify rest of the test
-  ts.onExistsAlwaysReturn = true; // all tmp files exist
-  ts.onRenameReturn = true; // commit txn
-  ts.onRemoveReturn = true; // transaction cleanup
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+fan=1\n"), F("Entry should be in the txn's overlay"));
 
-  t->assert(sdStorage->commitTxn(txn, &ts), F("commitTxn failed"));
+  ts.onReadIdxData = strdup(F(""));
+  t->assert(commitWithOverlays(txn, &ts), F("commitTxn failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("fan=1\n"), F("Unexpected first index entry written"));
   t->assert(endsWith(ts.removeCaptor, F(".cmt")), F("Last file removed should have been .cmt file"));
 }
 
@@ -423,10 +797,9 @@ void testIdxUpsert_firstLine(TestInvocation* t) {
   ts.onReadIdxData = strdup(F("fan=1\n"));
   IndexEntry entry1(F("ear"), F("6"));
   t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry1, txn), F("Insert first line failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+ear=6\n"), F("Change should be in the txn's overlay"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
   t->assertEqual(ts.writeIdxDataCaptor.get(), F("ear=6\nfan=1\n"), F("Inserted first line in wrong position"));
-
-  ts.onRemoveReturn = true;
-  sdStorage->abortTxn(txn, &ts);
 }
 
 void testIdxUpsert_betweenLines(TestInvocation* t) {
@@ -443,10 +816,9 @@ void testIdxUpsert_betweenLines(TestInvocation* t) {
   ts.onReadIdxData = strdup(F("ear=6\nfan=1\n"));
   IndexEntry entry1(F("egg"), F("12"));
   t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry1, txn), F("Insert between lines failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+egg=12\n"), F("Change should be in the txn's overlay"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
   t->assertEqual(ts.writeIdxDataCaptor.get(), F("ear=6\negg=12\nfan=1\n"), F("Inserted between in wrong position"));
-
-  ts.onRemoveReturn = true;
-  sdStorage->abortTxn(txn, &ts);
 }
 
 void testIdxUpsert_lastLine(TestInvocation* t) {
@@ -463,10 +835,9 @@ void testIdxUpsert_lastLine(TestInvocation* t) {
   ts.onReadIdxData = strdup(F("ear=6\nfan=1\n"));
   IndexEntry entry1(F("gum"), F("3"));
   t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry1, txn), F("Insert last line failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+gum=3\n"), F("Change should be in the txn's overlay"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
   t->assertEqual(ts.writeIdxDataCaptor.get(), F("ear=6\nfan=1\ngum=3\n"), F("Inserted after last in wrong position"));
-
-  ts.onRemoveReturn = true;
-  sdStorage->abortTxn(txn, &ts);
 }
 
 void testIdxUpsert_updateLine(TestInvocation* t) {
@@ -483,18 +854,517 @@ void testIdxUpsert_updateLine(TestInvocation* t) {
   ts.onReadIdxData = strdup(F("ear=6\nfan=1\n"));
   IndexEntry entry1(F("fan"), F("3"));
   t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry1, txn), F("Update index entry failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+fan=3\n"), F("Change should be in the txn's overlay"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
   t->assertEqual(ts.writeIdxDataCaptor.get(), F("ear=6\nfan=3\n"), F("Unexpected index data after update entry"));
+}
+
+void testIdxOverlay_merge(TestInvocation* t) {
+  t->setName(F("Index changes in a txn are merged once at commit"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\nhat=2\n"));
+
+  IndexEntry entry1(F("egg"), F("3"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry1, txn), F("Upsert egg failed"));
+  IndexEntry entry2(F("abc"), F("4"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry2, txn), F("Upsert abc failed"));
+  scriptExists(&ts, true); // the overlay has abc
+  t->assert(sdStorage->idxRemove(&ts, myIdx, F("abc"), txn), F("Key upserted in the txn should be removable"));
+  scriptExists(&ts, true, false, true); // ear is only in myIndex.idx
+  t->assert(sdStorage->idxRemove(&ts, myIdx, F("ear"), txn), F("Remove ear failed"));
+  scriptExists(&ts, true, false, true, true, false, true); // fan and gnu lookups
+  t->assert(sdStorage->idxRename(&ts, myIdx, F("fan"), F("gnu"), txn), F("Rename fan failed"));
+  scriptExists(&ts, true); // the overlay has ear's removal
+  t->assert(!sdStorage->idxRemove(&ts, myIdx, F("ear"), txn), F("Key removed in the txn should be gone"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+egg=3\n+abc=4\n-abc\n-ear\n-fan\n+gnu=1\n"), 
+        F("Index should not be rewritten before commit"));
+
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("egg=3\ngnu=1\nhat=2\n"), F("Unexpected index data after commit"));
+}
+
+void testIdxOverlay_readYourWrites(TestInvocation* t) {
+  t->setName(F("Index reads in a txn see its uncommitted changes"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\nhat=2\n"));
+  IndexEntry entry(F("egg"), F("3"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("Upsert egg failed"));
+  scriptExists(&ts, true, false, true); // ear is only in myIndex.idx
+  t->assert(sdStorage->idxRemove(&ts, myIdx, F("ear"), txn), F("Remove ear failed"));
+
+  char buffer[10] = { '\0' };
+  scriptExists(&ts, true); // the overlay has egg
+  t->assert(sdStorage->idxLookup(myIdx, F("egg"), buffer, 10, txn, &ts), F("Lookup 'egg' in the txn failed"));
+  t->assertEqual(buffer, F("3"), F("Wrong value for 'egg'"));
+  scriptExists(&ts, true); // the overlay has ear's removal
+  t->assert(!sdStorage->idxHasKey(myIdx, F("ear"), txn, &ts), F("Key removed in the txn should be gone"));
+  scriptExists(&ts, true, false, true); // fan is only in myIndex.idx
+  t->assert(sdStorage->idxHasKey(myIdx, F("fan"), txn, &ts), F("Committed key should be visible"));
+  scriptExists(&ts, true);
+  t->assert(!sdStorage->idxHasKey(myIdx, F("egg"), &ts), F("Changes should not be visible outside the txn"));
+
+  scriptExists(&ts, true, false, true); // overlay, no tmp file, myIndex.idx
+  SearchResults results("");
+  t->assert(sdStorage->idxPrefixSearch(myIdx, &results, txn, &ts), F("Prefix search failed"));
+  char* keys[] = { "egg", "fan", "hat" };
+  KeyValue* kv = results.matchResult;
+  for (uint8_t i = 0; i < 3; i++) {
+    t->assert(kv, F("Missing result"));
+    if (!kv) break;
+    t->assertEqual(kv->key, keys[i], F("Wrong key"));
+    kv = kv->next;
+  }
+  t->assert(!kv, F("Unexpected extra results"));
+  if (txn) delete txn;
+}
+
+void testIdxUpsertBatch_firstWrite(TestInvocation* t) {
+  t->setName(F("Index batch upsert - first write"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = false; // myIndex.idx doesn't exist yet (new index)
+  ts.onExistsReturn[1] = true; // /TESTROOT/~IDX dir exists
+  ts.onIsDirectoryReturn = true; // /TESTROOT/~IDX is a directory
+  ts.onExistsReturn[2] = false; // myIndex's tmp file doesn't exist yet
+  ts.onRenameReturn = true; // commit txn
+  ts.onRemoveReturn = true; // transaction cleanup
+
+  IndexEntry batch[] = { IndexEntry(F("fan"), F("1")), IndexEntry(F("bar"), F("2")), IndexEntry(F("egg"), F("3")) };
+  t->assert(sdStorage->idxUpsertBatch(&ts, Index(F("myIndex")), batch, 3), F("Batch upsert failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("bar=2\negg=3\nfan=1\n"), F("Batch not written in key order"));
+  t->assert(endsWith(ts.removeCaptor, F(".cmt")), F("Last file removed should have been .cmt file"));
+}
+
+void testIdxUpsertBatch_merge(TestInvocation* t) {
+  t->setName(F("Index batch upsert - merge"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = true; // myIndex.idx exists for index upsert
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\nhat=2\n"));
+  IndexEntry batch[] = {
+    IndexEntry(F("zoo"), F("9")),   // append
+    IndexEntry(F("fan"), F("3")),   // replace
+    IndexEntry(F("abc"), F("1")),   // insert first
+    IndexEntry(F("gum"), F("4")),   // insert between
+    IndexEntry(F("fan"), F("5")),   // repeated key - last one wins
+    IndexEntry(F("yak"), F("8"))    // append
+  };
+  t->assert(sdStorage->idxUpsertBatch(&ts, myIdx, batch, 6, txn), F("Batch upsert failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+zoo=9\n+fan=3\n+abc=1\n+gum=4\n+fan=5\n+yak=8\n"), 
+        F("Batch should be in the txn's overlay as given"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("abc=1\near=6\nfan=5\ngum=4\nhat=2\nyak=8\nzoo=9\n"), 
+        F("Unexpected index data after batch upsert"));
+}
+
+void testIdxLog_writes(TestInvocation* t) {
+  t->setName(F("Log-structured index writes"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = true; // myIndex.dlt exists, copied into the txn
+  ts.onExistsReturn[3] = true; // the txn's delta log exists for remove lookup
+  ts.onExistsReturn[4] = false; // the txn hasn't compacted the index
+  ts.onExistsReturn[5] = true; // myIndex.idx exists for remove lookup
+
+  Index myIdx(F("myIndex"), Index::LOG_STRUCTURED);
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\n"));
+  ts.onReadDeltaData = strdup(F("+egg=4\n"));
+  IndexEntry entry(F("fan"), F("3"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("Upsert failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+egg=4\n+fan=3\n"), F("Upsert should only append to the delta log"));
+  t->assert(sdStorage->idxRemove(&ts, myIdx, F("ear"), txn), F("Remove failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("+egg=4\n+fan=3\n-ear\n"), F("Remove should only append to the delta log"));
 
   ts.onRemoveReturn = true;
   sdStorage->abortTxn(txn, &ts);
 }
 
+void testIdxLog_lookup(TestInvocation* t) {
+  t->setName(F("Log-structured index lookup"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\nhat=2\n"));
+  ts.onReadDeltaData = strdup(F("+fan=3\n-hat\n+gum=5\n-gum\n+abc=1\n"));
+
+  Index myIdx(F("myIndex"), Index::LOG_STRUCTURED);
+  char buffer[10] = { '\0' };
+  t->assert(sdStorage->idxLookup(myIdx, F("fan"), buffer, 10, &ts), F("Lookup 'fan' failed"));
+  t->assertEqual(buffer, F("3"), F("Delta log should supersede the index"));
+  t->assert(sdStorage->idxLookup(myIdx, F("ear"), buffer, 10, &ts), F("Lookup 'ear' failed"));
+  t->assertEqual(buffer, F("6"), F("Key only in the index not found"));
+  t->assert(sdStorage->idxLookup(myIdx, F("abc"), buffer, 10, &ts), F("Lookup 'abc' failed"));
+  t->assertEqual(buffer, F("1"), F("Key only in the delta log not found"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("hat"), &ts), F("Removed key 'hat' found"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("gum"), &ts), F("Removed key 'gum' found"));
+
+  // A sorted index would miss the delta log's records
+  t->assert(!sdStorage->idxLookup(Index(F("myIndex")), F("hat"), buffer, 10, &ts), F("Sorted lookup should fail"));
+}
+
+void testIdxLog_prefixSearch(TestInvocation* t) {
+  t->setName(F("Log-structured index prefix search"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\nfat=2\nfax=3\nfig=4\n"));
+  ts.onReadDeltaData = strdup(F("+fab=9\n-fat\n+fax=7\n+fay=8\n+zoo=1\n"));
+
+  Index myIdx(F("myIndex"), Index::LOG_STRUCTURED);
+  SearchResults results("fa");
+  t->assert(sdStorage->idxPrefixSearch(myIdx, &results, &ts), F("Prefix search failed"));
+  t->assertEqual(results.matchCount, 4, F("Wrong number of matches"));
+  const char* keys[] = { "fab", "fan", "fax", "fay" };
+  const char* values[] = { "9", "1", "7", "8" };
+  KeyValue* kv = results.matchResult;
+  for (uint8_t i = 0; i < 4 && kv; i++, kv = kv->next) {
+    t->assertEqual(kv->key, keys[i], F("Wrong key"));
+    t->assertEqual(kv->value, values[i], F("Wrong value"));
+  }
+}
+
+void testIdxLog_compact(TestInvocation* t) {
+  t->setName(F("Log-structured index compaction"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = true; // myIndex.dlt exists, copied into the txn
+  ts.onExistsReturn[3] = false; // myIndex's tmp file wasn't compacted into earlier in the txn
+  ts.onExistsReturn[4] = true; // myIndex.idx exists for compaction
+
+  Index myIdx(F("myIndex"), Index::LOG_STRUCTURED);
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\nhat=2\n"));
+  ts.onReadDeltaData = strdup(F("+fan=3\n-hat\n+abc=1\n+fan=4\n+zoo=9\n"));
+  t->assert(sdStorage->idxCompact(&ts, myIdx, txn), F("Compaction failed"));
+
+  // The mock's tmp files share a captor, so the compacted index replaces the delta log copied into the txn
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("abc=1\near=6\nfan=4\nzoo=9\n"), 
+        F("Unexpected index data after compaction"));
+
+  ts.onRemoveReturn = true;
+  sdStorage->abortTxn(txn, &ts);
+}
+
+// ~120 byte B+tree entries, so only 4 fit in a page
+void btEntry(uint8_t n, char* key, char* value) {
+  sprintf(key, "key%02u", n);
+  memset(value, 'v', 110);
+  sprintf(value + 110, "%02u", n);
+}
+
+// Inserts key00 to key11 in scrambled order, updating pages in place
+bool btBuild(BTreeIndex::Header* header, BTreeIndex::Pager* pager) {
+  char key[6];
+  char value[113];
+  for (uint8_t i = 0; i < 12; i++) {
+    btEntry((i * 7) % 12, key, value);
+    if (!helper.btUpsert(header, pager, key, value)) return false;
+  }
+  return true;
+}
+
+void testBTree_insert(TestInvocation* t) {
+  t->setName(F("B+tree insert with page splits"));
+  SDStorageTestHelper::RamPages pages(8);
+  BTreeIndex::Pager pager;
+  helper.ramPager(&pages, &pager);
+  BTreeIndex::Header header;
+  t->assert(btBuild(&header, &pager), F("Upsert failed"));
+  t->assert(header.keyCount == 12, F("Wrong key count"));
+  t->assert(header.height == 2, F("Leaves should have split under a new root"));
+
+  StringStream keys;
+  t->assert(helper.btScanKeys(&header, &pager, &keys), F("Scan failed"));
+  t->assertEqual(keys.get(), F("key00,key01,key02,key03,key04,key05,key06,key07,key08,key09,key10,key11,"),
+        F("Scan should return every key in order"));
+  char buffer[113];
+  char expected[113];
+  char key[6];
+  btEntry(7, key, expected);
+  t->assert(helper.btLookup(&header, &pager, "key07", buffer, sizeof(buffer)), F("Lookup key07 failed"));
+  t->assertEqual(buffer, expected, F("Wrong value for key07"));
+  t->assert(!helper.btLookup(&header, &pager, "key071", buffer, sizeof(buffer)), F("key071 should not exist"));
+
+  // Update in place
+  t->assert(helper.btUpsert(&header, &pager, "key07", "7"), F("Update failed"));
+  t->assert(header.keyCount == 12, F("Update should not change the key count"));
+  t->assert(helper.btLookup(&header, &pager, "key07", buffer, sizeof(buffer)), F("Lookup key07 failed"));
+  t->assertEqual(buffer, F("7"), F("Value not updated"));
+}
+
+void testBTree_remove(TestInvocation* t) {
+  t->setName(F("B+tree remove"));
+  SDStorageTestHelper::RamPages pages(8);
+  BTreeIndex::Pager pager;
+  helper.ramPager(&pages, &pager);
+  BTreeIndex::Header header;
+  t->assert(btBuild(&header, &pager), F("Upsert failed"));
+
+  const char* removeOrder[] = { "key00", "key01", "key02", "key03", "key11", "key05" };
+  for (uint8_t i = 0; i < 6; i++) {
+    t->assert(helper.btRemove(&header, &pager, removeOrder[i]) == BTreeIndex::OK, F("Remove failed"));
+  }
+  t->assert(helper.btRemove(&header, &pager, "key01") == BTreeIndex::NOT_FOUND, F("key01 already removed"));
+  t->assert(header.keyCount == 6, F("Wrong key count"));
+  StringStream keys;
+  t->assert(helper.btScanKeys(&header, &pager, &keys), F("Scan failed"));
+  t->assertEqual(keys.get(), F("key04,key06,key07,key08,key09,key10,"), F("Wrong keys after remove"));
+
+  const char* rest[] = { "key04", "key06", "key07", "key08", "key09", "key10" };
+  for (uint8_t i = 0; i < 6; i++) {
+    t->assert(helper.btRemove(&header, &pager, rest[i]) == BTreeIndex::OK, F("Remove failed"));
+  }
+  t->assert(header.height == 0 && header.root == BTreeIndex::NO_PAGE, F("Tree should be empty"));
+  t->assert(header.keyCount == 0, F("Wrong key count"));
+}
+
+void testBTree_copyOnWrite(TestInvocation* t) {
+  t->setName(F("B+tree copy-on-write"));
+  SDStorageTestHelper::RamPages pages(8);
+  BTreeIndex::Pager pager;
+  helper.ramPager(&pages, &pager);
+  BTreeIndex::Header header;
+  t->assert(btBuild(&header, &pager), F("Upsert failed"));
+
+  // Commit, then update a key in a new txn
+  pager.committedPages = header.pageCount;
+  BTreeIndex::Header committed = header;
+  t->assert(helper.btUpsert(&header, &pager, "key05", "new"), F("Upsert failed"));
+  t->assert(header.pageCount == committed.pageCount + 2, F("Leaf and root should have been copied"));
+  t->assert(header.root != committed.root, F("Should have a new root"));
+  char buffer[113];
+  t->assert(helper.btLookup(&header, &pager, "key05", buffer, sizeof(buffer)), F("Lookup key05 failed"));
+  t->assertEqual(buffer, F("new"), F("New header should see the update"));
+  t->assert(helper.btLookup(&committed, &pager, "key05", buffer, sizeof(buffer)), F("Committed lookup key05 failed"));
+  t->assert(strncmp(buffer, "vvvv", 4) == 0, F("Committed header should not see the update"));
+
+  // The copies are updated in place for the rest of the txn
+  uint32_t pageCount = header.pageCount;
+  t->assert(helper.btUpsert(&header, &pager, "key05", "newer"), F("Upsert failed"));
+  t->assert(header.pageCount == pageCount, F("Pages written in this txn should be updated in place"));
+}
+
+void testBTree_bulkLoad(TestInvocation* t) {
+  t->setName(F("B+tree bulk load"));
+  SDStorageTestHelper::RamPages pages(8);
+  BTreeIndex::Pager pager;
+  helper.ramPager(&pages, &pager);
+  BTreeIndex::Header header;
+  t->assert(helper.btBulkLoad(&header, &pager, btEntry, 9), F("Bulk load failed"));
+  t->assert(header.pageCount == 4, F("Should be 3 packed leaves and a root"));
+  t->assert(header.height == 2 && header.keyCount == 9, F("Wrong header"));
+  StringStream keys;
+  t->assert(helper.btScanKeys(&header, &pager, &keys), F("Scan failed"));
+  t->assertEqual(keys.get(), F("key00,key01,key02,key03,key04,key05,key06,key07,key08,"), F("Wrong keys"));
+  char buffer[113];
+  t->assert(helper.btLookup(&header, &pager, "key08", buffer, sizeof(buffer)), F("Lookup key08 failed"));
+}
+
+void testIdxBTree_txn(TestInvocation* t) {
+  t->setName(F("B+tree index writes and lookups"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+
+  Index myIdx(F("myIndex"), Index::BTREE);
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  IndexEntry batch[] = { IndexEntry("fan", "1"), IndexEntry("ear", "6"), IndexEntry("fat", "2"), IndexEntry("fan", "3") };
+  t->assert(sdStorage->idxUpsertBatch(&ts, myIdx, batch, 4, txn), F("Batch upsert failed"));
+  t->assert(sdStorage->idxRemove(&ts, myIdx, F("fat"), txn), F("Remove failed"));
+  t->assert(sdStorage->idxRename(&ts, myIdx, F("ear"), F("egg"), txn), F("Rename failed"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("fan"), &ts), F("Changes should not be visible before commit"));
+  t->assert(sdStorage->idxHasKey(myIdx, F("fan"), txn, &ts), F("The txn should see its own changes"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("fat"), txn, &ts), F("The txn should see its own removals"));
+
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onRenameReturn = true;
+  ts.onRemoveReturn = true;
+  t->assert(sdStorage->commitTxn(txn, &ts), F("Commit failed"));
+  char buffer[10] = { '\0' };
+  t->assert(sdStorage->idxLookup(myIdx, F("fan"), buffer, 10, &ts), F("Lookup 'fan' failed"));
+  t->assertEqual(buffer, F("3"), F("Last entry in the batch should win"));
+  t->assert(sdStorage->idxLookup(myIdx, F("egg"), buffer, 10, &ts), F("Lookup 'egg' failed"));
+  t->assertEqual(buffer, F("6"), F("Renamed key should keep its value"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("ear"), &ts), F("ear was renamed"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("fat"), &ts), F("fat was removed"));
+  SearchResults results("f");
+  t->assert(sdStorage->idxPrefixSearch(myIdx, &results, &ts), F("Prefix search failed"));
+  t->assertEqual(results.matchCount, 1, F("Wrong number of matches"));
+  t->assertEqual(results.matchResult->key, F("fan"), F("Wrong match"));
+  IndexCursor cursor;
+  char key[IndexCursor::MAX_KEY_LENGTH + 1];
+  t->assert(sdStorage->idxSeekKey(myIdx, &cursor, F("e"), &ts), F("Cursor seek failed"));
+  t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), buffer, 10, &ts), F("Cursor 'egg' missing"));
+  t->assertEqual(key, F("egg"), F("Wrong first cursor key"));
+  t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), buffer, 10, &ts), F("Cursor 'fan' missing"));
+  t->assertEqual(key, F("fan"), F("Wrong second cursor key"));
+  t->assert(!sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), buffer, 10, &ts) && cursor.isDone, 
+        F("Cursor should be done"));
+}
+
+void testIdxBTree_convertSorted(TestInvocation* t) {
+  t->setName(F("B+tree index converted from a sorted index"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+
+  // The old sorted index file
+  Index myIdx(F("myIndex"), Index::BTREE);
+  char idxFilename[FileHelper::MAX_FILENAME_LENGTH];
+  helper.getIndexFilename(sdStorage, myIdx, idxFilename, FileHelper::MAX_FILENAME_LENGTH);
+  MockSdFat mock;
+  const char* sorted = "ear=6\nfan=1\nhat=2\n";
+  mock.openBlockFile(idxFilename, true, &ts)->write(0, reinterpret_cast<const uint8_t*>(sorted), strlen(sorted));
+  ts.onReadIdxData = strdup(sorted);
+
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  IndexEntry entry(F("zoo"), F("9"));
+  t->assert(!sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("Upsert should fail until converted"));
+  t->assert(sdStorage->idxCompact(&ts, myIdx, txn), F("Conversion failed"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("Upsert after conversion failed"));
+
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onRenameReturn = true;
+  ts.onRemoveReturn = true;
+  t->assert(sdStorage->commitTxn(txn, &ts), F("Commit failed"));
+  char buffer[10] = { '\0' };
+  t->assert(sdStorage->idxLookup(myIdx, F("hat"), buffer, 10, &ts), F("Lookup 'hat' failed"));
+  t->assertEqual(buffer, F("2"));
+  t->assert(sdStorage->idxLookup(myIdx, F("zoo"), buffer, 10, &ts), F("Lookup 'zoo' failed"));
+  t->assertEqual(buffer, F("9"));
+}
+
+void testBloom_filter(TestInvocation* t) {
+  t->setName(F("Bloom filter"));
+  t->assert(helper.bloomBlocksFor(0) == 1, F("Should always have a block"));
+  t->assert(helper.bloomBlocksFor(1000) == 3, F("Wrong number of blocks for 1000 keys"));
+
+  SDStorageTestHelper::RamPages pages(3);
+  BTreeIndex::Pager pager;
+  helper.ramPager(&pages, &pager);
+  BloomFilter::Header header;
+  t->assert(helper.bloomCreate(&pager, &header, 2), F("Create failed"));
+  t->assert(helper.bloomContains(&pager, "k000") == BloomFilter::MISS, F("New filter should be empty"));
+  char key[6];
+  bool added = true;
+  for (uint16_t i = 0; i < 300; i++) {
+    sprintf(key, "k%03u", i);
+    added &= helper.bloomAdd(&pager, &header, key);
+  }
+  t->assert(added, F("Add failed"));
+  t->assert(header.keyCount == 300, F("Wrong key count"));
+  bool allFound = true;
+  uint16_t falsePositives = 0;
+  for (uint16_t i = 0; i < 300; i++) {
+    sprintf(key, "k%03u", i);
+    allFound &= (helper.bloomContains(&pager, key) == BloomFilter::MAYBE);
+    sprintf(key, "x%03u", i);
+    if (helper.bloomContains(&pager, key) == BloomFilter::MAYBE) falsePositives++;
+  }
+  t->assert(allFound, F("Added keys must never be a miss"));
+  t->assert(falsePositives < 10, F("Too many false positives"));
+}
+
+void testIdxBloom_skipsScan(TestInvocation* t) {
+  t->setName(F("Bloom filter skips index scan on a miss"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = false; // myIndex.idx doesn't exist (write first line)
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  IndexEntry entry(F("fan"), F("1"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("First entry insert failed"));
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onRenameReturn = true;
+  ts.onRemoveReturn = true;
+  t->assert(sdStorage->commitTxn(txn, &ts), F("Commit failed"));
+  ts.onReadIdxData = strdup("fan=1\n");
+  free(ts.readIdxFilenameCaptor); // merging the txn's overlay read the index
+  ts.readIdxFilenameCaptor = nullptr;
+
+  t->assert(!sdStorage->idxHasKey(myIdx, F("bat"), &ts), F("bat should not exist"));
+  t->assert(ts.readIdxFilenameCaptor == nullptr, F("Index should not have been scanned"));
+  t->assert(sdStorage->idxHasKey(myIdx, F("fan"), &ts), F("fan should exist"));
+  t->assert(ts.readIdxFilenameCaptor != nullptr, F("Index should have been scanned"));
+}
+
+void testIdxBloom_rebuild(TestInvocation* t) {
+  t->setName(F("Bloom filter rebuilt for an existing index"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = true; // myIndex.idx exists
+  ts.onReadIdxData = strdup("ear=6\nfan=1\n");
+
+  Index myIdx(F("myIndex"));
+  char bloomFilename[FileHelper::MAX_FILENAME_LENGTH];
+  helper.getBloomFilename(sdStorage, myIdx, bloomFilename, FileHelper::MAX_FILENAME_LENGTH);
+  MockSdFat mock;
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  IndexEntry entry(F("hat"), F("2"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("Upsert failed"));
+  t->assert(!txn->exists(bloomFilename), F("Filter can't be started for an index that already has entries"));
+
+  t->assert(sdStorage->idxRebuild(&ts, myIdx, txn), F("Rebuild failed"));
+  t->assert(txn->exists(bloomFilename), F("Filter should be part of the txn"));
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onRenameReturn = true;
+  ts.onRemoveReturn = true;
+  t->assert(sdStorage->commitTxn(txn, &ts), F("Commit failed"));
+  t->assert(mock.openBlockFile(bloomFilename, false, &ts) != nullptr, F("Filter not committed"));
+
+  // The rebuild read the txn's copy of the index, which has hat
+  free(ts.onReadIdxData);
+  ts.onReadIdxData = strdup("ear=6\nfan=1\nhat=2\n");
+  t->assert(sdStorage->idxHasKey(myIdx, F("hat"), &ts), F("hat should exist"));
+  t->assert(sdStorage->idxHasKey(myIdx, F("ear"), &ts), F("ear should exist"));
+  free(ts.readIdxFilenameCaptor);
+  ts.readIdxFilenameCaptor = nullptr;
+  t->assert(!sdStorage->idxHasKey(myIdx, F("zoo"), &ts), F("zoo should not exist"));
+  t->assert(ts.readIdxFilenameCaptor == nullptr, F("Index should not have been scanned"));
+}
+
 void testIdxRemove(TestInvocation *t) {
   t->setName(F("Index remove"));
   MockSdFat::TestState ts;
   ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
   ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
-  ts.onExistsReturn[2] = true; // myIndex.idx exists for index upsert
+  ts.onExistsReturn[2] = false; // the txn hasn't written myIndex yet
+  ts.onExistsReturn[3] = true; // myIndex.idx exists for remove lookup
 
   Index myIdx(F("myIndex"));
   Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
@@ -502,10 +1372,9 @@ void testIdxRemove(TestInvocation *t) {
 
   ts.onReadIdxData = strdup(F("ear=3\negg=45\nfan=1\n"));
   t->assert(sdStorage->idxRemove(&ts, myIdx, F("ear"), txn), F("Remove key failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("-ear\n"), F("Removal should be in the txn's overlay"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
   t->assertEqual(ts.writeIdxDataCaptor.get(), F("egg=45\nfan=1\n"), F("Unexpected index data after remove key"));
-
-  ts.onRemoveReturn = true;
-  sdStorage->abortTxn(txn, &ts);
 }
 
 void testIdxRenameKey_happyPath(TestInvocation *t) {
@@ -518,15 +1387,15 @@ void testIdxRenameKey_happyPath(TestInvocation *t) {
   Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
   t->assert(txn, F("Create transaction failed"));
 
-  ts.onExistsAlways = true;
-  ts.onExistsAlwaysReturn = true; // simplify the rest of the test
+  ts.onExistsReturn[2] = false; // the txn hasn't written myIndex yet
+  ts.onExistsReturn[3] = true; // myIndex.idx exists for egg lookup
+  ts.onExistsReturn[4] = false;
+  ts.onExistsReturn[5] = true; // myIndex.idx exists for bag lookup
   ts.onReadIdxData = strdup(F("ear=3\negg=45\nfan=1\n"));
   t->assert(sdStorage->idxRename(&ts, myIdx, F("egg"), F("bag"), txn), F("Rename key failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("-egg\n+bag=45\n"), F("Rename should be in the txn's overlay"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
   t->assertEqual(ts.writeIdxDataCaptor.get(), F("bag=45\near=3\nfan=1\n"), F("Unexpected index data after rename key"));
-
-  ts.onRemoveReturn = true;
-  t->assert(txn, F("txn is null"));
-  t->assert(sdStorage->abortTxn(txn, &ts), F("abortTxn failed"));
 }
 
 void testIdxRenameKey_keyDoesntExist(TestInvocation *t) {
@@ -555,7 +1424,7 @@ void testIdxLookup(TestInvocation *t) {
   MockSdFat::TestState ts;
   ts.onExistsAlways = true;
   ts.onExistsAlwaysReturn = true;
-  ts.onReadIdxData = strdup(F("ear=3\negg=45\nfan=1\nbar=\n"));
+  ts.onReadIdxData = strdup(F("bar=\near=3\negg=45\nfan=1\n"));
 
   Index myIdx(F("myIndex"));
   char buffer[10] = { '\0' };
@@ -580,6 +1449,218 @@ void testIdxHasKey(TestInvocation *t) {
   t->assert(!sdStorage->idxHasKey(myIdx, F("lap"), &ts), F("Key should not have existed"));
 }
 
+void testFenceSearch(TestInvocation *t) {
+  t->setName(F("Fence file binary search"));
+  StringStream fence;
+  helper.writeFenceRecord(&fence, "ear", 0);
+  helper.writeFenceRecord(&fence, "fan", 13);
+  helper.writeFenceRecord(&fence, "fan", 19); // trailer: largest key, index size
+
+  FenceIndex::Range range;
+  t->assert(helper.fenceSearch("egg", false, fence.get(), 19, &range) == FenceIndex::FOUND, F("egg not found"));
+  t->assert(range.start == 0 && range.end == 13, F("Wrong range for egg"));
+  t->assert(helper.fenceSearch("fan", false, fence.get(), 19, &range) == FenceIndex::FOUND, F("fan not found"));
+  t->assert(range.start == 13 && range.end == 19, F("Wrong range for fan"));
+  t->assert(helper.fenceSearch("dog", false, fence.get(), 19, &range) == FenceIndex::MISS, F("dog sorts before first key"));
+  t->assert(helper.fenceSearch("zoo", false, fence.get(), 19, &range) == FenceIndex::MISS, F("zoo sorts after last key"));
+  t->assert(helper.fenceSearch("f", true, fence.get(), 19, &range) == FenceIndex::FOUND, F("Prefix f not found"));
+  t->assert(range.start == 0, F("Wrong start for prefix f"));
+  t->assert(helper.fenceSearch("fan", true, fence.get(), 19, &range) == FenceIndex::FOUND, F("Prefix fan not found"));
+  t->assert(range.start == 13, F("Wrong start for prefix fan"));
+  t->assert(helper.fenceSearch("fan", false, fence.get(), 20, &range) == FenceIndex::UNAVAILABLE, 
+        F("Stale fence should be ignored"));
+}
+
+void testIdxUpsert_writesFence(TestInvocation* t) {
+  t->setName(F("Index upsert - writes fence file"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = true; // myIndex.idx exists for index upsert
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\n"));
+  IndexEntry entry1(F("egg"), F("12"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry1, txn), F("Insert between lines failed"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
+  t->assert(endsWith(ts.writeAuxFilenameCaptor, F(".tmp")), F("Fence not written to a tmp file"));
+  StringStream expected;
+  helper.writeFenceRecord(&expected, "ear", 0);
+  helper.writeFenceRecord(&expected, "fan", 19);
+  t->assertEqual(ts.writeAuxDataCaptor.get(), expected.get(), F("Unexpected fence data"));
+}
+
+void testFenceWriter_rawBytes(TestInvocation* t) {
+  t->setName(F("Fence built from raw bytes matches one built from lines"));
+  StringStream index;
+  for (uint16_t i = 0; i < 300; i++) {
+    index.print(F("  key"));
+    index.print(i);
+    index.print(i % 7 == 0 ? F(" = v\n") : F("=value\n"));
+  }
+  index.print(F("aVeryLongKeyThatIsTooWideForTheFence=x\n"));
+  StringStream expected;
+  helper.fenceFromLines(index.get(), &expected);
+  StringStream chunked;
+  helper.fenceFromBytes(index.get(), 7, &chunked); // splits keys across chunks
+  t->assertEqual(chunked.get(), expected.get(), F("Fence from 7 byte chunks differs"));
+  StringStream blocks;
+  helper.fenceFromBytes(index.get(), 512, &blocks);
+  t->assertEqual(blocks.get(), expected.get(), F("Fence from 512 byte chunks differs"));
+}
+
+void testIdxUpsert_copiesTail(TestInvocation* t) {
+  t->setName(F("Index upsert - copies the rest of the index as-is"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = true; // myIndex.idx exists for index upsert
+  ts.onReadIdxLines = 200;
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  IndexEntry entry(F("k00001x"), F("1"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("Upsert failed"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
+
+  StringStream expected;
+  char line[12];
+  for (uint16_t i = 0; i < 200; i++) {
+    snprintf_P(line, sizeof(line), PSTR("k%05u=v\n"), i);
+    expected.print(line);
+    if (i == 1) expected.print(F("k00001x=1\n"));
+  }
+  t->assertEqual(ts.writeIdxDataCaptor.get(), expected.get(), F("Unexpected index data"));
+  StringStream expectedFence;
+  helper.fenceFromLines(expected.get(), &expectedFence);
+  t->assertEqual(ts.writeAuxDataCaptor.get(), expectedFence.get(), F("Unexpected fence data"));
+}
+
+void testIdxUpsertAsync(TestInvocation* t) {
+  t->setName(F("Async index upsert - rewrites a step per poll"));
+  MockSdFat::TestState ts;
+  scriptExists(&ts, true, false, true); // myIndex.idx, not its tmp file, then myIndex.idx for the rewrite
+  ts.onReadIdxLines = 200;
+  ts.onRenameReturn = true; // commit txn
+  ts.onRemoveReturn = true; // transaction cleanup
+
+  Index myIdx(F("myIndex"));
+  IndexEntry entry(F("k00150x"), F("1"));
+  AsyncOp* op = sdStorage->idxUpsertAsync(&ts, myIdx, &entry);
+  AsyncOp* next = sdStorage->idxRemoveAsync(&ts, myIdx, F("k00001"));
+  if (!t->assert(op && next, F("Async ops should have been started"))) return;
+  t->assert(op->getStatus() == AsyncOp::QUEUED, F("Nothing should run before poll()"));
+  uint8_t polls = 0;
+  while (!op->isDone() && polls < 20) {
+    sdStorage->poll(0);
+    polls++;
+    if (!op->isDone()) t->assert(next->getStatus() == AsyncOp::QUEUED, F("Second op should wait for the first"));
+  }
+  t->assert(op->getStatus() == AsyncOp::SUCCEEDED, F("Async upsert failed"));
+  t->assert(polls > 3, F("Rewrite should have been spread over several polls"));
+
+  StringStream expected;
+  char line[12];
+  for (uint16_t i = 0; i < 200; i++) {
+    snprintf_P(line, sizeof(line), PSTR("k%05u=v\n"), i);
+    expected.print(line);
+    if (i == 150) expected.print(F("k00150x=1\n"));
+  }
+  t->assertEqual(ts.writeIdxDataCaptor.get(), expected.get(), F("Unexpected index data"));
+  StringStream expectedFence;
+  helper.fenceFromLines(expected.get(), &expectedFence);
+  t->assertEqual(ts.writeAuxDataCaptor.get(), expectedFence.get(), F("Unexpected fence data"));
+
+  delete next; // cancels it before it starts
+  t->assert(!sdStorage->poll(0), F("Cancelled op should have left the queue"));
+  delete op;
+}
+
+void testIdxUpsert_appendsLastKey(TestInvocation* t) {
+  t->setName(F("Index upsert - keys after the last one are appended"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\n"));
+  StringStream fence;
+  helper.fenceFromLines(ts.onReadIdxData, &fence);
+  ts.onReadFenceData = strdup(fence.get());
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  IndexEntry entry1(F("goat"), F("2"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry1, txn), F("First append failed"));
+  IndexEntry entry2(F("hen"), F("3"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry2, txn), F("Second append failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("goat=2\nhen=3\n"), F("Only the new lines should be written"));
+  t->assert(contains(ts.writeTxnDataCaptor.get(), F("{APPEND}12")), F("Txn should append at the end of the index"));
+  StringStream expectedFence;
+  helper.fenceFromLines("ear=6\nfan=1\ngoat=2\nhen=3\n", &expectedFence);
+  t->assertEqual(ts.writeAuxDataCaptor.get(), expectedFence.get(), 
+        F("Fence tmp file should replace the committed fence's trailer"));
+
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onAppendReturn = true;
+  ts.onRenameReturn = true;
+  ts.onRemoveReturn = true;
+  t->assert(sdStorage->commitTxn(txn, &ts), F("commitTxn failed"));
+  t->assert(ts.appendFilenameCaptor, F("Commit should have appended"));
+}
+
+void testIdxUpsert_appendNotLastKey(TestInvocation* t) {
+  t->setName(F("Index upsert - keys before the last one rewrite the index"));
+  MockSdFat::TestState ts;
+  ts.onExistsReturn[0] = true; // myIndex.idx exists for txn
+  ts.onExistsReturn[1] = false; // myIndex's tmp file doesn't exist yet
+  ts.onExistsReturn[2] = true; // myIndex.idx exists for index upsert
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\n"));
+  StringStream fence;
+  helper.fenceFromLines(ts.onReadIdxData, &fence);
+  ts.onReadFenceData = strdup(fence.get());
+
+  Index myIdx(F("myIndex"));
+  Transaction* txn = sdStorage->beginTxn(&ts, myIdx);
+  t->assert(txn, F("Create transaction failed"));
+  IndexEntry entry(F("fan"), F("2"));
+  t->assert(sdStorage->idxUpsert(&ts, myIdx, &entry, txn), F("Update of the last key failed"));
+  t->assert(!contains(ts.writeTxnDataCaptor.get(), F("{APPEND}")), F("Txn should replace the index"));
+  t->assert(commitWithOverlays(txn, &ts), F("Commit failed"));
+  t->assertEqual(ts.writeIdxDataCaptor.get(), F("ear=6\nfan=2\n"), F("Index should have been rewritten"));
+}
+
+void testIdxLookup_withFence(TestInvocation *t) {
+  t->setName(F("Index lookup with fence file"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onReadIdxData = strdup(F("ear=3\negg=45\nfan=1\n"));
+  StringStream fence;
+  helper.writeFenceRecord(&fence, "ear", 0);
+  helper.writeFenceRecord(&fence, "fan", 13);
+  helper.writeFenceRecord(&fence, "fan", 19);
+  ts.onReadFenceData = strdup(fence.get());
+
+  Index myIdx(F("myIndex"));
+  char buffer[10] = { '\0' };
+  t->assert(sdStorage->idxLookup(myIdx, F("egg"), buffer, 10, &ts), F("Lookup egg failed"));
+  t->assertEqual(buffer, F("45"));
+  t->assert(sdStorage->idxLookup(myIdx, F("fan"), buffer, 10, &ts), F("Lookup fan failed"));
+  t->assertEqual(buffer, F("1"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("eel"), &ts), F("eel should not exist"));
+  t->assert(!sdStorage->idxHasKey(myIdx, F("zoo"), &ts), F("zoo should not exist"));
+
+  // Stale fence falls back to a full scan
+  free(ts.onReadIdxData);
+  ts.onReadIdxData = strdup(F("ear=3\negg=45\nfan=1\nzoo=7\n"));
+  t->assert(sdStorage->idxHasKey(myIdx, F("zoo"), &ts), F("zoo should exist"));
+}
+
 void testIdxSearchResults(TestInvocation *t) {
   t->setName(F("SearchResults struct"));
   sdstorage::SearchResults* sr = new sdstorage::SearchResults("a");
@@ -678,6 +1759,877 @@ void testIdxPrefixSearch_over10Matches(TestInvocation *t) {
   t->assert(!kv, F("Unexpected extra results"));
 }
 
+void testIdxCursor_prefix(TestInvocation *t) {
+  t->setName(F("Index cursor over a prefix and from a key"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onReadIdxData = strdup(F("apple=1\nbanana=2\nbandana=345\nberry=4\ncherry=\n"));
+
+  Index myIdx(F("myIndex"));
+  IndexCursor cursor;
+  char key[IndexCursor::MAX_KEY_LENGTH + 1];
+  char value[10];
+  t->assert(sdStorage->idxSeek(myIdx, &cursor, F("ban"), &ts), F("Seek failed"));
+  t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("banana missing"));
+  t->assertEqual(key, F("banana"), F("Wrong first key"));
+  t->assertEqual(value, F("2"), F("Wrong first value"));
+  t->assert(cursor.offset == 17, F("Cursor should be at the next line"));
+  t->assert(!sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, 3, &ts), F("Value shouldn't fit"));
+  t->assert(!cursor.isDone && cursor.offset == 17, F("Cursor should not move if the value doesn't fit"));
+  t->assert(cursor.isTooLong, F("Cursor should say the value didn't fit"));
+  t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("bandana missing"));
+  t->assertEqual(key, F("bandana"), F("Wrong second key"));
+  t->assertEqual(value, F("345"), F("Wrong second value"));
+  t->assert(!cursor.isTooLong, F("Next entry fit"));
+  t->assert(!sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("Should be past the prefix"));
+  t->assert(cursor.isDone, F("Cursor should be done"));
+
+  t->assert(sdStorage->idxSeekKey(myIdx, &cursor, F("bat"), &ts), F("Seek to key failed"));
+  t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("berry missing"));
+  t->assertEqual(key, F("berry"), F("Wrong key after bat"));
+  t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("cherry missing"));
+  t->assertEqual(key, F("cherry"), F("Wrong last key"));
+  t->assertEqual(value, F(""), F("Wrong empty value"));
+  t->assert(!sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("Should be at the end"));
+  t->assert(cursor.isDone, F("Cursor should be done at the end"));
+}
+
+void testIdxCursor_resume(TestInvocation *t) {
+  t->setName(F("Index cursor pages past 10 entries and resumes after changes"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  char index[25 * 8 + 1] = { '\0' };
+  for (uint8_t i = 0; i < 25; i++) sprintf(index + strlen(index), "k%02u=%02u\n", i, i);
+  ts.onReadIdxData = strdup(index);
+
+  Index myIdx(F("myIndex"));
+  IndexCursor cursor;
+  char key[8];
+  char value[8];
+  t->assert(sdStorage->idxSeek(myIdx, &cursor, F("k"), &ts), F("Seek failed"));
+  for (uint8_t i = 0; i < 12; i++) {
+    t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("Entry missing"));
+  }
+  t->assertEqual(key, F("k11"), F("Wrong 12th key"));
+  IndexCursor saved = cursor;
+
+  // Drop k12 and add a key before the cursor, so the saved offset is no good
+  free(ts.onReadIdxData);
+  char* k12 = strstr(index, "k12=");
+  memmove(k12, k12 + 7, strlen(k12 + 7) + 1);
+  char changed[sizeof(index) + 8];
+  sprintf(changed, "a=0\n%s", index);
+  ts.onReadIdxData = strdup(changed);
+  uint8_t count = 0;
+  while (sdStorage->idxNext(myIdx, &saved, key, sizeof(key), value, sizeof(value), &ts)) {
+    if (count == 0) t->assertEqual(key, F("k13"), F("Should resume after k11"));
+    count++;
+  }
+  t->assert(saved.isDone, F("Cursor should be done"));
+  t->assertEqual(count, 12, F("Wrong number of entries after resuming"));
+  t->assertEqual(key, F("k24"), F("Wrong last key"));
+}
+
+void testIdxCursor_sameSize(TestInvocation *t) {
+  t->setName(F("Index cursor finds its place again after a same-size rewrite"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  char index[25 * 8 + 1] = { '\0' };
+  for (uint8_t i = 0; i < 25; i++) sprintf(index + strlen(index), "k%02u=x%02u\n", i, i);
+  ts.onReadIdxData = strdup(index);
+
+  Index myIdx(F("myIndex"));
+  IndexCursor cursor;
+  char key[8];
+  char value[8];
+  t->assert(sdStorage->idxSeek(myIdx, &cursor, F("k"), &ts), F("Seek failed"));
+  for (uint8_t i = 0; i < 12; i++) {
+    t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("Entry missing"));
+  }
+  t->assertEqual(key, F("k11"), F("Wrong 12th key"));
+
+  // Add a key before the cursor, drop k12 and lengthen the last value, so the
+  // size is the same but the offset is now in the middle of k11's line
+  free(ts.onReadIdxData);
+  char* k12 = strstr(index, "k12=");
+  memmove(k12, k12 + 8, strlen(k12 + 8) + 1);
+  char changed[sizeof(index) + 8];
+  sprintf(changed, "a=0\n%s", index);
+  strcpy(changed + strlen(changed) - 1, "xxxx\n");
+  ts.onReadIdxData = strdup(changed);
+  t->assert(strlen(changed) == cursor.indexSize, F("Index should be the same size"));
+  uint8_t count = 0;
+  while (sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts)) {
+    if (count == 0) t->assertEqual(key, F("k13"), F("Should resume after k11"));
+    count++;
+  }
+  t->assert(cursor.isDone, F("Cursor should be done"));
+  t->assertEqual(count, 12, F("Wrong number of entries after resuming"));
+}
+
+void testIdxCursor_log(TestInvocation *t) {
+  t->setName(F("Index cursor merges the delta log"));
+  MockSdFat::TestState ts;
+  ts.onExistsAlways = true;
+  ts.onExistsAlwaysReturn = true;
+  ts.onReadIdxData = strdup(F("ear=6\nfan=1\nfat=2\nfax=3\nfig=4\n"));
+  ts.onReadDeltaData = strdup(F("+fab=9\n-fat\n+fax=7\n+fay=8\n+zoo=1\n-ear\n+fax=5\n"));
+
+  Index myIdx(F("myIndex"), Index::LOG_STRUCTURED);
+  IndexCursor cursor;
+  char key[IndexCursor::MAX_KEY_LENGTH + 1];
+  char value[10];
+  const char* keys[] = { "fab", "fan", "fax", "fay", "fig", "zoo" };
+  const char* values[] = { "9", "1", "5", "8", "4", "1" };
+  t->assert(sdStorage->idxSeek(myIdx, &cursor, "", &ts), F("Seek failed"));
+  for (uint8_t i = 0; i < 6; i++) {
+    t->assert(sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("Entry missing"));
+    t->assertEqual(key, keys[i], F("Wrong key"));
+    t->assertEqual(value, values[i], F("Wrong value"));
+  }
+  t->assert(!sdStorage->idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value), &ts), F("Unexpected extra entry"));
+  t->assert(cursor.isDone, F("Cursor should be done"));
+}
+
+// Number of files in fs whose name ends in ext
+uint16_t countFiles(MockSdFat::RamFs* fs, const __FlashStringHelper* ext) {
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < fs->getFileCount(); i++) {
+    if (endsWith(fs->getFilename(i), ext)) count++;
+  }
+  return count;
+}
+
+// A Mega only has room for a small workload, a host build can run bigger ones
+#if defined(__AVR__)
+  #define RAMFS_WORKLOAD_COUNT 10
+#else
+  #define RAMFS_WORKLOAD_COUNT 100
+#endif
+
+void testSectorWriter(TestInvocation* t) {
+  t->setName(F("Sector writer lines writes up with sectors"));
+  const char* line = "0123456789";
+  StringStream dest;
+  SectorWriter::SharedBuffer shared;
+  SectorWriter::Stats stats;
+  SectorWriter writer(&dest, 500, &shared, &stats);
+  for (uint8_t i = 0; i < 60; i++) writer.write(line, 10);
+  // 600 bytes from offset 500: 12 to fill the first sector, 512, then 76 left over
+  t->assertEqual(stats.writeCalls, 2, F("Only filled sectors should have been written"));
+  t->assertEqual(stats.bytesWritten, 524, F("Unexpected bytes written before flush"));
+  writer.flush();
+  t->assertEqual(stats.writeCalls, 3, F("Flush should write the rest"));
+  t->assertEqual(stats.sectorWrites, 3, F("Unexpected sector writes"));
+  t->assert(strlen(dest.get()) == 600, F("Unexpected data length"));
+  t->assert(strncmp(dest.get() + 590, line, 10) == 0, F("Unexpected data"));
+
+  StringStream direct;
+  SectorWriter::Stats directStats;
+  SectorWriter unbuffered(&direct, 500, nullptr, &directStats);
+  for (uint8_t i = 0; i < 60; i++) unbuffered.write(line, 10);
+  t->assertEqual(directStats.writeCalls, 60, F("Unbuffered writes should go straight through"));
+  t->assertEqual(directStats.sectorWrites, 62, F("Two writes should have crossed sector boundaries"));
+
+  // The buffer's taken, so a second writer writes straight through
+  writer.write(line, 10);
+  SectorWriter::Stats otherStats;
+  {
+    SectorWriter other(&direct, 0, &shared, &otherStats);
+    other.write(line, 10);
+    t->assertEqual(otherStats.writeCalls, 1, F("Writes without the buffer should go straight through"));
+  }
+  t->assert(shared.owner == &writer, F("Buffer should have stayed with its owner"));
+
+  // Whole sectors at a sector boundary aren't copied
+  uint8_t block[SectorWriter::SECTOR_SIZE * 2];
+  memset(block, 'x', sizeof(block));
+  SectorWriter::Stats blockStats;
+  {
+    SectorWriter aligned(&direct, 0, &shared, &blockStats, true);
+    t->assertEqual(stats.writeCalls, 4, F("Taking the buffer should flush its owner"));
+    t->assert(strlen(dest.get()) == 610, F("Unexpected data length after the buffer was taken"));
+    aligned.write(block, sizeof(block));
+    t->assertEqual(blockStats.writeCalls, 1, F("Aligned sectors should be written in one go"));
+    t->assertEqual(blockStats.sectorWrites, 2, F("Unexpected aligned sector writes"));
+  }
+  t->assert(shared.owner == nullptr, F("Buffer should be free once its owner is gone"));
+
+  // A short write is remembered, and nothing after it is passed on
+  MockSdFat::RamFs fs;
+  Stream* file = fs.openWrite("/short.txt");
+  if (!t->assert(file != nullptr, F("Couldn't open the file"))) return;
+  SectorWriter::Stats shortStats;
+  SectorWriter failing(file, 0, &shared, &shortStats, true);
+  t->assert(failing.write(line, 10) == 10, F("Buffered write should have been taken"));
+  fs.isPoweredOff = true;
+  failing.flush();
+  t->assert(failing.hasFailed(), F("Failed flush should be reported"));
+  fs.isPoweredOff = false;
+  t->assert(failing.write(block, sizeof(block)) == 0, F("Writes after a failure should return 0"));
+  failing.flush();
+  t->assert(shortStats.bytesWritten == 0, F("Nothing should have been written after the failure"));
+}
+
+// Source for BlockReader tests: head, then longLen 'x's, then tail, at most 7 bytes a read
+struct BlockReaderSource {
+  const char* head;
+  uint16_t longLen;
+  const char* tail;
+  uint16_t pos;
+};
+
+int readBlockReaderSource(uint8_t* buffer, size_t len, void* ctx) {
+  BlockReaderSource* src = static_cast<BlockReaderSource*>(ctx);
+  uint16_t headLen = strlen(src->head);
+  uint16_t total = headLen + src->longLen + strlen(src->tail);
+  size_t n = 0;
+  for (; n < len && n < 7 && src->pos < total; n++, src->pos++) {
+    if (src->pos < headLen) buffer[n] = src->head[src->pos];
+    else if (src->pos < headLen + src->longLen) buffer[n] = 'x';
+    else buffer[n] = src->tail[src->pos - headLen - src->longLen];
+  }
+  return n;
+}
+
+void testBlockReader(TestInvocation* t) {
+  t->setName(F("Block reader splits lines across reads and blocks"));
+  BlockReaderSource src = {"a=1\r\n\nb=2\n", BlockReader::BLOCK_SIZE + 100, "\nc=3", 0};
+  BlockReader reader(readBlockReaderSource, &src);
+  char* line = reader.nextLine(64);
+  t->assert(line && strcmp(line, "a=1") == 0, F("Expected CR to be stripped"));
+  line = reader.nextLine(64);
+  t->assert(line && strcmp(line, "b=2") == 0, F("Expected the empty line to be skipped"));
+  line = reader.nextLine(64);
+  t->assert(line && strlen(line) == 63 && line[0] == 'x', F("Expected a longer line than the block to be cut short"));
+  line = reader.nextLine(64);
+  t->assert(line && strcmp(line, "c=3") == 0, F("Expected the last line without a line ending"));
+  t->assert(!reader.nextLine(64), F("Expected the end of the source"));
+
+  BlockReaderSource rest = {"k=1\nrest of it", 0, "", 0};
+  BlockReader copier(readBlockReaderSource, &rest);
+  line = copier.nextLine(64);
+  t->assert(line && strcmp(line, "k=1") == 0, F("Unexpected first line"));
+  size_t copied = 0;
+  size_t len;
+  const uint8_t* block;
+  while ((block = copier.nextBlock(&len)) != nullptr) {
+    t->assert(strncmp(reinterpret_cast<const char*>(block), &"rest of it"[copied], len) == 0, F("Unexpected block"));
+    copied += len;
+  }
+  t->assert(copied == 10, F("Expected the rest after the first line"));
+}
+
+void testEntryCache(TestInvocation* t) {
+  t->setName(F("Entry cache keeps the most recently used paths"));
+  EntryCache cache;
+  char path[12];
+  t->assert(cache.get("/R/a.dat") == EntryCache::UNKNOWN, F("Empty cache should know nothing"));
+  cache.put("/R/a.dat", EntryCache::IS_FILE);
+  cache.put("/R/~IDX", EntryCache::IS_DIR);
+  t->assert(cache.get("/R/a.dat") == EntryCache::IS_FILE, F("Expected the file"));
+  t->assert(cache.get("/R/~IDX") == EntryCache::IS_DIR, F("Expected the directory"));
+  t->assert(cache.stats().hits == 2 && cache.stats().misses == 1, F("Unexpected hits and misses"));
+
+  // Filling it up drops the least recently used entry, which isn't /R/a.dat any more
+  t->assert(cache.get("/R/a.dat") == EntryCache::IS_FILE, F("Expected the file again"));
+  for (uint8_t i = 0; i < EntryCache::CAPACITY - 1; i++) {
+    snprintf_P(path, sizeof(path), PSTR("/R/%u.dat"), i);
+    cache.put(path, EntryCache::MISSING);
+  }
+  t->assert(cache.get("/R/~IDX") == EntryCache::UNKNOWN, F("Least recently used entry should have been dropped"));
+  t->assert(cache.get("/R/a.dat") == EntryCache::IS_FILE, F("Recently used entry should have been kept"));
+
+  cache.invalidate("/R/a.dat");
+  t->assert(cache.get("/R/a.dat") == EntryCache::UNKNOWN, F("Invalidated entry should be gone"));
+  t->assertEqual(cache.stats().invalidations, 1, F("Unexpected invalidations"));
+
+  char longPath[EntryCache::NAME_SIZE + 1];
+  memset(longPath, 'x', EntryCache::NAME_SIZE);
+  longPath[EntryCache::NAME_SIZE] = '\0';
+  cache.put(longPath, EntryCache::IS_FILE);
+  t->assert(cache.get(longPath) == EntryCache::UNKNOWN, F("Long paths shouldn't be cached"));
+
+  cache.put("/R/b.dat", EntryCache::IS_FILE);
+  cache.setEnabled(false);
+  cache.put("/R/c.dat", EntryCache::IS_FILE);
+  t->assert(cache.get("/R/c.dat") == EntryCache::UNKNOWN, F("Disabled cache should know nothing"));
+  cache.setEnabled(true);
+  t->assert(cache.get("/R/b.dat") == EntryCache::UNKNOWN, F("Turning the cache off should clear it"));
+}
+
+void testEntryCache_mixedCase(TestInvocation* t) {
+  t->setName(F("Entry cache ignores case like FAT"));
+  EntryCache cache;
+  cache.put("/R/Data.DAT", EntryCache::IS_FILE);
+  t->assert(cache.get("/r/data.dat") == EntryCache::IS_FILE, F("Lower case path should find the entry"));
+  t->assert(cache.get("/R/DATA.DAT") == EntryCache::IS_FILE, F("Upper case path should find the entry"));
+  cache.put("/R/DATA.dat", EntryCache::MISSING);
+  t->assert(cache.get("/R/Data.DAT") == EntryCache::MISSING, F("Differently cased put should replace the entry"));
+  cache.invalidate("/r/DaTa.DaT");
+  t->assert(cache.get("/R/Data.DAT") == EntryCache::UNKNOWN, F("Differently cased invalidate should drop the entry"));
+  t->assertEqual(cache.stats().invalidations, 1, F("Unexpected invalidations"));
+}
+
+void testRamFs_workload(TestInvocation* t) {
+  t->setName(F("RAM filesystem - save and index workload"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  t->assert(fs.isDirectory("/TESTROOT/~WORK") && fs.isDirectory("/TESTROOT/~IDX"), F("Directories not created"));
+
+  const uint8_t count = RAMFS_WORKLOAD_COUNT;
+  Index idx(F("bench"));
+  char key[8];
+  char filename[12];
+  fs.resetStats();
+  storage.resetWriteStats();
+  uint32_t start = micros();
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t n = (i * 37UL) % count;  // not in key order
+    snprintf_P(key, sizeof(key), PSTR("k%03u"), n);
+    snprintf_P(filename, sizeof(filename), PSTR("f%03u.dat"), n);
+    StreamableDTO dto;
+    dto.put("key", key);
+    IndexEntry entry(key, filename);
+    if (!t->assert(storage.save(&ts, filename, &dto), F("Save failed"))) return;
+    if (!t->assert(storage.idxUpsert(&ts, idx, &entry), F("Upsert failed"))) return;
+  }
+  uint32_t elapsed = micros() - start;
+  Serial.print(F("  "));
+  Serial.print(count);
+  Serial.print(F(" saves + upserts: "));
+  Serial.print(elapsed);
+  Serial.print(F("us, opens="));
+  Serial.print(fs.stats.opens);
+  Serial.print(F(", dirOps="));
+  Serial.print(fs.stats.dirOps);
+  Serial.print(F(", written="));
+  Serial.print(fs.stats.bytesWritten);
+  Serial.print(F(", read="));
+  Serial.print(fs.stats.bytesRead);
+  Serial.print(F(", sectorWrites="));
+  Serial.println(storage.getWriteStats().sectorWrites);
+
+  char buffer[12];
+  bool allFound = true;
+  for (uint8_t n = 0; n < count && allFound; n++) {
+    snprintf_P(key, sizeof(key), PSTR("k%03u"), n);
+    snprintf_P(filename, sizeof(filename), PSTR("f%03u.dat"), n);
+    allFound = storage.idxLookup(idx, key, buffer, sizeof(buffer), &ts) && strcmp(buffer, filename) == 0;
+    StreamableDTO loaded;
+    allFound = allFound && storage.load(filename, &loaded, false, &ts) && strcmp(loaded.get("key"), key) == 0;
+  }
+  t->assert(allFound, F("Saved files and index entries should all be found"));
+  t->assert(fs.fileSize("/TESTROOT/~IDX/bench.idx") == count * 14UL, F("Unexpected index size"));
+  t->assertEqual(countFiles(&fs, F(".txn")) + countFiles(&fs, F(".cmt")) + countFiles(&fs, F(".tmp")), 0, 
+        F("Transaction files left behind"));
+}
+
+void testRamFs_powerFail(TestInvocation* t) {
+  t->setName(F("RAM filesystem - power failure during an upsert"));
+  Index idx(F("crash"));
+  char buffer[8];
+  bool isSafe = true;
+  for (uint8_t failAfter = 1; failAfter < 40 && isSafe; failAfter++) {
+    MockSdFat::RamFs fs;
+    MockSdFat::TestState ts;
+    ts.fs = &fs;
+    SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+    if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+    IndexEntry first(F("a"), F("1"));
+    IndexEntry second(F("c"), F("3"));
+    if (!t->assert(storage.idxUpsert(&ts, idx, &first) && storage.idxUpsert(&ts, idx, &second), F("Setup failed"))) return;
+
+    fs.failAfter = failAfter;
+    IndexEntry entry(F("b"), F("2"));
+    bool upserted = storage.idxUpsert(&ts, idx, &entry);
+    if (!fs.isPoweredOff) {
+      t->assert(upserted, F("Upsert without a power failure failed"));
+      break;
+    }
+    // Until the commit record is written the old index must be intact, and
+    // after it, fsck has to finish moving the new one into place
+    fs.isPoweredOff = false;
+    fs.failAfter = 0;
+    bool hadCommit = countFiles(&fs, F(".cmt")) > 0;
+    SDStorage recovered(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+    isSafe = recovered.begin(&ts) && countFiles(&fs, F(".tmp")) + countFiles(&fs, F(".cmt")) == 0
+          && recovered.idxLookup(idx, F("a"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "1") == 0
+          && recovered.idxLookup(idx, F("c"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "3") == 0;
+    buffer[0] = '\0';
+    bool hasB = recovered.idxLookup(idx, F("b"), buffer, sizeof(buffer), &ts);
+    isSafe = isSafe && (hasB ? strcmp(buffer, "2") == 0 : !hadCommit);
+    if (!isSafe) {
+      Serial.print(F("  Index lost when the power failed at change #"));
+      Serial.println(failAfter);
+    }
+  }
+  t->assert(isSafe, F("Index should survive a power failure at any point"));
+}
+
+void testRamFs_binaryFiles(TestInvocation* t) {
+  t->setName(F("RAM filesystem - files can hold NULs"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  MockSdFat mock;
+  mock.use(&ts, USE_ANY);
+  t->assert(mock.mkdir("/TESTROOT"), F("mkdir failed"));
+  const uint8_t bytes[] = { 'a', '\0', 'b', 0xFF };
+  File dest = mock.open("/TESTROOT/page.bpg", O_RDWR | O_CREAT | O_TRUNC);
+  if (!t->assert(dest, F("open for writing failed"))) return;
+  t->assert(dest.write(bytes, sizeof(bytes)) == sizeof(bytes), F("Write failed"));
+  dest.close();
+  t->assert(fs.fileSize("/TESTROOT/page.bpg") == sizeof(bytes), F("Write stopped at the NUL"));
+  File src = mock.open("/TESTROOT/page.bpg", FILE_READ);
+  uint8_t buffer[8];
+  t->assert(src.read(buffer, sizeof(buffer)) == sizeof(bytes) && memcmp(buffer, bytes, sizeof(bytes)) == 0, 
+        F("Read stopped at the NUL"));
+  src.close();
+}
+
+void testRamFs_commitReplace(TestInvocation* t) {
+  t->setName(F("RAM filesystem - commit moves tmp files over the originals"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  storage.setEntryCaching(false);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  StreamableDTO before;
+  before.put("v", "old");
+  if (!t->assert(storage.save(&ts, F("one.dat"), &before) && storage.save(&ts, F("two.dat"), &before), 
+        F("Setup failed"))) return;
+
+  Transaction* txn = storage.beginTxn(&ts, F("one.dat"), F("two.dat"), F("three.dat"));
+  if (!t->assert(txn, F("beginTxn failed"))) return;
+  StreamableDTO after;
+  after.put("v", "new");
+  t->assert(storage.save(&ts, F("one.dat"), &after, txn) && storage.save(&ts, F("two.dat"), &after, txn)
+        && storage.save(&ts, F("three.dat"), &after, txn), F("Saves failed"));
+  fs.resetStats();
+  t->assert(storage.commitTxn(txn, &ts), F("Commit failed"));
+  Serial.print(F("  Committing 3 files: dirOps="));
+  Serial.println(fs.stats.dirOps);
+  // .txn to .cmt, one replace per file, then removing the .cmt
+  t->assertEqual(fs.stats.dirOps, 5, F("Each file should take one directory operation"));
+
+  bool isNew = true;
+  const char* names[] = { "one.dat", "two.dat", "three.dat" };
+  for (uint8_t i = 0; i < 3; i++) {
+    StreamableDTO loaded;
+    isNew = isNew && storage.load(names[i], &loaded, false, &ts) && strcmp(loaded.get("v"), "new") == 0;
+  }
+  t->assert(isNew, F("Committed files should all have the new data"));
+  t->assertEqual(countFiles(&fs, F(".tmp")) + countFiles(&fs, F(".cmt")), 0, F("Transaction files left behind"));
+}
+
+void testRamFs_groupWriteFailure(TestInvocation* t) {
+  t->setName(F("RAM filesystem - failed save keeps the rest of the group"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  StreamableDTO dto;
+  dto.put("v", "old");
+  if (!t->assert(storage.save(&ts, F("one.dat"), &dto), F("Setup failed"))) return;
+
+  t->assert(storage.setGroupCommit(3, 0, &ts), F("setGroupCommit failed"));
+  dto.put("v", "new");
+  t->assert(storage.save(&ts, F("one.dat"), &dto) && storage.save(&ts, F("two.dat"), &dto), F("Grouped save failed"));
+  dto.put("v", "newer");
+  fs.failNextOpen = true;
+  t->assert(!storage.save(&ts, F("one.dat"), &dto), F("Save should have failed"));
+  t->assert(storage.save(&ts, F("three.dat"), &dto), F("Group should still take saves"));
+  t->assert(storage.flushGroup(&ts), F("Flush failed"));
+  t->assertEqual(storage.getLockStats().held, 0, F("Locks left behind"));
+
+  StreamableDTO loaded;
+  t->assert(storage.load(F("one.dat"), &loaded, &ts), F("Load one.dat failed"));
+  t->assertEqual(loaded.get("v"), F("new"), F("one.dat should keep its earlier save in the group"));
+  t->assert(fs.exists("/TESTROOT/two.dat") && fs.exists("/TESTROOT/three.dat"), 
+        F("The rest of the group should have been committed"));
+  t->assert(storage.load(F("two.dat"), &loaded, &ts), F("Load two.dat failed"));
+  t->assertEqual(loaded.get("v"), F("new"), F("Wrong committed value"));
+  t->assertEqual(countFiles(&fs, F(".tmp")), 0, F("Dropped tmp file left behind"));
+  storage.setGroupCommit(0, 0, &ts);
+}
+
+void testRamFs_leftoverWork(TestInvocation* t) {
+  t->setName(F("RAM filesystem - no clean marker while the work directory has leftovers"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  // Left behind by an interrupted transaction that recovery hasn't seen
+  t->assert(fs.openWrite("/TESTROOT/~WORK/00000000.tmp"), F("Setup failed"));
+  t->assert(!storage.sync(&ts), F("Should not mark clean with a leftover work file"));
+  t->assert(!fs.exists("/TESTROOT/~CLEAN"), F("Marker should not have been written"));
+  fs.remove("/TESTROOT/~WORK/00000000.tmp");
+  t->assert(storage.sync(&ts), F("sync failed"));
+  t->assert(fs.exists("/TESTROOT/~CLEAN"), F("Marker not written"));
+}
+
+void testRamFs_bloomGrowth(TestInvocation* t) {
+  t->setName(F("RAM filesystem - bloom filter grows with its index"));
+#if defined(__AVR__)
+  Serial.println(F("  Skipped: the index doesn't fit in an AVR's RAM"));
+#else
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  Index idx(F("grow"));
+  char key[8];
+  bool upserted = true;
+  // One more key than a block holds, one upsert at a time
+  for (uint16_t i = 0; i < 410 && upserted; i++) {
+    snprintf_P(key, sizeof(key), PSTR("k%04u"), i);
+    IndexEntry entry(key, "v");
+    upserted = storage.idxUpsert(&ts, idx, &entry);
+  }
+  if (!t->assert(upserted, F("Upsert failed"))) return;
+  // The header and blocksFor(820) = 3 blocks
+  t->assertEqual(fs.fileSize("/TESTROOT/~IDX/grow.blm"), 4 * 512UL, F("Filter should have been rebuilt bigger"));
+
+  char buffer[4];
+  bool allFound = true;
+  for (uint16_t i = 0; i < 410 && allFound; i++) {
+    snprintf_P(key, sizeof(key), PSTR("k%04u"), i);
+    allFound = storage.idxLookup(idx, key, buffer, sizeof(buffer), &ts);
+  }
+  t->assert(allFound, F("Every key should still be found"));
+  t->assert(!storage.idxHasKey(idx, F("k9999"), &ts), F("Missing key should not be found"));
+#endif
+}
+
+// Upserts 40 keys (in reverse, so none is appended) and removes every fifth, in one txn
+bool txnChurn(SDStorage* storage, Index idx, Transaction* txn, MockSdFat::TestState* ts, 
+      const char* changesFilename, uint32_t* maxChangesSize) {
+  char key[8];
+  bool success = true;
+  for (int8_t i = 39; i >= 0 && success; i--) {
+    snprintf_P(key, sizeof(key), PSTR("k%02d"), i);
+    IndexEntry entry(key, key);
+    success = storage->idxUpsert(ts, idx, &entry, txn);
+    if (i % 5 == 0) success = success && storage->idxRemove(ts, idx, key, txn);
+    const char* tmpFilename = helper.getTmpFilename(txn, changesFilename);
+    uint32_t size = tmpFilename ? ts->fs->fileSize(tmpFilename) : 0;
+    if (size > *maxChangesSize) *maxChangesSize = size;
+  }
+  return success;
+}
+
+void testRamFs_txnChangesBounded(TestInvocation* t) {
+  t->setName(F("RAM filesystem - txn overlays and delta logs are folded in as they grow"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  Index sorted(F("sorted"), Index::SORTED, 64);
+  Index logged(F("logged"), Index::LOG_STRUCTURED, 64);
+  IndexEntry seed(F("a"), F("1"));
+  t->assert(storage.idxUpsert(&ts, sorted, &seed) && storage.idxUpsert(&ts, logged, &seed), F("Seed upsert failed"));
+
+  Transaction* txn = storage.beginTxn(&ts, sorted, logged);
+  if (!t->assert(txn, F("Create transaction failed"))) return;
+  uint32_t maxOverlay = 0;
+  uint32_t maxDelta = 0;
+  bool success = txnChurn(&storage, sorted, txn, &ts, "/TESTROOT/~IDX/sorted.ovl", &maxOverlay)
+        && txnChurn(&storage, logged, txn, &ts, "/TESTROOT/~IDX/logged.dlt", &maxDelta);
+  if (!t->assert(success, F("Upsert or remove in txn failed"))) return;
+  // A threshold's worth, plus the line that crossed it
+  t->assert(maxOverlay < 64 + 8, F("Overlay should have been folded into the index"));
+  t->assert(maxDelta < 64 + 8, F("Delta log should have been compacted"));
+  t->assert(storage.idxHasKey(sorted, F("k39"), txn, &ts) && !storage.idxHasKey(sorted, F("k35"), txn, &ts),
+        F("Txn should see its own folded changes"));
+  if (!t->assert(storage.commitTxn(txn, &ts), F("Commit failed"))) return;
+
+  char key[8];
+  bool isCorrect = storage.idxHasKey(sorted, F("a"), &ts) && storage.idxHasKey(logged, F("a"), &ts);
+  for (uint8_t i = 0; i < 40 && isCorrect; i++) {
+    snprintf_P(key, sizeof(key), PSTR("k%02u"), i);
+    isCorrect = storage.idxHasKey(sorted, key, &ts) == (i % 5 != 0) && storage.idxHasKey(logged, key, &ts) == (i % 5 != 0);
+  }
+  t->assert(isCorrect, F("Every change in the txn should be committed"));
+}
+
+// Polls op until it's done, returning how many polls that took
+uint16_t pollUntilDone(SDStorage* storage, AsyncOp* op) {
+  uint16_t polls = 0;
+  while (op && !op->isDone() && polls < 1000) {
+    storage->poll(0);
+    polls++;
+  }
+  return polls;
+}
+
+void testRamFs_asyncLogStructured(TestInvocation* t) {
+  t->setName(F("RAM filesystem - async log-structured lookups and compactions are stepped"));
+#if defined(__AVR__)
+  Serial.println(F("  Skipped: the index doesn't fit in an AVR's RAM"));
+#else
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  Index uncompacted(F("uncomp"), Index::LOG_STRUCTURED, 0);
+  Index compacted(F("comp"), Index::LOG_STRUCTURED, 64);
+  const uint16_t count = 300;
+  char key[8];
+  bool success = true;
+  for (uint16_t i = 0; i < count && success; i++) {
+    snprintf_P(key, sizeof(key), PSTR("k%05u"), i);
+    IndexEntry entry(key, "v");
+    success = storage.idxUpsert(&ts, uncompacted, &entry) && storage.idxUpsert(&ts, compacted, &entry);
+  }
+  if (!t->assert(success, F("Setup failed"))) return;
+
+  // The whole delta log has to be read to know the key is there
+  AsyncOp* op = storage.idxRemoveAsync(&ts, uncompacted, F("k00003"));
+  uint16_t polls = pollUntilDone(&storage, op);
+  t->assert(op && op->getStatus() == AsyncOp::SUCCEEDED, F("Async remove failed"));
+  t->assert(polls > 3, F("Lookup should have been spread over several polls"));
+  if (op) delete op;
+  t->assert(!storage.idxHasKey(uncompacted, F("k00003"), &ts), F("Key should have been removed"));
+
+  // Each upsert adds a line to the delta log, and one of them compacts it into the index
+  uint16_t maxPolls = 0;
+  for (uint16_t i = count; i < count + 10; i++) {
+    snprintf_P(key, sizeof(key), PSTR("k%05u"), i);
+    IndexEntry entry(key, "v");
+    op = storage.idxUpsertAsync(&ts, compacted, &entry);
+    polls = pollUntilDone(&storage, op);
+    if (polls > maxPolls) maxPolls = polls;
+    t->assert(op && op->getStatus() == AsyncOp::SUCCEEDED, F("Async upsert failed"));
+    if (op) delete op;
+  }
+  t->assert(maxPolls > 3, F("Compaction should have been spread over several polls"));
+  t->assert(fs.fileSize("/TESTROOT/~IDX/comp.dlt") < 64, F("Delta log should have been compacted"));
+  bool isCorrect = true;
+  for (uint16_t i = 0; i < count + 10 && isCorrect; i++) {
+    snprintf_P(key, sizeof(key), PSTR("k%05u"), i);
+    isCorrect = storage.idxHasKey(compacted, key, &ts);
+  }
+  t->assert(isCorrect, F("Every key should still be in the index"));
+  t->assertEqual(storage.getLockStats().held, 0, F("Locks left behind"));
+#endif
+}
+
+// Runs the same upserts against a fresh RAM filesystem, returning the directory operations the last one made
+uint32_t entryCacheUpserts(TestInvocation* t, bool isCached, uint32_t* hits) {
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  storage.setEntryCaching(isCached);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return 0;
+  Index idx(F("cached"));
+  IndexEntry first(F("a"), F("1"));
+  IndexEntry second(F("c"), F("3"));
+  if (!t->assert(storage.idxUpsert(&ts, idx, &first) && storage.idxUpsert(&ts, idx, &second), F("Setup failed"))) return 0;
+
+  fs.resetStats();
+  storage.resetEntryCacheStats();
+  IndexEntry entry(F("b"), F("2"));
+  t->assert(storage.idxUpsert(&ts, idx, &entry), F("Upsert failed"));
+  uint32_t dirOps = fs.stats.dirOps;
+  *hits = storage.getEntryCacheStats().hits;
+
+  char buffer[4];
+  t->assert(storage.idxLookup(idx, F("a"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "1") == 0
+        && storage.idxLookup(idx, F("b"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "2") == 0
+        && storage.idxLookup(idx, F("c"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "3") == 0, 
+        F("Index entries should all be found"));
+  t->assertEqual(countFiles(&fs, F(".tmp")), 0, F("Transaction files left behind"));
+  return dirOps;
+}
+
+void testRamFs_entryCache(TestInvocation* t) {
+  t->setName(F("RAM filesystem - entry cache saves directory walks"));
+  uint32_t uncachedHits = 0;
+  uint32_t cachedHits = 0;
+  uint32_t uncached = entryCacheUpserts(t, false, &uncachedHits);
+  uint32_t cached = entryCacheUpserts(t, true, &cachedHits);
+  Serial.print(F("  One upsert: dirOps="));
+  Serial.print(uncached);
+  Serial.print(F(" uncached, "));
+  Serial.print(cached);
+  Serial.print(F(" cached ("));
+  Serial.print(cachedHits);
+  Serial.println(F(" directory walks avoided)"));
+  t->assertEqual(uncachedHits, 0, F("Cache should have been off"));
+  t->assert(cachedHits > 0, F("Expected some lookups answered from the cache"));
+  // Every hit is an exists() or isDirectory() that didn't reach the filesystem
+  t->assert(cached + cachedHits == uncached, F("Hits should account for the directory operations saved"));
+}
+
+
+void testRamFs_wrongMode(TestInvocation* t) {
+  t->setName(F("RAM filesystem - index opened in the wrong mode"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  char buffer[8];
+
+  Index tree(F("mx"), Index::BTREE);
+  Index treeAsSorted(F("mx"));
+  IndexEntry first(F("aaa"), F("1"));
+  IndexEntry second(F("bbb"), F("2"));
+  if (!t->assert(storage.idxUpsert(&ts, tree, &first), F("B+tree upsert failed"))) return;
+  t->assert(!storage.idxUpsert(&ts, treeAsSorted, &second), F("Sorted upsert of a B+tree should fail"));
+  t->assert(!storage.idxLookup(treeAsSorted, F("aaa"), buffer, sizeof(buffer), &ts), F("Sorted lookup of a B+tree should fail"));
+  SearchResults results("a");
+  t->assert(!storage.idxPrefixSearch(treeAsSorted, &results, &ts), F("Sorted search of a B+tree should fail"));
+  IndexCursor cursor;
+  t->assert(!storage.idxSeek(treeAsSorted, &cursor, "", &ts), F("Sorted seek of a B+tree should fail"));
+  t->assert(storage.idxLookup(tree, F("aaa"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "1") == 0, 
+        F("B+tree should be intact"));
+  t->assert(countFiles(&fs, F(".tmp")) == 0, F("Failed upsert should have left no tmp files"));
+
+  // A sorted index can't see a delta log's records, but an empty one is fine
+  Index logged(F("lg"), Index::LOG_STRUCTURED, 0);
+  Index loggedAsSorted(F("lg"));
+  IndexEntry oldEntry(F("ccc"), F("old"));
+  IndexEntry newEntry(F("ccc"), F("new"));
+  if (!t->assert(storage.idxUpsert(&ts, logged, &oldEntry) && storage.idxCompact(&ts, logged), F("Log setup failed"))) return;
+  t->assert(storage.idxLookup(loggedAsSorted, F("ccc"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "old") == 0, 
+        F("Compacted log-structured index should read as sorted"));
+  if (!t->assert(storage.idxUpsert(&ts, logged, &newEntry), F("Log upsert failed"))) return;
+  t->assert(!storage.idxLookup(loggedAsSorted, F("ccc"), buffer, sizeof(buffer), &ts), F("Sorted lookup should see the delta log"));
+  t->assert(!storage.idxUpsert(&ts, loggedAsSorted, &second), F("Sorted upsert should see the delta log"));
+  t->assert(storage.idxLookup(logged, F("ccc"), buffer, sizeof(buffer), &ts) && strcmp(buffer, "new") == 0, 
+        F("Log-structured index should be intact"));
+}
+
+void testRamFs_cursorLongKeys(TestInvocation* t) {
+  t->setName(F("RAM filesystem - index cursor over long keys"));
+  const char* longKey = "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"; // 40, past a short key buffer
+  const Index::Mode modes[] = { Index::SORTED, Index::LOG_STRUCTURED, Index::BTREE };
+  for (uint8_t m = 0; m < 3; m++) {
+    MockSdFat::RamFs fs;
+    MockSdFat::TestState ts;
+    ts.fs = &fs;
+    SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+    if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+    Index idx(F("long"), modes[m], 0);
+    IndexEntry entries[] = { IndexEntry("a", "1"), IndexEntry(longKey, "2"), IndexEntry("c", "3") };
+    if (!t->assert(storage.idxUpsertBatch(&ts, idx, entries, 3), F("Setup failed"))) return;
+
+    IndexCursor cursor;
+    char shortKey[8];
+    char key[IndexCursor::MAX_KEY_LENGTH + 1];
+    char value[8];
+    t->assert(storage.idxSeek(idx, &cursor, "", &ts), F("Seek failed"));
+    t->assert(storage.idxNext(idx, &cursor, shortKey, sizeof(shortKey), value, sizeof(value), &ts)
+          && strcmp(shortKey, "a") == 0, F("a missing"));
+    t->assert(!storage.idxNext(idx, &cursor, shortKey, sizeof(shortKey), value, sizeof(value), &ts), 
+          F("Long key shouldn't fit"));
+    t->assert(cursor.isTooLong && !cursor.isDone, F("Cursor should say the key didn't fit, not that it's done"));
+    t->assert(storage.idxNext(idx, &cursor, key, sizeof(key), value, sizeof(value), &ts)
+          && strcmp(key, longKey) == 0 && strcmp(value, "2") == 0, F("Long key missing with a bigger buffer"));
+    t->assert(storage.idxNext(idx, &cursor, key, sizeof(key), value, sizeof(value), &ts)
+          && strcmp(key, "c") == 0, F("Cursor should go on past the long key"));
+    t->assert(!storage.idxNext(idx, &cursor, key, sizeof(key), value, sizeof(value), &ts)
+          && cursor.isDone && !cursor.isTooLong, F("Cursor should be done"));
+  }
+}
+
+void testRamFs_btreeSavepoint(TestInvocation* t) {
+  t->setName(F("RAM filesystem - B+tree rolled back to a savepoint"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+
+  Index tree(F("sp"), Index::BTREE);
+  IndexEntry first(F("aaa"), F("1"));
+  IndexEntry undone(F("bbb"), F("2"));
+  IndexEntry retried(F("ccc"), F("3"));
+  Transaction* txn = storage.beginTxn(&ts, tree);
+  if (!t->assert(txn, F("beginTxn failed"))) return;
+  t->assert(storage.idxUpsert(&ts, tree, &first, txn), F("Upsert before the savepoint failed"));
+  Transaction::Savepoint* sp = storage.savepoint(txn, &ts);
+  t->assert(sp, F("savepoint failed"));
+  // bbb lands in the page aaa was written to earlier in the txn
+  t->assert(storage.idxUpsert(&ts, tree, &undone, txn), F("Upsert after the savepoint failed"));
+  t->assert(storage.rollbackTo(txn, sp, &ts), F("rollbackTo failed"));
+  t->assert(storage.idxUpsert(&ts, tree, &retried, txn), F("Upsert after the rollback failed"));
+  if (!t->assert(storage.commitTxn(txn, &ts), F("Commit failed"))) return;
+
+  SearchResults results("");
+  t->assert(storage.idxPrefixSearch(tree, &results, &ts), F("Prefix search failed"));
+  t->assertEqual(results.matchCount, 2, F("Rolled back entry should be gone from the tree"));
+  t->assert(!storage.idxHasKey(tree, F("bbb"), &ts), F("Rolled back entry should be gone"));
+  IndexCursor cursor;
+  char key[IndexCursor::MAX_KEY_LENGTH + 1];
+  char value[8];
+  t->assert(storage.idxSeek(tree, &cursor, "", &ts), F("Seek failed"));
+  t->assert(storage.idxNext(tree, &cursor, key, sizeof(key), value, sizeof(value), &ts)
+        && strcmp(key, "aaa") == 0, F("Cursor 'aaa' missing"));
+  t->assert(storage.idxNext(tree, &cursor, key, sizeof(key), value, sizeof(value), &ts)
+        && strcmp(key, "ccc") == 0, F("Cursor should skip the rolled back entry"));
+  t->assert(!storage.idxNext(tree, &cursor, key, sizeof(key), value, sizeof(value), &ts) && cursor.isDone, 
+        F("Cursor should be done"));
+}
+
+void testRamFs_asyncLocks(TestInvocation* t) {
+  t->setName(F("RAM filesystem - async ops and sync calls don't wait on each other's locks"));
+  MockSdFat::RamFs fs;
+  MockSdFat::TestState ts;
+  ts.fs = &fs;
+  SDStorage storage(12, reinterpret_cast<const __FlashStringHelper *>(_MOCK_TESTROOT), errFunction);
+  if (!t->assert(storage.begin(&ts), F("begin failed"))) return;
+  Index idx(F("locked"));
+  char key[8];
+  bool success = true;
+  for (uint8_t i = 0; i < 60 && success; i++) {
+    snprintf_P(key, sizeof(key), PSTR("k%05u"), i * 2);
+    IndexEntry entry(key, "v");
+    success = storage.idxUpsert(&ts, idx, &entry);
+  }
+  if (!t->assert(success, F("Setup failed"))) return;
+
+  // The sketch's txn has the index, so the op has to wait for it
+  Transaction* txn = storage.beginTxn(&ts, idx);
+  if (!t->assert(txn, F("beginTxn failed"))) return;
+  IndexEntry waiting(F("k00001"), F("1"));
+  AsyncOp* op = storage.idxUpsertAsync(&ts, idx, &waiting);
+  t->assert(storage.poll(0) && storage.poll(0), F("Op should still be queued"));
+  t->assert(op && op->getStatus() == AsyncOp::QUEUED, F("Op shouldn't start while the index is locked"));
+  t->assert(storage.commitTxn(txn, &ts), F("Commit failed"));
+  pollUntilDone(&storage, op);
+  t->assert(op && op->getStatus() == AsyncOp::SUCCEEDED, F("Op should run once the lock is released"));
+  if (op) delete op;
+
+  // And a sync call can't wait for a running op's lock, as only poll() releases it
+  IndexEntry running(F("k00003"), F("3"));
+  IndexEntry blocked(F("k00005"), F("5"));
+  op = storage.idxUpsertAsync(&ts, idx, &running);
+  storage.poll(0);
+  t->assert(op && op->getStatus() == AsyncOp::RUNNING, F("Op should be part way through its rewrite"));
+  t->assert(!storage.idxUpsert(&ts, idx, &blocked), F("Sync upsert should fail while the op holds the index"));
+  pollUntilDone(&storage, op);
+  t->assert(op && op->getStatus() == AsyncOp::SUCCEEDED, F("Async upsert failed"));
+  if (op) delete op;
+  t->assert(storage.idxUpsert(&ts, idx, &blocked), F("Sync upsert should work once the op is done"));
+  t->assert(storage.idxHasKey(idx, F("k00001"), &ts) && storage.idxHasKey(idx, F("k00003"), &ts)
+        && storage.idxHasKey(idx, F("k00005"), &ts), F("Upserted keys missing"));
+}
 
 void setup() {
   Serial.begin(9600);
@@ -685,6 +2637,7 @@ void setup() {
 
   TestFunction tests[] = {
     testBegin,
+    testCleanShutdown,
     testConstructor,
     testCanonicalFilename,
     testMakeDir,
@@ -697,16 +2650,23 @@ void setup() {
     testCreateTransaction_newFileNoSuchDir,
     testCreateTransaction_newFileInvalidPath,
     testCreateTransaction_existingTmpFile,
+    testLockTable,
+    testTryBeginTxn,
+    testGroupCommit,
     testTransactionalEraseFile_happyPath,
+    testTxnJournal,
+    testSavepoint,
     testTransactionalEraseFile_notInTransaction,
     testAbortTransaction_happyPath,
     testAbortTransaction_abortFails,
     testCommitTransaction_happyPath,
     testCommitTransaction_failure,
     testLoadFile,
+    testLoadFile_inTxn,
     testSaveFile_noTxn,
     testIdxFilename,
     testParseIndexEntry,
+    testViewIndexLine,
     testToIndexLine,
     testIdxUpsert_firstEntryNoTxn,
     testIdxUpsert_firstEntryWithTxn,
@@ -714,16 +2674,65 @@ void setup() {
     testIdxUpsert_betweenLines,
     testIdxUpsert_lastLine,
     testIdxUpsert_updateLine,
+    testIdxOverlay_merge,
+    testIdxOverlay_readYourWrites,
+    testIdxUpsertBatch_firstWrite,
+    testIdxUpsertBatch_merge,
+    testIdxLog_writes,
+    testIdxLog_lookup,
+    testIdxLog_prefixSearch,
+    testIdxLog_compact,
+    testBTree_insert,
+    testBTree_remove,
+    testBTree_copyOnWrite,
+    testBTree_bulkLoad,
+    testIdxBTree_txn,
+    testIdxBTree_convertSorted,
+    testBloom_filter,
+    testIdxBloom_skipsScan,
+    testIdxBloom_rebuild,
     testIdxRemove,
     testIdxRenameKey_happyPath,
     testIdxRenameKey_keyDoesntExist,
     testIdxLookup,
     testIdxHasKey,
+    testIdxScan_allocations,
+    testIdxScan_earlyTermination,
+    testFenceSearch,
+    testIdxUpsert_writesFence,
+    testFenceWriter_rawBytes,
+    testIdxUpsert_copiesTail,
+    testIdxUpsertAsync,
+    testIdxUpsert_appendsLastKey,
+    testIdxUpsert_appendNotLastKey,
+    testIdxLookup_withFence,
     testIdxSearchResults,
     testIdxPrefixSearch_noResults,
     testIdxPrefixSearch_emptySearchString,
     testIdxPrefixSearch_under10Matches,
-    testIdxPrefixSearch_over10Matches
+    testIdxPrefixSearch_over10Matches,
+    testIdxCursor_prefix,
+    testIdxCursor_resume,
+    testIdxCursor_sameSize,
+    testIdxCursor_log,
+    testSectorWriter,
+    testBlockReader,
+    testEntryCache,
+    testEntryCache_mixedCase,
+    testRamFs_workload,
+    testRamFs_powerFail,
+    testRamFs_binaryFiles,
+    testRamFs_commitReplace,
+    testRamFs_groupWriteFailure,
+    testRamFs_leftoverWork,
+    testRamFs_bloomGrowth,
+    testRamFs_txnChangesBounded,
+    testRamFs_asyncLogStructured,
+    testRamFs_entryCache,
+    testRamFs_wrongMode,
+    testRamFs_cursorLongKeys,
+    testRamFs_btreeSavepoint,
+    testRamFs_asyncLocks
   };
 
   runTestSuiteShowMem(tests, before, nullptr);
@@ -3,7 +3,6 @@
 
 
 #include <Arduino.h>
-#include <SdFat.h>
 #include <SDStorage.h>
 #include <sdstorage/Strings.h>
 
@@ -13,7 +12,7 @@ using namespace SDStorageStrings;
 class SDStorageTestHelper {
 
   public:
-    SdFat* getSdFat(SDStorage* sdStorage) {
+    StorageProvider::Fs* getSdFat(SDStorage* sdStorage) {
       return &(sdStorage->_storageProvider._sd);
     };
     FileHelper* getFileHelper(SDStorage* sdStorage) {
@@ -28,7 +27,7 @@ class SDStorageTestHelper {
     char* getTmpFilename(Transaction* txn, const char* filename) {
       return txn->getTmpFilename(filename);
     };
-    bool createFile(SdFat* sdFat, const char* filename) {
+    bool createFile(StorageProvider::Fs* sdFat, const char* filename) {
       File file = sdFat->open(filename, FILE_WRITE);
       if (!file) return false;
       file.println("abc=123");
@@ -38,7 +37,7 @@ class SDStorageTestHelper {
     void commit(Transaction* txn) {
       txn->setCommitted();
     };
-    bool writeTxn(SdFat* sdFat, Transaction* txn, const char* fname) {
+    bool writeTxn(StorageProvider::Fs* sdFat, Transaction* txn, const char* fname) {
       char filename[64];
       txn->getFilename(filename, 64);
       File file = sdFat->open(filename, FILE_WRITE);
@@ -53,6 +52,14 @@ class SDStorageTestHelper {
     bool doFsck(SDStorage* sdStorage) {
       return sdStorage->fsck();
     };
+    // An index scan, and the same scan the way it was done before BlockReader
+    bool scanIndex(SDStorage* sdStorage, const char* indexFilename, 
+          StreamableManager::FilterFunction filter, void* statePtr) {
+      return sdStorage->_storageProvider._scanIndex(indexFilename, filter, statePtr);
+    };
+    void pipeIndex(SDStorage* sdStorage, File* src, StreamableManager::FilterFunction filter, void* statePtr) {
+      sdStorage->_storageProvider._streams.pipe(src, nullptr, filter, false, statePtr);
+    };
 
 };
 
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# Builds this suite for a Linux or macOS host with -DSDSTORAGE_POSIX, and
+# runs it, so SDStorage's real code paths run against a directory instead
+# of an SD card.
+#
+# Usage:
+#   ./build-posix.sh        Build and run
+#   ./build-posix.sh -b     Build only
+#
+# host/ stands in for the Arduino core. StreamableDTO and TestTool are
+# built from their sources in ARDUINO_LIBRARIES (~/Arduino/libraries
+# unless set), the same copies the device build uses. /TESTROOT is created
+# under SDSTORAGE_POSIX_DIR (build/posix-root unless set), and any left
+# there by an earlier run is removed first.
+
+BUILD_ONLY=false
+while getopts "b" opt; do
+  case $opt in
+    b) BUILD_ONLY=true ;;
+  esac
+done
+
+cd "$(dirname "$0")" || exit 1
+ARDUINO_LIBRARIES="${ARDUINO_LIBRARIES:-$HOME/Arduino/libraries}"
+POSIX_DIR="${SDSTORAGE_POSIX_DIR:-$PWD/build/posix-root}"
+OUT=build/posix/test-suite
+
+INCLUDES=(-Ihost -I. -I../../src)
+SOURCES=(host/Arduino.cpp ../../src/*.cpp ../../src/sdstorage/*.cpp)
+for LIB in StreamableDTO TestTool; do
+  LIB_DIR="$ARDUINO_LIBRARIES/$LIB"
+  [ -d "$LIB_DIR/src" ] && LIB_DIR="$LIB_DIR/src"
+  if [ ! -d "$LIB_DIR" ]; then
+    echo "$LIB not found in $ARDUINO_LIBRARIES (set ARDUINO_LIBRARIES to where it's installed)" >&2
+    exit 1
+  fi
+  INCLUDES+=("-I$LIB_DIR")
+  while IFS= read -r -d '' SOURCE; do SOURCES+=("$SOURCE"); done < <(find "$LIB_DIR" -name '*.cpp' -print0)
+done
+
+# -fpermissive and -w, as the Arduino AVR core builds with them
+mkdir -p "$(dirname "$OUT")" "$POSIX_DIR" || exit 1
+${CXX:-g++} -std=gnu++17 -O1 -fpermissive -w $CXXFLAGS \
+  -DSDSTORAGE_POSIX -DSDSTORAGE_POSIX_DIR="\"$POSIX_DIR\"" "${INCLUDES[@]}" \
+  -x c++ test-suite.ino -x c++ "${SOURCES[@]}" -o "$OUT" || exit 1
+
+if ! $BUILD_ONLY; then
+  rm -rf "$POSIX_DIR/TESTROOT"
+  "$OUT"
+fi
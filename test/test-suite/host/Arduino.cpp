@@ -0,0 +1,61 @@
+#include <Arduino.h>
+#include <time.h>
+
+HardwareSerial Serial;
+
+static unsigned long long _nowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const unsigned long long _startMicros = _nowMicros();
+
+unsigned long millis() { return (_nowMicros() - _startMicros) / 1000; }
+unsigned long micros() { return _nowMicros() - _startMicros; }
+
+void delay(unsigned long ms) {
+  struct timespec ts = { static_cast<time_t>(ms / 1000), static_cast<long>(ms % 1000) * 1000000L };
+  nanosleep(&ts, nullptr);
+}
+
+void yield() {}
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+
+size_t Print::print(long n, int base) {
+  char buffer[24];
+  if (base == HEX) {
+    snprintf(buffer, sizeof(buffer), "%lX", static_cast<unsigned long>(n));
+  } else {
+    snprintf(buffer, sizeof(buffer), "%ld", n);
+  }
+  return write(buffer);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), (base == HEX) ? "%lX" : "%lu", n);
+  return write(buffer);
+}
+
+size_t Print::print(double n, int digits) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+  return write(buffer);
+}
+
+size_t Stream::readBytes(char* buffer, size_t len) {
+  size_t n = 0;
+  int c;
+  while (n < len && (c = read()) != -1) buffer[n++] = c;
+  return n;
+}
+
+void setup();
+
+int main() {
+  setup();
+  Serial.flush();
+  return 0;
+}
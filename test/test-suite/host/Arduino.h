@@ -0,0 +1,93 @@
+#ifndef _SDStorage_Host_Arduino_h
+#define _SDStorage_Host_Arduino_h
+
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <avr/pgmspace.h>
+
+/*
+ * The part of the Arduino core that SDStorage and its test suite use, for
+ * building them on a Linux or macOS host (see build-posix.sh). Serial
+ * writes to stdout, and millis() and micros() count from startup. main()
+ * runs setup() once, which is where the test suite runs.
+ */
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(PSTR(s)))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HEX 16
+#define DEC 10
+#define OUTPUT 1
+#define INPUT 0
+#define HIGH 1
+#define LOW 0
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+class Print {
+  public:
+    virtual ~Print() {};
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t len) {
+      size_t n = 0;
+      while (n < len && write(buffer[n])) n++;
+      return n;
+    };
+    size_t write(const char* str) { return str ? write(reinterpret_cast<const uint8_t*>(str), strlen(str)) : 0; };
+    size_t write(const char* buffer, size_t len) { return write(reinterpret_cast<const uint8_t*>(buffer), len); };
+    virtual void flush() {};
+
+    size_t print(const __FlashStringHelper* str) { return write(reinterpret_cast<const char*>(str)); };
+    size_t print(const char* str) { return write(str); };
+    size_t print(char c) { return write(static_cast<uint8_t>(c)); };
+    size_t print(unsigned char n, int base = DEC) { return print(static_cast<unsigned long>(n), base); };
+    size_t print(int n, int base = DEC) { return print(static_cast<long>(n), base); };
+    size_t print(unsigned int n, int base = DEC) { return print(static_cast<unsigned long>(n), base); };
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println() { return write('\n'); };
+    template<typename T> size_t println(T value) { return print(value) + println(); };
+    template<typename T> size_t println(T value, int format) { return print(value, format) + println(); };
+};
+
+class Stream: public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    size_t readBytes(char* buffer, size_t len);
+    size_t readBytes(uint8_t* buffer, size_t len) { return readBytes(reinterpret_cast<char*>(buffer), len); };
+};
+
+class HardwareSerial: public Stream {
+  public:
+    void begin(unsigned long baud) {};
+    operator bool() { return true; };
+    size_t write(uint8_t c) override { return putchar(c) == EOF ? 0 : 1; };
+    using Print::write;
+    int available() override { return 0; };
+    int read() override { return -1; };
+    int peek() override { return -1; };
+    void flush() override { fflush(stdout); };
+};
+
+extern HardwareSerial Serial;
+
+
+#endif
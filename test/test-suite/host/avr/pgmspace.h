@@ -0,0 +1,36 @@
+#ifndef _SDStorage_Host_pgmspace_h
+#define _SDStorage_Host_pgmspace_h
+
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * On a host, program memory is ordinary memory, so PROGMEM does nothing and
+ * the _P functions are the usual ones
+ */
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*reinterpret_cast<const uint8_t*>(p))
+#define pgm_read_word(p) (*reinterpret_cast<const uint16_t*>(p))
+#define pgm_read_dword(p) (*reinterpret_cast<const uint32_t*>(p))
+#define pgm_read_ptr(p) (*reinterpret_cast<void* const*>(p))
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcasecmp_P strcasecmp
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcat_P strcat
+#define strchr_P strchr
+#define strstr_P strstr
+#define memcmp_P memcmp
+#define memcpy_P memcpy
+#define sprintf_P sprintf
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+
+
+#endif
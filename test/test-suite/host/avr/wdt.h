@@ -0,0 +1,10 @@
+#ifndef _SDStorage_Host_wdt_h
+#define _SDStorage_Host_wdt_h
+
+
+// There's no watchdog on a host
+inline void wdt_disable() {};
+inline void wdt_reset() {};
+
+
+#endif
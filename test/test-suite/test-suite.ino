@@ -17,10 +17,12 @@ static const char TESTROOT[] PROGMEM = "TESTROOT";
 
 SDStorageTestHelper helper;
 SDStorage sdStorage(SD_CS_PIN, TESTROOT, true, errFunction);
-SdFat* sdFat = nullptr;
+StorageProvider::Fs* sdFat = nullptr;  // SdFat, or PosixFs on a host
 
 void before() {
   if (!didBegin) {
+    // Tests change the card through sdFat too, behind SDStorage's back
+    sdStorage.setEntryCaching(false);
     beginSuccess = sdStorage.begin();
     sdFat = helper.getSdFat(&sdStorage);
     didBegin = true;
@@ -89,6 +91,30 @@ void testCreateFile_deleteAfterWrite(TestInvocation* t) {
   // self-cleaning
 }
 
+void testCreateFile_writeAtEnd(TestInvocation* t) {
+  t->setName(F("FILE_WRITE starts at the end, but can seek back"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/file4.dat");
+  File file = sdFat->open("/TESTROOT/file4.dat", FILE_WRITE);
+  if (!t->assert(file, F("Open failed"))) return;
+  file.print(F("abc"));
+  t->assert(file.size() == 3, F("Size should count the write"));
+  file.close();
+
+  file = sdFat->open("/TESTROOT/file4.dat", FILE_WRITE);
+  if (!t->assert(file, F("Reopen failed"))) return;
+  t->assert(file.size() == 3 && file.position() == 3, F("Should be positioned at the end"));
+  t->assert(file.seek(0) && file.write('X') == 1, F("Seek and write failed"));
+  file.close();
+
+  file = sdFat->open("/TESTROOT/file4.dat", FILE_READ);
+  char contents[5] = { '\0' };
+  t->assert(file && file.read(contents, sizeof(contents) - 1) == 3, F("Read failed"));
+  file.close();
+  t->assertEqual(contents, "Xbc", F("Write should have gone where the file was seeked to"));
+  sdFat->remove("/TESTROOT/file4.dat");
+}
+
 void testCreateDirectory(TestInvocation* t) {
   t->setName(F("Create directory"));
   if (!t->assert(beginSuccess, F("SKIPPED"))) return;
@@ -139,6 +165,8 @@ void testCreateIndex(TestInvocation* t) {
   // cleanup
   t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx1.idx")), F("Erase failed"));
   t->assert(!sdFat->exists(F("/TESTROOT/~IDX/idx1.idx")), F("/TESTROOT/~IDX/idx1.idx not erased"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx1.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx1.blm"));
 }
 
 void testIndexUpsert(TestInvocation* t) {
@@ -167,6 +195,8 @@ void testIndexUpsert(TestInvocation* t) {
   // cleanup
   t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx2.idx")), F("Erase failed"));
   t->assert(!sdFat->exists(F("/TESTROOT/~IDX/idx2.idx")), F("/TESTROOT/~IDX/idx2.idx not erased"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx2.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx2.blm"));
 }
 
 void testIndexRemoveKey(TestInvocation* t) {
@@ -185,6 +215,484 @@ void testIndexRemoveKey(TestInvocation* t) {
   // cleanup
   t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx3.idx")), F("Erase failed"));
   t->assert(!sdFat->exists(F("/TESTROOT/~IDX/idx3.idx")), F("/TESTROOT/~IDX/idx3.idx not erased"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx3.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx3.blm"));
+}
+
+void testIndexFence(TestInvocation* t) {
+  t->setName(F("Index lookups through the fence file"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx6.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx6.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx6.blm");
+
+  // Enough entries to span several fence blocks
+  Index myIdx(F("idx6"));
+  char key[8];
+  char value[10];
+  for (uint8_t i = 0; i < 60; i++) {
+    sprintf_P(key, PSTR("key%02u"), i);
+    sprintf_P(value, PSTR("value%02u"), i);
+    IndexEntry entry(key, value);
+    if (!t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"))) return;
+  }
+  t->assert(sdFat->exists("/TESTROOT/~IDX/idx6.fnc"), F("Fence file not found"));
+
+  char buf[10];
+  t->assert(sdStorage.idxLookup(myIdx, "key00", buf, 10), F("First key lookup failed"));
+  t->assertEqual(buf, F("value00"));
+  t->assert(sdStorage.idxLookup(myIdx, "key31", buf, 10), F("Middle key lookup failed"));
+  t->assertEqual(buf, F("value31"));
+  t->assert(sdStorage.idxLookup(myIdx, "key59", buf, 10), F("Last key lookup failed"));
+  t->assertEqual(buf, F("value59"));
+  t->assert(!sdStorage.idxLookup(myIdx, "key60", buf, 10), F("Missing key found"));
+  t->assert(!sdStorage.idxLookup(myIdx, "key3", buf, 10), F("Missing key found"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx6.idx")), F("Erase failed"));
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx6.fnc")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx6.blm"));
+}
+
+void testIndexUpsertBatch(TestInvocation* t) {
+  t->setName(F("Batch upsert an index"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx7.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx7.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx7.blm");
+
+  Index myIdx(F("idx7"));
+  IndexEntry first[] = { IndexEntry(F("mno"), F("1")), IndexEntry(F("abc"), F("2")) };
+  t->assert(sdStorage.idxUpsertBatch(myIdx, first, 2), F("First batch failed"));
+  IndexEntry second[] = { IndexEntry(F("xyz"), F("3")), IndexEntry(F("abc"), F("4")), IndexEntry(F("ghi"), F("5")) };
+  t->assert(sdStorage.idxUpsertBatch(myIdx, second, 3), F("Second batch failed"));
+
+  char buf[10];
+  t->assert(sdStorage.idxLookup(myIdx, "abc", buf, 10), F("Lookup 'abc' failed"));
+  t->assertEqual(buf, F("4"));
+  t->assert(sdStorage.idxLookup(myIdx, "ghi", buf, 10), F("Lookup 'ghi' failed"));
+  t->assertEqual(buf, F("5"));
+  t->assert(sdStorage.idxLookup(myIdx, "mno", buf, 10), F("Lookup 'mno' failed"));
+  t->assertEqual(buf, F("1"));
+  t->assert(sdStorage.idxLookup(myIdx, "xyz", buf, 10), F("Lookup 'xyz' failed"));
+  t->assertEqual(buf, F("3"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx7.idx")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx7.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx7.blm"));
+}
+
+void testIndexLogStructured(TestInvocation* t) {
+  t->setName(F("Log-structured index"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx8.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx8.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx8.blm");
+  sdFat->remove("/TESTROOT/~IDX/idx8.dlt");
+
+  // Small threshold so the delta log gets compacted along the way
+  Index myIdx(F("idx8"), Index::LOG_STRUCTURED, 64);
+  char key[8];
+  char value[10];
+  for (uint8_t i = 0; i < 10; i++) {
+    sprintf_P(key, PSTR("key%02u"), i);
+    sprintf_P(value, PSTR("value%02u"), i);
+    IndexEntry entry(key, value);
+    if (!t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"))) return;
+  }
+  t->assert(sdFat->exists("/TESTROOT/~IDX/idx8.idx"), F("Delta log never compacted"));
+  t->assert(sdStorage.idxRemove(myIdx, "key03"), F("Remove failed"));
+  t->assert(sdStorage.idxRename(myIdx, "key04", "key40"), F("Rename failed"));
+
+  char buf[10];
+  t->assert(sdStorage.idxLookup(myIdx, "key00", buf, 10), F("Lookup 'key00' failed"));
+  t->assertEqual(buf, F("value00"));
+  t->assert(sdStorage.idxLookup(myIdx, "key40", buf, 10), F("Lookup 'key40' failed"));
+  t->assertEqual(buf, F("value04"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key03"), F("Removed key found"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key04"), F("Renamed key found"));
+
+  t->assert(sdStorage.idxCompact(myIdx), F("Compaction failed"));
+  File delta = sdFat->open("/TESTROOT/~IDX/idx8.dlt");
+  t->assert(delta && delta.size() == 0, F("Delta log not empty after compaction"));
+  delta.close();
+  t->assert(sdStorage.idxLookup(myIdx, "key09", buf, 10), F("Lookup 'key09' after compaction failed"));
+  t->assertEqual(buf, F("value09"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key03"), F("Removed key found after compaction"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx8.idx")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx8.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx8.blm"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx8.dlt"));
+}
+
+void testIndexBTree(TestInvocation* t) {
+  t->setName(F("B+tree index"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx9.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx9.bpg");
+  sdFat->remove("/TESTROOT/~IDX/idx9.blm");
+
+  Index myIdx(F("idx9"), Index::BTREE);
+  char key[8];
+  char value[40];
+  // Enough entries for a few levels of pages
+  for (uint8_t i = 0; i < 60; i++) {
+    sprintf_P(key, PSTR("key%02u"), (i * 7) % 60);
+    sprintf_P(value, PSTR("value%02u-abcdefghijklmnopqrstuvwxyz"), (i * 7) % 60);
+    IndexEntry entry(key, value);
+    if (!t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"))) return;
+  }
+  t->assert(sdFat->exists("/TESTROOT/~IDX/idx9.bpg"), F("Page file missing"));
+  t->assert(sdStorage.idxRemove(myIdx, "key03"), F("Remove failed"));
+  t->assert(sdStorage.idxRename(myIdx, "key04", "key40x"), F("Rename failed"));
+
+  char buf[40];
+  t->assert(sdStorage.idxLookup(myIdx, "key00", buf, 40), F("Lookup 'key00' failed"));
+  t->assertEqual(buf, F("value00-abcdefghijklmnopqrstuvwxyz"));
+  t->assert(sdStorage.idxLookup(myIdx, "key40x", buf, 40), F("Lookup 'key40x' failed"));
+  t->assertEqual(buf, F("value04-abcdefghijklmnopqrstuvwxyz"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key03"), F("Removed key found"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key04"), F("Renamed key found"));
+  SearchResults results("key5");
+  t->assert(sdStorage.idxPrefixSearch(myIdx, &results), F("Prefix search failed"));
+  t->assertEqual(results.matchCount, 10, F("Wrong number of matches"));
+
+  File pages = sdFat->open("/TESTROOT/~IDX/idx9.bpg");
+  uint32_t sizeBefore = pages.size();
+  pages.close();
+  t->assert(sdStorage.idxCompact(myIdx), F("Compaction failed"));
+  pages = sdFat->open("/TESTROOT/~IDX/idx9.bpg");
+  t->assert(pages && pages.size() < sizeBefore, F("Page file not packed by compaction"));
+  pages.close();
+  t->assert(sdStorage.idxLookup(myIdx, "key59", buf, 40), F("Lookup 'key59' after compaction failed"));
+  t->assertEqual(buf, F("value59-abcdefghijklmnopqrstuvwxyz"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx9.idx")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx9.bpg"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx9.blm"));
+}
+
+void testIndexBloom(TestInvocation* t) {
+  t->setName(F("Index bloom filter"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx10.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx10.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx10.blm");
+
+  Index myIdx(F("idx10"));
+  char key[8];
+  char value[10];
+  for (uint8_t i = 0; i < 20; i++) {
+    sprintf_P(key, PSTR("key%02u"), i);
+    sprintf_P(value, PSTR("value%02u"), i);
+    IndexEntry entry(key, value);
+    if (!t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"))) return;
+  }
+  t->assert(sdFat->exists("/TESTROOT/~IDX/idx10.blm"), F("Bloom filter not created"));
+  t->assert(sdStorage.idxHasKey(myIdx, "key07"), F("key07 not found"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key20"), F("Missing key found"));
+  t->assert(sdStorage.idxRemove(myIdx, "key07"), F("Remove failed"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key07"), F("Removed key found"));
+
+  // An index without a filter only gets one from idxRebuild
+  t->assert(sdFat->remove("/TESTROOT/~IDX/idx10.blm"), F("Erase failed"));
+  IndexEntry entry("key20", "value20");
+  t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"));
+  t->assert(!sdFat->exists("/TESTROOT/~IDX/idx10.blm"), F("Bloom filter created for an index with entries"));
+  t->assert(sdStorage.idxRebuild(myIdx), F("Rebuild failed"));
+  t->assert(sdFat->exists("/TESTROOT/~IDX/idx10.blm"), F("Bloom filter not rebuilt"));
+  char buf[10];
+  t->assert(sdStorage.idxLookup(myIdx, "key20", buf, 10), F("Lookup 'key20' failed"));
+  t->assertEqual(buf, F("value20"));
+  t->assert(sdStorage.idxHasKey(myIdx, "key00"), F("key00 not found"));
+  t->assert(!sdStorage.idxHasKey(myIdx, "key21"), F("Missing key found"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx10.idx")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx10.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx10.blm"));
+}
+
+void testIndexAppend(TestInvocation* t) {
+  t->setName(F("Index upserts of the largest key append"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx12.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx12.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx12.blm");
+
+  Index myIdx(F("idx12"));
+  char key[8];
+  char value[10];
+  for (uint8_t i = 0; i < 50; i++) {
+    sprintf_P(key, PSTR("key%02u"), i);
+    sprintf_P(value, PSTR("value%02u"), i);
+    IndexEntry entry(key, value);
+    if (!t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"))) return;
+  }
+
+  // Several appends in one txn, then an abort leaves the index as it was
+  Transaction* txn = sdStorage.beginTxn(myIdx);
+  if (!t->assert(txn, F("beginTxn failed"))) return;
+  for (uint8_t i = 50; i < 55; i++) {
+    sprintf_P(key, PSTR("key%02u"), i);
+    sprintf_P(value, PSTR("value%02u"), i);
+    IndexEntry entry(key, value);
+    t->assert(sdStorage.idxUpsert(myIdx, &entry, txn), F("Upsert in txn failed"));
+  }
+  t->assert(sdStorage.abortTxn(txn), F("abortTxn failed"));
+  File file = sdFat->open("/TESTROOT/~IDX/idx12.idx", FILE_READ);
+  t->assert(file.size() == 50UL * 14, F("Aborted appends changed the index"));
+  file.close();
+  t->assert(!sdStorage.idxHasKey(myIdx, "key50"), F("Aborted key found"));
+
+  txn = sdStorage.beginTxn(myIdx);
+  if (!t->assert(txn, F("beginTxn failed"))) return;
+  for (uint8_t i = 50; i < 60; i++) {
+    sprintf_P(key, PSTR("key%02u"), i);
+    sprintf_P(value, PSTR("value%02u"), i);
+    IndexEntry entry(key, value);
+    t->assert(sdStorage.idxUpsert(myIdx, &entry, txn), F("Upsert in txn failed"));
+  }
+  t->assert(sdStorage.commitTxn(txn), F("commitTxn failed"));
+  file = sdFat->open("/TESTROOT/~IDX/idx12.idx", FILE_READ);
+  t->assert(file.size() == 60UL * 14, F("Unexpected index size"));
+  file.close();
+
+  // Same fence as writing the index in one go: key00 at 0, key37 at 518, and the trailer
+  file = sdFat->open("/TESTROOT/~IDX/idx12.fnc", FILE_READ);
+  t->assert(file.size() == 3UL * 43, F("Unexpected fence size"));
+  file.close();
+  char buf[10];
+  t->assert(sdStorage.idxLookup(myIdx, "key37", buf, 10), F("Lookup 'key37' failed"));
+  t->assertEqual(buf, F("value37"));
+  t->assert(sdStorage.idxLookup(myIdx, "key59", buf, 10), F("Lookup 'key59' failed"));
+  t->assertEqual(buf, F("value59"));
+
+  // A key that isn't the largest rewrites the index as usual
+  IndexEntry entry("key05", "updated");
+  t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Update failed"));
+  t->assert(sdStorage.idxLookup(myIdx, "key05", buf, 10), F("Lookup 'key05' failed"));
+  t->assertEqual(buf, F("updated"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx12.idx")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx12.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx12.blm"));
+}
+
+// Average micros() for a lookup of key
+uint32_t timeLookup(Index idx, const char* key) {
+  const uint8_t runs = 5;
+  uint32_t start = micros();
+  for (uint8_t i = 0; i < runs; i++) sdStorage.idxHasKey(idx, key);
+  return (micros() - start) / runs;
+}
+
+void testIndexCursor(TestInvocation* t) {
+  t->setName(F("Index cursor pages through more than 10 matches"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx13.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx13.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx13.blm");
+
+  Index myIdx(F("idx13"));
+  char key[8];
+  char value[10];
+  for (uint8_t i = 0; i < 30; i++) {
+    sprintf_P(key, PSTR("key%02u"), i);
+    sprintf_P(value, PSTR("value%02u"), i);
+    IndexEntry entry(key, value);
+    if (!t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"))) return;
+  }
+
+  IndexCursor cursor;
+  t->assert(sdStorage.idxSeek(myIdx, &cursor, F("key1")), F("Seek failed"));
+  uint8_t count = 0;
+  while (sdStorage.idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value))) count++;
+  t->assert(cursor.isDone, F("Cursor should be done"));
+  t->assert(count == 10, F("Wrong number of 'key1' matches"));
+
+  // Resumes by key once the index has changed
+  t->assert(sdStorage.idxSeek(myIdx, &cursor), F("Seek failed"));
+  for (uint8_t i = 0; i < 5; i++) sdStorage.idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value));
+  t->assertEqual(key, "key04", F("Wrong 5th key"));
+  IndexEntry entry("key00a", "new");
+  t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"));
+  t->assert(sdStorage.idxNext(myIdx, &cursor, key, sizeof(key), value, sizeof(value)), F("Resume failed"));
+  t->assertEqual(key, "key05", F("Should resume after key04"));
+
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx13.idx")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx13.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx13.blm"));
+}
+
+void testIndexTxnOverlay(TestInvocation* t) {
+  t->setName(F("Index changes in a txn merged at commit"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx14.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx14.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx14.blm");
+
+  Index myIdx(F("idx14"));
+  IndexEntry batch[] = { IndexEntry(F("ear"), F("6")), IndexEntry(F("fan"), F("1")), IndexEntry(F("hat"), F("2")) };
+  if (!t->assert(sdStorage.idxUpsertBatch(myIdx, batch, 3), F("Batch upsert failed"))) return;
+
+  Transaction* txn = sdStorage.beginTxn(myIdx);
+  if (!t->assert(txn, F("Create transaction failed"))) return;
+  IndexEntry egg(F("egg"), F("3"));
+  t->assert(sdStorage.idxUpsert(myIdx, &egg, txn), F("Upsert failed"));
+  t->assert(sdStorage.idxRemove(myIdx, F("ear"), txn), F("Remove failed"));
+  t->assert(sdStorage.idxRename(myIdx, F("egg"), F("elk"), txn), F("Rename of a key upserted in the txn failed"));
+  t->assert(!sdStorage.idxRemove(myIdx, F("ear"), txn), F("Key removed in the txn should be gone"));
+  t->assert(sdStorage.idxHasKey(myIdx, F("ear")), F("Index should be unchanged until commit"));
+  t->assert(!sdStorage.idxHasKey(myIdx, F("ear"), txn), F("Txn should see its own removal"));
+  SearchResults results("e");
+  t->assert(sdStorage.idxPrefixSearch(myIdx, &results, txn), F("Prefix search in txn failed"));
+  t->assert(results.matchCount == 1 && strcmp(results.matchResult->key, "elk") == 0, 
+        F("Prefix search in txn should see its changes"));
+  t->assert(sdStorage.commitTxn(txn), F("Commit failed"));
+
+  char buffer[10];
+  t->assert(!sdStorage.idxHasKey(myIdx, F("ear")), F("ear should have been removed"));
+  t->assert(!sdStorage.idxHasKey(myIdx, F("egg")), F("egg should have been renamed"));
+  t->assert(sdStorage.idxLookup(myIdx, F("elk"), buffer, sizeof(buffer)), F("elk not found"));
+  t->assertEqual(buffer, "3", F("Wrong value for elk"));
+  t->assert(!sdFat->exists("/TESTROOT/~IDX/idx14.ovl"), F("Overlay should not be committed"));
+
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx14.idx")), F("Erase failed"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx14.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx14.blm"));
+}
+
+/*
+ * Benchmark: miss-lookup latency vs index size. The index is written
+ * directly, without a fence or bloom filter, so every lookup is a plain
+ * scan of the index from the start and only the sort order can cut it short.
+ */
+void testIndexMissLatency(TestInvocation* t) {
+  t->setName(F("Miss-lookup latency vs index size"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx11.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx11.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx11.blm");
+
+  Index myIdx(F("idx11"));
+  uint16_t count = 0;
+  uint32_t earlyAt100 = 0;
+  uint32_t earlyAt800 = 0;
+  uint32_t endAt800 = 0;
+  Serial.println(F("   entries | miss first (us) | miss middle (us) | miss last (us)"));
+  for (uint16_t size = 100; size <= 800; size *= 2) {
+    // Even keys only, so odd keys are misses in between them
+    File idxFile = sdFat->open("/TESTROOT/~IDX/idx11.idx", O_WRONLY | O_CREAT | O_APPEND);
+    if (!t->assert(idxFile, F("Can't write index"))) return;
+    char line[16];
+    for (; count < size; count++) {
+      sprintf_P(line, PSTR("key%04u=value"), count * 2);
+      idxFile.println(line);
+    }
+    idxFile.close();
+
+    char middle[8];
+    sprintf_P(middle, PSTR("key%04u"), size + 1);
+    uint32_t early = timeLookup(myIdx, "key0001");
+    uint32_t mid = timeLookup(myIdx, middle);
+    uint32_t end = timeLookup(myIdx, "key9999");
+    char row[64];
+    sprintf_P(row, PSTR("   %7u | %15lu | %16lu | %13lu"), size, early, mid, end);
+    Serial.println(row);
+    if (size == 100) earlyAt100 = early;
+    if (size == 800) {
+      earlyAt800 = early;
+      endAt800 = end;
+    }
+  }
+  // Misses near the front of the index stop early no matter how big it is
+  t->assert(earlyAt800 < 2 * earlyAt100 + 2000, F("Early miss latency grows with index size"));
+  t->assert(earlyAt800 < endAt800 / 4, F("Early miss should be much faster than a full scan"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx11.idx")), F("Erase failed"));
+}
+
+bool countScanLine(const char* line, StreamableManager::DestinationStream* dest, void* statePtr) {
+  (*static_cast<uint32_t*>(statePtr))++;
+  return true;
+}
+
+void testIndexScanThroughput(TestInvocation* t) {
+  t->setName(F("Index scan throughput, byte at a time vs a block at a time"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  const char* filename = "/TESTROOT/~IDX/idx12.idx";
+  sdFat->remove(filename);
+  File idxFile = sdFat->open(filename, O_WRONLY | O_CREAT | O_APPEND);
+  if (!t->assert(idxFile, F("Can't write index"))) return;
+  char line[16];
+  for (uint16_t i = 0; i < 2000; i++) {
+    sprintf_P(line, PSTR("key%04u=value"), i);
+    idxFile.println(line);
+  }
+  idxFile.close();
+
+  SDStorageTestHelper helper;
+  uint32_t pipeLines = 0;
+  uint32_t start = micros();
+  idxFile = sdFat->open(filename, FILE_READ);
+  if (!t->assert(idxFile, F("Can't read index"))) return;
+  helper.pipeIndex(&sdStorage, &idxFile, countScanLine, &pipeLines);
+  idxFile.close();
+  uint32_t pipeTime = micros() - start;
+
+  uint32_t blockLines = 0;
+  start = micros();
+  t->assert(helper.scanIndex(&sdStorage, filename, countScanLine, &blockLines), F("Scan failed"));
+  uint32_t blockTime = micros() - start;
+
+  char row[64];
+  sprintf_P(row, PSTR("   byte at a time: %lu lines/s"), pipeLines * 1000000UL / (pipeTime ? pipeTime : 1));
+  Serial.println(row);
+  sprintf_P(row, PSTR("   block at a time: %lu lines/s"), blockLines * 1000000UL / (blockTime ? blockTime : 1));
+  Serial.println(row);
+  t->assert(pipeLines == 2000 && blockLines == 2000, F("Both scans should see every line"));
+
+  // cleanup
+  t->assert(sdFat->remove(filename), F("Erase failed"));
+}
+
+void testEntryCache(TestInvocation* t) {
+  t->setName(F("Directory walks saved by the entry cache"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdFat->remove("/TESTROOT/~IDX/idx13.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx13.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx13.blm");
+
+  // Only SDStorage touches the card until it's turned off again
+  sdStorage.setEntryCaching(true);
+  Index myIdx(F("idx13"));
+  IndexEntry first(F("abc"), F("1"));
+  IndexEntry second(F("ghi"), F("3"));
+  t->assert(sdStorage.idxUpsert(myIdx, &first) && sdStorage.idxUpsert(myIdx, &second), F("Setup failed"));
+  sdStorage.resetEntryCacheStats();
+  uint32_t start = micros();
+  IndexEntry entry(F("def"), F("2"));
+  t->assert(sdStorage.idxUpsert(myIdx, &entry), F("Upsert failed"));
+  uint32_t elapsed = micros() - start;
+  EntryCache::Stats stats = sdStorage.getEntryCacheStats();
+  char buf[10];
+  t->assert(sdStorage.idxLookup(myIdx, "def", buf, 10) && strcmp(buf, "2") == 0, F("Lookup failed"));
+  sdStorage.setEntryCaching(false);
+
+  char row[64];
+  sprintf_P(row, PSTR("   one upsert: %lu us, %lu walks avoided, %lu made"), elapsed, stats.hits, stats.misses);
+  Serial.println(row);
+  t->assert(stats.hits > 0, F("Expected some lookups answered from the cache"));
+
+  // cleanup
+  t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx13.idx")), F("Erase failed"));
 }
 
 void testTransaction_success(TestInvocation* t) {
@@ -197,12 +705,18 @@ void testTransaction_success(TestInvocation* t) {
   t->assert(!sdStorage.exists(F("/TESTROOT/file4.dat")), F("File already exists"));
 
   StreamableDTO dto;
+  dto.put("abc", "def");
   Index myIdx(F("idx4"));
   IndexEntry entry(F("abc"),F("def"));
   Transaction* txn = sdStorage.beginTxn(myIdx, F("file4.dat"));
   t->assert(txn, F("beginTxn failed"));
   t->assert(sdStorage.save(F("file4.dat"), &dto, txn), F("Save failed"));
   t->assert(sdStorage.idxUpsert(myIdx, &entry, txn), F("Index upsert failed"));
+  StreamableDTO dtoOut;
+  t->assert(sdStorage.load(F("file4.dat"), &dtoOut, txn), F("Load in txn failed"));
+  t->assertEqual(dtoOut.get(F("abc")), F("def"), F("Load in txn should see the save"));
+  t->assert(sdStorage.idxHasKey(myIdx, F("abc"), txn), F("Lookup in txn should see the upsert"));
+  t->assert(!sdStorage.idxHasKey(myIdx, F("abc")), F("Lookup outside the txn should not see the upsert"));
 
   t->assert(!sdFat->exists("/TESTROOT/~IDX/idx4.idx"), F("Index file exists before commit"));
   t->assert(!sdFat->exists("/TESTROOT/file4.dat"), F("File exists before commit"));
@@ -213,6 +727,8 @@ void testTransaction_success(TestInvocation* t) {
   // cleanup
   t->assert(sdFat->remove(F("/TESTROOT/~IDX/idx4.idx")), F("Erase failed"));
   t->assert(!sdFat->exists(F("/TESTROOT/~IDX/idx4.idx")), F("/TESTROOT/~IDX/idx4.idx not erased"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx4.fnc"));
+  sdFat->remove(F("/TESTROOT/~IDX/idx4.blm"));
   t->assert(sdStorage.erase(F("file4.dat")), F("Erase failed"));
   t->assert(!sdStorage.exists(F("file4.dat")), F("file4.dat not erased"));
 }
@@ -240,24 +756,150 @@ void testTransaction_abort(TestInvocation* t) {
   t->assert(!sdFat->exists("/TESTROOT/file5.dat"), F("Aborted file created anyway"));
 }
 
+void testTransaction_savepoint(TestInvocation* t) {
+  t->setName(F("Roll a transaction back to a savepoint"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdStorage.erase(F("file10.dat"));
+  sdFat->remove("/TESTROOT/~IDX/idx10.idx");
+
+  StreamableDTO dto;
+  dto.put("step", "1");
+  Index myIdx(F("idx10"));
+  IndexEntry entry(F("step2"), F("file10.dat"));
+  Transaction* txn = sdStorage.beginTxn(myIdx, F("file10.dat"));
+  if (!t->assert(txn, F("beginTxn failed"))) return;
+  t->assert(sdStorage.save(F("file10.dat"), &dto, txn), F("Save failed"));
+  Transaction::Savepoint* sp = sdStorage.savepoint(txn);
+  t->assert(sp, F("savepoint failed"));
+
+  // A second step that gets rolled back, twice
+  for (uint8_t i = 0; i < 2; i++) {
+    dto.put("step", "2");
+    t->assert(sdStorage.save(F("file10.dat"), &dto, txn), F("Save in step 2 failed"));
+    t->assert(sdStorage.idxUpsert(myIdx, &entry, txn), F("Index upsert in step 2 failed"));
+    t->assert(sdStorage.rollbackTo(txn, sp), F("rollbackTo failed"));
+  }
+  StreamableDTO dtoOut;
+  t->assert(sdStorage.load(F("file10.dat"), &dtoOut, txn), F("Load in txn failed"));
+  t->assertEqual(dtoOut.get(F("step")), F("1"), F("Step 1 should have been kept"));
+  t->assert(!sdStorage.idxHasKey(myIdx, F("step2"), txn), F("Index upsert should have been rolled back"));
+  t->assert(sdStorage.commitTxn(txn), F("commitTxn failed"));
+
+  StreamableDTO committed;
+  t->assert(sdStorage.load(F("file10.dat"), &committed), F("Load failed"));
+  t->assertEqual(committed.get(F("step")), F("1"), F("Only step 1 should have been committed"));
+  t->assert(!sdStorage.idxHasKey(myIdx, F("step2")), F("Index upsert should not have been committed"));
+  File workDirFile = sdFat->open("/TESTROOT/~WORK");
+  t->assert(!workDirFile.openNextFile(), F("Savepoint copies left in /TESTROOT/~WORK"));
+  workDirFile.close();
+  t->assert(sdStorage.erase(F("file10.dat")), F("Erase failed"));
+  sdFat->remove("/TESTROOT/~IDX/idx10.idx");
+  sdFat->remove("/TESTROOT/~IDX/idx10.fnc");
+  sdFat->remove("/TESTROOT/~IDX/idx10.blm");
+}
+
+void testTransaction_lockTimeout(TestInvocation* t) {
+  t->setName(F("Transaction lock timeout"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  StreamableDTO dto;
+  Transaction* txn1 = sdStorage.beginTxn(F("file6.dat"));
+  if (!t->assert(txn1, F("beginTxn failed"))) return;
+
+  uint32_t start = millis();
+  t->assert(!sdStorage.tryBeginTxn(50, F("file6.dat")), F("file6.dat should be locked"));
+  t->assert(millis() - start >= 50, F("Should have waited 50ms"));
+  sdStorage.setLockTimeout(0);
+  t->assert(!sdStorage.save(F("file6.dat"), &dto), F("Save should fail, not hang"));
+  sdStorage.setLockTimeout(LockTable::WAIT_FOREVER);
+  t->assert(sdStorage.getLockStats().timeouts >= 2, F("Timeouts not counted"));
+
+  t->assert(sdStorage.abortTxn(txn1), F("abortTxn failed"));
+  Transaction* txn2 = sdStorage.tryBeginTxn(0, F("file6.dat"));
+  t->assert(txn2, F("file6.dat should be unlocked"));
+  if (txn2) t->assert(sdStorage.abortTxn(txn2), F("abortTxn failed"));
+}
+
+void testGroupCommit(TestInvocation* t) {
+  t->setName(F("Group commit of implicit saves"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdStorage.erase(F("file7.dat"));
+  sdStorage.erase(F("file8.dat"));
+
+  t->assert(sdStorage.setGroupCommit(4), F("setGroupCommit failed"));
+  StreamableDTO dtoIn;
+  char count[4];
+  for (uint8_t i = 0; i < 3; i++) {
+    sprintf_P(count, PSTR("%u"), i);
+    dtoIn.put("count", count);
+    t->assert(sdStorage.save(F("file7.dat"), &dtoIn), F("Save failed"));
+  }
+  t->assert(!sdFat->exists("/TESTROOT/file7.dat"), F("Saves should wait for the group"));
+  StreamableDTO dtoOut;
+  t->assert(sdStorage.load(F("file7.dat"), &dtoOut), F("Load failed"));
+  t->assertEqual(dtoOut.get(F("count")), F("2"), F("Load should see the last save"));
+  t->assert(sdStorage.save(F("file8.dat"), &dtoIn), F("Save failed"));
+  t->assert(sdFat->exists("/TESTROOT/file7.dat") && sdFat->exists("/TESTROOT/file8.dat"), 
+        F("4th save should commit the group"));
+
+  t->assert(sdStorage.save(F("file8.dat"), &dtoIn), F("Save failed"));
+  t->assert(sdStorage.erase(F("file8.dat")), F("Erase of a file in the group failed"));
+  t->assert(!sdStorage.exists(F("file8.dat")), F("file8.dat not erased"));
+  t->assert(sdStorage.setGroupCommit(0), F("setGroupCommit failed"));
+  t->assert(sdStorage.erase(F("file7.dat")), F("Erase failed"));
+}
+
+void testCleanShutdown(TestInvocation* t) {
+  t->setName(F("Clean shutdown lets begin() skip recovery"));
+  if (!t->assert(beginSuccess, F("SKIPPED"))) return;
+  sdStorage.erase(F("file9.dat"));
+
+  t->assert(sdStorage.end(), F("end failed"));
+  uint32_t start = micros();
+  t->assert(sdStorage.begin(), F("begin after end failed"));
+  uint32_t cleanBoot = micros() - start;
+  t->assert(sdFat->exists("/TESTROOT/~CLEAN"), F("Marker should be kept until the next write"));
+  StreamableDTO dto;
+  t->assert(sdStorage.save(F("file9.dat"), &dto), F("Save failed"));
+  t->assert(!sdFat->exists("/TESTROOT/~CLEAN"), F("Save should have removed the marker"));
+
+  start = micros();
+  t->assert(sdStorage.begin(), F("begin without the marker failed"));
+  uint32_t dirtyBoot = micros() - start;
+  char row[64];
+  sprintf_P(row, PSTR("   begin() clean: %lu us, recovering: %lu us"), cleanBoot, dirtyBoot);
+  Serial.println(row);
+  t->assert(sdStorage.erase(F("file9.dat")), F("Erase failed"));
+}
+
+uint16_t fsckEntries = 0;
+uint8_t fsckCommits = 0;
+void fsckProgress(uint16_t entriesDone, uint8_t commitsApplied) {
+  fsckEntries = entriesDone;
+  fsckCommits = commitsApplied;
+}
+
 void testFsck(TestInvocation* t) {
   t->setName(F("Filesystem check and repair (fsck)"));
   if (!t->assert(beginSuccess, F("SKIPPED"))) return;
   const char* fname1 = "/TESTROOT/fsck1.dat";
   const char* fname2 = "/TESTROOT/fsck2.dat";
   const char* fname3 = "/TESTROOT/~WORK/orphan.tmp";
+  const char* fname4 = "/TESTROOT/fsck4.dat";
   sdFat->remove(fname1);
   sdFat->remove(fname2);
   sdFat->remove(fname3);
+  sdFat->remove(fname4);
 
   File workDirFile = sdFat->open("/TESTROOT/~WORK");
   if (!t->assert(!workDirFile.openNextFile(), F("/TESTROOT/~WORK not empty!"))) return;
   workDirFile.close();
 
   // Create some files in the ~WORK dir simulating a power loss during 
-  // SD read/write activity. One uncommitted transaction, one that
-  // has been marked ready to apply, and a file that isn't referenced 
-  // in any transaction
+  // SD read/write activity. One uncommitted transaction, two that
+  // have been marked ready to apply, and a file that isn't referenced 
+  // in any transaction. Of the committed ones, fname2 doesn't exist, as
+  // if the power failed between removing it and moving its tmp file into
+  // place on FAT, and fname4 still has its old contents
   Transaction* uncommitted = helper.newTransaction(&sdStorage);
   helper.addToTxn(uncommitted, fname1);
   if (!t->assert(helper.writeTxn(sdFat, uncommitted, fname1), F("writeTxn failed for fname1"))) return;
@@ -275,18 +917,40 @@ void testFsck(TestInvocation* t) {
   if (!t->assert(!sdFat->exists(fname2), F("fname2 should NOT have been written"))) return;
   if (!t->assert(sdFat->exists(tmpFilename2), F("fname2 tmpfile should have been written"))) return;
 
+  File oldFile = sdFat->open(fname4, FILE_WRITE);
+  if (!t->assert(oldFile, F("create fname4 failed"))) return;
+  oldFile.println("old=1");
+  oldFile.close();
+  Transaction* replacing = helper.newTransaction(&sdStorage);
+  helper.commit(replacing);
+  helper.addToTxn(replacing, fname4);
+  if (!t->assert(helper.writeTxn(sdFat, replacing, fname4), F("writeTxn failed for fname4"))) return;
+  char* tmpFilename4 = helper.getTmpFilename(replacing, fname4);
+  if (!t->assert(helper.createFile(sdFat, tmpFilename4), F("create fname4 tmpfile failed"))) return;
+
   if (!t->assert(helper.createFile(sdFat, fname3), F("create fname3 failed"))) return;
   errThrown = false;
   delete uncommitted;
   delete committed;
+  delete replacing;
 
   // Perform the fsck
+  fsckEntries = 0;
+  fsckCommits = 0;
+  sdStorage.setRecoveryProgress(fsckProgress);
   t->assert((helper.doFsck(&sdStorage) && !errThrown), F("fsck failed"));
+  sdStorage.setRecoveryProgress(nullptr);
+  // all three journals, all three tmp files and the orphan
+  t->assert(fsckEntries == 7, F("fsck progress should have counted 7 entries"));
+  t->assert(fsckCommits == 2, F("fsck progress should have counted 2 commits"));
 
   // uncommitted transaction should have been cleaned up, file should have been written for committed
   // transaction, orphan file should have been cleaned up
   t->assert(!sdFat->exists(fname1), F("fname1 should NOT have been written"));
   t->assert(sdFat->exists(fname2), F("fname2 should have been written"));
+  StreamableDTO replaced;
+  t->assert(sdStorage.load(fname4, &replaced) && replaced.get("abc") && !replaced.get("old"), 
+        F("fname4 should have been replaced"));
   File workDirFileAfter = sdFat->open("/TESTROOT/~WORK");
   t->assert(!workDirFileAfter.openNextFile(), F("/TESTROOT/~WORK not empty after fsck"));
   workDirFileAfter.close();
@@ -309,13 +973,29 @@ void setup() {
     testCreateFile_empty,
     testCreateFile_readAfterWrite,
     testCreateFile_deleteAfterWrite,
+    testCreateFile_writeAtEnd,
     testCreateDirectory,
     testCreateFile_inDirectory,
     testCreateIndex,
     testIndexUpsert,
     testIndexRemoveKey,
+    testIndexFence,
+    testIndexUpsertBatch,
+    testIndexLogStructured,
+    testIndexBTree,
+    testIndexBloom,
+    testIndexAppend,
+    testIndexCursor,
+    testIndexTxnOverlay,
+    testIndexMissLatency,
+    testIndexScanThroughput,
+    testEntryCache,
     testTransaction_success,
     testTransaction_abort,
+    testTransaction_savepoint,
+    testTransaction_lockTimeout,
+    testGroupCommit,
+    testCleanShutdown,
     testFsck
   };
 